@@ -58,18 +58,33 @@
       'sources': [
         'src/bit_reader.cc',
         'src/bit_writer.cc',
+        'src/buffer_pool.cc',
+        'src/buffered_write_stream.cc',
+        'src/cache_plan.cc',
+        'src/deflate_copies.cc',
+        'src/extent_stream.cc',
         'src/huffer.cc',
         'src/huffman_table.cc',
+        'src/incremental_huffer.cc',
+        'src/puff_cache.cc',
+        'src/puff_crc32.cc',
         'src/puff_reader.cc',
         'src/puff_writer.cc',
         'src/puffer.cc',
         'src/puffin_stream.cc',
         'src/puffpatch.cc',
+        'src/stats.cc',
+        'src/thread_pool.cc',
       ],
       'dependencies': [
         'libpuffin-proto',
       ],
       'all_dependent_settings': {
+        'variables': {
+          'deps': [
+            'zlib',
+          ],
+        },
         'link_settings': {
           'libraries': [
             '-lbspatch',
@@ -86,6 +101,8 @@
       'sources': [
         'src/file_stream.cc',
         'src/memory_stream.cc',
+        'src/mmap_file_stream.cc',
+        'src/puff_index.cc',
         'src/puffdiff.cc',
         'src/utils.cc',
       ],
@@ -130,7 +147,6 @@
         'libpuffdiff-static',
       ],
       'sources': [
-        'src/extent_stream.cc',
         'src/main.cc',
       ],
     },
@@ -166,7 +182,7 @@
           'includes': ['../../platform2/common-mk/common_test.gypi'],
           'sources': [
             'src/bit_io_unittest.cc',
-            'src/extent_stream.cc',
+            'src/huffman_table_unittest.cc',
             'src/patching_unittest.cc',
             'src/puff_io_unittest.cc',
             'src/puffin_unittest.cc',
@@ -175,6 +191,23 @@
             'src/utils_unittest.cc',
           ],
         },
+        # Benchmarks.
+        {
+          'target_name': 'puffin_benchmark',
+          'type': 'executable',
+          'dependencies': [
+            'libpuffdiff-static',
+            'libsample_generator',
+          ],
+          'link_settings': {
+            'libraries': [
+              '-lbenchmark',
+            ],
+          },
+          'sources': [
+            'src/benchmark.cc',
+          ],
+        },
       ],
     }],
     # fuzzer target
@@ -0,0 +1,473 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Throughput benchmarks of puffing, huffing, reading puff streams and the whole
+// puffdiff and puffpatch operations. The throughput of each benchmark is
+// reported relative to the size of its deflate stream (or its puff stream for
+// the |PuffinStream| reads). Besides the generated samples, real zip and gzip
+// files can be benchmarked by listing them (separated by ':') in the
+// PUFFIN_BENCHMARK_FILES environment variable.
+
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+
+#include "puffin/src/bit_reader.h"
+#include "puffin/src/bit_writer.h"
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/huffer.h"
+#include "puffin/src/include/puffin/puffdiff.h"
+#include "puffin/src/include/puffin/puffer.h"
+#include "puffin/src/include/puffin/puffpatch.h"
+#include "puffin/src/include/puffin/utils.h"
+#include "puffin/src/memory_stream.h"
+#include "puffin/src/puff_reader.h"
+#include "puffin/src/puff_writer.h"
+#include "puffin/src/puffin_stream.h"
+#include "puffin/src/sample_generator.h"
+
+using std::string;
+using std::vector;
+
+using puffin::BitExtent;
+using puffin::Buffer;
+using puffin::BufferBitReader;
+using puffin::BufferBitWriter;
+using puffin::BufferPuffReader;
+using puffin::BufferPuffWriter;
+using puffin::ByteExtent;
+using puffin::Error;
+using puffin::Huffer;
+using puffin::MemoryStream;
+using puffin::Puffer;
+using puffin::PuffinStream;
+
+namespace {
+
+// The number of files in each generated sample and the size of each file
+// before compression.
+constexpr size_t kNumFiles = 16;
+constexpr size_t kFileSize = 64 * 1024;
+
+// The size of each read from a |PuffinStream|.
+constexpr size_t kSequentialReadSize = 64 * 1024;
+constexpr size_t kRandomReadSize = 4 * 1024;
+constexpr size_t kNumRandomReads = 256;
+
+// The puff cache sizes |PuffinStream| and |PuffPatch| are measured with. Zero
+// means no cache and -1 a cache as large as the puff stream.
+constexpr int64_t kCacheSizes[] = {0, 256 * 1024, -1};
+
+const char kTmpFilePath[] = "/tmp/puffin_benchmark.tmp";
+
+// A deflate stream with the location of its deflates, and a slightly modified
+// version of it used as the destination of puffdiff and puffpatch.
+struct Sample {
+  string name;
+  Buffer data;
+  vector<BitExtent> deflates;
+  Buffer new_data;
+  vector<BitExtent> new_deflates;
+
+  // Populated by |FindPuffs|.
+  vector<ByteExtent> puffs;
+  uint64_t puff_size;
+  Buffer puff;
+  // Populated by |MakePatch|.
+  Buffer patch;
+};
+
+vector<BitExtent> ToBitExtents(const vector<ByteExtent>& extents) {
+  vector<BitExtent> bit_extents;
+  for (const auto& ext : extents) {
+    bit_extents.emplace_back(ext.offset * 8, ext.length * 8);
+  }
+  return bit_extents;
+}
+
+// Generates the text-like content of file |index| of a sample. The words are
+// picked from a small vocabulary so the content compresses to both literals
+// and back-references. If |modified|, a few of the words are replaced.
+Buffer GenerateFile(size_t index, bool modified) {
+  static const char* const kWords[] = {
+      "puffin", "deflate", "huffman", "stream", "patch", "block", "literal",
+      "length", "distance", "buffer", "cache", "extent", "the", "of", "a",
+      "is", "and", "to", "in", "for", "0123", "4567", "89ab", "cdef"};
+  std::mt19937 gen(index);
+  std::uniform_int_distribution<size_t> word(
+      0, sizeof(kWords) / sizeof(kWords[0]) - 1);
+  std::uniform_int_distribution<int> change(0, 999);
+  Buffer file;
+  while (file.size() < kFileSize) {
+    string w = kWords[word(gen)];
+    if (change(gen) == 0 && modified) {
+      std::reverse(w.begin(), w.end());
+    }
+    file.insert(file.end(), w.begin(), w.end());
+    file.push_back(word(gen) % 8 == 0 ? '\n' : ' ');
+  }
+  file.resize(kFileSize);
+  return file;
+}
+
+// Compresses the files of a sample into consecutive raw deflates. The files are
+// compressed with |levels| in turn.
+bool GenerateDeflates(const vector<int>& levels,
+                      int strategy,
+                      bool modified,
+                      Buffer* data,
+                      vector<BitExtent>* deflates) {
+  for (size_t index = 0; index < kNumFiles; index++) {
+    auto file = GenerateFile(index, modified);
+    Buffer comp(file.size() * 2 + 100);
+    if (!puffin::sample_generator::CompressToDeflate(
+            file, &comp, levels[index % levels.size()], strategy)) {
+      return false;
+    }
+    deflates->emplace_back(data->size() * 8, comp.size() * 8);
+    data->insert(data->end(), comp.begin(), comp.end());
+  }
+  return true;
+}
+
+bool GenerateSample(const string& name,
+                    const vector<int>& levels,
+                    int strategy,
+                    vector<Sample>* samples) {
+  Sample sample;
+  sample.name = name;
+  if (!GenerateDeflates(levels, strategy, false, &sample.data,
+                        &sample.deflates) ||
+      !GenerateDeflates(levels, strategy, true, &sample.new_data,
+                        &sample.new_deflates)) {
+    return false;
+  }
+  samples->push_back(std::move(sample));
+  return true;
+}
+
+// Compresses all the files of a sample into one gzip file.
+bool GenerateGzip(bool modified, Buffer* gzip) {
+  Buffer files;
+  for (size_t index = 0; index < kNumFiles; index++) {
+    auto file = GenerateFile(index, modified);
+    files.insert(files.end(), file.begin(), file.end());
+  }
+  z_stream stream = {};
+  stream.next_in = files.data();
+  stream.avail_in = files.size();
+  gzip->resize(files.size() + 1024);
+  stream.next_out = gzip->data();
+  stream.avail_out = gzip->size();
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return false;
+  }
+  auto result = deflate(&stream, Z_FINISH);
+  deflateEnd(&stream);
+  gzip->resize(stream.total_out);
+  return result == Z_STREAM_END;
+}
+
+bool GenerateGzipSample(vector<Sample>* samples) {
+  Sample sample;
+  sample.name = "gzip";
+  vector<ByteExtent> deflates, new_deflates;
+  if (!GenerateGzip(false, &sample.data) ||
+      !GenerateGzip(true, &sample.new_data) ||
+      !puffin::LocateDeflatesInGzip(sample.data, &deflates) ||
+      !puffin::LocateDeflatesInGzip(sample.new_data, &new_deflates)) {
+    return false;
+  }
+  sample.deflates = ToBitExtents(deflates);
+  sample.new_deflates = ToBitExtents(new_deflates);
+  samples->push_back(std::move(sample));
+  return true;
+}
+
+// Loads the files in PUFFIN_BENCHMARK_FILES as samples. There is no modified
+// version of a real file, so it is diffed against itself.
+bool LoadFileSamples(vector<Sample>* samples) {
+  const char* files = getenv("PUFFIN_BENCHMARK_FILES");
+  if (files == nullptr) {
+    return true;
+  }
+  string paths = files;
+  for (size_t start = 0; start < paths.size();) {
+    auto end = std::min(paths.find(':', start), paths.size());
+    auto path = paths.substr(start, end - start);
+    start = end + 1;
+    if (path.empty()) {
+      continue;
+    }
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+      return false;
+    }
+    Sample sample;
+    sample.name = path.substr(path.rfind('/') + 1);
+    sample.data.assign(std::istreambuf_iterator<char>(file),
+                       std::istreambuf_iterator<char>());
+    vector<ByteExtent> deflates;
+    if (!puffin::LocateDeflatesInGzip(sample.data, &deflates) &&
+        !puffin::LocateDeflatesInZipArchive(sample.data, &deflates)) {
+      return false;
+    }
+    // The deflates in zip archives are not always sorted.
+    std::sort(deflates.begin(), deflates.end(),
+              [](const ByteExtent& a, const ByteExtent& b) {
+                return a.offset < b.offset;
+              });
+    sample.deflates = ToBitExtents(deflates);
+    sample.new_data = sample.data;
+    sample.new_deflates = sample.deflates;
+    samples->push_back(std::move(sample));
+  }
+  return true;
+}
+
+bool FindPuffs(Sample* sample) {
+  auto stream = MemoryStream::CreateForRead(sample->data);
+  if (!puffin::FindPuffLocations(stream, sample->deflates, &sample->puffs,
+                                 &sample->puff_size)) {
+    return false;
+  }
+  stream = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(sample->data), std::make_shared<Puffer>(),
+      sample->puff_size, sample->deflates, sample->puffs);
+  sample->puff.resize(sample->puff_size);
+  return stream && stream->Read(sample->puff.data(), sample->puff.size());
+}
+
+bool MakePatch(Sample* sample) {
+  auto result = puffin::PuffDiff(sample->data, sample->new_data,
+                                 sample->deflates, sample->new_deflates,
+                                 kTmpFilePath, &sample->patch);
+  unlink(kTmpFilePath);
+  return result;
+}
+
+uint64_t GetCacheSize(const Sample& sample, int64_t cache_size) {
+  return cache_size < 0 ? sample.puff_size : cache_size;
+}
+
+void BM_PuffDeflate(benchmark::State& state, const Sample* sample) {
+  Puffer puffer;
+  Buffer puff(sample->puff_size);
+  for (auto _ : state) {
+    for (size_t idx = 0; idx < sample->deflates.size(); idx++) {
+      const auto& deflate = sample->deflates[idx];
+      const auto& puff_extent = sample->puffs[idx];
+      auto start_byte = deflate.offset / 8;
+      auto end_byte = (deflate.offset + deflate.length + 7) / 8;
+      BufferBitReader bit_reader(sample->data.data() + start_byte,
+                                 end_byte - start_byte);
+      auto extra_bits = deflate.offset % 8;
+      bit_reader.CacheBits(extra_bits);
+      bit_reader.DropBits(extra_bits);
+      BufferPuffWriter puff_writer(puff.data() + puff_extent.offset,
+                                   puff_extent.length);
+      Error error;
+      if (!puffer.PuffDeflate(&bit_reader, &puff_writer, nullptr, &error)) {
+        state.SkipWithError("Failed to puff");
+        return;
+      }
+    }
+    benchmark::DoNotOptimize(puff.data());
+  }
+  state.SetBytesProcessed(state.iterations() * sample->data.size());
+}
+
+void BM_HuffDeflate(benchmark::State& state, const Sample* sample) {
+  Huffer huffer;
+  Buffer deflate_buffer(sample->data.size());
+  for (auto _ : state) {
+    for (size_t idx = 0; idx < sample->deflates.size(); idx++) {
+      const auto& deflate = sample->deflates[idx];
+      const auto& puff_extent = sample->puffs[idx];
+      auto start_byte = deflate.offset / 8;
+      auto end_byte = (deflate.offset + deflate.length + 7) / 8;
+      BufferPuffReader puff_reader(sample->puff.data() + puff_extent.offset,
+                                   puff_extent.length);
+      BufferBitWriter bit_writer(deflate_buffer.data() + start_byte,
+                                 end_byte - start_byte);
+      // The deflates do not always start at a byte boundary.
+      if (!bit_writer.WriteBits(deflate.offset % 8, 0)) {
+        state.SkipWithError("Failed to huff");
+        return;
+      }
+      Error error;
+      if (!huffer.HuffDeflate(&puff_reader, &bit_writer, &error)) {
+        state.SkipWithError("Failed to huff");
+        return;
+      }
+    }
+    benchmark::DoNotOptimize(deflate_buffer.data());
+  }
+  state.SetBytesProcessed(state.iterations() * sample->data.size());
+}
+
+void BM_FindPuffLocations(benchmark::State& state, const Sample* sample) {
+  auto stream = MemoryStream::CreateForRead(sample->data);
+  for (auto _ : state) {
+    vector<ByteExtent> puffs;
+    uint64_t puff_size;
+    if (!puffin::FindPuffLocations(stream, sample->deflates, &puffs,
+                                   &puff_size, state.range(0))) {
+      state.SkipWithError("Failed to find the puff locations");
+      return;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * sample->data.size());
+}
+
+void BM_PuffinStreamSequentialRead(benchmark::State& state,
+                                   const Sample* sample) {
+  auto puffer = std::make_shared<Puffer>();
+  Buffer buffer(kSequentialReadSize);
+  for (auto _ : state) {
+    auto stream = PuffinStream::CreateForPuff(
+        MemoryStream::CreateForRead(sample->data), puffer, sample->puff_size,
+        sample->deflates, sample->puffs,
+        GetCacheSize(*sample, state.range(0)));
+    for (uint64_t offset = 0; offset < sample->puff_size;
+         offset += buffer.size()) {
+      auto size = std::min<uint64_t>(buffer.size(), sample->puff_size - offset);
+      if (!stream || !stream->Read(buffer.data(), size)) {
+        state.SkipWithError("Failed to read the puff stream");
+        return;
+      }
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * sample->puff_size);
+}
+
+void BM_PuffinStreamRandomRead(benchmark::State& state, const Sample* sample) {
+  auto puffer = std::make_shared<Puffer>();
+  Buffer buffer(kRandomReadSize);
+  auto read_size = std::min<uint64_t>(buffer.size(), sample->puff_size);
+  std::mt19937 gen(0);
+  std::uniform_int_distribution<uint64_t> offset(
+      0, sample->puff_size - read_size);
+  vector<uint64_t> offsets(kNumRandomReads);
+  for (auto& read_offset : offsets) {
+    read_offset = offset(gen);
+  }
+  auto stream = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(sample->data), puffer, sample->puff_size,
+      sample->deflates, sample->puffs, GetCacheSize(*sample, state.range(0)));
+  for (auto _ : state) {
+    for (auto read_offset : offsets) {
+      if (!stream || !stream->Seek(read_offset) ||
+          !stream->Read(buffer.data(), read_size)) {
+        state.SkipWithError("Failed to read the puff stream");
+        return;
+      }
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * offsets.size() * read_size);
+}
+
+void BM_PuffDiff(benchmark::State& state, const Sample* sample) {
+  for (auto _ : state) {
+    Buffer patch;
+    auto result =
+        puffin::PuffDiff(sample->data, sample->new_data, sample->deflates,
+                         sample->new_deflates, kTmpFilePath, &patch);
+    unlink(kTmpFilePath);
+    if (!result) {
+      state.SkipWithError("Failed to create the patch");
+      return;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * sample->new_data.size());
+}
+
+void BM_PuffPatch(benchmark::State& state, const Sample* sample) {
+  if (sample->patch.empty()) {
+    state.SkipWithError("Failed to create the patch");
+    return;
+  }
+  Buffer dst(sample->new_data.size());
+  for (auto _ : state) {
+    if (!puffin::PuffPatch(MemoryStream::CreateForRead(sample->data),
+                           MemoryStream::CreateForWrite(&dst),
+                           sample->patch.data(), sample->patch.size(),
+                           GetCacheSize(*sample, state.range(0)))) {
+      state.SkipWithError("Failed to apply the patch");
+      return;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * sample->new_data.size());
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  vector<Sample> samples;
+  if (!GenerateSample("fixed", {Z_DEFAULT_COMPRESSION}, Z_FIXED, &samples) ||
+      !GenerateSample("dynamic", {Z_DEFAULT_COMPRESSION}, Z_DEFAULT_STRATEGY,
+                      &samples) ||
+      !GenerateSample("stored", {Z_NO_COMPRESSION}, Z_DEFAULT_STRATEGY,
+                      &samples) ||
+      !GenerateSample("mixed", {Z_NO_COMPRESSION, Z_BEST_SPEED, 6,
+                                Z_BEST_COMPRESSION},
+                      Z_DEFAULT_STRATEGY, &samples) ||
+      !GenerateGzipSample(&samples) || !LoadFileSamples(&samples)) {
+    return 1;
+  }
+  for (auto& sample : samples) {
+    if (!FindPuffs(&sample)) {
+      return 1;
+    }
+    // Only |BM_PuffPatch| needs the patch, and it reports the failure.
+    if (!MakePatch(&sample)) {
+      sample.patch.clear();
+    }
+  }
+
+  for (const auto& sample : samples) {
+    const auto* s = &sample;
+    benchmark::RegisterBenchmark(("PuffDeflate/" + s->name).c_str(),
+                                 BM_PuffDeflate, s);
+    benchmark::RegisterBenchmark(("HuffDeflate/" + s->name).c_str(),
+                                 BM_HuffDeflate, s);
+    benchmark::RegisterBenchmark(("FindPuffLocations/" + s->name).c_str(),
+                                 BM_FindPuffLocations, s)
+        ->Arg(1)
+        ->Arg(4)
+        ->UseRealTime();
+    auto* sequential = benchmark::RegisterBenchmark(
+        ("PuffinStreamSequentialRead/" + s->name).c_str(),
+        BM_PuffinStreamSequentialRead, s);
+    auto* random = benchmark::RegisterBenchmark(
+        ("PuffinStreamRandomRead/" + s->name).c_str(),
+        BM_PuffinStreamRandomRead, s);
+    benchmark::RegisterBenchmark(("PuffDiff/" + s->name).c_str(), BM_PuffDiff,
+                                 s)
+        ->Unit(benchmark::kMillisecond);
+    auto* patch = benchmark::RegisterBenchmark(
+        ("PuffPatch/" + s->name).c_str(), BM_PuffPatch, s);
+    patch->Unit(benchmark::kMillisecond);
+    for (auto cache_size : kCacheSizes) {
+      sequential->Arg(cache_size);
+      random->Arg(cache_size);
+      patch->Arg(cache_size);
+    }
+  }
+
+  benchmark::Initialize(&argc, argv);
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
@@ -24,13 +24,7 @@ TEST(BitIOTest, BitWriterAndBitReaderTest) {
   ASSERT_TRUE(bw.WriteBits(8, 0xFF));
   ASSERT_TRUE(bw.WriteBoundaryBits(0x0F));
   uint8_t tmp[] = {1, 2};
-  size_t index = 0;
-  ASSERT_TRUE(bw.WriteBytes(2, [&tmp, &index](uint8_t* buffer, size_t count) {
-    if (count > 2 - index)
-      return false;
-    memcpy(buffer, &tmp[index], count);
-    return true;
-  }));
+  ASSERT_TRUE(bw.WriteBytes(2, tmp));
   ASSERT_FALSE(bw.WriteBits(9, 0x1C));
   ASSERT_TRUE(bw.WriteBits(4, 0x0A));
   ASSERT_TRUE(bw.WriteBoundaryBits(0xBB));
@@ -45,12 +39,11 @@ TEST(BitIOTest, BitWriterAndBitReaderTest) {
   br.DropBits(8);
   ASSERT_EQ(br.ReadBoundaryBits(), 0x0F);
   ASSERT_EQ(br.SkipBoundaryBits(), 5);
-  std::function<bool(uint8_t*, size_t)> read_fn;
-  ASSERT_TRUE(br.GetByteReaderFn(2, &read_fn));
-  ASSERT_TRUE(read_fn(tmp, 2));
+  const uint8_t* bytes;
+  ASSERT_TRUE(br.ReadBytes(2, &bytes));
+  ASSERT_EQ(bytes, &buf[2]);
+  ASSERT_EQ(0, memcmp(bytes, tmp, 2));
   ASSERT_EQ(br.Offset(), 4);
-  ASSERT_TRUE(read_fn(tmp, 0));
-  ASSERT_FALSE(read_fn(tmp, 1));
   ASSERT_FALSE(br.CacheBits(9));
   ASSERT_TRUE(br.CacheBits(8));
   ASSERT_EQ(br.ReadBits(4), 0x0A);
@@ -62,4 +55,84 @@ TEST(BitIOTest, BitWriterAndBitReaderTest) {
   ASSERT_FALSE(br.CacheBits(1));
 }
 
+// Testing |BufferBitReader| with reads that cross the word refills of its cache
+// and the byte-by-byte reads at the end of the buffer.
+TEST(BitIOTest, BufferBitReaderRefillTest) {
+  Buffer buf(67);
+  for (size_t idx = 0; idx < buf.size(); idx++) {
+    buf[idx] = idx * 37 + 11;
+  }
+  auto expected_bits = [&buf](size_t offset, size_t nbits) {
+    uint32_t bits = 0;
+    for (size_t idx = 0; idx < nbits; idx++) {
+      auto bit = offset + idx;
+      bits |= ((buf[bit / 8] >> (bit % 8)) & 1U) << idx;
+    }
+    return bits;
+  };
+
+  BufferBitReader br(buf.data(), buf.size());
+  uint64_t offset = 0;
+  for (size_t nbits = 1; offset + nbits <= buf.size() * 8;
+       nbits = nbits % 32 + 1) {
+    ASSERT_TRUE(br.CacheBits(nbits));
+    ASSERT_EQ(br.ReadBits(nbits), expected_bits(offset, nbits));
+    br.DropBits(nbits);
+    offset += nbits;
+    ASSERT_EQ(br.OffsetInBits(), offset);
+    ASSERT_EQ(br.Offset(), (offset + 7) / 8);
+  }
+  ASSERT_FALSE(br.CacheBits(buf.size() * 8 - offset + 1));
+
+  BufferBitReader br2(buf.data(), buf.size());
+  ASSERT_FALSE(br2.CacheBits(57));
+  ASSERT_TRUE(br2.CacheBits(56));
+  ASSERT_EQ(br2.ReadBits(32), expected_bits(0, 32));
+}
+
+// Testing |BufferBitWriter| with writes that cross the words it flushes, bits
+// above |nbits| and a stored payload copied after them.
+TEST(BitIOTest, BufferBitWriterWordsTest) {
+  Buffer expected(67);
+  for (size_t idx = 0; idx < expected.size(); idx++) {
+    expected[idx] = idx * 37 + 11;
+  }
+  auto expected_bits = [&expected](size_t offset, size_t nbits) {
+    uint32_t bits = 0;
+    for (size_t idx = 0; idx < nbits; idx++) {
+      auto bit = offset + idx;
+      bits |= ((expected[bit / 8] >> (bit % 8)) & 1U) << idx;
+    }
+    return bits;
+  };
+
+  const size_t kPayloadOffset = 40;
+  const size_t kPayloadSize = 11;
+  Buffer buf(expected.size());
+  BufferBitWriter bw(buf.data(), buf.size());
+  uint64_t offset = 0;
+  for (size_t nbits = 1; offset + nbits <= kPayloadOffset * 8;
+       nbits = nbits % 32 + 1) {
+    auto garbage = nbits < 32 ? 0xFFFFFFFFU << nbits : 0;
+    ASSERT_TRUE(bw.WriteBits(nbits, expected_bits(offset, nbits) | garbage));
+    offset += nbits;
+  }
+  auto boundary = (kPayloadOffset * 8 - offset) % 8;
+  ASSERT_TRUE(bw.WriteBits(kPayloadOffset * 8 - offset - boundary,
+                           expected_bits(offset, kPayloadOffset * 8 - offset -
+                                                     boundary)));
+  offset = kPayloadOffset * 8 - boundary;
+  ASSERT_TRUE(bw.WriteBoundaryBits(expected_bits(offset, boundary)));
+  ASSERT_TRUE(bw.WriteBytes(kPayloadSize, &expected[kPayloadOffset]));
+  offset = (kPayloadOffset + kPayloadSize) * 8;
+  for (; offset + 24 <= expected.size() * 8; offset += 24) {
+    ASSERT_TRUE(bw.WriteBits(24, expected_bits(offset, 24)));
+  }
+  ASSERT_TRUE(bw.WriteBits(8, expected_bits(offset, 8)));
+  ASSERT_FALSE(bw.WriteBits(1, 0));
+  ASSERT_TRUE(bw.Flush());
+  ASSERT_EQ(bw.Size(), expected.size());
+  ASSERT_EQ(buf, expected);
+}
+
 }  // namespace puffin
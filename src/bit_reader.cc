@@ -4,33 +4,40 @@
 
 #include "puffin/src/bit_reader.h"
 
+#include <endian.h>
+#include <string.h>
+
 #include "puffin/src/set_errors.h"
 
 namespace puffin {
 
-bool BufferBitReader::CacheBits(size_t nbits) {
+bool BufferBitReader::RefillCache(size_t nbits) {
   if ((in_size_ - index_) * 8 + in_cache_bits_ < nbits) {
     return false;
   }
-  if (nbits > sizeof(in_cache_) * 8) {
+  if (nbits > kMaxCacheBits) {
     return false;
   }
+  if (in_size_ - index_ >= sizeof(uint64_t)) {
+    // Read the next eight bytes at once and keep as many whole bytes of them as
+    // fit in the cache.
+    uint64_t word;
+    memcpy(&word, &in_buf_[index_], sizeof(word));
+    word = le64toh(word);
+    size_t nbytes = (63 - in_cache_bits_) / 8;
+    in_cache_ |= (word & ((uint64_t(1) << (nbytes * 8)) - 1)) << in_cache_bits_;
+    in_cache_bits_ += nbytes * 8;
+    index_ += nbytes;
+    return true;
+  }
+  // Near the end of the buffer, read one byte at a time.
   while (in_cache_bits_ < nbits) {
-    in_cache_ |= in_buf_[index_++] << in_cache_bits_;
+    in_cache_ |= static_cast<uint64_t>(in_buf_[index_++]) << in_cache_bits_;
     in_cache_bits_ += 8;
   }
   return true;
 }
 
-uint32_t BufferBitReader::ReadBits(size_t nbits) {
-  return in_cache_ & ((1U << nbits) - 1);
-}
-
-void BufferBitReader::DropBits(size_t nbits) {
-  in_cache_ >>= nbits;
-  in_cache_bits_ -= nbits;
-}
-
 uint8_t BufferBitReader::ReadBoundaryBits() {
   return in_cache_ & ((1 << (in_cache_bits_ & 7)) - 1);
 }
@@ -42,21 +49,13 @@ size_t BufferBitReader::SkipBoundaryBits() {
   return nbits;
 }
 
-bool BufferBitReader::GetByteReaderFn(
-    size_t length, std::function<bool(uint8_t*, size_t)>* read_fn) {
+bool BufferBitReader::ReadBytes(size_t length, const uint8_t** bytes) {
   index_ -= (in_cache_bits_ + 7) / 8;
   in_cache_ = 0;
   in_cache_bits_ = 0;
   TEST_AND_RETURN_FALSE(length <= in_size_ - index_);
-  *read_fn = [this, length](uint8_t* buffer, size_t count) mutable {
-    TEST_AND_RETURN_FALSE(count <= length);
-    if (buffer != nullptr) {
-      memcpy(buffer, &in_buf_[index_], count);
-    }
-    index_ += count;
-    length -= count;
-    return true;
-  };
+  *bytes = &in_buf_[index_];
+  index_ += length;
   return true;
 }
 
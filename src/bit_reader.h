@@ -52,15 +52,14 @@ class BitReaderInterface {
   // the number of bits skipped.
   virtual size_t SkipBoundaryBits() = 0;
 
-  // Populates a function that allows reading from the byte that has the next
-  // avilable bit for reading. This function clears all the bits that have been
-  // cached previously. As a consequence the next |CacheBits| starts reading
-  // from a byte boundary. The returned functin can only read |length| bytes. It
-  // might be necessary to call |ReadBoundaryBits| and |SkipBoundaryBits| before
-  // this function.
-  virtual bool GetByteReaderFn(
-      size_t length,
-      std::function<bool(uint8_t* buffer, size_t count)>* read_fn) = 0;
+  // Reads |length| bytes starting from the byte that has the next available bit
+  // for reading. The bytes are not copied, instead |bytes| is set to point to
+  // them in the input, and the read offset is moved past them. This function
+  // clears all the bits that have been cached previously. As a consequence the
+  // next |CacheBits| starts reading from a byte boundary. It might be
+  // necessary to call |ReadBoundaryBits| and |SkipBoundaryBits| before this
+  // function. Returns false if there are not |length| bytes left.
+  virtual bool ReadBytes(size_t length, const uint8_t** bytes) = 0;
 
   // Returns the number of bytes read till now. This size includes the last
   // partially read byte.
@@ -70,8 +69,10 @@ class BitReaderInterface {
   virtual uint64_t OffsetInBits() const = 0;
 };
 
-// A raw buffer implementation of |BitReaderInterface|.
-class BufferBitReader : public BitReaderInterface {
+// A raw buffer implementation of |BitReaderInterface|. It is final and its
+// most frequently used functions are inline, so the calls can be devirtualized
+// when the concrete type is known.
+class BufferBitReader final : public BitReaderInterface {
  public:
   // Sets the beginning of the buffer that the users wants to read.
   //
@@ -86,23 +87,37 @@ class BufferBitReader : public BitReaderInterface {
 
   ~BufferBitReader() override = default;
 
-  // Can only cache up to 32 bits.
-  bool CacheBits(size_t nbits) override;
-  uint32_t ReadBits(size_t nbits) override;
-  void DropBits(size_t nbits) override;
+  // Can only cache up to |kMaxCacheBits| bits. The cache is refilled eight
+  // bytes at a time as long as enough input is left.
+  inline bool CacheBits(size_t nbits) override {
+    return in_cache_bits_ >= nbits || RefillCache(nbits);
+  }
+  inline uint32_t ReadBits(size_t nbits) override {
+    return in_cache_ & ((uint64_t(1) << nbits) - 1);
+  }
+  inline void DropBits(size_t nbits) override {
+    in_cache_ >>= nbits;
+    in_cache_bits_ -= nbits;
+  }
   uint8_t ReadBoundaryBits() override;
   size_t SkipBoundaryBits() override;
-  bool GetByteReaderFn(
-      size_t length,
-      std::function<bool(uint8_t* buffer, size_t count)>* read_fn) override;
+  bool ReadBytes(size_t length, const uint8_t** bytes) override;
   size_t Offset() const override;
   uint64_t OffsetInBits() const override;
 
  private:
+  // The maximum number of bits that can be cached, so refilling whole bytes
+  // never overflows |in_cache_|.
+  static constexpr size_t kMaxCacheBits = 56;
+
+  // Fills |in_cache_| with at least |nbits| bits. Returns false if there is not
+  // enough input left.
+  bool RefillCache(size_t nbits);
+
   const uint8_t* in_buf_;  // The input buffer.
   uint64_t in_size_;       // The number of bytes in |in_buf_|.
   uint64_t index_;         // The index to the next byte to be read.
-  uint32_t in_cache_;      // The temporary buffer to put input data into.
+  uint64_t in_cache_;      // The temporary buffer to put input data into.
   size_t in_cache_bits_;   // The number of bits available in |in_cache_|.
 
   DISALLOW_COPY_AND_ASSIGN(BufferBitReader);
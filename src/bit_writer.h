@@ -5,10 +5,12 @@
 #ifndef SRC_BIT_WRITER_H_
 #define SRC_BIT_WRITER_H_
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 
 #include "puffin/src/include/puffin/common.h"
+#include "puffin/src/set_errors.h"
 
 namespace puffin {
 // An abstract class for writing bits into a deflate stream. For more
@@ -26,19 +28,16 @@ class BitWriterInterface {
   // |bits|  IN  The bit values to write into the output.
   virtual bool WriteBits(size_t nbits, uint32_t bits) = 0;
 
-  // It first flushes the cache and then puts the |nbytes| bytes from |buffer|
+  // It first flushes the cache and then puts the |nbytes| bytes from |bytes|
   // into the output buffer. User should make sure there that the number of bits
   // written into the |BitWriter| before this call is a multiplication of
   // eight. Otherwise it is errornous. This can be achieved by calling
   // |WriteBoundaryBits| or |WriteBits| (if the user is tracking the number of
   // bits written).
   //
-  // |nbytes|  IN  The number of bytes to read using |read_fn| and write into
-  //               the output.
-  // |read_fn| IN  A function to read bytes from.
-  virtual bool WriteBytes(
-      size_t nbytes,
-      const std::function<bool(uint8_t* buffer, size_t count)>& read_fn) = 0;
+  // |nbytes| IN  The number of bytes to write into the output.
+  // |bytes|  IN  The bytes to write.
+  virtual bool WriteBytes(size_t nbytes, const uint8_t* bytes) = 0;
 
   // Puts enough least-significant bits from |bits| into output until the
   // beginning of the next Byte is reached. The number of bits to write into
@@ -59,8 +58,9 @@ class BitWriterInterface {
   virtual size_t Size() const = 0;
 };
 
-// A raw buffer implementation of |BitWriterInterface|.
-class BufferBitWriter : public BitWriterInterface {
+// A raw buffer implementation of |BitWriterInterface|. It is final so its
+// functions can be inlined in the template entry points of |Huffer|.
+class BufferBitWriter final : public BitWriterInterface {
  public:
   // Sets the beginning of the buffer that the users wants to write into.
   //
@@ -75,15 +75,44 @@ class BufferBitWriter : public BitWriterInterface {
 
   ~BufferBitWriter() override = default;
 
-  bool WriteBits(size_t nbits, uint32_t bits) override;
-  bool WriteBytes(size_t nbytes,
-                  const std::function<bool(uint8_t* buffer, size_t count)>&
-                      read_fn) override;
-  bool WriteBoundaryBits(uint8_t bits) override;
+  // The bits are gathered in a 64-bit holder and written out 32 bits at a
+  // time, so most calls only shift them into the holder.
+  inline bool WriteBits(size_t nbits, uint32_t bits) override {
+    TEST_AND_RETURN_FALSE(((out_size_ - index_) * 8) - out_holder_bits_ >=
+                          nbits);
+    TEST_AND_RETURN_FALSE(nbits <= sizeof(bits) * 8);
+    out_holder_ |= (static_cast<uint64_t>(bits) & ((1ULL << nbits) - 1))
+                   << out_holder_bits_;
+    out_holder_bits_ += nbits;
+    if (out_holder_bits_ >= 32) {
+      WriteWord();
+    }
+    return true;
+  }
+  bool WriteBytes(size_t nbytes, const uint8_t* bytes) override;
+  inline bool WriteBoundaryBits(uint8_t bits) override {
+    return WriteBits((8 - (out_holder_bits_ & 7)) & 7, bits);
+  }
   bool Flush() override;
-  size_t Size() const override;
+  inline size_t Size() const override { return index_; }
+
+  // Starts writing from the beginning of the output buffer again, once the
+  // bytes written so far are taken out of it. The bits in the cache are kept.
+  inline void Rewind() { index_ = 0; }
 
  private:
+  // Writes the lower 32 bits of |out_holder_| into the output.
+  inline void WriteWord() {
+    auto out = &out_buf_[index_];
+    out[0] = out_holder_;
+    out[1] = out_holder_ >> 8;
+    out[2] = out_holder_ >> 16;
+    out[3] = out_holder_ >> 24;
+    index_ += 4;
+    out_holder_ >>= 32;
+    out_holder_bits_ -= 32;
+  }
+
   // The output buffer.
   uint8_t* out_buf_;
 
@@ -93,8 +122,9 @@ class BufferBitWriter : public BitWriterInterface {
   // The index to the next byte to write into.
   uint64_t index_;
 
-  // A temporary buffer to keep the bits going out.
-  uint32_t out_holder_;
+  // A temporary buffer to keep the bits going out. It has less than 32 bits
+  // between the calls.
+  uint64_t out_holder_;
 
   // The number of bits in |out_holder_|.
   uint8_t out_holder_bits_;
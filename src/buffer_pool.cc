@@ -0,0 +1,91 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/buffer_pool.h"
+
+#include <iterator>
+#include <memory>
+#include <utility>
+
+namespace puffin {
+
+namespace {
+
+// The capacity of the smallest size class.
+constexpr uint64_t kMinCapacity = 4096;
+
+}  // namespace
+
+BufferPool::BufferPool(uint64_t max_size) : max_size_(max_size), cur_size_(0) {}
+
+// Above |kMinCapacity| the capacity is |size| rounded up to a quarter of the
+// largest power of two not greater than it, so at most a quarter of a buffer is
+// wasted.
+uint64_t BufferPool::GetCapacity(uint64_t size) {
+  if (size <= kMinCapacity) {
+    return kMinCapacity;
+  }
+  uint64_t step = kMinCapacity / 4;
+  while (step * 8 <= size) {
+    step <<= 1;
+  }
+  return (size + step - 1) / step * step;
+}
+
+SharedBufferPtr BufferPool::TryGet(uint64_t size) {
+  return GetBuffer(size, false);
+}
+
+SharedBufferPtr BufferPool::Get(uint64_t size) {
+  return GetBuffer(size, true);
+}
+
+SharedBufferPtr BufferPool::GetBuffer(uint64_t size, bool force) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  // Reuse the smallest free buffer that fits.
+  auto iter = free_buffers_.lower_bound(size);
+  if (iter != free_buffers_.end()) {
+    auto buffer = std::move(iter->second.back());
+    iter->second.pop_back();
+    if (iter->second.empty()) {
+      free_buffers_.erase(iter);
+    }
+    buffer->resize(size);
+    return buffer;
+  }
+
+  // None of the free buffers are large enough, release the largest ones until
+  // there is enough memory left for a new buffer.
+  auto capacity = GetCapacity(size);
+  while (cur_size_ + capacity > max_size_ && !free_buffers_.empty()) {
+    auto largest = std::prev(free_buffers_.end());
+    cur_size_ -= largest->first;
+    largest->second.pop_back();
+    if (largest->second.empty()) {
+      free_buffers_.erase(largest);
+    }
+  }
+  if (cur_size_ + capacity > max_size_ && !force) {
+    return nullptr;
+  }
+
+  auto buffer = std::make_shared<Buffer>();
+  buffer->reserve(capacity);
+  buffer->resize(size);
+  cur_size_ += buffer->capacity();
+  return buffer;
+}
+
+void BufferPool::Release(SharedBufferPtr buffer) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto capacity = buffer->capacity();
+  free_buffers_[capacity].push_back(std::move(buffer));
+}
+
+uint64_t BufferPool::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return cur_size_;
+}
+
+}  // namespace puffin
@@ -0,0 +1,66 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_BUFFER_POOL_H_
+#define SRC_BUFFER_POOL_H_
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "puffin/src/include/puffin/common.h"
+
+namespace puffin {
+
+// A pool of reusable buffers with a cap on the total memory of the buffers it
+// allocates, whether they are in use or kept for reuse. The capacity of the
+// buffers is rounded up to a size class (a quarter of a power of two), so a
+// released buffer can be reused for any request of a similar size without
+// reallocating. It can be shared by the streams of one operation so they are
+// limited by a single memory budget. It is thread safe.
+class BufferPool {
+ public:
+  // |max_size| IN  The maximum total capacity (in bytes) of the buffers
+  //                allocated by this pool.
+  explicit BufferPool(uint64_t max_size);
+  ~BufferPool() = default;
+
+  // Returns a buffer of size |size|, or null if it cannot be allocated within
+  // |max_size()| after dropping all the free buffers.
+  SharedBufferPtr TryGet(uint64_t size);
+
+  // Similar to |TryGet| but always returns a buffer, even if its allocation
+  // exceeds |max_size()|.
+  SharedBufferPtr Get(uint64_t size);
+
+  // Returns |buffer| (taken from this pool) back to the pool for reuse. Its
+  // size may have changed but not beyond its capacity.
+  void Release(SharedBufferPtr buffer);
+
+  // Returns the total capacity of the buffers allocated by this pool, including
+  // the free ones.
+  uint64_t size() const;
+
+  uint64_t max_size() const { return max_size_; }
+
+  // Returns the capacity of the buffers allocated for |size| bytes.
+  static uint64_t GetCapacity(uint64_t size);
+
+ private:
+  SharedBufferPtr GetBuffer(uint64_t size, bool force);
+
+  const uint64_t max_size_;
+
+  // Guards all the members below.
+  mutable std::mutex mutex_;
+  uint64_t cur_size_;
+  // The free buffers indexed by their capacity.
+  std::map<uint64_t, std::vector<SharedBufferPtr>> free_buffers_;
+
+  DISALLOW_COPY_AND_ASSIGN(BufferPool);
+};
+
+}  // namespace puffin
+
+#endif  // SRC_BUFFER_POOL_H_
@@ -0,0 +1,125 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/buffered_write_stream.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "puffin/src/set_errors.h"
+
+namespace puffin {
+
+constexpr uint64_t BufferedWriteStream::kPageSize;
+
+UniqueStreamPtr BufferedWriteStream::Create(UniqueStreamPtr stream,
+                                            size_t buffer_size) {
+  TEST_AND_RETURN_VALUE(stream, nullptr);
+  TEST_AND_RETURN_VALUE(buffer_size >= kPageSize, nullptr);
+  uint64_t offset;
+  TEST_AND_RETURN_VALUE(stream->GetOffset(&offset), nullptr);
+  return UniqueStreamPtr(
+      new BufferedWriteStream(std::move(stream), buffer_size, offset));
+}
+
+BufferedWriteStream::BufferedWriteStream(UniqueStreamPtr stream,
+                                         size_t buffer_size,
+                                         uint64_t offset)
+    : stream_(std::move(stream)),
+      max_buffer_size_(buffer_size),
+      buffer_offset_(offset),
+      stream_offset_(offset) {
+  buffer_.reserve(max_buffer_size_);
+}
+
+BufferedWriteStream::~BufferedWriteStream() {
+  // The caller should have closed it, but do not lose the buffered bytes if it
+  // did not.
+  if (!buffer_.empty() && !FlushBuffer(true)) {
+    LOG(ERROR) << "Failed to write out the buffered bytes.";
+  }
+}
+
+bool BufferedWriteStream::GetSize(uint64_t* size) const {
+  TEST_AND_RETURN_FALSE(stream_->GetSize(size));
+  *size = std::max(*size, buffer_offset_ + buffer_.size());
+  return true;
+}
+
+bool BufferedWriteStream::GetOffset(uint64_t* offset) const {
+  *offset = buffer_offset_ + buffer_.size();
+  return true;
+}
+
+bool BufferedWriteStream::Seek(uint64_t offset) {
+  if (offset == buffer_offset_ + buffer_.size()) {
+    return true;
+  }
+  TEST_AND_RETURN_FALSE(FlushBuffer(true));
+  TEST_AND_RETURN_FALSE(stream_->Seek(offset));
+  stream_offset_ = offset;
+  buffer_offset_ = offset;
+  return true;
+}
+
+bool BufferedWriteStream::Read(void* /* buffer */, size_t /* length */) {
+  LOG(ERROR) << "BufferedWriteStream does not support reading.";
+  return false;
+}
+
+bool BufferedWriteStream::Write(const void* buffer, size_t length) {
+  auto c_bytes = static_cast<const uint8_t*>(buffer);
+  while (length > 0) {
+    if (buffer_.empty() && length >= max_buffer_size_) {
+      if (stream_offset_ != buffer_offset_) {
+        TEST_AND_RETURN_FALSE(stream_->Seek(buffer_offset_));
+      }
+      TEST_AND_RETURN_FALSE(stream_->Write(c_bytes, length));
+      buffer_offset_ += length;
+      stream_offset_ = buffer_offset_;
+      return true;
+    }
+    auto bytes_to_copy = std::min(length, max_buffer_size_ - buffer_.size());
+    buffer_.insert(buffer_.end(), c_bytes, c_bytes + bytes_to_copy);
+    c_bytes += bytes_to_copy;
+    length -= bytes_to_copy;
+    if (buffer_.size() == max_buffer_size_) {
+      TEST_AND_RETURN_FALSE(FlushBuffer(false));
+    }
+  }
+  return true;
+}
+
+bool BufferedWriteStream::Flush() {
+  return FlushBuffer(true);
+}
+
+bool BufferedWriteStream::Close() {
+  TEST_AND_RETURN_FALSE(FlushBuffer(true));
+  return stream_->Close();
+}
+
+bool BufferedWriteStream::FlushBuffer(bool all) {
+  uint64_t length = buffer_.size();
+  if (!all) {
+    auto aligned_end =
+        (buffer_offset_ + buffer_.size()) / kPageSize * kPageSize;
+    if (aligned_end > buffer_offset_) {
+      length = aligned_end - buffer_offset_;
+    }
+  }
+  if (length == 0) {
+    return true;
+  }
+  if (stream_offset_ != buffer_offset_) {
+    TEST_AND_RETURN_FALSE(stream_->Seek(buffer_offset_));
+  }
+  TEST_AND_RETURN_FALSE(stream_->Write(buffer_.data(), length));
+  buffer_.erase(buffer_.begin(), buffer_.begin() + length);
+  buffer_offset_ += length;
+  stream_offset_ = buffer_offset_;
+  return true;
+}
+
+}  // namespace puffin
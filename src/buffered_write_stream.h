@@ -0,0 +1,68 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_BUFFERED_WRITE_STREAM_H_
+#define SRC_BUFFERED_WRITE_STREAM_H_
+
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/stream.h"
+
+namespace puffin {
+
+// A write-only stream that gathers the writes into another stream in a buffer
+// and writes them out together once the buffer is full, e.g. the many small
+// writes of a |PuffinStream| into the destination file of a patch. The
+// buffered bytes are written out before it seeks to a non-contiguous offset and
+// when it is closed. When the buffer fills, only the bytes up to the last page
+// boundary (an offset of the underlying stream that is a multiple of
+// |kPageSize|) are written out, so the writes into a file stay page aligned.
+class BufferedWriteStream : public StreamInterface {
+ public:
+  // The alignment of the writes of the full buffers.
+  static constexpr uint64_t kPageSize = 4096;
+
+  // |stream|      IN  The stream to write into.
+  // |buffer_size| IN  The maximum number of bytes kept before writing them out.
+  //                   It should be at least |kPageSize|. Writes of at least
+  //                   |buffer_size| bytes into an empty buffer go directly to
+  //                   |stream|.
+  static UniqueStreamPtr Create(UniqueStreamPtr stream, size_t buffer_size);
+  ~BufferedWriteStream() override;
+
+  bool GetSize(uint64_t* size) const override;
+  bool GetOffset(uint64_t* offset) const override;
+  bool Seek(uint64_t offset) override;
+  bool Read(void* buffer, size_t length) override;
+  bool Write(const void* buffer, size_t length) override;
+  bool Close() override;
+
+  // Writes out all the buffered bytes.
+  bool Flush();
+
+ private:
+  BufferedWriteStream(UniqueStreamPtr stream,
+                      size_t buffer_size,
+                      uint64_t offset);
+
+  // Writes out the buffered bytes, or only the ones up to the last page
+  // boundary in |buffer_| if |all| is false and there is one.
+  bool FlushBuffer(bool all);
+
+  // The underlying stream to write into.
+  UniqueStreamPtr stream_;
+
+  // The bytes not written out yet, which go at |buffer_offset_| of |stream_|.
+  Buffer buffer_;
+  size_t max_buffer_size_;
+  uint64_t buffer_offset_;
+
+  // The offset of |stream_|.
+  uint64_t stream_offset_;
+
+  DISALLOW_COPY_AND_ASSIGN(BufferedWriteStream);
+};
+
+}  // namespace puffin
+
+#endif  // SRC_BUFFERED_WRITE_STREAM_H_
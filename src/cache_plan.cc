@@ -0,0 +1,191 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/cache_plan.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <utility>
+
+#include "bsdiff/control_entry.h"
+#include "bsdiff/patch_reader.h"
+
+#include "puffin/src/buffer_pool.h"
+#include "puffin/src/set_errors.h"
+
+namespace puffin {
+
+using std::vector;
+
+bool GetBspatchSourceReads(const uint8_t* patch,
+                           size_t patch_size,
+                           uint64_t src_size,
+                           vector<ByteExtent>* reads) {
+  bsdiff::BsdiffPatchReader patch_reader;
+  TEST_AND_RETURN_FALSE(patch_reader.Init(patch, patch_size));
+  int64_t old_pos = 0;
+  uint64_t new_pos = 0;
+  while (new_pos < patch_reader.new_file_size()) {
+    bsdiff::ControlEntry control_entry(0, 0, 0);
+    TEST_AND_RETURN_FALSE(patch_reader.ParseControlEntry(&control_entry));
+    // bspatch only reads the diff part of each entry from the source, and only
+    // the part that is inside the source.
+    auto start = std::max(old_pos, static_cast<int64_t>(0));
+    auto end = std::min(old_pos + static_cast<int64_t>(control_entry.diff_size),
+                        static_cast<int64_t>(src_size));
+    if (start < end) {
+      reads->emplace_back(start, end - start);
+    }
+    new_pos += control_entry.diff_size + control_entry.extra_size;
+    old_pos += control_entry.diff_size + control_entry.offset_increment;
+  }
+  return true;
+}
+
+void GetPuffReads(const vector<ByteExtent>& reads,
+                  const vector<ByteExtent>& puffs,
+                  vector<size_t>* puff_reads) {
+  for (const auto& read : reads) {
+    // The first puff that ends after the beginning of |read|.
+    size_t idx = std::distance(
+        puffs.begin(),
+        std::upper_bound(puffs.begin(), puffs.end(), read.offset,
+                         [](uint64_t offset, const ByteExtent& puff) {
+                           return offset < puff.offset + puff.length;
+                         }));
+    for (; idx < puffs.size() && puffs[idx].offset < read.offset + read.length;
+         idx++) {
+      if (puffs[idx].length > 0 &&
+          (puff_reads->empty() || puff_reads->back() != idx)) {
+        puff_reads->push_back(idx);
+      }
+    }
+  }
+}
+
+void MakeCachePlan(const vector<ByteExtent>& puffs,
+                   uint64_t max_cache_size,
+                   CachePlan* plan) {
+  const auto& puff_reads = plan->puff_reads;
+  auto num_reads = puff_reads.size();
+  // The index of the next read of the same puff for each read.
+  vector<size_t> next_reads(num_reads);
+  vector<size_t> next_read_of_puff(puffs.size(), num_reads);
+  for (size_t pos = num_reads; pos-- > 0;) {
+    next_reads[pos] = next_read_of_puff[puff_reads[pos]];
+    next_read_of_puff[puff_reads[pos]] = pos;
+  }
+
+  // The cached puffs indexed by the index of their next read, and the total
+  // capacity of their buffers, the same way |PuffinStream| would allocate
+  // them.
+  std::map<size_t, size_t> cache;
+  uint64_t cache_size = 0;
+  auto capacity = [&puffs](size_t puff_id) {
+    return BufferPool::GetCapacity(puffs[puff_id].length);
+  };
+
+  plan->cached_reads.assign(num_reads, false);
+  for (size_t pos = 0; pos < num_reads; pos++) {
+    auto puff_id = puff_reads[pos];
+    auto iter = cache.find(pos);
+    if (iter != cache.end()) {
+      // A hit, the puff is now read next at |next_reads[pos]|.
+      cache.erase(iter);
+    } else {
+      cache_size += capacity(puff_id);
+    }
+    // Keep the puff only if it is read again and the puffs it would evict are
+    // all read after it.
+    auto next_read = next_reads[pos];
+    while (next_read < num_reads && cache_size > max_cache_size &&
+           !cache.empty() && std::prev(cache.end())->first > next_read) {
+      cache_size -= capacity(std::prev(cache.end())->second);
+      cache.erase(std::prev(cache.end()));
+    }
+    if (next_read < num_reads && cache_size <= max_cache_size) {
+      cache[next_read] = puff_id;
+      plan->cached_reads[pos] = true;
+    } else {
+      cache_size -= capacity(puff_id);
+    }
+  }
+}
+
+void SimulateCache(const vector<ByteExtent>& puffs,
+                   const CachePlan& plan,
+                   uint64_t max_cache_size,
+                   vector<bool>* puffed,
+                   PuffCacheSimulation* simulation) {
+  // Like |PuffinStream|, nothing is cached if the largest puff does not fit.
+  for (const auto& puff : puffs) {
+    if (puff.length > max_cache_size) {
+      max_cache_size = 0;
+      break;
+    }
+  }
+  const auto& puff_reads = plan.puff_reads;
+  const auto& cached_reads = plan.cached_reads;
+  auto num_reads = puff_reads.size();
+  vector<size_t> next_reads(num_reads);
+  vector<size_t> next_read_of_puff(puffs.size(), num_reads);
+  for (size_t pos = num_reads; pos-- > 0;) {
+    next_reads[pos] = next_read_of_puff[puff_reads[pos]];
+    next_read_of_puff[puff_reads[pos]] = pos;
+    if (!cached_reads.empty() && !cached_reads[pos]) {
+      next_reads[pos] = num_reads;
+    }
+  }
+
+  // The cached puffs ordered by their next read, so the last one is evicted
+  // first, and the total capacity of their buffers.
+  std::set<std::pair<size_t, size_t>> cache;
+  vector<size_t> cached_next_read(puffs.size(), num_reads);
+  vector<bool> is_cached(puffs.size(), false);
+  uint64_t cache_size = 0;
+  // The puff in the buffer of the puffs the plan does not keep.
+  auto uncached_puff_id = puffs.size();
+
+  for (size_t pos = 0; pos < num_reads; pos++) {
+    auto puff_id = puff_reads[pos];
+    simulation->puff_reads++;
+    bool hit = false;
+    if (max_cache_size == 0) {
+      // Each read puffs the puff again.
+    } else if (is_cached[puff_id]) {
+      hit = true;
+      cache.erase({cached_next_read[puff_id], puff_id});
+      cached_next_read[puff_id] = next_reads[pos];
+      cache.emplace(next_reads[pos], puff_id);
+    } else if (next_reads[pos] == num_reads) {
+      hit = uncached_puff_id == puff_id;
+      uncached_puff_id = puff_id;
+    } else {
+      auto capacity = BufferPool::GetCapacity(puffs[puff_id].length);
+      while (cache_size + capacity > max_cache_size && !cache.empty()) {
+        auto victim = std::prev(cache.end())->second;
+        cache.erase(std::prev(cache.end()));
+        is_cached[victim] = false;
+        cache_size -= BufferPool::GetCapacity(puffs[victim].length);
+      }
+      cache.emplace(next_reads[pos], puff_id);
+      cached_next_read[puff_id] = next_reads[pos];
+      is_cached[puff_id] = true;
+      cache_size += capacity;
+    }
+
+    if (hit) {
+      simulation->cache_hits++;
+      continue;
+    }
+    simulation->puff_bytes += puffs[puff_id].length;
+    if ((*puffed)[puff_id]) {
+      simulation->repuff_bytes += puffs[puff_id].length;
+    }
+    (*puffed)[puff_id] = true;
+  }
+}
+
+}  // namespace puffin
@@ -0,0 +1,61 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_CACHE_PLAN_H_
+#define SRC_CACHE_PLAN_H_
+
+#include <vector>
+
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/puffpatch.h"
+
+namespace puffin {
+
+// The order in which the puffs of a puff stream are read, and which of them are
+// kept in the puff cache after being read (see |PuffinStream::CreateForPuff|).
+struct CachePlan {
+  // The ids of the puffs in the order they are read. Consecutive reads of the
+  // same puff are merged into one.
+  std::vector<size_t> puff_reads;
+  // For each entry of |puff_reads|, whether its puff is kept in the cache after
+  // it is read. If empty, all of them are kept until they are evicted.
+  std::vector<bool> cached_reads;
+};
+
+// Finds the ranges of the source (of size |src_size|) that bspatch reads when
+// applying the bsdiff patch |patch|, in the order they are read.
+bool GetBspatchSourceReads(const uint8_t* patch,
+                           size_t patch_size,
+                           uint64_t src_size,
+                           std::vector<ByteExtent>* reads);
+
+// Populates |puff_reads| with the ids of the puffs in |puffs| covered by the
+// ranges in |reads| of the puff stream, in order. |puffs| should be sorted.
+void GetPuffReads(const std::vector<ByteExtent>& reads,
+                  const std::vector<ByteExtent>& puffs,
+                  std::vector<size_t>* puff_reads);
+
+// Simulates reading the puffs in |plan->puff_reads| through a cache of
+// |max_cache_size| bytes and populates |plan->cached_reads|. The simulated
+// cache evicts the puffs that are read furthest in the future, and does not
+// keep a puff if it is not read again or if keeping it would evict puffs that
+// are read before it.
+void MakeCachePlan(const std::vector<ByteExtent>& puffs,
+                   uint64_t max_cache_size,
+                   CachePlan* plan);
+
+// Simulates reading the puffs in |plan.puff_reads| through the puff cache of a
+// |PuffinStream| of |max_cache_size| bytes following |plan|, without puffing
+// them, and adds the reads, hits and puffed bytes to |simulation|. |puffed|
+// marks the puffs puffed before (e.g. by the streams of the earlier chunks of
+// a patch), so puffing them again is counted as re-puffing, and is updated.
+void SimulateCache(const std::vector<ByteExtent>& puffs,
+                   const CachePlan& plan,
+                   uint64_t max_cache_size,
+                   std::vector<bool>* puffed,
+                   PuffCacheSimulation* simulation);
+
+}  // namespace puffin
+
+#endif  // SRC_CACHE_PLAN_H_
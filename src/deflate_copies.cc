@@ -0,0 +1,80 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/deflate_copies.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "puffin/src/set_errors.h"
+
+namespace puffin {
+
+using std::vector;
+
+bool FindPuffOfBytes(const vector<BitExtent>& deflates,
+                     const vector<ByteExtent>& puffs,
+                     const ByteExtent& bytes,
+                     ByteExtent* puff) {
+  TEST_AND_RETURN_FALSE(deflates.size() == puffs.size());
+  auto first = std::lower_bound(deflates.begin(), deflates.end(),
+                                bytes.offset * 8,
+                                [](const BitExtent& deflate, uint64_t offset) {
+                                  return deflate.offset < offset;
+                                });
+  TEST_AND_RETURN_FALSE(first != deflates.end() &&
+                        first->offset == bytes.offset * 8);
+  size_t first_idx = std::distance(deflates.begin(), first);
+  auto end_byte = bytes.offset + bytes.length;
+  auto last_idx = first_idx;
+  for (auto idx = first_idx;
+       idx < deflates.size() && deflates[idx].offset < end_byte * 8; idx++) {
+    TEST_AND_RETURN_FALSE(deflates[idx].offset + deflates[idx].length <=
+                          end_byte * 8);
+    last_idx = idx;
+  }
+  // The raw bytes after the last deflate follow its puff in the puff stream,
+  // starting with the byte it ends in (with its bits shifted out).
+  const auto& last_deflate = deflates[last_idx];
+  auto raw_start = (last_deflate.offset + last_deflate.length) / 8;
+  auto puff_end =
+      puffs[last_idx].offset + puffs[last_idx].length + end_byte - raw_start;
+  *puff = ByteExtent(puffs[first_idx].offset,
+                     puff_end - puffs[first_idx].offset);
+  return true;
+}
+
+void RemoveCopies(const ByteExtent& dst,
+                  const ByteExtent& dst_puff,
+                  const vector<DeflateCopy>& copies,
+                  vector<ByteExtent>* dst_parts,
+                  vector<ByteExtent>* dst_puff_parts) {
+  dst_parts->clear();
+  dst_puff_parts->clear();
+  auto copy = std::lower_bound(copies.begin(), copies.end(), dst.offset,
+                               [](const DeflateCopy& copy, uint64_t offset) {
+                                 return copy.dst.offset < offset;
+                               });
+  uint64_t offset = 0;
+  uint64_t puff_offset = 0;
+  auto add_parts = [&](uint64_t end, uint64_t puff_end) {
+    if (end > offset) {
+      dst_parts->emplace_back(offset, end - offset);
+    }
+    if (puff_end > puff_offset) {
+      dst_puff_parts->emplace_back(puff_offset, puff_end - puff_offset);
+    }
+  };
+  for (; copy != copies.end() && copy->dst.offset < dst.offset + dst.length;
+       copy++) {
+    add_parts(copy->dst.offset - dst.offset,
+              copy->dst_puff.offset - dst_puff.offset);
+    offset = copy->dst.offset + copy->dst.length - dst.offset;
+    puff_offset = copy->dst_puff.offset + copy->dst_puff.length -
+                  dst_puff.offset;
+  }
+  add_parts(dst.length, dst_puff.length);
+}
+
+}  // namespace puffin
@@ -0,0 +1,50 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_DEFLATE_COPIES_H_
+#define SRC_DEFLATE_COPIES_H_
+
+#include <vector>
+
+#include "puffin/src/include/puffin/common.h"
+
+namespace puffin {
+
+// A part of the destination deflate stream that is identical to a part of the
+// source deflate stream, so |PuffPatch| copies it from the source instead of
+// patching its puff (see |metadata::PatchCopy|).
+struct DeflateCopy {
+  DeflateCopy(uint64_t src_offset, const ByteExtent& dst)
+      : src_offset(src_offset), dst(dst), dst_puff(0, 0) {}
+
+  // The offset of the copy in the source deflate stream and its location in
+  // the destination deflate stream.
+  uint64_t src_offset;
+  ByteExtent dst;
+  // The part of the destination puff stream the copy replaces.
+  ByteExtent dst_puff;
+};
+
+// Finds the part |puff| of a puff stream that holds the part |bytes| of its
+// deflate stream, from the |deflates| of the deflate stream and their |puffs|.
+// Fails if |bytes| does not start with a deflate or does not hold whole
+// deflates, including the deflates starting in its last byte.
+bool FindPuffOfBytes(const std::vector<BitExtent>& deflates,
+                     const std::vector<ByteExtent>& puffs,
+                     const ByteExtent& bytes,
+                     ByteExtent* puff);
+
+// Splits the part |dst| of the destination deflate stream and its puff
+// |dst_puff| into the parts around the |copies| inside them, in |dst_parts|
+// and |dst_puff_parts| relative to the start of |dst| and |dst_puff|. The
+// |copies| should be sorted, and each one either inside |dst| or outside it.
+void RemoveCopies(const ByteExtent& dst,
+                  const ByteExtent& dst_puff,
+                  const std::vector<DeflateCopy>& copies,
+                  std::vector<ByteExtent>* dst_parts,
+                  std::vector<ByteExtent>* dst_puff_parts);
+
+}  // namespace puffin
+
+#endif  // SRC_DEFLATE_COPIES_H_
@@ -27,10 +27,23 @@ ExtentStream::ExtentStream(UniqueStreamPtr stream,
                            const vector<ByteExtent>& extents,
                            bool is_for_write)
     : stream_(std::move(stream)),
-      extents_(extents),
       cur_extent_offset_(0),
       is_for_write_(is_for_write),
-      offset_(0) {
+      offset_(0),
+      needs_seek_(true) {
+  // Merging the adjacent extents saves a read or write of |stream_| for each
+  // extent in a contiguous run, like the blocks of a mostly unfragmented file.
+  for (const auto& extent : extents) {
+    if (extent.length == 0) {
+      continue;
+    }
+    if (!extents_.empty() &&
+        extents_.back().offset + extents_.back().length == extent.offset) {
+      extents_.back().length += extent.length;
+    } else {
+      extents_.push_back(extent);
+    }
+  }
   extents_upper_bounds_.reserve(extents_.size() + 1);
   extents_upper_bounds_.emplace_back(0);
   uint64_t total_size = 0;
@@ -70,8 +83,16 @@ bool ExtentStream::Seek(uint64_t offset) {
   cur_extent_ = std::next(extents_.begin(), extent_idx);
   offset_ = offset;
   cur_extent_offset_ = offset_ - extents_upper_bounds_[extent_idx];
-  TEST_AND_RETURN_FALSE(
-      stream_->Seek(cur_extent_->offset + cur_extent_offset_));
+  needs_seek_ = true;
+  return true;
+}
+
+bool ExtentStream::SeekStream() {
+  if (needs_seek_) {
+    TEST_AND_RETURN_FALSE(
+        stream_->Seek(cur_extent_->offset + cur_extent_offset_));
+    needs_seek_ = false;
+  }
   return true;
 }
 
@@ -85,6 +106,16 @@ bool ExtentStream::Read(void* buffer, size_t length) {
   return true;
 }
 
+bool ExtentStream::ReadZeroCopy(const uint8_t** data, size_t length) {
+  if (is_for_write_ || cur_extent_ == extents_.end() ||
+      length > cur_extent_->length - cur_extent_offset_ || !SeekStream() ||
+      !stream_->ReadZeroCopy(data, length)) {
+    return false;
+  }
+  Advance(length);
+  return true;
+}
+
 bool ExtentStream::Write(const void* buffer, size_t length) {
   TEST_AND_RETURN_FALSE(is_for_write_);
   TEST_AND_RETURN_FALSE(DoReadOrWrite(nullptr, buffer, length));
@@ -94,6 +125,9 @@ bool ExtentStream::Write(const void* buffer, size_t length) {
 bool ExtentStream::DoReadOrWrite(void* read_buffer,
                                  const void* write_buffer,
                                  size_t length) {
+  if (DoReadOrWriteExtents(read_buffer, write_buffer, length)) {
+    return true;
+  }
   uint64_t bytes_passed = 0;
   while (bytes_passed < length) {
     if (cur_extent_ == extents_.end()) {
@@ -101,6 +135,7 @@ bool ExtentStream::DoReadOrWrite(void* read_buffer,
     }
     uint64_t bytes_to_pass = std::min(length - bytes_passed,
                                       cur_extent_->length - cur_extent_offset_);
+    TEST_AND_RETURN_FALSE(SeekStream());
     if (read_buffer != nullptr) {
       TEST_AND_RETURN_FALSE(
           stream_->Read(reinterpret_cast<uint8_t*>(read_buffer) + bytes_passed,
@@ -115,18 +150,55 @@ bool ExtentStream::DoReadOrWrite(void* read_buffer,
     }
 
     bytes_passed += bytes_to_pass;
-    cur_extent_offset_ += bytes_to_pass;
-    offset_ += bytes_to_pass;
-    if (cur_extent_offset_ == cur_extent_->length) {
-      // We have to advance the cur_extent_;
-      cur_extent_++;
-      cur_extent_offset_ = 0;
-      if (cur_extent_ != extents_.end()) {
-        TEST_AND_RETURN_FALSE(stream_->Seek(cur_extent_->offset));
-      }
+    Advance(bytes_to_pass);
+  }
+  return true;
+}
+
+bool ExtentStream::DoReadOrWriteExtents(void* read_buffer,
+                                        const void* write_buffer,
+                                        size_t length) {
+  if (cur_extent_ == extents_.end() ||
+      length <= cur_extent_->length - cur_extent_offset_) {
+    return false;
+  }
+  batch_extents_.clear();
+  uint64_t extent_offset = cur_extent_offset_;
+  uint64_t bytes_passed = 0;
+  for (auto extent = cur_extent_; bytes_passed < length; extent++) {
+    if (extent == extents_.end()) {
+      return false;
+    }
+    uint64_t bytes_to_pass =
+        std::min(length - bytes_passed, extent->length - extent_offset);
+    batch_extents_.emplace_back(extent->offset + extent_offset, bytes_to_pass);
+    bytes_passed += bytes_to_pass;
+    extent_offset = 0;
+  }
+  if (read_buffer != nullptr) {
+    if (!stream_->ReadExtents(batch_extents_, read_buffer)) {
+      return false;
     }
+  } else if (write_buffer == nullptr ||
+             !stream_->WriteExtents(batch_extents_, write_buffer)) {
+    return false;
+  }
+  for (const auto& extent : batch_extents_) {
+    Advance(extent.length);
   }
+  needs_seek_ = true;
   return true;
 }
 
+void ExtentStream::Advance(uint64_t length) {
+  cur_extent_offset_ += length;
+  offset_ += length;
+  if (cur_extent_offset_ == cur_extent_->length) {
+    // We have to advance the cur_extent_;
+    cur_extent_++;
+    cur_extent_offset_ = 0;
+    needs_seek_ = true;
+  }
+}
+
 }  // namespace puffin
@@ -13,9 +13,9 @@
 
 namespace puffin {
 
-// A stream object that allows reading and writing into disk extents. This is
-// only used in main.cc for puffin binary to allow puffpatch on a actual rootfs
-// and kernel images.
+// A stream object that allows reading and writing into disk extents. It is used
+// in main.cc for puffin binary to allow puffpatch on a actual rootfs and kernel
+// images, and by |PuffPatch| to write the parts of a chunk around its copies.
 class ExtentStream : public StreamInterface {
  public:
   // Creates a stream only for writing.
@@ -30,6 +30,9 @@ class ExtentStream : public StreamInterface {
   bool GetOffset(uint64_t* offset) const override;
   bool Seek(uint64_t offset) override;
   bool Read(void* buffer, size_t length) override;
+  // Only supported if the |length| bytes are in the current extent and
+  // |stream| supports it.
+  bool ReadZeroCopy(const uint8_t** data, size_t length) override;
   bool Write(const void* buffer, size_t length) override;
   bool Close() override;
 
@@ -45,9 +48,24 @@ class ExtentStream : public StreamInterface {
                      const void* write_buffer,
                      size_t length);
 
+  // Reads or writes the |length| bytes starting in the current extent with one
+  // |ReadExtents| or |WriteExtents| of |stream_| if they span more than one
+  // extent. Returns false if they do not or |stream_| does not support it.
+  bool DoReadOrWriteExtents(void* read_buffer,
+                            const void* write_buffer,
+                            size_t length);
+
+  // Advances the current offset by |length| bytes which should not pass the end
+  // of the current extent.
+  void Advance(uint64_t length);
+
+  // Seeks |stream_| to the current offset if it is not there.
+  bool SeekStream();
+
   // The underlying stream to read from and write into.
   UniqueStreamPtr stream_;
 
+  // The extents with the empty ones dropped and the adjacent ones merged.
   std::vector<ByteExtent> extents_;
 
   // The current |ByteExtent| that is being read from or write into.
@@ -69,6 +87,14 @@ class ExtentStream : public StreamInterface {
   // Used for proper and faster seeking.
   std::vector<uint64_t> extents_upper_bounds_;
 
+  // True if |stream_| may not be at the current offset. |stream_| is only
+  // seeked when it is read or written, so crossing an extent or seeking more
+  // than once in between costs no seek.
+  bool needs_seek_;
+
+  // The parts of the extents passed to the last |DoReadOrWriteExtents|.
+  std::vector<ByteExtent> batch_extents_;
+
   DISALLOW_COPY_AND_ASSIGN(ExtentStream);
 };
 
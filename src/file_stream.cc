@@ -16,6 +16,7 @@
 namespace puffin {
 
 using std::string;
+using std::vector;
 
 UniqueStreamPtr FileStream::Open(const string& path, bool read, bool write) {
   TEST_AND_RETURN_VALUE(read || write, nullptr);
@@ -83,6 +84,41 @@ bool FileStream::Write(const void* buffer, size_t length) {
   return true;
 }
 
+bool FileStream::ReadExtents(const vector<ByteExtent>& extents, void* buffer) {
+  auto c_bytes = static_cast<uint8_t*>(buffer);
+  for (const auto& extent : extents) {
+    size_t total_bytes_read = 0;
+    while (total_bytes_read < extent.length) {
+      auto bytes_read =
+          pread(fd_, c_bytes + total_bytes_read,
+                extent.length - total_bytes_read,
+                extent.offset + total_bytes_read);
+      TEST_AND_RETURN_FALSE(bytes_read > 0);
+      total_bytes_read += bytes_read;
+    }
+    c_bytes += extent.length;
+  }
+  return true;
+}
+
+bool FileStream::WriteExtents(const vector<ByteExtent>& extents,
+                              const void* buffer) {
+  auto c_bytes = static_cast<const uint8_t*>(buffer);
+  for (const auto& extent : extents) {
+    size_t total_bytes_wrote = 0;
+    while (total_bytes_wrote < extent.length) {
+      auto bytes_wrote =
+          pwrite(fd_, c_bytes + total_bytes_wrote,
+                 extent.length - total_bytes_wrote,
+                 extent.offset + total_bytes_wrote);
+      TEST_AND_RETURN_FALSE(bytes_wrote >= 0);
+      total_bytes_wrote += bytes_wrote;
+    }
+    c_bytes += extent.length;
+  }
+  return true;
+}
+
 bool FileStream::Close() {
   return close(fd_) == 0;
 }
@@ -7,6 +7,7 @@
 
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "puffin/common.h"
 #include "puffin/stream.h"
@@ -26,6 +27,10 @@ class FileStream : public StreamInterface {
   bool Seek(uint64_t offset) override;
   bool Read(void* buffer, size_t length) override;
   bool Write(const void* buffer, size_t length) override;
+  bool ReadExtents(const std::vector<ByteExtent>& extents,
+                   void* buffer) override;
+  bool WriteExtents(const std::vector<ByteExtent>& extents,
+                    const void* buffer) override;
   bool Close() override;
 
  protected:
@@ -21,13 +21,17 @@ namespace puffin {
 
 using std::string;
 
-Huffer::Huffer() : dyn_ht_(new HuffmanTable()), fix_ht_(new HuffmanTable()) {}
-
-Huffer::~Huffer() {}
-
-bool Huffer::HuffDeflate(PuffReaderInterface* pr,
-                         BitWriterInterface* bw,
-                         Error* error) const {
+namespace {
+
+// The implementation of |Huffer::HuffDeflate|. It is a template on the types of
+// the puff reader and the bit writer so calls to final types like
+// |BufferPuffReader| and |BufferBitWriter| can be inlined.
+template <typename PuffReaderType, typename BitWriterType>
+bool HuffDeflateImpl(HuffmanTable* fix_ht,
+                     HuffmanTable* dyn_ht,
+                     PuffReaderType* pr,
+                     BitWriterType* bw,
+                     Error* error) {
   *error = Error::kSuccess;
   PuffData pd;
   HuffmanTable* cur_ht = nullptr;
@@ -61,8 +65,9 @@ bool Huffer::HuffDeflate(PuffReaderInterface* pr,
                                           Error::kInsufficientOutput);
           TEST_AND_RETURN_FALSE_SET_ERROR(bw->WriteBits(16, ~pd.length),
                                           Error::kInsufficientOutput);
-          TEST_AND_RETURN_FALSE_SET_ERROR(bw->WriteBytes(pd.length, pd.read_fn),
-                                          Error::kInsufficientOutput);
+          TEST_AND_RETURN_FALSE_SET_ERROR(
+              bw->WriteBytes(pd.length, pd.literals),
+              Error::kInsufficientOutput);
           // Reading end of block, but don't write anything.
           TEST_AND_RETURN_FALSE(pr->GetNext(&pd, error));
           TEST_AND_RETURN_FALSE_SET_ERROR(
@@ -81,13 +86,13 @@ bool Huffer::HuffDeflate(PuffReaderInterface* pr,
         continue;
 
       case BlockType::kFixed:
-        fix_ht_->BuildFixedHuffmanTable();
-        cur_ht = fix_ht_.get();
+        fix_ht->BuildFixedHuffmanTable();
+        cur_ht = fix_ht;
         break;
 
       case BlockType::kDynamic:
-        cur_ht = dyn_ht_.get();
-        TEST_AND_RETURN_FALSE(dyn_ht_->BuildDynamicHuffmanTable(
+        cur_ht = dyn_ht;
+        TEST_AND_RETURN_FALSE(dyn_ht->BuildDynamicHuffmanTable(
             &pd.block_metadata[1], pd.length - 1, bw, error));
         break;
 
@@ -105,84 +110,39 @@ bool Huffer::HuffDeflate(PuffReaderInterface* pr,
       TEST_AND_RETURN_FALSE(pr->GetNext(&pd, error));
       switch (pd.type) {
         case PuffData::Type::kLiteral:
-        case PuffData::Type::kLiterals: {
-          auto write_literal = [&cur_ht, &bw, &error](uint8_t literal) {
-            uint16_t literal_huffman;
-            size_t nbits;
-            TEST_AND_RETURN_FALSE_SET_ERROR(
-                cur_ht->LitLenHuffman(literal, &literal_huffman, &nbits),
-                Error::kInvalidInput);
-            TEST_AND_RETURN_FALSE_SET_ERROR(
-                bw->WriteBits(nbits, literal_huffman),
-                Error::kInsufficientOutput);
-            return true;
-          };
-
-          if (pd.type == PuffData::Type::kLiteral) {
-            TEST_AND_RETURN_FALSE(write_literal(pd.byte));
-          } else {
-            auto len = pd.length;
-            while (len-- > 0) {
-              uint8_t literal;
-              pd.read_fn(&literal, 1);
-              TEST_AND_RETURN_FALSE(write_literal(literal));
-            }
-          }
+          TEST_AND_RETURN_FALSE(
+              cur_ht->EncodeLiterals(&pd.byte, 1, bw, error));
           break;
-        }
+
+        case PuffData::Type::kLiterals:
+          TEST_AND_RETURN_FALSE(
+              cur_ht->EncodeLiterals(pd.literals, pd.length, bw, error));
+          break;
+
         case PuffData::Type::kLenDist: {
           auto len = pd.length;
           auto dist = pd.distance;
           TEST_AND_RETURN_FALSE_SET_ERROR(len >= 3 && len <= 258,
                                           Error::kInvalidInput);
 
-          // Using a binary search here instead of the linear search may be (but
-          // not necessarily) faster. Needs experiment to validate.
-          size_t index = 0;
-          while (len > kLengthBases[index]) {
-            index++;
-          }
-          if (len < kLengthBases[index]) {
-            index--;
-          }
-          auto extra_bits_len = kLengthExtraBits[index];
-          uint16_t length_huffman;
+          TEST_AND_RETURN_FALSE_SET_ERROR(dist >= 1 && dist <= 32768,
+                                          Error::kInvalidInput);
+
+          // The length and distance codes are each written at once with their
+          // extra bits.
+          uint32_t huffman;
           size_t nbits;
           TEST_AND_RETURN_FALSE_SET_ERROR(
-              cur_ht->LitLenHuffman(index + 257, &length_huffman, &nbits),
+              cur_ht->EncodeLength(len, &huffman, &nbits),
               Error::kInvalidInput);
-
-          TEST_AND_RETURN_FALSE_SET_ERROR(bw->WriteBits(nbits, length_huffman),
+          TEST_AND_RETURN_FALSE_SET_ERROR(bw->WriteBits(nbits, huffman),
                                           Error::kInsufficientInput);
 
-          if (extra_bits_len > 0) {
-            TEST_AND_RETURN_FALSE_SET_ERROR(
-                bw->WriteBits(extra_bits_len, len - kLengthBases[index]),
-                Error::kInsufficientInput);
-          }
-
-          // Same as above (binary search).
-          index = 0;
-          while (dist > kDistanceBases[index]) {
-            index++;
-          }
-          if (dist < kDistanceBases[index]) {
-            index--;
-          }
-          extra_bits_len = kDistanceExtraBits[index];
-          uint16_t distance_huffman;
           TEST_AND_RETURN_FALSE_SET_ERROR(
-              cur_ht->DistanceHuffman(index, &distance_huffman, &nbits),
+              cur_ht->EncodeDistance(dist, &huffman, &nbits),
               Error::kInvalidInput);
-
-          TEST_AND_RETURN_FALSE_SET_ERROR(
-              bw->WriteBits(nbits, distance_huffman),
-              Error::kInsufficientInput);
-          if (extra_bits_len > 0) {
-            TEST_AND_RETURN_FALSE_SET_ERROR(
-                bw->WriteBits(extra_bits_len, dist - kDistanceBases[index]),
-                Error::kInsufficientInput);
-          }
+          TEST_AND_RETURN_FALSE_SET_ERROR(bw->WriteBits(nbits, huffman),
+                                          Error::kInsufficientInput);
           break;
         }
 
@@ -214,4 +174,24 @@ bool Huffer::HuffDeflate(PuffReaderInterface* pr,
   return true;
 }
 
+}  // namespace
+
+Huffer::Huffer()
+    : dyn_ht_(new HuffmanTable(kDefaultMaxCachedTables)),
+      fix_ht_(new HuffmanTable()) {}
+
+Huffer::~Huffer() {}
+
+bool Huffer::HuffDeflate(PuffReaderInterface* pr,
+                         BitWriterInterface* bw,
+                         Error* error) const {
+  return HuffDeflateImpl(fix_ht_.get(), dyn_ht_.get(), pr, bw, error);
+}
+
+bool Huffer::HuffDeflate(BufferPuffReader* pr,
+                         BufferBitWriter* bw,
+                         Error* error) const {
+  return HuffDeflateImpl(fix_ht_.get(), dyn_ht_.get(), pr, bw, error);
+}
+
 }  // namespace puffin
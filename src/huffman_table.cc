@@ -21,23 +21,23 @@ const uint8_t kPermutations[19] = {
 // The bases of each alphabet which is added to the integer value of extra
 // bits that comes after the Huffman code in the input to create the given
 // length value. The last element is a guard.
-const uint16_t kLengthBases[30] = {
+constexpr uint16_t kLengthBases[30] = {
   3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23,  27, 31, 35, 43,
   51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258, 0xFFFF};
 
 // Number of extra bits that comes after the associating Huffman code.
-const uint8_t kLengthExtraBits[29] = {
+constexpr uint8_t kLengthExtraBits[29] = {
   0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5,
   5, 5, 0};
 
 // Same as |kLengthBases| but for the distances instead of lengths. The last
 // element is a guard.
-const uint16_t kDistanceBases[31] = {
+constexpr uint16_t kDistanceBases[31] = {
   1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
   1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577, 0xFFFF};
 
 // Same as |kLengthExtraBits| but for distances instead of lengths.
-const uint8_t kDistanceExtraBits[30] = {
+constexpr uint8_t kDistanceExtraBits[30] = {
   0, 0, 0,  0,  1,  1,  2,  2,  3,  3,  4, 4, 5,  5,  6,  6,  7,  7,  8,  8, 9,
   9, 10, 10, 11, 11, 12, 12, 13, 13};
 // clang-format on
@@ -47,7 +47,303 @@ const uint8_t kDistanceExtraBits[30] = {
 // 286 = 256 (coding a byte) +
 //         1 (coding the end of block symbole) +
 //        29 (coding the lengths)
-HuffmanTable::HuffmanTable() : codeindexpairs_(288), initialized_(false) {}
+namespace {
+
+// The fixed Huffman codes (RFC1951 section 3.2.6) are generated at compile time
+// and shared by all |HuffmanTable|s. The literal/length codes are 7 to 9 bits
+// and the distance codes are 5 bits, so the lookup arrays have no sub-tables.
+constexpr size_t kNumFixedLitLen = 288;
+constexpr size_t kNumFixedDistance = 30;
+constexpr size_t kFixedLitLenBits = 9;
+constexpr size_t kFixedDistanceBits = 5;
+
+// A list of indices for generating the elements of an array at compile time.
+template <size_t... I>
+struct IndexList {};
+template <size_t N, size_t... I>
+struct MakeIndexList : MakeIndexList<N - 1, N - 1, I...> {};
+template <size_t... I>
+struct MakeIndexList<0, I...> {
+  using Type = IndexList<I...>;
+};
+
+// An array that can be initialized by a constexpr function.
+template <typename T, size_t N>
+struct StaticArray {
+  T data[N];
+};
+
+// Reverses the first |nbits| bits of |code|. Huffman codes are stored in the
+// deflate stream starting from their most significant bit.
+constexpr uint32_t ReverseBits(uint32_t code, size_t nbits) {
+  return nbits == 0 ? 0 : ((code & 1) << (nbits - 1)) |
+                              ReverseBits(code >> 1, nbits - 1);
+}
+
+// Returns the length of the fixed Huffman code of a literal/length |alphabet|.
+constexpr uint8_t FixedLitLenLength(size_t alphabet) {
+  return alphabet < 144 ? 8 : alphabet < 256 ? 9 : alphabet < 280 ? 7 : 8;
+}
+
+// Returns the fixed Huffman code of a literal/length |alphabet|.
+constexpr uint32_t FixedLitLenCode(size_t alphabet) {
+  return alphabet < 144
+             ? 0x30 + alphabet
+             : alphabet < 256 ? 0x190 + alphabet - 144
+                              : alphabet < 280 ? alphabet - 256
+                                               : 0xC0 + alphabet - 280;
+}
+
+// Returns the literal/length alphabet of the fixed Huffman code at the start
+// of |bits|. The 7-bit codes are 0 to 0x17, the 8-bit codes 0x30 to 0xC7 and
+// the 9-bit codes 0x190 to 0x1FF.
+constexpr size_t FixedLitLenAlphabet(uint32_t bits) {
+  return ReverseBits(bits, 7) < 0x18
+             ? 256 + ReverseBits(bits, 7)
+             : ReverseBits(bits, 8) < 0xC0
+                   ? ReverseBits(bits, 8) - 0x30
+                   : ReverseBits(bits, 8) < 0xC8
+                         ? 280 + ReverseBits(bits, 8) - 0xC0
+                         : 144 + ReverseBits(bits, 9) - 0x190;
+}
+
+// Returns the packed entry of a fixed Huffman code (see |kHuffmanEntryValid|).
+constexpr uint32_t FixedEntry(size_t alphabet, uint32_t nbits, uint32_t extra) {
+  return kHuffmanEntryValid | (extra << 24) | (nbits << 16) | alphabet;
+}
+
+constexpr uint32_t FixedLitLenEntry(size_t alphabet) {
+  return FixedEntry(alphabet, FixedLitLenLength(alphabet),
+                    alphabet >= 257 && alphabet < 286
+                        ? kLengthExtraBits[alphabet - 257]
+                        : 0);
+}
+
+constexpr uint32_t FixedDistanceEntry(size_t alphabet) {
+  return alphabet < kNumFixedDistance
+             ? FixedEntry(alphabet, kFixedDistanceBits,
+                          kDistanceExtraBits[alphabet])
+             : 0;
+}
+
+template <size_t... I>
+constexpr StaticArray<uint8_t, sizeof...(I)> MakeFixedLitLenLens(
+    IndexList<I...>) {
+  return {{FixedLitLenLength(I)...}};
+}
+
+template <size_t... I>
+constexpr StaticArray<uint32_t, sizeof...(I)> MakeFixedLitLenHcodes(
+    IndexList<I...>) {
+  return {{FixedLitLenEntry(FixedLitLenAlphabet(I))...}};
+}
+
+template <size_t... I>
+constexpr StaticArray<uint16_t, sizeof...(I)> MakeFixedLitLenRcodes(
+    IndexList<I...>) {
+  return {{static_cast<uint16_t>(
+      ReverseBits(FixedLitLenCode(I), FixedLitLenLength(I)))...}};
+}
+
+template <size_t... I>
+constexpr StaticArray<uint32_t, sizeof...(I)> MakeFixedDistanceHcodes(
+    IndexList<I...>) {
+  return {{FixedDistanceEntry(ReverseBits(I, kFixedDistanceBits))...}};
+}
+
+template <size_t... I>
+constexpr StaticArray<uint16_t, sizeof...(I)> MakeFixedDistanceRcodes(
+    IndexList<I...>) {
+  return {{static_cast<uint16_t>(ReverseBits(I, kFixedDistanceBits))...}};
+}
+
+constexpr StaticArray<uint8_t, kNumFixedLitLen> kFixedLitLenLens =
+    MakeFixedLitLenLens(MakeIndexList<kNumFixedLitLen>::Type());
+constexpr StaticArray<uint32_t, 1 << kFixedLitLenBits> kFixedLitLenHcodes =
+    MakeFixedLitLenHcodes(MakeIndexList<1 << kFixedLitLenBits>::Type());
+constexpr StaticArray<uint16_t, kNumFixedLitLen> kFixedLitLenRcodes =
+    MakeFixedLitLenRcodes(MakeIndexList<kNumFixedLitLen>::Type());
+constexpr StaticArray<uint8_t, kNumFixedDistance> kFixedDistanceLens = {
+    {5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+     5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5}};
+constexpr StaticArray<uint32_t, 1 << kFixedDistanceBits> kFixedDistanceHcodes =
+    MakeFixedDistanceHcodes(MakeIndexList<1 << kFixedDistanceBits>::Type());
+constexpr StaticArray<uint16_t, kNumFixedDistance> kFixedDistanceRcodes =
+    MakeFixedDistanceRcodes(MakeIndexList<kNumFixedDistance>::Type());
+
+// The encoding of the lengths and distances is looked up instead of searched
+// in |kLengthBases| and |kDistanceBases|.
+constexpr size_t kNumLiterals = 256;
+constexpr size_t kNumLengths = 259;
+constexpr size_t kNumDistanceSymbols = 512;
+
+// Returns the alphabet (minus 257) of the length |len|.
+constexpr size_t LengthSymbol(size_t len, size_t index = 0) {
+  return kLengthBases[index + 1] > len ? index : LengthSymbol(len, index + 1);
+}
+
+// Returns the alphabet of the distance |dist|.
+constexpr size_t DistanceSymbol(size_t dist, size_t index = 0) {
+  return kDistanceBases[index + 1] > dist ? index
+                                          : DistanceSymbol(dist, index + 1);
+}
+
+// Returns the packed entry of a length (see |HuffmanTable::EncodeLength|)
+// with the Huffman code |huffman| of |nbits| bits followed by |extra_bits|
+// extra bits of |extra|.
+constexpr uint32_t LengthEntry(uint32_t huffman,
+                               size_t nbits,
+                               size_t extra_bits,
+                               uint32_t extra) {
+  return kHuffmanEntryValid | ((nbits + extra_bits) << 24) | (extra << nbits) |
+         huffman;
+}
+
+constexpr uint32_t FixedLengthEntry(size_t len, size_t symbol) {
+  return len < 3 ? 0
+                 : LengthEntry(ReverseBits(FixedLitLenCode(symbol + 257),
+                                           FixedLitLenLength(symbol + 257)),
+                               FixedLitLenLength(symbol + 257),
+                               kLengthExtraBits[symbol],
+                               len - kLengthBases[symbol]);
+}
+
+// A literal is encoded like a length without extra bits.
+constexpr uint32_t FixedLiteralEntry(size_t literal) {
+  return LengthEntry(ReverseBits(FixedLitLenCode(literal),
+                                 FixedLitLenLength(literal)),
+                     FixedLitLenLength(literal), 0, 0);
+}
+
+template <size_t... I>
+constexpr StaticArray<uint32_t, sizeof...(I)> MakeFixedLiteralCodes(
+    IndexList<I...>) {
+  return {{FixedLiteralEntry(I)...}};
+}
+
+template <size_t... I>
+constexpr StaticArray<uint8_t, sizeof...(I)> MakeLengthSymbols(
+    IndexList<I...>) {
+  return {{static_cast<uint8_t>(LengthSymbol(I))...}};
+}
+
+// The first 256 entries are indexed by the distance minus one and the rest by
+// 256 plus the distance minus one shifted right by seven. The distance
+// alphabets above 15 start at distances one more than a multiple of 128.
+template <size_t... I>
+constexpr StaticArray<uint8_t, sizeof...(I)> MakeDistanceSymbols(
+    IndexList<I...>) {
+  return {{static_cast<uint8_t>(I < 256 ? DistanceSymbol(I + 1)
+                                         : DistanceSymbol(((I - 256) << 7) +
+                                                          1))...}};
+}
+
+template <size_t... I>
+constexpr StaticArray<uint32_t, sizeof...(I)> MakeFixedLengthCodes(
+    IndexList<I...>) {
+  return {{FixedLengthEntry(I, LengthSymbol(I))...}};
+}
+
+constexpr StaticArray<uint32_t, kNumLiterals> kFixedLiteralCodes =
+    MakeFixedLiteralCodes(MakeIndexList<kNumLiterals>::Type());
+constexpr StaticArray<uint8_t, kNumLengths> kLengthSymbols =
+    MakeLengthSymbols(MakeIndexList<kNumLengths>::Type());
+constexpr StaticArray<uint8_t, kNumDistanceSymbols> kDistanceSymbolsArray =
+    MakeDistanceSymbols(MakeIndexList<kNumDistanceSymbols>::Type());
+constexpr StaticArray<uint32_t, kNumLengths> kFixedLengthCodes =
+    MakeFixedLengthCodes(MakeIndexList<kNumLengths>::Type());
+
+// Returns the 64-bit FNV-1a hash of the |length| bytes of |data|.
+uint64_t HashMetadata(const uint8_t* data, size_t length) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t idx = 0; idx < length; idx++) {
+    hash = (hash ^ data[idx]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+}  // namespace
+
+const uint8_t* const kDistanceSymbols = kDistanceSymbolsArray.data;
+
+HuffmanTable::HuffmanTable(size_t max_cached_tables)
+    : cur_num_lit_len_(0),
+      cur_literal_codes_(nullptr),
+      cur_length_codes_(nullptr),
+      cur_num_distance_(0),
+      initialized_(false),
+      max_cached_tables_(max_cached_tables) {}
+
+bool HuffmanTable::FindCachedTable(const uint8_t* metadata,
+                                   size_t length,
+                                   bool reverse) {
+  if (max_cached_tables_ == 0) {
+    return false;
+  }
+  auto hash = HashMetadata(metadata, length);
+  auto table = std::find_if(
+      cached_tables_.begin(), cached_tables_.end(),
+      [hash, metadata, length, reverse](const CachedTable& table) {
+        return table.hash == hash && table.reverse == reverse &&
+               table.metadata.size() == length &&
+               std::equal(table.metadata.begin(), table.metadata.end(),
+                          metadata);
+      });
+  if (table == cached_tables_.end()) {
+    return false;
+  }
+  std::rotate(cached_tables_.begin(), table, table + 1);
+  const auto& cached = cached_tables_.front();
+  if (reverse) {
+    lit_len_rcodes_ = cached.lit_len_rcodes;
+    literal_codes_ = cached.literal_codes;
+    length_codes_ = cached.length_codes;
+    distance_rcodes_ = cached.distance_rcodes;
+    code_rcodes_ = cached.code_rcodes;
+    code_max_bits_ = cached.code_max_bits;
+  } else {
+    lit_len_hcodes_ = cached.lit_len_hcodes;
+    distance_hcodes_ = cached.distance_hcodes;
+    lit_len_root_bits_ = cached.lit_len_root_bits;
+    distance_root_bits_ = cached.distance_root_bits;
+  }
+  lit_len_max_bits_ = cached.lit_len_max_bits;
+  distance_max_bits_ = cached.distance_max_bits;
+  return true;
+}
+
+void HuffmanTable::CacheTable(const uint8_t* metadata,
+                              size_t length,
+                              bool reverse) {
+  if (max_cached_tables_ == 0) {
+    return;
+  }
+  // Reuse the arrays of the least recently used table if the cache is full.
+  if (cached_tables_.size() < max_cached_tables_) {
+    cached_tables_.emplace_back();
+  }
+  std::rotate(cached_tables_.begin(), cached_tables_.end() - 1,
+              cached_tables_.end());
+  auto& cached = cached_tables_.front();
+  cached.hash = HashMetadata(metadata, length);
+  cached.reverse = reverse;
+  cached.metadata.assign(metadata, metadata + length);
+  if (reverse) {
+    cached.lit_len_rcodes = lit_len_rcodes_;
+    cached.literal_codes = literal_codes_;
+    cached.length_codes = length_codes_;
+    cached.distance_rcodes = distance_rcodes_;
+    cached.code_rcodes = code_rcodes_;
+    cached.code_max_bits = code_max_bits_;
+  } else {
+    cached.lit_len_hcodes = lit_len_hcodes_;
+    cached.distance_hcodes = distance_hcodes_;
+    cached.lit_len_root_bits = lit_len_root_bits_;
+    cached.distance_root_bits = distance_root_bits_;
+  }
+  cached.lit_len_max_bits = lit_len_max_bits_;
+  cached.distance_max_bits = distance_max_bits_;
+}
 
 bool HuffmanTable::InitHuffmanCodes(const Buffer& lens, size_t* max_bits) {
   // Temporary buffers used in |InitHuffmanCodes|.
@@ -65,10 +361,13 @@ bool HuffmanTable::InitHuffmanCodes(const Buffer& lens, size_t* max_bits) {
     }
   }
 
-  // Check for oversubscribed code lengths. (A code with length 'L' cannot have
-  // more than 2^L items.
+  // Check for oversubscribed code lengths. (The codes of length 'L' cannot use
+  // more than the 2^L items left by the shorter codes.) This guarantees the
+  // resulting codes are prefix free.
+  int left = 1;
   for (size_t idx = 1; idx <= *max_bits; idx++) {
-    if (len_count_[idx] > (1 << idx)) {
+    left = (left << 1) - len_count_[idx];
+    if (left < 0) {
       LOG(ERROR) << "Oversubscribed code lengths error!";
       return false;
     }
@@ -107,27 +406,66 @@ bool HuffmanTable::InitHuffmanCodes(const Buffer& lens, size_t* max_bits) {
 }
 
 bool HuffmanTable::BuildHuffmanCodes(const Buffer& lens,
-                                     std::vector<uint16_t>* hcodes,
+                                     const uint8_t* extra_bits,
+                                     size_t extra_start,
+                                     size_t extra_end,
+                                     std::vector<uint32_t>* hcodes,
+                                     size_t* root_bits,
                                      size_t* max_bits) {
   TEST_AND_RETURN_FALSE(InitHuffmanCodes(lens, max_bits));
-  // Sort descending based on the bit-length of the code.
-  std::sort(codeindexpairs_.begin(),
-            codeindexpairs_.end(),
-            [&lens](const CodeIndexPair& a, const CodeIndexPair& b) {
-              return lens[a.index] > lens[b.index];
-            });
+  *root_bits = std::min(*root_bits, *max_bits);
+  size_t root_size = 1 << *root_bits;
+  size_t root_mask = root_size - 1;
+
+  // Find the number of index bits of the sub-table for each first level slot
+  // shared by codes longer than |root_bits|. It is the length of the longest
+  // code that starts with that slot minus |root_bits|.
+  uint8_t sub_bits[1 << kLitLenRootBits] = {0};
+  for (const auto& cip : codeindexpairs_) {
+    auto len = lens[cip.index];
+    if (len > *root_bits) {
+      auto& bits = sub_bits[cip.code & root_mask];
+      bits = std::max(bits, static_cast<uint8_t>(len - *root_bits));
+    }
+  }
 
   // Only zero out the part of hcodes which is valuable.
-  memset(hcodes->data(), 0, (1 << *max_bits) * sizeof(uint16_t));
+  size_t size = root_size;
+  for (size_t idx = 0; idx < root_size; idx++) {
+    size += sub_bits[idx] ? 1 << sub_bits[idx] : 0;
+  }
+  hcodes->assign(size, 0);
+  size_t sub_table = root_size;
+  for (size_t idx = 0; idx < root_size; idx++) {
+    if (sub_bits[idx]) {
+      (*hcodes)[idx] = kHuffmanEntryValid | kHuffmanEntrySubTable |
+                       (sub_bits[idx] << 16) | sub_table;
+      sub_table += 1 << sub_bits[idx];
+    }
+  }
+
   for (const auto& cip : codeindexpairs_) {
-    // The MSB bit of the code in hcodes is set if it is a valid code and its
+    uint32_t len = lens[cip.index];
+    uint32_t extra = 0;
+    if (extra_bits != nullptr && cip.index >= extra_start &&
+        cip.index < extra_end) {
+      extra = extra_bits[cip.index - extra_start];
+    }
+    // The MSB bit of the entry in hcodes is set if it is a valid code and its
     // code exists in the input Huffman table.
-    (*hcodes)[cip.code] = cip.index | 0x8000;
-    auto fill_bits = *max_bits - lens[cip.index];
-    for (auto idx = 1; idx < (1 << fill_bits); idx++) {
-      auto location = (idx << lens[cip.index]) | cip.code;
-      if (!((*hcodes)[location] & 0x8000)) {
-        (*hcodes)[location] = cip.index | 0x8000;
+    uint32_t entry = kHuffmanEntryValid | (extra << 24) | (len << 16) |
+                     cip.index;
+    if (len <= *root_bits) {
+      for (size_t idx = cip.code; idx < root_size; idx += 1 << len) {
+        (*hcodes)[idx] = entry;
+      }
+    } else {
+      auto link = (*hcodes)[cip.code & root_mask];
+      size_t sub_size = 1 << EntryBits(link);
+      auto* sub_hcodes = hcodes->data() + EntryAlphabet(link);
+      for (size_t idx = cip.code >> *root_bits; idx < sub_size;
+           idx += 1 << (len - *root_bits)) {
+        sub_hcodes[idx] = entry;
       }
     }
   }
@@ -157,57 +495,58 @@ bool HuffmanTable::BuildHuffmanReverseCodes(const Buffer& lens,
   return true;
 }
 
-bool HuffmanTable::BuildFixedHuffmanTable() {
-  if (!initialized_) {
-    // For all the vectors used in this class, we set the size in the
-    // constructor and we do not change the size later. This is for optimization
-    // purposes. The total size of data in this class is approximately
-    // 2KB. Because it is a constructor return values cannot be checked.
-    lit_len_lens_.resize(288);
-    lit_len_rcodes_.resize(288);
-    lit_len_hcodes_.resize(1 << 9);
-
-    distance_lens_.resize(30);
-    distance_rcodes_.resize(30);
-    distance_hcodes_.resize(1 << 5);
-
-    size_t i = 0;
-    while (i < 144) {
-      lit_len_lens_[i++] = 8;
-    }
-    while (i < 256) {
-      lit_len_lens_[i++] = 9;
-    }
-    while (i < 280) {
-      lit_len_lens_[i++] = 7;
-    }
-    while (i < 288) {
-      lit_len_lens_[i++] = 8;
-    }
-
-    i = 0;
-    while (i < 30) {
-      distance_lens_[i++] = 5;
+void HuffmanTable::BuildMergedCodes() {
+  literal_codes_.resize(kNumLiterals);
+  for (size_t literal = 0; literal < kNumLiterals; literal++) {
+    auto nbits = lit_len_lens_[literal];
+    literal_codes_[literal] =
+        nbits == 0 ? 0 : LengthEntry(lit_len_rcodes_[literal], nbits, 0, 0);
+  }
+  length_codes_.assign(kNumLengths, 0);
+  for (size_t len = 3; len < kNumLengths; len++) {
+    size_t symbol = kLengthSymbols.data[len];
+    if (symbol + 257 < lit_len_lens_.size()) {
+      length_codes_[len] = LengthEntry(
+          lit_len_rcodes_[symbol + 257], lit_len_lens_[symbol + 257],
+          kLengthExtraBits[symbol], len - kLengthBases[symbol]);
     }
-
-    TEST_AND_RETURN_FALSE(
-        BuildHuffmanCodes(lit_len_lens_, &lit_len_hcodes_, &lit_len_max_bits_));
-
-    TEST_AND_RETURN_FALSE(BuildHuffmanCodes(
-        distance_lens_, &distance_hcodes_, &distance_max_bits_));
-
-    TEST_AND_RETURN_FALSE(BuildHuffmanReverseCodes(
-        lit_len_lens_, &lit_len_rcodes_, &lit_len_max_bits_));
-
-    TEST_AND_RETURN_FALSE(BuildHuffmanReverseCodes(
-        distance_lens_, &distance_rcodes_, &distance_max_bits_));
-
-    initialized_ = true;
   }
+}
+
+bool HuffmanTable::BuildFixedHuffmanTable() {
+  cur_num_lit_len_ = kNumFixedLitLen;
+  cur_lit_len_lens_ = kFixedLitLenLens.data;
+  cur_lit_len_hcodes_ = kFixedLitLenHcodes.data;
+  cur_lit_len_rcodes_ = kFixedLitLenRcodes.data;
+  cur_literal_codes_ = kFixedLiteralCodes.data;
+  cur_length_codes_ = kFixedLengthCodes.data;
+  lit_len_root_bits_ = kFixedLitLenBits;
+  lit_len_max_bits_ = kFixedLitLenBits;
+
+  cur_num_distance_ = kNumFixedDistance;
+  cur_distance_lens_ = kFixedDistanceLens.data;
+  cur_distance_hcodes_ = kFixedDistanceHcodes.data;
+  cur_distance_rcodes_ = kFixedDistanceRcodes.data;
+  distance_root_bits_ = kFixedDistanceBits;
+  distance_max_bits_ = kFixedDistanceBits;
   return true;
 }
 
-bool HuffmanTable::BuildDynamicHuffmanTable(BitReaderInterface* br,
+void HuffmanTable::UseDynamicTable() {
+  cur_num_lit_len_ = lit_len_lens_.size();
+  cur_lit_len_lens_ = lit_len_lens_.data();
+  cur_lit_len_hcodes_ = lit_len_hcodes_.data();
+  cur_lit_len_rcodes_ = lit_len_rcodes_.data();
+  cur_literal_codes_ = literal_codes_.data();
+  cur_length_codes_ = length_codes_.data();
+  cur_num_distance_ = distance_lens_.size();
+  cur_distance_lens_ = distance_lens_.data();
+  cur_distance_hcodes_ = distance_hcodes_.data();
+  cur_distance_rcodes_ = distance_rcodes_.data();
+}
+
+template <typename BitReaderType>
+bool HuffmanTable::BuildDynamicHuffmanTable(BitReaderType* br,
                                             uint8_t* buffer,
                                             size_t* length,
                                             Error* error) {
@@ -215,19 +554,22 @@ bool HuffmanTable::BuildDynamicHuffmanTable(BitReaderInterface* br,
   if (!initialized_) {
     // Only resizing the arrays needed.
     code_lens_.resize(19);
-    code_hcodes_.resize(1 << 7);
+    code_hcodes_.reserve(1 << kCodeRootBits);
 
+    // The first level of the Huffman code arrays plus the sub-tables needed
+    // for the longest codes in the common case.
     lit_len_lens_.resize(286);
-    lit_len_hcodes_.resize(1 << 15);
+    lit_len_hcodes_.reserve(852);
 
     distance_lens_.resize(30);
-    distance_hcodes_.resize(1 << 15);
+    distance_hcodes_.reserve(592);
 
     // 286: Maximum number of literal/lengths symbols.
     // 30: Maximum number of distance symbols.
     // The reason we reserve this to the sum of both maximum sizes is that we
     // need to calculate both huffman codes contiguously. See b/72815313.
     tmp_lens_.resize(286 + 30);
+    codeindexpairs_.reserve(288);
     initialized_ = true;
   }
 
@@ -284,8 +626,10 @@ bool HuffmanTable::BuildDynamicHuffmanTable(BitReaderInterface* br,
     code_lens_[kPermutations[idx]] = 0;
   }
 
+  code_root_bits_ = kCodeRootBits;
   TEST_AND_RETURN_FALSE_SET_ERROR(
-      BuildHuffmanCodes(code_lens_, &code_hcodes_, &code_max_bits_),
+      BuildHuffmanCodes(code_lens_, nullptr, 0, 0, &code_hcodes_,
+                        &code_root_bits_, &code_max_bits_),
       Error::kInvalidInput);
 
   // Build literals/lengths and distance Huffman code length arrays.
@@ -305,20 +649,37 @@ bool HuffmanTable::BuildDynamicHuffmanTable(BitReaderInterface* br,
   distance_lens_.insert(distance_lens_.begin(), tmp_lens_.begin() + num_lit_len,
                         tmp_lens_.end());
 
+  // The Huffman table metadata is complete now, so reuse the Huffman codes if
+  // they were built for a previous block.
+  if (FindCachedTable(buffer, index, false)) {
+    UseDynamicTable();
+    *length = index;
+    return true;
+  }
+
+  lit_len_root_bits_ = kLitLenRootBits;
   TEST_AND_RETURN_FALSE_SET_ERROR(
-      BuildHuffmanCodes(lit_len_lens_, &lit_len_hcodes_, &lit_len_max_bits_),
+      BuildHuffmanCodes(lit_len_lens_, kLengthExtraBits, 257, 286,
+                        &lit_len_hcodes_, &lit_len_root_bits_,
+                        &lit_len_max_bits_),
       Error::kInvalidInput);
 
   // Build distance Huffman codes.
+  distance_root_bits_ = kDistanceRootBits;
   TEST_AND_RETURN_FALSE_SET_ERROR(
-      BuildHuffmanCodes(distance_lens_, &distance_hcodes_, &distance_max_bits_),
+      BuildHuffmanCodes(distance_lens_, kDistanceExtraBits, 0, 30,
+                        &distance_hcodes_, &distance_root_bits_,
+                        &distance_max_bits_),
       Error::kInvalidInput);
+  CacheTable(buffer, index, false);
+  UseDynamicTable();
 
   *length = index;
   return true;
 }
 
-bool HuffmanTable::BuildHuffmanCodeLengths(BitReaderInterface* br,
+template <typename BitReaderType>
+bool HuffmanTable::BuildHuffmanCodeLengths(BitReaderType* br,
                                            uint8_t* buffer,
                                            size_t* length,
                                            size_t max_bits,
@@ -392,9 +753,10 @@ bool HuffmanTable::BuildHuffmanCodeLengths(BitReaderInterface* br,
   return true;
 }
 
+template <typename BitWriterType>
 bool HuffmanTable::BuildDynamicHuffmanTable(const uint8_t* buffer,
                                             size_t length,
-                                            BitWriterInterface* bw,
+                                            BitWriterType* bw,
                                             Error* error) {
   if (!initialized_) {
     // Only resizing the arrays needed.
@@ -409,9 +771,15 @@ bool HuffmanTable::BuildDynamicHuffmanTable(const uint8_t* buffer,
 
     tmp_lens_.resize(286 + 30);
 
+    codeindexpairs_.reserve(288);
     initialized_ = true;
   }
 
+  // The Huffman table metadata is known up front, so the Huffman codes are
+  // reused if they were built for a previous block. The code lengths still
+  // have to be written into the deflate stream.
+  bool cached = FindCachedTable(buffer, length, true);
+
   TEST_AND_RETURN_FALSE_SET_ERROR(length >= 3, Error::kInsufficientInput);
   size_t index = 0;
   // Write the header.
@@ -454,9 +822,11 @@ bool HuffmanTable::BuildDynamicHuffmanTable(const uint8_t* buffer,
     code_lens_[kPermutations[idx]] = 0;
   }
 
-  TEST_AND_RETURN_FALSE_SET_ERROR(
-      BuildHuffmanReverseCodes(code_lens_, &code_rcodes_, &code_max_bits_),
-      Error::kInvalidInput);
+  if (!cached) {
+    TEST_AND_RETURN_FALSE_SET_ERROR(
+        BuildHuffmanReverseCodes(code_lens_, &code_rcodes_, &code_max_bits_),
+        Error::kInvalidInput);
+  }
 
   // Build literal/lengths and distance Huffman code length arrays.
   auto bytes_available = length - index;
@@ -473,26 +843,35 @@ bool HuffmanTable::BuildDynamicHuffmanTable(const uint8_t* buffer,
   distance_lens_.insert(distance_lens_.begin(), tmp_lens_.begin() + num_lit_len,
                         tmp_lens_.end());
 
-  // Build literal/lengths Huffman reverse codes.
-  TEST_AND_RETURN_FALSE_SET_ERROR(
-      BuildHuffmanReverseCodes(
-          lit_len_lens_, &lit_len_rcodes_, &lit_len_max_bits_),
-      Error::kInvalidInput);
+  if (!cached) {
+    // Build literal/lengths Huffman reverse codes.
+    TEST_AND_RETURN_FALSE_SET_ERROR(
+        BuildHuffmanReverseCodes(
+            lit_len_lens_, &lit_len_rcodes_, &lit_len_max_bits_),
+        Error::kInvalidInput);
 
-  // Build distance Huffman reverse codes.
-  TEST_AND_RETURN_FALSE_SET_ERROR(
-      BuildHuffmanReverseCodes(
-          distance_lens_, &distance_rcodes_, &distance_max_bits_),
-      Error::kInvalidInput);
+    // Build distance Huffman reverse codes.
+    TEST_AND_RETURN_FALSE_SET_ERROR(
+        BuildHuffmanReverseCodes(
+            distance_lens_, &distance_rcodes_, &distance_max_bits_),
+        Error::kInvalidInput);
+
+    BuildMergedCodes();
+  }
 
   TEST_AND_RETURN_FALSE_SET_ERROR(length == index, Error::kInvalidInput);
+  if (!cached) {
+    CacheTable(buffer, length, true);
+  }
+  UseDynamicTable();
 
   return true;
 }
 
+template <typename BitWriterType>
 bool HuffmanTable::BuildHuffmanCodeLengths(const uint8_t* buffer,
                                            size_t* length,
-                                           BitWriterInterface* bw,
+                                           BitWriterType* bw,
                                            size_t num_codes,
                                            Buffer* lens,
                                            Error* error) {
@@ -554,6 +933,15 @@ bool HuffmanTable::BuildHuffmanCodeLengths(const uint8_t* buffer,
   return true;
 }
 
+template bool HuffmanTable::BuildDynamicHuffmanTable<BitReaderInterface>(
+    BitReaderInterface* br, uint8_t* buffer, size_t* length, Error* error);
+template bool HuffmanTable::BuildDynamicHuffmanTable<BufferBitReader>(
+    BufferBitReader* br, uint8_t* buffer, size_t* length, Error* error);
+template bool HuffmanTable::BuildDynamicHuffmanTable<BitWriterInterface>(
+    const uint8_t* buffer, size_t length, BitWriterInterface* bw, Error* error);
+template bool HuffmanTable::BuildDynamicHuffmanTable<BufferBitWriter>(
+    const uint8_t* buffer, size_t length, BufferBitWriter* bw, Error* error);
+
 std::string BlockTypeToString(BlockType type) {
   switch (type) {
     case BlockType::kUncompressed:
@@ -40,9 +40,45 @@ extern const uint16_t kDistanceBases[];
 // Same as |kLengthExtraBits| except for distances instead of lengths.
 extern const uint8_t kDistanceExtraBits[];
 
+// The alphabets of the distances, indexed by the distance minus one for
+// distances up to 256, and by 256 plus the distance minus one shifted right by
+// seven for the larger ones (see |HuffmanTable::EncodeDistance|).
+extern const uint8_t* const kDistanceSymbols;
+
+// The maximum number of extra bits that comes after a length or distance code.
+constexpr size_t kMaxLengthExtraBits = 5;
+constexpr size_t kMaxDistanceExtraBits = 13;
+
+// The Huffman code to alphabet arrays (hcodes) are multi-level lookup tables.
+// The first level is indexed by the first |*_root_bits_| bits of the input and
+// codes longer than that are resolved through a second level sub-table. Each
+// entry is packed into 32 bits:
+//   bits  0-15: The alphabet, or the index of the sub-table for links.
+//   bits 16-23: The number of bits in the Huffman code, or the number of index
+//               bits of the sub-table for links.
+//   bits 24-27: The number of extra bits that comes after the Huffman code.
+//   bit  30:    Set if the entry is a link to a sub-table.
+//   bit  31:    Set if the entry is valid.
+constexpr uint32_t kHuffmanEntryValid = 0x80000000;
+constexpr uint32_t kHuffmanEntrySubTable = 0x40000000;
+
+// The number of bits used for indexing the first level of the literal/length,
+// distance and code length Huffman code arrays.
+constexpr size_t kLitLenRootBits = 9;
+constexpr size_t kDistanceRootBits = 6;
+constexpr size_t kCodeRootBits = 7;
+
+// The number of built dynamic Huffman tables |Puffer| and |Huffer| keep for
+// reuse by later blocks with the same Huffman table metadata.
+constexpr size_t kDefaultMaxCachedTables = 8;
+
 class HuffmanTable {
  public:
-  HuffmanTable();
+  // |max_cached_tables| is the number of built dynamic Huffman tables to keep
+  // for reuse. Deflate streams created by the same encoder often repeat the
+  // same dynamic Huffman table, and building it again costs more than
+  // decoding the symbols of a small block. Zero disables the cache.
+  explicit HuffmanTable(size_t max_cached_tables = 0);
   virtual ~HuffmanTable() = default;
 
   // Checks the lengths of Huffman length arrays for correctness
@@ -71,6 +107,39 @@ class HuffmanTable {
   // codes.
   inline size_t DistanceMaxBits() { return distance_max_bits_; }
 
+  // Returns the packed entry associated with the set of input bits for the
+  // literal/length code length array. |bits| should contain at least
+  // |LitLenMaxBits()| bits of the input (zero padded if not available).
+  inline uint32_t LitLenEntry(uint32_t bits) const {
+    return LookupEntry(cur_lit_len_hcodes_, lit_len_root_bits_, bits);
+  }
+
+  // Same as |LitLenEntry| but for the distance code length array.
+  inline uint32_t DistanceEntry(uint32_t bits) const {
+    return LookupEntry(cur_distance_hcodes_, distance_root_bits_, bits);
+  }
+
+  // Returns true if the packed |entry| is associated with an alphabet.
+  static inline bool IsValidEntry(uint32_t entry) {
+    return entry & kHuffmanEntryValid;
+  }
+
+  // Returns the alphabet of the packed |entry|.
+  static inline uint16_t EntryAlphabet(uint32_t entry) {
+    return entry & 0xFFFF;
+  }
+
+  // Returns the number of bits in the Huffman code of the packed |entry|.
+  static inline size_t EntryBits(uint32_t entry) {
+    return (entry >> 16) & 0xFF;
+  }
+
+  // Returns the number of extra bits that comes after the Huffman code of the
+  // packed |entry|.
+  static inline size_t EntryExtraBits(uint32_t entry) {
+    return (entry >> 24) & 0x0F;
+  }
+
   // Returns the alphabet associated with the set of input bits for the code
   // length array.
   //
@@ -79,10 +148,10 @@ class HuffmanTable {
   // |nbits|    OUT  The number of bits in the Huffman code of alphabet.
   // Returns true if there is an alphabet associated with |bits|.
   inline bool CodeAlphabet(uint32_t bits, uint16_t* alphabet, size_t* nbits) {
-    auto hc = code_hcodes_[bits];
-    TEST_AND_RETURN_FALSE(hc & 0x8000);
-    *alphabet = hc & 0x7FFF;
-    *nbits = code_lens_[*alphabet];
+    auto entry = LookupEntry(code_hcodes_.data(), code_root_bits_, bits);
+    TEST_AND_RETURN_FALSE(IsValidEntry(entry));
+    *alphabet = EntryAlphabet(entry);
+    *nbits = EntryBits(entry);
     return true;
   }
 
@@ -94,10 +163,10 @@ class HuffmanTable {
   // |nbits|    OUT  The number of bits in the Huffman code of the |alphabet|.
   // Returns true if there is an alphabet associated with |bits|.
   inline bool LitLenAlphabet(uint32_t bits, uint16_t* alphabet, size_t* nbits) {
-    auto hc = lit_len_hcodes_[bits];
-    TEST_AND_RETURN_FALSE(hc & 0x8000);
-    *alphabet = hc & 0x7FFF;
-    *nbits = lit_len_lens_[*alphabet];
+    auto entry = LitLenEntry(bits);
+    TEST_AND_RETURN_FALSE(IsValidEntry(entry));
+    *alphabet = EntryAlphabet(entry);
+    *nbits = EntryBits(entry);
     return true;
   }
 
@@ -111,10 +180,10 @@ class HuffmanTable {
   inline bool DistanceAlphabet(uint32_t bits,
                                uint16_t* alphabet,
                                size_t* nbits) {
-    auto hc = distance_hcodes_[bits];
-    TEST_AND_RETURN_FALSE(hc & 0x8000);
-    *alphabet = hc & 0x7FFF;
-    *nbits = distance_lens_[*alphabet];
+    auto entry = DistanceEntry(bits);
+    TEST_AND_RETURN_FALSE(IsValidEntry(entry));
+    *alphabet = EntryAlphabet(entry);
+    *nbits = EntryBits(entry);
     return true;
   }
 
@@ -140,15 +209,15 @@ class HuffmanTable {
   inline bool LitLenHuffman(uint16_t alphabet,
                             uint16_t* huffman,
                             size_t* nbits) {
-    TEST_AND_RETURN_FALSE(alphabet < lit_len_lens_.size());
-    *huffman = lit_len_rcodes_[alphabet];
-    *nbits = lit_len_lens_[alphabet];
+    TEST_AND_RETURN_FALSE(alphabet < cur_num_lit_len_);
+    *huffman = cur_lit_len_rcodes_[alphabet];
+    *nbits = cur_lit_len_lens_[alphabet];
     return true;
   }
 
   inline bool EndOfBlockBitLength(size_t* nbits) {
-    TEST_AND_RETURN_FALSE(256 < lit_len_lens_.size());
-    *nbits = lit_len_lens_[256];
+    TEST_AND_RETURN_FALSE(256 < cur_num_lit_len_);
+    *nbits = cur_lit_len_lens_[256];
     return true;
   }
 
@@ -161,27 +230,105 @@ class HuffmanTable {
   inline bool DistanceHuffman(uint16_t alphabet,
                               uint16_t* huffman,
                               size_t* nbits) {
-    TEST_AND_RETURN_FALSE(alphabet < distance_lens_.size());
-    *huffman = distance_rcodes_[alphabet];
-    *nbits = distance_lens_[alphabet];
+    TEST_AND_RETURN_FALSE(alphabet < cur_num_distance_);
+    *huffman = cur_distance_rcodes_[alphabet];
+    *nbits = cur_distance_lens_[alphabet];
+    return true;
+  }
+
+  // Returns the Huffman code of |literal| from a table of the literal codes
+  // packed like the length codes (see |EncodeLength|), so a run of literals is
+  // encoded with one lookup per byte.
+  inline bool EncodeLiteral(uint8_t literal, uint32_t* huffman, size_t* nbits) {
+    auto entry = cur_literal_codes_[literal];
+    TEST_AND_RETURN_FALSE(IsValidEntry(entry));
+    *huffman = entry & 0xFFFFFF;
+    *nbits = (entry >> 24) & 0x1F;
+    return true;
+  }
+
+  // Writes the Huffman codes of the |length| bytes of |literals| into |bw|.
+  // The codes are packed into a 64-bit holder and written 32 bits at a time,
+  // so a run of literals takes a fraction of the |WriteBits| calls of one per
+  // byte.
+  template <typename BitWriterType>
+  inline bool EncodeLiterals(const uint8_t* literals,
+                             size_t length,
+                             BitWriterType* bw,
+                             Error* error) {
+    uint64_t holder = 0;
+    size_t holder_bits = 0;
+    for (size_t idx = 0; idx < length; idx++) {
+      uint32_t huffman;
+      size_t nbits;
+      TEST_AND_RETURN_FALSE_SET_ERROR(
+          EncodeLiteral(literals[idx], &huffman, &nbits),
+          Error::kInvalidInput);
+      holder |= static_cast<uint64_t>(huffman) << holder_bits;
+      holder_bits += nbits;
+      if (holder_bits >= 32) {
+        TEST_AND_RETURN_FALSE_SET_ERROR(
+            bw->WriteBits(32, static_cast<uint32_t>(holder)),
+            Error::kInsufficientOutput);
+        holder >>= 32;
+        holder_bits -= 32;
+      }
+    }
+    TEST_AND_RETURN_FALSE_SET_ERROR(
+        bw->WriteBits(holder_bits, static_cast<uint32_t>(holder)),
+        Error::kInsufficientOutput);
     return true;
   }
 
-  // This populates the object with fixed huffman table parameters.
-  // TODO(ahassani): Revamp the use of this function to be initiliazed once in
-  // the lifetime of the program and only one instance needed.
+  // Returns the Huffman code of the alphabet of the length |len| (3 to 258)
+  // merged with the extra bits that come after it, so they are written at
+  // once. The merged codes are looked up from a table built with the Huffman
+  // codes.
+  //
+  // |len|     IN   The length.
+  // |huffman| OUT  The Huffman code followed by the extra bits.
+  // |nbits|   OUT  The total number of bits in |huffman|.
+  inline bool EncodeLength(size_t len, uint32_t* huffman, size_t* nbits) {
+    auto entry = cur_length_codes_[len];
+    TEST_AND_RETURN_FALSE(IsValidEntry(entry));
+    *huffman = entry & 0xFFFFFF;
+    *nbits = (entry >> 24) & 0x1F;
+    return true;
+  }
+
+  // Same as |EncodeLength| but for the distance |dist| (1 to 32768). Its
+  // alphabet is looked up in |kDistanceSymbols|.
+  inline bool EncodeDistance(size_t dist, uint32_t* huffman, size_t* nbits) {
+    auto alphabet = kDistanceSymbols[dist <= 256 ? dist - 1
+                                                 : 256 + ((dist - 1) >> 7)];
+    TEST_AND_RETURN_FALSE(alphabet < cur_num_distance_);
+    auto len = cur_distance_lens_[alphabet];
+    *huffman = cur_distance_rcodes_[alphabet] |
+               ((dist - kDistanceBases[alphabet]) << len);
+    *nbits = len + kDistanceExtraBits[alphabet];
+    return true;
+  }
+
+  // This populates the object with fixed huffman table parameters. The fixed
+  // Huffman codes are generated at compile time and shared by all objects, so
+  // the object only points to them.
   bool BuildFixedHuffmanTable();
 
   // This functions first reads the Huffman code length arrays from the input
   // deflate stream, then builds both literal/length and distance Huffman
   // code arrays. It also writes the Huffman table into the puffed stream.
   //
-  // |br|      IN      The |BitReaderInterface| reading the deflate stream.
+  // It is a template on the type of the bit reader so the reads of a final
+  // reader type like |BufferBitReader| are not virtual calls. It is explicitly
+  // instantiated for |BitReaderInterface| and |BufferBitReader|.
+  //
+  // |br|      IN      The bit reader reading the deflate stream.
   // |buffer|  OUT     The object to write the Huffman table.
   // |length|  IN/OUT  The length available in the |buffer| and in return it
   //                   will be the length of Huffman table data written into
   //                   the |buffer|.
-  bool BuildDynamicHuffmanTable(BitReaderInterface* br,
+  template <typename BitReaderType>
+  bool BuildDynamicHuffmanTable(BitReaderType* br,
                                 uint8_t* buffer,
                                 size_t* length,
                                 Error* error);
@@ -189,16 +336,17 @@ class HuffmanTable {
   // This functions first reads the Huffman code length arrays from the input
   // puffed |buffer|, then builds both literal/length and distance Huffman code
   // arrays. It also writes the coded Huffman table arrays into the deflate
-  // stream.
+  // stream. It is explicitly instantiated for |BitWriterInterface| and
+  // |BufferBitWriter|.
   //
   // |buffer| IN      The array to read the Huffman table from.
   // |length| IN      The length available in the |buffer|.
-  // |bw|     IN/OUT  The |BitWriterInterface| for writing into the deflate
-  //                  stream.
+  // |bw|     IN/OUT  The bit writer for writing into the deflate stream.
   // |error|  OUT     The error code.
+  template <typename BitWriterType>
   bool BuildDynamicHuffmanTable(const uint8_t* buffer,
                                 size_t length,
-                                BitWriterInterface* bw,
+                                BitWriterType* bw,
                                 Error* error);
 
  protected:
@@ -208,14 +356,28 @@ class HuffmanTable {
   // |max_bits| OUT  The maximum number of bits used for the Huffman codes.
   bool InitHuffmanCodes(const Buffer& lens, size_t* max_bits);
 
-  // Creates the Huffman code to alphabet array.
-  // |lens|     IN   The input array of code lengths.
-  // |hcodes|   OUT  The Huffman to alphabet array.
-  // |max_bits| OUT  The maximum number of bits used for the Huffman codes.
+  // Creates the multi-level Huffman code to alphabet array.
+  // |lens|        IN   The input array of code lengths.
+  // |extra_bits|  IN   The number of extra bits for each alphabet starting from
+  //                    |extra_start|. Can be nullptr if there are none.
+  // |extra_start| IN   The first alphabet that has extra bits.
+  // |extra_end|   IN   One past the last alphabet that has extra bits.
+  // |hcodes|      OUT  The Huffman to alphabet array.
+  // |root_bits|   IN/OUT  The maximum number of bits for indexing the first
+  //                    level of |hcodes|, and in return the actual number.
+  // |max_bits|    OUT  The maximum number of bits used for the Huffman codes.
   bool BuildHuffmanCodes(const Buffer& lens,
-                         std::vector<uint16_t>* hcodes,
+                         const uint8_t* extra_bits,
+                         size_t extra_start,
+                         size_t extra_end,
+                         std::vector<uint32_t>* hcodes,
+                         size_t* root_bits,
                          size_t* max_bits);
 
+  // Builds |literal_codes_| and |length_codes_| from the literal/length
+  // Huffman codes.
+  void BuildMergedCodes();
+
   // Creates the alphabet to Huffman code array.
   // |lens|     IN   The input array of code lengths.
   // |rcodes|   OUT  The Huffman to Huffman array.
@@ -228,8 +390,7 @@ class HuffmanTable {
   // writes the array into the puffed stream. The Huffman code length array is
   // either the literal/lengths or distance codes.
   //
-  // |br|        IN      The |BitReaderInterface| for reading the deflate
-  //                      stream.
+  // |br|        IN      The bit reader for reading the deflate stream.
   // |buffer|    OUT     The array to write the Huffman table.
   // |length|    IN/OUT  The length available in the |buffer| and in return it
   //                     will be the length of data written into the |buffer|.
@@ -237,7 +398,8 @@ class HuffmanTable {
   // |num_codes| IN      The size of the Huffman code length array in the input.
   // |lens|      OUT     The resulting Huffman code length array.
   // |error|     OUT     The error code.
-  bool BuildHuffmanCodeLengths(BitReaderInterface* br,
+  template <typename BitReaderType>
+  bool BuildHuffmanCodeLengths(BitReaderType* br,
                                uint8_t* buffer,
                                size_t* length,
                                size_t max_bits,
@@ -250,20 +412,67 @@ class HuffmanTable {
   //
   // |buffer|    IN      The array to read the Huffman table from.
   // |length|    IN      The length available in the |buffer|.
-  // |bw|        IN/OUT  The |BitWriterInterface| for writing into the deflate
-  //                     stream.
+  // |bw|        IN/OUT  The bit writer for writing into the deflate stream.
   // |num_codes| IN      Number of Huffman code lengths to read from the
   //                     |buffer|.
   // |lens|      OUT     The Huffman code lengths array.
   // |error|     OUT     The error code.
+  template <typename BitWriterType>
   bool BuildHuffmanCodeLengths(const uint8_t* buffer,
                                size_t* length,
-                               BitWriterInterface* bw,
+                               BitWriterType* bw,
                                size_t num_codes,
                                Buffer* lens,
                                Error* error);
 
  private:
+  // Looks up the packed entry of the first Huffman code in |bits| from the
+  // multi-level array |hcodes|.
+  static inline uint32_t LookupEntry(const uint32_t* hcodes,
+                                     size_t root_bits,
+                                     uint32_t bits) {
+    auto entry = hcodes[bits & ((1U << root_bits) - 1)];
+    if (entry & kHuffmanEntrySubTable) {
+      auto index = (bits >> root_bits) & ((1U << EntryBits(entry)) - 1);
+      entry = hcodes[EntryAlphabet(entry) + index];
+    }
+    return entry;
+  }
+
+  // Points the current Huffman codes to the arrays of the dynamic table.
+  void UseDynamicTable();
+
+  // Looks up the dynamic Huffman table with the |length| bytes of |metadata|
+  // in |cached_tables_| and, if found, makes it the current table. |reverse| is
+  // true if the table is used for huffing instead of puffing. Returns false if
+  // the table is not cached.
+  bool FindCachedTable(const uint8_t* metadata, size_t length, bool reverse);
+
+  // Keeps the current dynamic Huffman table with the |length| bytes of
+  // |metadata| in |cached_tables_|, replacing the least recently used one if
+  // the cache is full.
+  void CacheTable(const uint8_t* metadata, size_t length, bool reverse);
+
+  // A dynamic Huffman table kept for reuse. Only the arrays needed for the
+  // direction given by |reverse| are set.
+  struct CachedTable {
+    uint64_t hash;
+    bool reverse;
+    Buffer metadata;
+    std::vector<uint32_t> lit_len_hcodes;
+    std::vector<uint16_t> lit_len_rcodes;
+    std::vector<uint32_t> literal_codes;
+    std::vector<uint32_t> length_codes;
+    size_t lit_len_root_bits;
+    size_t lit_len_max_bits;
+    std::vector<uint32_t> distance_hcodes;
+    std::vector<uint16_t> distance_rcodes;
+    size_t distance_root_bits;
+    size_t distance_max_bits;
+    std::vector<uint16_t> code_rcodes;
+    size_t code_max_bits;
+  };
+
   // A utility struct used to create Huffman codes.
   struct CodeIndexPair {
     uint16_t code;   // The Huffman code
@@ -275,14 +484,36 @@ class HuffmanTable {
 
   // Used in building Huffman codes for literals/lengths and distances.
   std::vector<uint8_t> lit_len_lens_;
-  std::vector<uint16_t> lit_len_hcodes_;
+  std::vector<uint32_t> lit_len_hcodes_;
   std::vector<uint16_t> lit_len_rcodes_;
+  // The Huffman codes of the literals, in the same format as |length_codes_|.
+  std::vector<uint32_t> literal_codes_;
+  // The Huffman codes of the lengths merged with their extra bits, indexed by
+  // the length. Bits 0-23 are the merged code, bits 24-28 its number of bits
+  // and bit 31 is set if the length has a code.
+  std::vector<uint32_t> length_codes_;
+  size_t lit_len_root_bits_;
   size_t lit_len_max_bits_;
   std::vector<uint8_t> distance_lens_;
-  std::vector<uint16_t> distance_hcodes_;
+  std::vector<uint32_t> distance_hcodes_;
   std::vector<uint16_t> distance_rcodes_;
+  size_t distance_root_bits_;
   size_t distance_max_bits_;
 
+  // The current literal/length and distance Huffman codes used by the lookup
+  // functions above. They point either to the arrays of the dynamic table above
+  // or to the static fixed Huffman tables.
+  size_t cur_num_lit_len_;
+  const uint8_t* cur_lit_len_lens_;
+  const uint32_t* cur_lit_len_hcodes_;
+  const uint16_t* cur_lit_len_rcodes_;
+  const uint32_t* cur_literal_codes_;
+  const uint32_t* cur_length_codes_;
+  size_t cur_num_distance_;
+  const uint8_t* cur_distance_lens_;
+  const uint32_t* cur_distance_hcodes_;
+  const uint16_t* cur_distance_rcodes_;
+
   // The reason for keeping a temporary buffer here is to avoid reallocing each
   // time.
   std::vector<uint8_t> tmp_lens_;
@@ -290,12 +521,18 @@ class HuffmanTable {
   // Used in building Huffman codes for reading and decoding literal/length and
   // distance Huffman code length arrays.
   std::vector<uint8_t> code_lens_;
-  std::vector<uint16_t> code_hcodes_;
+  std::vector<uint32_t> code_hcodes_;
   std::vector<uint16_t> code_rcodes_;
+  size_t code_root_bits_;
   size_t code_max_bits_;
 
   bool initialized_;
 
+  // The cached dynamic Huffman tables ordered from the most recently used to
+  // the least recently used one.
+  std::vector<CachedTable> cached_tables_;
+  size_t max_cached_tables_;
+
   DISALLOW_COPY_AND_ASSIGN(HuffmanTable);
 };
 
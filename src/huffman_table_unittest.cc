@@ -0,0 +1,84 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <algorithm>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "puffin/src/huffman_table.h"
+#include "puffin/src/include/puffin/common.h"
+
+namespace puffin {
+
+using std::vector;
+
+namespace {
+
+// Exposes the builders of the dynamic Huffman tables.
+class TestHuffmanTable : public HuffmanTable {
+ public:
+  using HuffmanTable::BuildHuffmanCodes;
+  using HuffmanTable::BuildHuffmanReverseCodes;
+};
+
+}  // namespace
+
+// Makes sure the fixed Huffman tables generated at compile time are the same
+// as the ones built from the fixed code lengths (RFC1951 section 3.2.6) like a
+// dynamic Huffman table.
+TEST(HuffmanTableTest, FixedHuffmanTableTest) {
+  Buffer lit_len_lens(288, 8);
+  std::fill(lit_len_lens.begin() + 144, lit_len_lens.begin() + 256, 9);
+  std::fill(lit_len_lens.begin() + 256, lit_len_lens.begin() + 280, 7);
+  Buffer distance_lens(30, 5);
+
+  HuffmanTable fixed;
+  ASSERT_TRUE(fixed.BuildFixedHuffmanTable());
+  TestHuffmanTable dynamic;
+
+  vector<uint32_t> hcodes;
+  size_t root_bits = kLitLenRootBits;
+  size_t max_bits;
+  ASSERT_TRUE(dynamic.BuildHuffmanCodes(lit_len_lens, kLengthExtraBits, 257,
+                                        286, &hcodes, &root_bits, &max_bits));
+  EXPECT_EQ(max_bits, fixed.LitLenMaxBits());
+  ASSERT_EQ(hcodes.size(), 1U << max_bits);
+  for (uint32_t bits = 0; bits < hcodes.size(); bits++) {
+    EXPECT_EQ(fixed.LitLenEntry(bits), hcodes[bits]) << "bits " << bits;
+  }
+
+  root_bits = kDistanceRootBits;
+  ASSERT_TRUE(dynamic.BuildHuffmanCodes(distance_lens, kDistanceExtraBits, 0,
+                                        30, &hcodes, &root_bits, &max_bits));
+  EXPECT_EQ(max_bits, fixed.DistanceMaxBits());
+  ASSERT_EQ(hcodes.size(), 1U << max_bits);
+  for (uint32_t bits = 0; bits < hcodes.size(); bits++) {
+    EXPECT_EQ(fixed.DistanceEntry(bits), hcodes[bits]) << "bits " << bits;
+  }
+
+  vector<uint16_t> rcodes(lit_len_lens.size());
+  ASSERT_TRUE(
+      dynamic.BuildHuffmanReverseCodes(lit_len_lens, &rcodes, &max_bits));
+  for (uint16_t alphabet = 0; alphabet < rcodes.size(); alphabet++) {
+    uint16_t huffman;
+    size_t nbits;
+    ASSERT_TRUE(fixed.LitLenHuffman(alphabet, &huffman, &nbits));
+    EXPECT_EQ(huffman, rcodes[alphabet]) << "alphabet " << alphabet;
+    EXPECT_EQ(nbits, lit_len_lens[alphabet]) << "alphabet " << alphabet;
+  }
+
+  rcodes.resize(distance_lens.size());
+  ASSERT_TRUE(
+      dynamic.BuildHuffmanReverseCodes(distance_lens, &rcodes, &max_bits));
+  for (uint16_t alphabet = 0; alphabet < rcodes.size(); alphabet++) {
+    uint16_t huffman;
+    size_t nbits;
+    ASSERT_TRUE(fixed.DistanceHuffman(alphabet, &huffman, &nbits));
+    EXPECT_EQ(huffman, rcodes[alphabet]) << "alphabet " << alphabet;
+    EXPECT_EQ(nbits, distance_lens[alphabet]) << "alphabet " << alphabet;
+  }
+}
+
+}  // namespace puffin
@@ -61,6 +61,18 @@ struct PUFFIN_EXPORT BitExtent {
   uint64_t length;
 };
 
+// The encodings of the puff streams. The format of the puffs diffed in a patch
+// is recorded in its header, and both the source and the destination are
+// puffed in it.
+enum class PuffFormat : uint32_t {
+  // The original encoding, which the patches without a format use.
+  kV1 = 0,
+  // Like |kV1|, but the distances of the length/distance pairs and the sizes
+  // of the block metadata take one byte instead of two if they are less than
+  // 128, so the puffs are smaller.
+  kV2 = 1,
+};
+
 }  // namespace puffin
 
 #endif  // SRC_INCLUDE_PUFFIN_COMMON_H_
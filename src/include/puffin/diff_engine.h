@@ -0,0 +1,98 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_INCLUDE_PUFFIN_DIFF_ENGINE_H_
+#define SRC_INCLUDE_PUFFIN_DIFF_ENGINE_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "puffin/common.h"
+#include "puffin/stream.h"
+
+namespace puffin {
+
+// The id of the bsdiff engine, which |PuffDiff| and |PuffPatch| use by default.
+constexpr uint32_t kBsdiffEngineId = 0;
+
+// The compressions of the patches between the puff streams. The codec of a
+// patch is recorded in the patch header, so it can be refused before it is
+// applied by an engine that can not decompress it.
+enum class PatchCodec : uint32_t {
+  // The bzip2-compressed legacy bsdiff format. The default of bsdiff.
+  kBz2 = 0,
+  // Slower to create, but usually the smallest patches.
+  kBrotli = 1,
+  // The fastest to apply, but the largest patches.
+  kNone = 2,
+};
+
+// The engine applying the binary patches between the puff streams inside a
+// puffin patch. The id of the engine that created the patches is kept in the
+// patch header, so a patch is only applied by an engine with the same id.
+class PUFFIN_EXPORT PatchEngine {
+ public:
+  virtual ~PatchEngine() = default;
+
+  // Returns the id of the patches this engine applies.
+  virtual uint32_t id() const = 0;
+
+  // Applies |patch| of size |patch_size| by reading the source puff stream
+  // from |src| and writing the destination puff stream into |dst|. It can be
+  // called from multiple threads at the same time.
+  virtual bool Patch(UniqueStreamPtr src,
+                     UniqueStreamPtr dst,
+                     const uint8_t* patch,
+                     size_t patch_size) const = 0;
+
+  // Finds the ranges of the source (of size |src_size|) that |Patch| reads
+  // when applying |patch|, in the order they are read, so the source puffs can
+  // be cached and prefetched accordingly. Engines that can not tell return
+  // false, and the puffs are cached without a plan.
+  virtual bool GetSourceReads(const uint8_t* /* patch */,
+                              size_t /* patch_size */,
+                              uint64_t /* src_size */,
+                              std::vector<ByteExtent>* /* reads */) const {
+    return false;
+  }
+
+  // Returns true if this engine can apply patches compressed with |codec|.
+  virtual bool SupportsCodec(PatchCodec codec) const {
+    return codec == PatchCodec::kNone;
+  }
+};
+
+// The engine creating the binary patches between the puff streams for
+// |PuffDiff|, and the |PatchEngine| that applies them.
+class PUFFIN_EXPORT DiffEngine : public PatchEngine {
+ public:
+  // Whatever an engine builds from a source once and reuses for diffing it
+  // against many destinations, like the suffix array of bsdiff.
+  class SourceIndex {
+   public:
+    virtual ~SourceIndex() = default;
+  };
+
+  ~DiffEngine() override = default;
+
+  // Returns the codec of the patches this engine creates.
+  virtual PatchCodec codec() const { return PatchCodec::kNone; }
+
+  // Creates the patch from |src| of size |src_size| to |dst| of size
+  // |dst_size| into the file at |patch_path|. If not null, |src_index| keeps an
+  // index of |src| between the diffs of the same |src|: If |*src_index| is
+  // null, the engine may build the index into it. Otherwise the index is only
+  // read, possibly by multiple threads at the same time.
+  virtual bool Diff(const uint8_t* src,
+                    size_t src_size,
+                    const uint8_t* dst,
+                    size_t dst_size,
+                    const std::string& patch_path,
+                    std::unique_ptr<SourceIndex>* src_index) const = 0;
+};
+
+}  // namespace puffin
+
+#endif  // SRC_INCLUDE_PUFFIN_DIFF_ENGINE_H_
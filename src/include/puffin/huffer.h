@@ -14,6 +14,8 @@
 namespace puffin {
 
 class BitWriterInterface;
+class BufferBitWriter;
+class BufferPuffReader;
 class PuffReaderInterface;
 class HuffmanTable;
 
@@ -28,6 +30,13 @@ class PUFFIN_EXPORT Huffer {
                    BitWriterInterface* bw,
                    Error* error) const;
 
+  // Similar to the function above, but specialized for the concrete
+  // |BufferPuffReader| and |BufferBitWriter| types so the hot loop does not
+  // make any virtual calls.
+  bool HuffDeflate(BufferPuffReader* pr,
+                   BufferBitWriter* bw,
+                   Error* error) const;
+
  private:
   std::unique_ptr<HuffmanTable> dyn_ht_;
   std::unique_ptr<HuffmanTable> fix_ht_;
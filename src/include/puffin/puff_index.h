@@ -0,0 +1,64 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_INCLUDE_PUFFIN_PUFF_INDEX_H_
+#define SRC_INCLUDE_PUFFIN_PUFF_INDEX_H_
+
+#include <string>
+#include <vector>
+
+#include "puffin/common.h"
+#include "puffin/stream.h"
+
+namespace puffin {
+
+// The deflate and puff locations of a file, so they can be found once and
+// reused for diffing the file against many others. The size and CRC-32 of the
+// file identify the content the index was made for.
+struct PUFFIN_EXPORT PuffIndex {
+  std::vector<BitExtent> deflates;
+  std::vector<ByteExtent> puffs;
+  uint64_t puff_size = 0;
+
+  // The location of the subblocks of |deflates| and their puffs. They can be
+  // used as checkpoints for puffing only part of a deflate (see
+  // |PuffinStream::CreateForPuff|).
+  std::vector<BitExtent> subblock_deflates;
+  std::vector<ByteExtent> subblock_puffs;
+
+  uint64_t file_size = 0;
+  uint32_t file_crc32 = 0;
+};
+
+// Finds the puffs of |deflates| in |src| like |FindPuffLocations| on
+// |num_threads| threads and populates |index| with them and the size and CRC-32
+// of |src|.
+PUFFIN_EXPORT
+bool CreatePuffIndex(const UniqueStreamPtr& src,
+                     const std::vector<BitExtent>& deflates,
+                     PuffIndex* index,
+                     size_t num_threads = 1);
+
+// Returns false if the size or CRC-32 of |src| is not the one |index| was
+// created for.
+PUFFIN_EXPORT
+bool CheckPuffIndex(const UniqueStreamPtr& src, const PuffIndex& index);
+
+// Serializes |index| into |index_stream|.
+PUFFIN_EXPORT
+bool SavePuffIndex(const PuffIndex& index, const UniqueStreamPtr& index_stream);
+
+// Deserializes an index saved by |SavePuffIndex| from |data| of size |size|
+// into |index|. Fails if the index is malformed or of an unsupported version.
+PUFFIN_EXPORT
+bool LoadPuffIndex(const uint8_t* data, size_t size, PuffIndex* index);
+
+// Similar to the function above, but loads the index from the file at |path|,
+// which is mapped into memory instead of being read.
+PUFFIN_EXPORT
+bool LoadPuffIndex(const std::string& path, PuffIndex* index);
+
+}  // namespace puffin
+
+#endif  // SRC_INCLUDE_PUFFIN_PUFF_INDEX_H_
@@ -5,16 +5,65 @@
 #ifndef SRC_INCLUDE_PUFFIN_PUFFDIFF_H_
 #define SRC_INCLUDE_PUFFIN_PUFFDIFF_H_
 
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include "puffin/common.h"
+#include "puffin/diff_engine.h"
+#include "puffin/puff_index.h"
+#include "puffin/stats.h"
 #include "puffin/stream.h"
 
 namespace puffin {
 
+class PuffBuffer;
+
+// The optional settings of |PuffDiff| and |PuffDiffer|.
+struct PUFFIN_EXPORT PuffDiffOptions {
+  // The number of threads used for puffing the deflates at the same time. Zero
+  // means the number of available cores.
+  size_t num_threads = 1;
+  // If true, the puffed source and destination are written into memory-mapped
+  // files next to the temporary file (removed before returning) instead of
+  // being kept in memory.
+  bool mmap_puffs = false;
+  // If not zero, a plan for caching the puffs of the source in a puff cache of
+  // this many bytes is added to the patch, which |PuffPatch| follows when its
+  // cache is at least as large. Not used if the patch is split into chunks.
+  uint64_t cache_plan_size = 0;
+  // If not null, the counters and timings of the operation are added to it.
+  Stats* stats = nullptr;
+  // If not null, the puff locations of the source are taken from this index
+  // (see |CreatePuffIndex|) instead of being found by decoding the source. It
+  // must have been created for the source and its deflates.
+  const PuffIndex* src_index = nullptr;
+  // If more than one, the destination is split into at most this many chunks
+  // that start at byte-aligned deflates and have about the same puff size.
+  // Each chunk gets its own bsdiff patch, so |PuffPatch| can apply the chunks
+  // on different threads. The chunks are diffed on |num_threads| threads.
+  size_t num_chunks = 1;
+  // The engine creating the patches between the puff streams. Its id and codec
+  // are recorded in the patch. If null, bsdiff is used (see
+  // |CreateBsdiffEngine|).
+  std::shared_ptr<DiffEngine> engine;
+  // If true, the CRC-32 of the uncompressed data of each deflate of the
+  // destination is added to the patch (four bytes per deflate), and
+  // |PuffPatch| checks the data of the destination deflates against it while
+  // huffing them.
+  bool add_dst_crc32s = false;
+  // The encoding of the puff streams diffed, which is recorded in the patch.
+  // |PuffFormat::kV2| makes smaller puffs, so diffing takes less time and
+  // memory, but the patch can only be applied by a |PuffPatch| that knows the
+  // format. |src_index| is not used for other formats than |PuffFormat::kV1|.
+  PuffFormat puff_format = PuffFormat::kV1;
+};
+
 // Performs a diff operation between input deflate streams and creates a patch
-// that is used in the client to recreate the |dst| from |src|.
+// that is used in the client to recreate the |dst| from |src|. The deflates of
+// |dst| identical to deflates of |src| are copied from |src| by |PuffPatch|
+// instead of being diffed.
 // |src|          IN   Source deflate stream.
 // |dst|          IN   Destination deflate stream.
 // |src_deflates| IN   Deflate locations in |src|.
@@ -30,8 +79,27 @@ bool PuffDiff(UniqueStreamPtr src,
               const std::string& tmp_filepath,
               Buffer* patch);
 
-// Similar to the function above, except that it accepts raw buffer rather than
-// stream.
+// Similar to the function above, but with the settings in |options|.
+bool PuffDiff(UniqueStreamPtr src,
+              UniqueStreamPtr dst,
+              const std::vector<BitExtent>& src_deflates,
+              const std::vector<BitExtent>& dst_deflates,
+              const std::string& tmp_filepath,
+              Buffer* patch,
+              const PuffDiffOptions& options);
+
+// Similar to the function above, except that it writes the patch into the
+// stream |patch|.
+bool PuffDiff(UniqueStreamPtr src,
+              UniqueStreamPtr dst,
+              const std::vector<BitExtent>& src_deflates,
+              const std::vector<BitExtent>& dst_deflates,
+              const std::string& tmp_filepath,
+              const UniqueStreamPtr& patch,
+              const PuffDiffOptions& options = PuffDiffOptions());
+
+// Similar to the functions above, except that they accept raw buffer rather
+// than stream.
 PUFFIN_EXPORT
 bool PuffDiff(const Buffer& src,
               const Buffer& dst,
@@ -39,6 +107,108 @@ bool PuffDiff(const Buffer& src,
               const std::vector<BitExtent>& dst_deflates,
               const std::string& tmp_filepath,
               Buffer* patch);
+PUFFIN_EXPORT
+bool PuffDiff(const Buffer& src,
+              const Buffer& dst,
+              const std::vector<BitExtent>& src_deflates,
+              const std::vector<BitExtent>& dst_deflates,
+              const std::string& tmp_filepath,
+              Buffer* patch,
+              const PuffDiffOptions& options);
+
+// A target of |PuffDiffer::Diff|. The arguments are the same as |dst|,
+// |dst_deflates|, |tmp_filepath| and |puffin_patch| of |PuffDiff|.
+struct PUFFIN_EXPORT PuffDiffTarget {
+  UniqueStreamPtr dst;
+  std::vector<BitExtent> dst_deflates;
+  std::string tmp_filepath;
+  UniqueStreamPtr patch;
+};
+
+// The brotli quality of the patches compressed with |PatchCodec::kBrotli|.
+constexpr int kDefaultBrotliQuality = 9;
+
+// Returns the engine creating the patches with bsdiff and applying them with
+// bspatch. The patches are compressed with |codec|, which bspatch decompresses
+// while it is applying them.
+PUFFIN_EXPORT
+std::shared_ptr<DiffEngine> CreateBsdiffEngine(
+    PatchCodec codec = PatchCodec::kBz2,
+    int brotli_quality = kDefaultBrotliQuality);
+
+// Creates patches from one source to many targets like |PuffDiff|. The source
+// is puffed only once, and the index the engine builds for the puffed source
+// (e.g. the suffix array of bsdiff) is kept after the first diff, so each
+// target only costs puffing it and searching it in the index.
+class PUFFIN_EXPORT PuffDiffer {
+ public:
+  ~PuffDiffer();
+
+  // Puffs |src| for diffing it against the targets later. The arguments are the
+  // same as the ones of |PuffDiff|, and only the |num_threads|, |mmap_puffs|,
+  // |stats|, |src_index|, |engine| and |puff_format| of |options| are used.
+  // |num_threads|, |mmap_puffs|, |engine| and |puff_format| also apply to the
+  // diffs, and the puffed |src| is kept next to |tmp_filepath| until the
+  // differ is destroyed if |mmap_puffs| is true.
+  static std::unique_ptr<PuffDiffer> Create(
+      UniqueStreamPtr src,
+      const std::vector<BitExtent>& src_deflates,
+      const std::string& tmp_filepath,
+      const PuffDiffOptions& options = PuffDiffOptions());
+
+  // Creates the patch from the source to |dst| into |patch|. The arguments are
+  // the same as the ones of |PuffDiff|, and only the |cache_plan_size|,
+  // |stats|, |num_chunks| and |add_dst_crc32s| of |options| are used. It can be
+  // called from multiple threads at the same time with different
+  // |tmp_filepath|s.
+  bool Diff(UniqueStreamPtr dst,
+            const std::vector<BitExtent>& dst_deflates,
+            const std::string& tmp_filepath,
+            const UniqueStreamPtr& patch,
+            const PuffDiffOptions& options = PuffDiffOptions());
+
+  // Creates the patches for all the |targets|, |num_diffs| of them at the same
+  // time (zero means the number of available cores). Each diff holds its puffed
+  // target and the memory of the engine while it runs. The |dst| streams of
+  // |targets| are consumed.
+  bool Diff(std::vector<PuffDiffTarget>* targets,
+            size_t num_diffs,
+            const PuffDiffOptions& options = PuffDiffOptions());
+
+ private:
+  PuffDiffer(std::unique_ptr<PuffBuffer> src_puff_buffer,
+             const std::vector<BitExtent>& src_deflates,
+             const std::vector<ByteExtent>& src_puffs,
+             const PuffDiffOptions& options,
+             std::shared_ptr<DiffEngine> engine);
+
+  // Runs the engine from the puffed source to |dst| of size |dst_size| and
+  // writes the patch into |patch_path|, building or reusing |src_index_|.
+  bool RunDiff(const uint8_t* dst,
+               size_t dst_size,
+               const std::string& patch_path);
+
+  // The puffed source and the location of its deflates and puffs.
+  std::unique_ptr<PuffBuffer> src_puff_buffer_;
+  std::vector<BitExtent> src_deflates_;
+  std::vector<ByteExtent> src_puffs_;
+
+  size_t num_threads_;
+  bool mmap_puffs_;
+
+  std::shared_ptr<DiffEngine> engine_;
+
+  // The encoding of the puffs of the source and the targets.
+  PuffFormat puff_format_;
+
+  // The index of the puffed source built by the first diff, if the engine
+  // builds one. Guarded by |src_index_mutex_| until |src_index_built_| is set.
+  std::mutex src_index_mutex_;
+  bool src_index_built_;
+  std::unique_ptr<DiffEngine::SourceIndex> src_index_;
+
+  DISALLOW_COPY_AND_ASSIGN(PuffDiffer);
+};
 
 }  // namespace puffin
 
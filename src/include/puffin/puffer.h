@@ -15,7 +15,10 @@
 namespace puffin {
 
 class BitReaderInterface;
+class BufferBitReader;
+class BufferPuffWriter;
 class PuffWriterInterface;
+class PuffSizeWriter;
 class HuffmanTable;
 
 class PUFFIN_EXPORT Puffer {
@@ -30,6 +33,65 @@ class PUFFIN_EXPORT Puffer {
                    std::vector<BitExtent>* deflates,
                    Error* error) const;
 
+  // Similar to the function above, but only computes the size of the puffed
+  // buffer (available in |pw->Size()|). It is faster because the output path
+  // is specialized for |PuffSizeWriter|.
+  bool PuffDeflate(BitReaderInterface* br,
+                   PuffSizeWriter* pw,
+                   std::vector<BitExtent>* deflates,
+                   Error* error) const;
+
+  // Similar to the functions above, but if |puffs| is not null, it will also be
+  // populated with the location of the puffed subblocks in the output. The
+  // subblocks are puffed independently of each other, so each pair of entries
+  // in |deflates| and |puffs| is a point where puffing can be resumed from.
+  bool PuffDeflate(BitReaderInterface* br,
+                   PuffWriterInterface* pw,
+                   std::vector<BitExtent>* deflates,
+                   std::vector<ByteExtent>* puffs,
+                   Error* error) const;
+  bool PuffDeflate(BitReaderInterface* br,
+                   PuffSizeWriter* pw,
+                   std::vector<BitExtent>* deflates,
+                   std::vector<ByteExtent>* puffs,
+                   Error* error) const;
+
+  // Similar to the functions above, but specialized for the concrete
+  // |BufferBitReader| and |BufferPuffWriter| (or |PuffSizeWriter|) types so the
+  // hot loop does not make any virtual calls. The functions above taking the
+  // interfaces are kept for other reader and writer types.
+  bool PuffDeflate(BufferBitReader* br,
+                   BufferPuffWriter* pw,
+                   std::vector<BitExtent>* deflates,
+                   Error* error) const;
+  bool PuffDeflate(BufferBitReader* br,
+                   PuffSizeWriter* pw,
+                   std::vector<BitExtent>* deflates,
+                   Error* error) const;
+  bool PuffDeflate(BufferBitReader* br,
+                   BufferPuffWriter* pw,
+                   std::vector<BitExtent>* deflates,
+                   std::vector<ByteExtent>* puffs,
+                   Error* error) const;
+  bool PuffDeflate(BufferBitReader* br,
+                   PuffSizeWriter* pw,
+                   std::vector<BitExtent>* deflates,
+                   std::vector<ByteExtent>* puffs,
+                   Error* error) const;
+
+  // Scans the deflate in |br| for the location of its subblocks (in |deflates|
+  // and |puffs| like the functions above, if not null) and the size of its
+  // puff in |puff_size|. It only decodes the Huffman symbols and their extra
+  // bits to skip them, the literals and uncompressed blocks are not read and
+  // no puff data is created, so it is cheaper than puffing with a
+  // |PuffSizeWriter|. The sizes are the ones of the puffs in |format|.
+  bool ScanDeflate(BufferBitReader* br,
+                   std::vector<BitExtent>* deflates,
+                   std::vector<ByteExtent>* puffs,
+                   uint64_t* puff_size,
+                   Error* error,
+                   PuffFormat format = PuffFormat::kV1) const;
+
  private:
   std::unique_ptr<HuffmanTable> dyn_ht_;
   std::unique_ptr<HuffmanTable> fix_ht_;
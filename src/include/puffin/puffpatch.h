@@ -5,7 +5,12 @@
 #ifndef SRC_INCLUDE_PUFFIN_PUFFPATCH_H_
 #define SRC_INCLUDE_PUFFIN_PUFFPATCH_H_
 
+#include <memory>
+#include <vector>
+
 #include "puffin/common.h"
+#include "puffin/diff_engine.h"
+#include "puffin/stats.h"
 #include "puffin/stream.h"
 
 namespace puffin {
@@ -13,6 +18,39 @@ namespace puffin {
 extern const char kMagic[];
 extern const size_t kMagicLength;
 
+// The objects reused by a series of patch operations on the same source, like
+// the operations of an update patching the files of one partition: the
+// |Puffer| and |Huffer|, the buffers of the puff caches and the puffs of the
+// source deflates read by earlier operations. The puffs are keyed by the
+// location of their deflates in the source, so later operations reading the
+// same deflates, through any stream of the source, do not puff them again.
+// The source should not change while the context is used, and the context
+// should be used by one operation at a time.
+class PUFFIN_EXPORT PuffPatchContext {
+ public:
+  virtual ~PuffPatchContext() = default;
+
+  // |max_cache_size| IN  The maximum amount of memory to cache puff buffers in
+  //                      each operation, like the one of |PuffPatch|.
+  // |max_kept_size|  IN  The maximum amount of memory to keep the puffs of the
+  //                      source in between the operations. Zero keeps none.
+  // |max_deflate_cache_size| IN  The maximum amount of memory to keep the bytes
+  //                              of the source deflates puffed in each
+  //                              operation, so the ones whose puffs are evicted
+  //                              are puffed again without reading the source.
+  //                              Zero keeps none.
+  static std::unique_ptr<PuffPatchContext> Create(
+      size_t max_cache_size,
+      size_t max_kept_size,
+      size_t max_deflate_cache_size = 0);
+
+ protected:
+  PuffPatchContext() = default;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(PuffPatchContext);
+};
+
 // Applies the puffin patch to deflate stream |src| to create deflate stream
 // |dst|. This function is used in the client and internally uses bspatch to
 // apply the patch. The input streams are of type |shared_ptr| because
@@ -25,12 +63,153 @@ extern const size_t kMagicLength;
 // |patch|         IN  The input patch.
 // |patch_length|  IN  The length of the patch.
 // |max_cache_size|IN  The maximum amount of memory to cache puff buffers.
+// |num_threads|   IN  The number of threads used for huffing the destination
+//                     deflates, overlapped with bspatch. Zero means the number
+//                     of available cores and one huffs on the calling thread.
+//                     If the patch is split into chunks (see |PuffDiff|), the
+//                     chunks are patched on this many threads instead, each
+//                     huffing its own deflates. |dst| is then written at the
+//                     offsets of the chunks in any order, so it is extended
+//                     with zeros first if it is smaller than the destination.
+// |stats|         OUT If not null, the counters and timings of the operation
+//                     are added to it.
+// |engine|        IN  The engine applying the patches between the puff streams.
+//                     It should have the id of the engine the patch was created
+//                     with and support its codec. If null, bspatch is used.
 PUFFIN_EXPORT
 bool PuffPatch(UniqueStreamPtr src,
                UniqueStreamPtr dst,
                const uint8_t* patch,
                size_t patch_length,
-               size_t max_cache_size = 0);
+               size_t max_cache_size = 0,
+               size_t num_threads = 1,
+               Stats* stats = nullptr,
+               std::shared_ptr<PatchEngine> engine = nullptr);
+
+// Similar to |PuffPatch| above, but reuses the objects of |context| and its
+// cache size.
+//
+// |src_extents|   IN  The location of |src| in the source of |context|, e.g.
+//                     the extents of a file on the source partition that |src|
+//                     reads like |ExtentStream|. If empty, |src| is the whole
+//                     source.
+PUFFIN_EXPORT
+bool PuffPatch(PuffPatchContext* context,
+               UniqueStreamPtr src,
+               const std::vector<ByteExtent>& src_extents,
+               UniqueStreamPtr dst,
+               const uint8_t* patch,
+               size_t patch_length,
+               size_t num_threads = 1,
+               Stats* stats = nullptr,
+               std::shared_ptr<PatchEngine> engine = nullptr);
+
+// Applies a puffin patch like |PuffPatch| while it is being received, so the
+// whole patch does not have to be in memory and patching overlaps with
+// receiving it. The patch is fed with |Write| in pieces of any size as they
+// arrive:
+//
+//   auto patcher = PuffPatcher::Create(std::move(src), std::move(dst));
+//   while (...)  // Receiving the patch.
+//     TEST_AND_RETURN_FALSE(patcher->Write(data, size));
+//   TEST_AND_RETURN_FALSE(patcher->Finish());
+//
+// If the patch is split into chunks (see |PuffDiff|), each chunk is patched as
+// soon as its bsdiff patch is received and is then dropped, so only the chunks
+// not patched yet are kept in memory. Otherwise bspatch needs the whole bsdiff
+// patch, so the patch is only kept (without its header) until |Finish|.
+class PUFFIN_EXPORT PuffPatcher {
+ public:
+  virtual ~PuffPatcher() = default;
+
+  // The arguments are the same as the ones of |PuffPatch|. If there are more
+  // than one |num_threads|, the chunks are patched on that many worker threads
+  // while the next ones are received. Otherwise |Write| patches them.
+  static std::unique_ptr<PuffPatcher> Create(
+      UniqueStreamPtr src,
+      UniqueStreamPtr dst,
+      size_t max_cache_size = 0,
+      size_t num_threads = 1,
+      Stats* stats = nullptr,
+      std::shared_ptr<PatchEngine> engine = nullptr);
+
+  // Similar to the function above, but reuses the objects of |context| like
+  // |PuffPatch|.
+  static std::unique_ptr<PuffPatcher> Create(
+      PuffPatchContext* context,
+      UniqueStreamPtr src,
+      const std::vector<ByteExtent>& src_extents,
+      UniqueStreamPtr dst,
+      size_t num_threads = 1,
+      Stats* stats = nullptr,
+      std::shared_ptr<PatchEngine> engine = nullptr);
+
+  // Feeds the next |size| bytes of the patch in |data|. Fails if the patch is
+  // malformed, can not be applied by the engine, or patching one of the
+  // received chunks failed.
+  virtual bool Write(const uint8_t* data, size_t size) = 0;
+
+  // Finishes patching after the whole patch is written and closes |dst|.
+  // Fails if the patch is incomplete.
+  virtual bool Finish() = 0;
+
+ protected:
+  PuffPatcher() = default;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(PuffPatcher);
+};
+
+// Returns the size of the destination |PuffPatch| creates from |patch| in
+// |dst_size|, as defined by the destination deflates and puffs in its header,
+// so the destination can be preallocated exactly (e.g. for
+// |MemoryStream::CreateForWrite| with a fixed buffer). Only the header has to
+// be in the first |patch_length| bytes of |patch|, so it can be called on the
+// beginning of a patch that is still being received.
+PUFFIN_EXPORT
+bool GetPuffPatchDestinationSize(const uint8_t* patch,
+                                 size_t patch_length,
+                                 uint64_t* dst_size);
+
+// The outcome of simulating the source puff cache of |PuffPatch| with one
+// cache size (see |SimulatePuffCache|).
+struct PuffCacheSimulation {
+  uint64_t max_cache_size = 0;
+  // The number of source puffs read, and the ones read from the cache instead
+  // of being puffed.
+  uint64_t puff_reads = 0;
+  uint64_t cache_hits = 0;
+  // The number of bytes of the source puffed, and the part of them that were
+  // puffed before and evicted from the cache (or not kept in it).
+  uint64_t puff_bytes = 0;
+  uint64_t repuff_bytes = 0;
+};
+
+// Replays the reads of the source puffs that |PuffPatch| does when applying
+// |patch| of size |patch_length| against the model of its puff cache, for each
+// of the |cache_sizes|, without reading the source or puffing anything. The
+// reads are taken from the cache plan of the patch, or found by |engine| from
+// its patches (e.g. the control entries of bspatch). The chunks of a patch
+// split into chunks are simulated one after another, as with one thread, each
+// with a cache of its own.
+//
+// |patch|         IN  The input patch.
+// |patch_length|  IN  The length of the patch.
+// |cache_sizes|   IN  The values of |max_cache_size| of |PuffPatch| to
+//                     simulate.
+// |simulations|   OUT The outcome for each of |cache_sizes|.
+// |engine|        IN  The engine the patch is applied with. If null, bspatch.
+PUFFIN_EXPORT
+bool SimulatePuffCache(const uint8_t* patch,
+                       size_t patch_length,
+                       const std::vector<uint64_t>& cache_sizes,
+                       std::vector<PuffCacheSimulation>* simulations,
+                       std::shared_ptr<PatchEngine> engine = nullptr);
+
+// Returns the engine applying the bsdiff patches with bspatch. It supports all
+// the |PatchCodec|s.
+PUFFIN_EXPORT
+std::shared_ptr<PatchEngine> CreateBspatchEngine();
 
 }  // namespace puffin
 
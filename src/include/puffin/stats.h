@@ -0,0 +1,100 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_INCLUDE_PUFFIN_STATS_H_
+#define SRC_INCLUDE_PUFFIN_STATS_H_
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+#include "puffin/common.h"
+
+namespace puffin {
+
+// The counters and timings of a puffin operation. It can be passed to
+// |PuffDiff|, |PuffPatch| and |PuffinStream| to find out where the time and
+// memory of the operation go. The members are updated by the worker threads of
+// the operation too, so the times of the phases can add up to more than the
+// time of the whole operation.
+struct PUFFIN_EXPORT Stats {
+  // The deflates (or parts of deflates) puffed and huffed, and the size of
+  // their puffs.
+  std::atomic<uint64_t> deflates_puffed{0};
+  std::atomic<uint64_t> puff_bytes{0};
+  std::atomic<uint64_t> deflates_huffed{0};
+  std::atomic<uint64_t> huff_bytes{0};
+
+  // The parts of the destination |PuffPatch| copied from the source instead of
+  // patching them, and their size.
+  std::atomic<uint64_t> deflates_copied{0};
+  std::atomic<uint64_t> copy_bytes{0};
+  // The destination deflates whose data |PuffPatch| checked against the CRC-32s
+  // in the patch while huffing them.
+  std::atomic<uint64_t> deflates_verified{0};
+
+  // The reads of the puff cache of |PuffinStream| and the buffers evicted from
+  // it. |peak_cache_size| is the largest memory held by the cache buffers.
+  std::atomic<uint64_t> cache_hits{0};
+  std::atomic<uint64_t> cache_misses{0};
+  std::atomic<uint64_t> cache_evictions{0};
+  std::atomic<uint64_t> peak_cache_size{0};
+  // The deflates not puffed as their puffs were kept by a |PuffPatchContext|
+  // from earlier operations.
+  std::atomic<uint64_t> kept_puff_hits{0};
+  // The deflates puffed from the bytes kept in the deflate cache of
+  // |PuffinStream| instead of reading them again.
+  std::atomic<uint64_t> deflate_cache_hits{0};
+  // The deflates puffed from the bytes read ahead of them by |PuffinStream|.
+  std::atomic<uint64_t> readahead_hits{0};
+
+  // The calls on the deflate streams under |PuffinStream|.
+  std::atomic<uint64_t> stream_seeks{0};
+  std::atomic<uint64_t> stream_reads{0};
+  std::atomic<uint64_t> stream_writes{0};
+
+  // The time in nanoseconds spent in each phase. |bsdiff_time_ns| and
+  // |bspatch_time_ns| include the puffing, huffing and I/O done by bsdiff and
+  // bspatch through |PuffinStream|.
+  std::atomic<uint64_t> puff_time_ns{0};
+  std::atomic<uint64_t> huff_time_ns{0};
+  std::atomic<uint64_t> io_time_ns{0};
+  std::atomic<uint64_t> bsdiff_time_ns{0};
+  std::atomic<uint64_t> bspatch_time_ns{0};
+
+  // Raises |peak_cache_size| to |cache_size| if it is larger.
+  void UpdatePeakCacheSize(uint64_t cache_size);
+
+  // Returns the stats in a human readable form, one per line.
+  std::string ToString() const;
+};
+
+// Adds the time from its creation to its destruction to the |time_ns| member
+// of |stats|. Does nothing if |stats| is null.
+class PUFFIN_EXPORT ScopedStatsTimer {
+ public:
+  ScopedStatsTimer(Stats* stats, std::atomic<uint64_t> Stats::*time_ns)
+      : time_ns_(stats != nullptr ? &(stats->*time_ns) : nullptr) {
+    if (time_ns_ != nullptr) {
+      start_ = std::chrono::steady_clock::now();
+    }
+  }
+  ~ScopedStatsTimer() {
+    if (time_ns_ != nullptr) {
+      *time_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - start_)
+                       .count();
+    }
+  }
+
+ private:
+  std::atomic<uint64_t>* time_ns_;
+  std::chrono::steady_clock::time_point start_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedStatsTimer);
+};
+
+}  // namespace puffin
+
+#endif  // SRC_INCLUDE_PUFFIN_STATS_H_
@@ -6,6 +6,7 @@
 #define SRC_INCLUDE_PUFFIN_STREAM_H_
 
 #include <memory>
+#include <vector>
 
 #include "puffin/common.h"
 
@@ -31,9 +32,34 @@ class StreamInterface {
   // Reads |length| bytes of data into |buffer|. On error, returns |false|.
   virtual bool Read(void* buffer, size_t length) = 0;
 
+  // Sets |data| to point to the next |length| bytes of the stream without
+  // copying them and advances the offset as |Read| does. The data stays valid
+  // until the stream is closed or destroyed. Streams that do not keep their
+  // data in memory do not support this and return |false|, in which case the
+  // caller should use |Read| instead.
+  virtual bool ReadZeroCopy(const uint8_t** /* data */, size_t /* length */) {
+    return false;
+  }
+
   // Writes |length| bytes of data into |buffer|. On error, returns |false|.
   virtual bool Write(const void* buffer, size_t length) = 0;
 
+  // Reads the bytes at |extents| of the stream back to back into |buffer| as
+  // one batch, without seeking in between (e.g. with positional reads of a
+  // file). The offset of the stream is undefined afterwards, so the caller
+  // should seek before its next read. Streams that do not support this return
+  // |false|, in which case the caller should seek and read each extent.
+  virtual bool ReadExtents(const std::vector<ByteExtent>& /* extents */,
+                           void* /* buffer */) {
+    return false;
+  }
+
+  // Similar to |ReadExtents| but writes the bytes in |buffer| into |extents|.
+  virtual bool WriteExtents(const std::vector<ByteExtent>& /* extents */,
+                            const void* /* buffer */) {
+    return false;
+  }
+
   // Closes the stream and cleans up all associated resources. On error, returns
   // |false|.
   virtual bool Close() = 0;
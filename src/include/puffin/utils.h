@@ -9,6 +9,7 @@
 #include <vector>
 
 #include "puffin/common.h"
+#include "puffin/stats.h"
 #include "puffin/stream.h"
 
 namespace puffin {
@@ -34,45 +35,122 @@ PUFFIN_EXPORT std::string ExtentsToString(const T& extents) {
 bool LocateDeflatesInZlib(const Buffer& data,
                           std::vector<ByteExtent>* deflate_blocks);
 
+// Similar to the function above, but reads only the header of the zlib stream
+// |src| instead of needing it all in memory.
+bool LocateDeflatesInZlib(const UniqueStreamPtr& src,
+                          std::vector<ByteExtent>* deflate_blocks);
+
 // Similar to the function above, except that it accepts the file path to the
 // source and a list of zlib blocks and returns the deflate addresses in bit
-// extents.
+// extents. The zlib blocks are split between |num_threads| threads (zero means
+// the number of available cores).
 PUFFIN_EXPORT
 bool LocateDeflatesInZlibBlocks(const std::string& file_path,
                                 const std::vector<ByteExtent>& zlibs,
-                                std::vector<BitExtent>* deflates);
+                                std::vector<BitExtent>* deflates,
+                                size_t num_threads = 1);
 
 // Searches for deflate locations in a gzip file. The results are
 // saved in |deflate_blocks|.
 bool LocateDeflatesInGzip(const Buffer& data,
                           std::vector<ByteExtent>* deflate_blocks);
 
+// Similar to the function above, but reads the gzip file from |src| in small
+// chunks while inflating the members to find their ends, so the memory used
+// does not grow with the size of the file.
+bool LocateDeflatesInGzip(const UniqueStreamPtr& src,
+                          std::vector<ByteExtent>* deflate_blocks);
+
 // Search for the deflates in a zip archive, and put the result in
 // |deflate_blocks|.
 bool LocateDeflatesInZipArchive(const Buffer& data,
                                 std::vector<ByteExtent>* deflate_blocks);
 
+// Similar to the function above, but finds the deflates of the zip archive
+// |src| by reading only its central directory (including the zip64 records)
+// and the local file headers of the deflate entries, so the archive does not
+// need to be in memory. Unlike the function above, fails if the archive has no
+// end of central directory record. The results are sorted by their offset.
+bool LocateDeflatesInZipArchive(const UniqueStreamPtr& src,
+                                std::vector<ByteExtent>* deflate_blocks);
+
 PUFFIN_EXPORT
 // Create a list of deflate subblock locations from the deflate blocks in a
-// zip archive.
+// zip archive. The subblocks are found on |num_threads| threads (see
+// |FindDeflateSubBlocks|).
 bool LocateDeflateSubBlocksInZipArchive(const Buffer& data,
-                                        std::vector<BitExtent>* deflates);
+                                        std::vector<BitExtent>* deflates,
+                                        size_t num_threads = 1);
 
 // Reads the deflates in from |deflates| and returns a list of its subblock
 // locations. Each subblock in practice is a deflate stream by itself.
 // Assumption is that the first subblock in each deflate in |deflates| start in
-// byte boundary.
+// byte boundary. The deflates are split between |num_threads| threads (zero
+// means the number of available cores), and the subblocks are returned in the
+// order of |deflates| like when they are found on one thread.
 bool FindDeflateSubBlocks(const UniqueStreamPtr& src,
                           const std::vector<ByteExtent>& deflates,
-                          std::vector<BitExtent>* subblock_deflates);
+                          std::vector<BitExtent>* subblock_deflates,
+                          size_t num_threads = 1);
 
 // Finds the location of puffs in the deflate stream |src| based on the location
 // of |deflates| and populates the |puffs|. We assume |deflates| are sorted by
-// their offset value. |out_puff_size| will be the size of the puff stream.
+// their offset value. |out_puff_size| will be the size of the puff stream. The
+// deflates are puffed on |num_threads| threads at the same time (zero means
+// the number of available cores). The locations are the ones of the puffs in
+// |puff_format|.
 bool FindPuffLocations(const UniqueStreamPtr& src,
                        const std::vector<BitExtent>& deflates,
                        std::vector<ByteExtent>* puffs,
-                       uint64_t* out_puff_size);
+                       uint64_t* out_puff_size,
+                       size_t num_threads = 1,
+                       PuffFormat puff_format = PuffFormat::kV1);
+
+// Similar to the function above, but also populates |subblock_deflates| and
+// |subblock_puffs| with the location of each deflate subblock and its puff in
+// the deflate and puff streams. They can be used as checkpoints for puffing
+// only part of a deflate (see |PuffinStream::CreateForPuff|).
+bool FindPuffLocations(const UniqueStreamPtr& src,
+                       const std::vector<BitExtent>& deflates,
+                       std::vector<ByteExtent>* puffs,
+                       uint64_t* out_puff_size,
+                       std::vector<BitExtent>* subblock_deflates,
+                       std::vector<ByteExtent>* subblock_puffs,
+                       size_t num_threads = 1,
+                       PuffFormat puff_format = PuffFormat::kV1);
+
+// Puffs the deflate stream |src| with deflates |deflates| into |dst| and
+// populates |puffs| and |out_puff_size| like |FindPuffLocations|, in a single
+// pass. Each deflate is decoded only once instead of once for finding the size
+// of its puff and again for puffing it through |PuffinStream|: It is puffed
+// into a growing buffer and then written into |dst| in order, together with
+// the raw data between the deflates. The deflates are puffed on |num_threads|
+// threads at the same time (zero means the number of available cores), and at
+// most two deflates per thread are buffered. If not null, the puffing is
+// recorded into |stats|. The deflates are puffed in |puff_format|.
+bool PuffDeflates(const UniqueStreamPtr& src,
+                  const std::vector<BitExtent>& deflates,
+                  const UniqueStreamPtr& dst,
+                  std::vector<ByteExtent>* puffs,
+                  uint64_t* out_puff_size,
+                  size_t num_threads = 1,
+                  Stats* stats = nullptr,
+                  PuffFormat puff_format = PuffFormat::kV1);
+
+// Checks that puffing and huffing back each of |deflates| in |src| reproduces
+// its bits, the way applying a patch would, and returns the indices of the ones
+// that do not (e.g. encoded differently than |Huffer| would or not valid at
+// all) in |bad_deflates|, in increasing order. They should be excluded from the
+// deflates passed to puffdiff. Each deflate is round-tripped in memory on its
+// own, on |num_threads| threads at the same time (zero means the number of
+// available cores). If not null, the puffing and huffing is recorded into
+// |stats|. Fails only if |src| cannot be read.
+PUFFIN_EXPORT
+bool ValidateDeflates(const UniqueStreamPtr& src,
+                      const std::vector<BitExtent>& deflates,
+                      std::vector<size_t>* bad_deflates,
+                      size_t num_threads = 1,
+                      Stats* stats = nullptr);
 
 }  // namespace puffin
 
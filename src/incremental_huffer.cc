@@ -0,0 +1,377 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/incremental_huffer.h"
+
+#include <algorithm>
+
+#include "puffin/src/bit_writer.h"
+#include "puffin/src/huffman_table.h"
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/errors.h"
+#include "puffin/src/puff_data.h"
+#include "puffin/src/set_errors.h"
+
+namespace puffin {
+
+namespace {
+
+// The size of the output buffer.
+constexpr size_t kOutputSize = 64 * 1024;  // 64 KiB
+
+// The free space of the output buffer needed for huffing the next piece of the
+// puff. No piece writes more than that: The largest one is the Huffman table
+// of a dynamic block, which is less than 300 bytes long.
+constexpr size_t kMaxStepOutput = 1024;
+
+// The number of literals of a compressed block huffed at once. Their Huffman
+// codes are at most 15 bits.
+constexpr size_t kLiteralsStep = 256;
+
+// The largest item is the block metadata with its two bytes of length.
+constexpr size_t kMaxItemSize = 2 + sizeof(PuffData::block_metadata);
+
+// Reads a value from the buffer in big-endian mode.
+inline uint16_t ReadByteArrayToUint16(const uint8_t* buffer) {
+  return (*buffer << 8) | *(buffer + 1);
+}
+
+}  // namespace
+
+IncrementalHuffer::IncrementalHuffer(PuffFormat format)
+    : format_(format),
+      dyn_ht_(new HuffmanTable(kDefaultMaxCachedTables)),
+      fix_ht_(new HuffmanTable()),
+      cur_ht_(nullptr),
+      output_(kOutputSize),
+      bit_writer_(new BufferBitWriter(output_.data(), output_.size())),
+      output_taken_(0),
+      deflate_size_(0),
+      state_(State::kBlockMetadata),
+      literals_left_(0) {
+  pending_.reserve(kMaxItemSize);
+}
+
+IncrementalHuffer::~IncrementalHuffer() {}
+
+bool IncrementalHuffer::Start(const BitExtent& deflate, uint8_t first_bits) {
+  TEST_AND_RETURN_FALSE(output_size() == 0);
+  bit_writer_.reset(new BufferBitWriter(output_.data(), output_.size()));
+  output_taken_ = 0;
+  deflate_size_ =
+      (deflate.offset + deflate.length + 7) / 8 - deflate.offset / 8;
+  state_ = State::kBlockMetadata;
+  literals_left_ = 0;
+  pending_.clear();
+  cur_ht_ = nullptr;
+  // Write the non-deflate bits of the first byte if it has any.
+  return bit_writer_->WriteBits(deflate.offset & 7, first_bits);
+}
+
+bool IncrementalHuffer::Write(const uint8_t* puff,
+                              size_t length,
+                              size_t* consumed) {
+  *consumed = 0;
+  Error error;
+  while (*consumed < length &&
+         output_.size() - bit_writer_->Size() >= kMaxStepOutput) {
+    TEST_AND_RETURN_FALSE(output_taken_ + bit_writer_->Size() <=
+                          deflate_size_);
+    auto data = puff + *consumed;
+    auto size = length - *consumed;
+    size_t count;
+    if (state_ == State::kLiterals) {
+      count = std::min<uint64_t>(
+          {size, literals_left_, static_cast<uint64_t>(kLiteralsStep)});
+      TEST_AND_RETURN_FALSE(
+          cur_ht_->EncodeLiterals(data, count, bit_writer_.get(), &error));
+      literals_left_ -= count;
+      *consumed += count;
+      if (literals_left_ == 0) {
+        state_ = State::kBlockData;
+      }
+    } else if (state_ == State::kStoredLiterals) {
+      // Leave room for the bytes in the cache of the bit writer.
+      uint64_t room = output_.size() - bit_writer_->Size() - 8;
+      count = std::min<uint64_t>({size, literals_left_, room});
+      TEST_AND_RETURN_FALSE(bit_writer_->WriteBytes(count, data));
+      literals_left_ -= count;
+      *consumed += count;
+      if (literals_left_ == 0) {
+        state_ = State::kStoredEnd;
+      }
+    } else {
+      if (state_ == State::kBlockData && pending_.empty()) {
+        // The usual case: Many items of a compressed block huffed at once.
+        TEST_AND_RETURN_FALSE(HuffBlockData(data, size, &count));
+        if (count > 0) {
+          *consumed += count;
+          continue;
+        }
+      }
+      TEST_AND_RETURN_FALSE(HuffNextItem(data, size, consumed));
+    }
+  }
+  TEST_AND_RETURN_FALSE(output_taken_ + bit_writer_->Size() <= deflate_size_);
+  return true;
+}
+
+bool IncrementalHuffer::Finish() {
+  TEST_AND_RETURN_FALSE(state_ == State::kBlockMetadata && pending_.empty());
+  TEST_AND_RETURN_FALSE(bit_writer_->Flush());
+  TEST_AND_RETURN_FALSE(output_taken_ + bit_writer_->Size() == deflate_size_);
+  return true;
+}
+
+uint8_t* IncrementalHuffer::output() const {
+  return const_cast<uint8_t*>(output_.data());
+}
+
+size_t IncrementalHuffer::output_size() const {
+  return bit_writer_->Size();
+}
+
+void IncrementalHuffer::ClearOutput() {
+  output_taken_ += bit_writer_->Size();
+  bit_writer_->Rewind();
+}
+
+bool IncrementalHuffer::HuffNextItem(const uint8_t* data,
+                                     size_t length,
+                                     size_t* consumed) {
+  size_t item_size;
+  if (pending_.empty()) {
+    TEST_AND_RETURN_FALSE(GetItemSize(data, length, &item_size));
+    if (item_size == 0 || item_size > length) {
+      // Keep the start of the item for the next |Write|.
+      TEST_AND_RETURN_FALSE(length < kMaxItemSize);
+      pending_.assign(data, data + length);
+      *consumed += length;
+      return true;
+    }
+    TEST_AND_RETURN_FALSE(HuffItem(data, item_size));
+    *consumed += item_size;
+    return true;
+  }
+
+  TEST_AND_RETURN_FALSE(
+      GetItemSize(pending_.data(), pending_.size(), &item_size));
+  // Add one byte at a time until the size of the item is known, and then the
+  // rest of it.
+  auto count =
+      item_size == 0 ? 1 : std::min(item_size - pending_.size(), length);
+  pending_.insert(pending_.end(), data, data + count);
+  *consumed += count;
+  TEST_AND_RETURN_FALSE(
+      GetItemSize(pending_.data(), pending_.size(), &item_size));
+  if (item_size != 0 && item_size == pending_.size()) {
+    TEST_AND_RETURN_FALSE(HuffItem(pending_.data(), pending_.size()));
+    pending_.clear();
+  }
+  return true;
+}
+
+bool IncrementalHuffer::HuffBlockData(const uint8_t* data,
+                                      size_t length,
+                                      size_t* consumed) {
+  // Stop before the output buffer is too full for the next item.
+  auto max_output_size = output_.size() - kMaxStepOutput;
+  size_t index = 0;
+  while (index < length && bit_writer_->Size() <= max_output_size) {
+    auto header = data[index];
+    auto next = index + 1;
+    size_t len = header & 0x7F;
+    if (header & 0x80) {  // A length/distance pair or an end of block.
+      if (len == 127) {
+        if (next >= length) {
+          break;
+        }
+        len = data[next++] + 127;
+      }
+      len += 3;
+      if (len >= 259 || next >= length) {
+        // Leave the end of block and the incomplete pairs to |HuffItem|.
+        break;
+      }
+      auto dist_size = PeekPuffValueSize(format_, data[next]);
+      if (next + dist_size > length) {
+        break;
+      }
+      size_t dist = ReadPuffValue(format_, data + next);
+      TEST_AND_RETURN_FALSE(dist < (1 << 15));
+      next += dist_size;
+      dist++;
+      uint32_t huffman;
+      size_t nbits;
+      TEST_AND_RETURN_FALSE(cur_ht_->EncodeLength(len, &huffman, &nbits));
+      TEST_AND_RETURN_FALSE(bit_writer_->WriteBits(nbits, huffman));
+      TEST_AND_RETURN_FALSE(cur_ht_->EncodeDistance(dist, &huffman, &nbits));
+      TEST_AND_RETURN_FALSE(bit_writer_->WriteBits(nbits, huffman));
+      index = next;
+    } else {  // Literals.
+      if (len == 127) {
+        if (next + 2 > length) {
+          break;
+        }
+        len = ReadByteArrayToUint16(data + next) + 127;
+        next += 2;
+      }
+      len++;
+      if (len > kLiteralsStep || next + len > length) {
+        // Leave the long or incomplete runs to |Write|.
+        break;
+      }
+      Error error;
+      TEST_AND_RETURN_FALSE(
+          cur_ht_->EncodeLiterals(data + next, len, bit_writer_.get(), &error));
+      index = next + len;
+    }
+  }
+  *consumed = index;
+  return true;
+}
+
+bool IncrementalHuffer::GetItemSize(const uint8_t* data,
+                                    size_t length,
+                                    size_t* item_size) const {
+  *item_size = 0;
+  if (state_ == State::kBlockMetadata) {
+    if (length > 0 && length >= PeekPuffValueSize(format_, data[0])) {
+      auto metadata_length = ReadPuffValue(format_, data) + 1;
+      TEST_AND_RETURN_FALSE(metadata_length <=
+                            sizeof(PuffData::block_metadata));
+      *item_size = PeekPuffValueSize(format_, data[0]) + metadata_length;
+    }
+    return true;
+  }
+  if (length == 0) {
+    return true;
+  }
+  if (data[0] & 0x80) {  // A length/distance pair or an end of block.
+    size_t header_size = 1;
+    size_t len = data[0] & 0x7F;
+    if (len == 127) {
+      if (length < 2) {
+        return true;
+      }
+      header_size = 2;
+      len = data[1] + 127;
+    }
+    len += 3;
+    TEST_AND_RETURN_FALSE(len <= 259);
+    // An end of block has no distance.
+    if (len == 259) {
+      *item_size = header_size;
+    } else if (length > header_size) {
+      *item_size =
+          header_size + PeekPuffValueSize(format_, data[header_size]);
+    }
+  } else {  // The header of literals.
+    *item_size = (data[0] & 0x7F) < 127 ? 1 : 3;
+  }
+  return true;
+}
+
+bool IncrementalHuffer::HuffItem(const uint8_t* data, size_t item_size) {
+  Error error;
+  if (state_ == State::kBlockMetadata) {
+    auto length_size = PeekPuffValueSize(format_, data[0]);
+    auto metadata = data + length_size;
+    auto metadata_length = item_size - length_size;
+    auto header = metadata[0];
+    auto final_bit = (header & 0x80) >> 7;
+    auto type = (header & 0x60) >> 5;
+    auto skipped_bits = header & 0x1F;
+    TEST_AND_RETURN_FALSE(bit_writer_->WriteBits(1, final_bit));
+    TEST_AND_RETURN_FALSE(bit_writer_->WriteBits(2, type));
+    switch (static_cast<BlockType>(type)) {
+      case BlockType::kUncompressed:
+        TEST_AND_RETURN_FALSE(bit_writer_->WriteBoundaryBits(skipped_bits));
+        state_ = State::kStoredData;
+        return true;
+
+      case BlockType::kFixed:
+        fix_ht_->BuildFixedHuffmanTable();
+        cur_ht_ = fix_ht_.get();
+        break;
+
+      case BlockType::kDynamic:
+        TEST_AND_RETURN_FALSE(metadata_length > 1);
+        cur_ht_ = dyn_ht_.get();
+        TEST_AND_RETURN_FALSE(dyn_ht_->BuildDynamicHuffmanTable(
+            metadata + 1, metadata_length - 1, bit_writer_.get(), &error));
+        break;
+
+      default:
+        LOG(ERROR) << "Invalid block compression type: "
+                   << static_cast<int>(type);
+        return false;
+    }
+    state_ = State::kBlockData;
+    return true;
+  }
+
+  bool is_len_dist = data[0] & 0x80;
+  size_t len = 0;
+  if (is_len_dist) {
+    len = (data[0] & 0x7F) < 127 ? (data[0] & 0x7F) + 3 : data[1] + 127 + 3;
+  } else {
+    len = (data[0] & 0x7F) < 127 ? (data[0] & 0x7F) + 1
+                                 : ReadByteArrayToUint16(data + 1) + 127 + 1;
+  }
+  bool is_end_of_block = is_len_dist && len == 259;
+
+  switch (state_) {
+    case State::kBlockData:
+      if (is_end_of_block) {
+        uint16_t eos_huffman;
+        size_t nbits;
+        TEST_AND_RETURN_FALSE(
+            cur_ht_->LitLenHuffman(256, &eos_huffman, &nbits));
+        TEST_AND_RETURN_FALSE(bit_writer_->WriteBits(nbits, eos_huffman));
+        state_ = State::kBlockMetadata;
+      } else if (is_len_dist) {
+        // The distance is zero-based in the puff stream.
+        size_t dist =
+            ReadPuffValue(format_, data + ((data[0] & 0x7F) < 127 ? 1 : 2));
+        TEST_AND_RETURN_FALSE(dist < (1 << 15));
+        dist++;
+        uint32_t huffman;
+        size_t nbits;
+        TEST_AND_RETURN_FALSE(cur_ht_->EncodeLength(len, &huffman, &nbits));
+        TEST_AND_RETURN_FALSE(bit_writer_->WriteBits(nbits, huffman));
+        TEST_AND_RETURN_FALSE(cur_ht_->EncodeDistance(dist, &huffman, &nbits));
+        TEST_AND_RETURN_FALSE(bit_writer_->WriteBits(nbits, huffman));
+      } else {
+        literals_left_ = len;
+        state_ = State::kLiterals;
+      }
+      return true;
+
+    case State::kStoredData:
+      TEST_AND_RETURN_FALSE(!is_len_dist || is_end_of_block);
+      if (is_end_of_block) {
+        TEST_AND_RETURN_FALSE(bit_writer_->WriteBits(16, 0));
+        TEST_AND_RETURN_FALSE(bit_writer_->WriteBits(16, ~0));
+        state_ = State::kBlockMetadata;
+      } else {
+        TEST_AND_RETURN_FALSE(bit_writer_->WriteBits(16, len));
+        TEST_AND_RETURN_FALSE(bit_writer_->WriteBits(16, ~len));
+        literals_left_ = len;
+        state_ = State::kStoredLiterals;
+      }
+      return true;
+
+    case State::kStoredEnd:
+      // Reading end of block, but don't write anything.
+      TEST_AND_RETURN_FALSE(is_end_of_block);
+      state_ = State::kBlockMetadata;
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+}  // namespace puffin
@@ -0,0 +1,119 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_INCREMENTAL_HUFFER_H_
+#define SRC_INCREMENTAL_HUFFER_H_
+
+#include <cstddef>
+#include <memory>
+
+#include "puffin/src/include/puffin/common.h"
+
+namespace puffin {
+
+class BufferBitWriter;
+class HuffmanTable;
+
+// Huffs a puff into its deflate like |Huffer::HuffDeflate|, but consumes the
+// puff piece by piece as it arrives and keeps only its state between the
+// pieces, so neither the whole puff nor the whole deflate is buffered. The
+// deflate is written into an output buffer of a fixed size that the caller
+// takes out whenever it fills up.
+class IncrementalHuffer {
+ public:
+  // |format| is the encoding of the puffs huffed.
+  explicit IncrementalHuffer(PuffFormat format = PuffFormat::kV1);
+  ~IncrementalHuffer();
+
+  // Starts huffing the puff of |deflate|. The output buffer should be empty.
+  //
+  // |deflate|    IN  The location of the deflate in the deflate stream.
+  // |first_bits| IN  The bits of the first byte of |deflate| that are before
+  //                  |deflate|.
+  bool Start(const BitExtent& deflate, uint8_t first_bits);
+
+  // Huffs the next |length| bytes of the puff in |puff|. It stops early if the
+  // output buffer is full, in which case it should be taken out with
+  // |ClearOutput| before the rest is written.
+  //
+  // |puff|     IN   The next bytes of the puff.
+  // |length|   IN   The number of bytes in |puff|.
+  // |consumed| OUT  The number of bytes of |puff| huffed.
+  bool Write(const uint8_t* puff, size_t length, size_t* consumed);
+
+  // Finishes the deflate after the whole puff is written. It fails if the puff
+  // ended in the middle of a block or the deflate does not have the size of
+  // the one given to |Start|. Then the output buffer has the rest of the
+  // deflate, including its last partial byte.
+  bool Finish();
+
+  // The bytes of the deflate written into the output buffer since it was last
+  // cleared. Only whole bytes are written before |Finish|.
+  uint8_t* output() const;
+  size_t output_size() const;
+
+  // Empties the output buffer after its bytes are taken out.
+  void ClearOutput();
+
+ private:
+  // The kind of data expected next in the puff.
+  enum class State {
+    // The metadata of a block.
+    kBlockMetadata,
+    // Literals, a length/distance pair or an end of block in a compressed
+    // block.
+    kBlockData,
+    // |literals_left_| more literals in a compressed block.
+    kLiterals,
+    // The literals or an end of block in an uncompressed block.
+    kStoredData,
+    // |literals_left_| more literals in an uncompressed block.
+    kStoredLiterals,
+    // The end of block after the literals of an uncompressed block.
+    kStoredEnd,
+  };
+
+  // Finds the size of the next item (anything other than literals) in the
+  // |length| bytes of |data|. |item_size| is zero if |data| is too short to
+  // tell.
+  bool GetItemSize(const uint8_t* data, size_t length, size_t* item_size) const;
+
+  // Huffs the consecutive length/distance pairs and short runs of literals of
+  // a compressed block at the start of the |length| bytes of |data| until an
+  // item it leaves to |HuffNextItem| or the output buffer is nearly full.
+  // |consumed| is the number of bytes huffed.
+  bool HuffBlockData(const uint8_t* data, size_t length, size_t* consumed);
+
+  // Huffs the next item at the start of the |length| bytes of |data|, or keeps
+  // it in |pending_| if it is not complete yet. |consumed| is incremented by
+  // the number of bytes used.
+  bool HuffNextItem(const uint8_t* data, size_t length, size_t* consumed);
+
+  // Huffs the next item in |data| of size |item_size|.
+  bool HuffItem(const uint8_t* data, size_t item_size);
+
+  PuffFormat format_;
+
+  std::unique_ptr<HuffmanTable> dyn_ht_;
+  std::unique_ptr<HuffmanTable> fix_ht_;
+  HuffmanTable* cur_ht_;
+
+  Buffer output_;
+  std::unique_ptr<BufferBitWriter> bit_writer_;
+  // The number of bytes of the deflate taken out of |output_| so far, and its
+  // expected size.
+  uint64_t output_taken_;
+  uint64_t deflate_size_;
+
+  State state_;
+  uint64_t literals_left_;
+  // The first bytes of an item that is split between two |Write|s.
+  Buffer pending_;
+
+  DISALLOW_COPY_AND_ASSIGN(IncrementalHuffer);
+};
+
+}  // namespace puffin
+
+#endif  // SRC_INCREMENTAL_HUFFER_H_
@@ -2,8 +2,11 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <sys/stat.h>
+
 #include <algorithm>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <sstream>
 
@@ -17,11 +20,14 @@
 #include "puffin/src/file_stream.h"
 #include "puffin/src/include/puffin/common.h"
 #include "puffin/src/include/puffin/huffer.h"
+#include "puffin/src/include/puffin/puff_index.h"
 #include "puffin/src/include/puffin/puffdiff.h"
 #include "puffin/src/include/puffin/puffer.h"
 #include "puffin/src/include/puffin/puffpatch.h"
+#include "puffin/src/include/puffin/stats.h"
 #include "puffin/src/include/puffin/utils.h"
 #include "puffin/src/memory_stream.h"
+#include "puffin/src/mmap_file_stream.h"
 #include "puffin/src/puffin_stream.h"
 #include "puffin/src/set_errors.h"
 
@@ -33,6 +39,7 @@ using puffin::ExtentStream;
 using puffin::FileStream;
 using puffin::Huffer;
 using puffin::MemoryStream;
+using puffin::MmapFileStream;
 using puffin::Puffer;
 using puffin::PuffinStream;
 using puffin::UniqueStreamPtr;
@@ -63,6 +70,83 @@ vector<T> StringToExtents(const string& str) {
 
 const uint64_t kDefaultPuffCacheSize = 50 * 1024 * 1024;  // 50 MB
 
+// The range of cache sizes simulated by default, in powers of two.
+const uint64_t kMinSimulatedCacheSize = 1024 * 1024;  // 1 MB
+const uint64_t kMaxSimulatedCacheSize = 1024 * 1024 * 1024;  // 1 GB
+
+// The cache size recommended by the cachesim operation is the smallest one
+// puffing at most this much more than the largest one simulated.
+const double kRecommendedCacheSlack = 0.05;
+
+// Parses the comma separated numbers in |str|.
+vector<uint64_t> StringToSizes(const string& str) {
+  vector<uint64_t> sizes;
+  std::stringstream ss(str);
+  string size_str;
+  while (getline(ss, size_str, kExtentDelimeter)) {
+    sizes.push_back(stoull(size_str));
+  }
+  return sizes;
+}
+
+// Simulates the source puff cache of applying |patch| with each of the
+// |cache_sizes| (or powers of two from |kMinSimulatedCacheSize| up to the first
+// one that does not puff anything twice) and logs a table of the outcome with
+// the time puffing takes at |puff_speed| MB/s, and the recommended cache size.
+bool LogPuffCacheSimulation(const Buffer& patch,
+                            vector<uint64_t> cache_sizes,
+                            uint64_t puff_speed) {
+  bool default_sizes = cache_sizes.empty();
+  if (default_sizes) {
+    cache_sizes.push_back(0);
+    for (auto size = kMinSimulatedCacheSize; size <= kMaxSimulatedCacheSize;
+         size *= 2) {
+      cache_sizes.push_back(size);
+    }
+  }
+  std::sort(cache_sizes.begin(), cache_sizes.end());
+  vector<puffin::PuffCacheSimulation> simulations;
+  TEST_AND_RETURN_FALSE(puffin::SimulatePuffCache(
+      patch.data(), patch.size(), cache_sizes, &simulations));
+  TEST_AND_RETURN_FALSE(!simulations.empty() && puff_speed > 0);
+  if (default_sizes) {
+    auto last = std::find_if(simulations.begin() + 1, simulations.end(),
+                             [](const puffin::PuffCacheSimulation& sim) {
+                               return sim.repuff_bytes == 0;
+                             });
+    if (last != simulations.end()) {
+      simulations.erase(last + 1, simulations.end());
+    }
+  }
+
+  std::stringstream table;
+  table << std::setw(12) << "cache_size" << std::setw(10) << "hit_rate"
+        << std::setw(14) << "puff_bytes" << std::setw(14) << "repuff_bytes"
+        << std::setw(12) << "puff_time_s" << std::endl;
+  auto min_puff_bytes = simulations.back().puff_bytes;
+  for (const auto& sim : simulations) {
+    double hit_rate =
+        sim.puff_reads == 0 ? 1.0 : 1.0 * sim.cache_hits / sim.puff_reads;
+    double puff_time = sim.puff_bytes / (puff_speed * 1024.0 * 1024.0);
+    table << std::setw(12) << sim.max_cache_size << std::setw(10) << std::fixed
+          << std::setprecision(4) << hit_rate << std::setw(14)
+          << sim.puff_bytes << std::setw(14) << sim.repuff_bytes
+          << std::setw(12) << std::setprecision(3) << puff_time << std::endl;
+    min_puff_bytes = std::min(min_puff_bytes, sim.puff_bytes);
+  }
+  const puffin::PuffCacheSimulation* recommended = nullptr;
+  for (const auto& sim : simulations) {
+    if (sim.puff_bytes <= min_puff_bytes * (1 + kRecommendedCacheSlack)) {
+      recommended = &sim;
+      break;
+    }
+  }
+  TEST_AND_RETURN_FALSE(recommended != nullptr);
+  LOG(INFO) << "puff cache simulation:\n" << table.str();
+  LOG(INFO) << "recommended cache_size: " << recommended->max_cache_size;
+  return true;
+}
+
 // An enum representing the type of compressed files.
 enum class FileType { kDeflate, kZlib, kGzip, kZip, kRaw, kUnknown };
 
@@ -84,6 +168,35 @@ FileType StringToFileType(const string& file_type) {
   return FileType::kUnknown;
 }
 
+// Parses |codec_name| into |codec|. Returns false if it is unknown.
+bool StringToPatchCodec(const string& codec_name, puffin::PatchCodec* codec) {
+  if (codec_name == "bz2") {
+    *codec = puffin::PatchCodec::kBz2;
+  } else if (codec_name == "brotli") {
+    *codec = puffin::PatchCodec::kBrotli;
+  } else if (codec_name == "none") {
+    *codec = puffin::PatchCodec::kNone;
+  } else {
+    LOG(ERROR) << "Unknown patch codec: " << codec_name;
+    return false;
+  }
+  return true;
+}
+
+// Parses the version |version| of the puff format into |format|. Returns false
+// if it is unknown.
+bool VersionToPuffFormat(uint64_t version, puffin::PuffFormat* format) {
+  if (version == 1) {
+    *format = puffin::PuffFormat::kV1;
+  } else if (version == 2) {
+    *format = puffin::PuffFormat::kV2;
+  } else {
+    LOG(ERROR) << "Unknown puff format version: " << version;
+    return false;
+  }
+  return true;
+}
+
 // Finds the location of deflates in |stream|. If |file_type_to_override| is
 // non-empty, it infers the file type based on that, otherwise, it infers the
 // file type based on the final extension of |file_name|. It returns false if
@@ -131,17 +244,28 @@ bool LocateDeflatesBasedOnFileType(const UniqueStreamPtr& stream,
     return true;
   }
 
-  Buffer data(stream_size);
-  TEST_AND_RETURN_FALSE(stream->Read(data.data(), data.size()));
+  // The deflates are located by reading only the headers (and inflating the
+  // gzip members) from |stream| so the file does not need to be in memory.
   switch (file_type) {
     case FileType::kZlib:
-      TEST_AND_RETURN_FALSE(puffin::LocateDeflatesInZlib(data, deflates));
+      TEST_AND_RETURN_FALSE(puffin::LocateDeflatesInZlib(stream, deflates));
       break;
     case FileType::kGzip:
-      TEST_AND_RETURN_FALSE(puffin::LocateDeflatesInGzip(data, deflates));
+      TEST_AND_RETURN_FALSE(puffin::LocateDeflatesInGzip(stream, deflates));
       break;
     case FileType::kZip:
-      TEST_AND_RETURN_FALSE(puffin::LocateDeflatesInZipArchive(data, deflates));
+      if (!puffin::LocateDeflatesInZipArchive(stream, deflates)) {
+        // Fall back to scanning the whole archive for local file headers in
+        // case it has no valid central directory.
+        LOG(WARNING) << "Failed to read the central directory of "
+                     << file_name << ", scanning the whole file instead.";
+        deflates->clear();
+        Buffer data(stream_size);
+        TEST_AND_RETURN_FALSE(stream->Seek(0));
+        TEST_AND_RETURN_FALSE(stream->Read(data.data(), data.size()));
+        TEST_AND_RETURN_FALSE(
+            puffin::LocateDeflatesInZipArchive(data, deflates));
+      }
       break;
     default:
       LOG(ERROR) << "Unknown file type: (" << file_type_to_override << ") nor ("
@@ -182,7 +306,7 @@ bool LocateDeflatesBasedOnFileType(const UniqueStreamPtr& stream,
                 "Target extents in the format of offset:length,...");      \
   DEFINE_string(operation, "",                                             \
                 "Type of the operation: puff, huff, puffdiff, puffpatch, " \
-                "puffhuff");                                               \
+                "puffhuff, index, cachesim, validate");                    \
   DEFINE_string(src_file_type, "",                                         \
                 "Type of the input source file: deflate, gzip, "           \
                 "zlib or zip");                                            \
@@ -192,7 +316,56 @@ bool LocateDeflatesBasedOnFileType(const UniqueStreamPtr& stream,
               "Logs all the given parameters including internally "        \
               "generated ones");                                           \
   DEFINE_uint64(cache_size, kDefaultPuffCacheSize,                         \
-                "Maximum size to cache the puff stream. Used in puffpatch");
+                "Maximum size to cache the puff stream. Used in "          \
+                "puffpatch");                                              \
+  DEFINE_uint64(threads, 1,                                                \
+                "Number of threads used for locating and puffing "         \
+                "(puffdiff) or huffing (puffpatch) the deflates. Zero "    \
+                "means the number of available cores");                    \
+  DEFINE_uint64(readahead, 0,                                              \
+                "Number of deflates read ahead of the one being puffed "   \
+                "on a background thread. Used in puff with --src_index");  \
+  DEFINE_bool(mmap_puffs, false,                                           \
+              "Keeps the puffed files in memory-mapped temporary files. "  \
+              "Used in puffdiff");                                         \
+  DEFINE_bool(cache_plan, false,                                           \
+              "Adds a plan for caching the source puffs in --cache_size "  \
+              "bytes to the patch. Used in puffdiff");                     \
+  DEFINE_uint64(patch_chunks, 1,                                           \
+                "Splits the target into at most this many chunks that "    \
+                "puffpatch applies on --threads threads. Used in "         \
+                "puffdiff");                                               \
+  DEFINE_string(patch_codec, "bz2",                                        \
+                "The compression of the bsdiff patches: bz2, brotli (the " \
+                "smallest) or none (the fastest to apply). Used in "       \
+                "puffdiff");                                               \
+  DEFINE_bool(dst_crc32s, false,                                           \
+              "Adds the CRC-32s of the target deflates to the patch, so "  \
+              "puffpatch checks each one while huffing it. Used in "       \
+              "puffdiff");                                                 \
+  DEFINE_uint64(puff_format, 1,                                            \
+                "The version of the puff format: 1 or 2 (smaller puffs, "  \
+                "so puffdiff is faster, but older puffpatch can not "      \
+                "apply the patches). Used in puff, puffhuff, huff and "    \
+                "puffdiff. The puffs of --src_index are always "           \
+                "version 1");                                              \
+  DEFINE_string(cache_sizes, "",                                           \
+                "The comma separated values of --cache_size that "         \
+                "cachesim simulates applying --patch_file with. By "       \
+                "default, powers of two from 1 MB up to the first one "    \
+                "that does not puff a source deflate twice");              \
+  DEFINE_uint64(puff_speed, 50,                                            \
+                "The puffing throughput in MB/s of the device the patch "  \
+                "is applied on (e.g. measured by puffin_benchmark), for "  \
+                "the puffing times estimated by cachesim");                \
+  DEFINE_bool(stats, false,                                                \
+              "Logs the counters and timings of the operation, such as "   \
+              "the puff cache hits and misses and the time spent puffing " \
+              "and huffing");                                              \
+  DEFINE_string(src_index, "",                                             \
+                "An index of the source deflate and puff locations made "  \
+                "by the index operation (written into --dst_file). Used "  \
+                "in puff and puffdiff instead of finding them again");
 
 #ifndef USE_BRILLO
 SETUP_FLAGS;
@@ -209,8 +382,26 @@ int main(int argc, char** argv) {
 #endif
 
   TEST_AND_RETURN_VALUE(!FLAGS_operation.empty(), -1);
+
+  // Simulating the puff cache only reads the patch.
+  if (FLAGS_operation == "cachesim") {
+    auto patch_stream = FileStream::Open(FLAGS_patch_file, true, false);
+    TEST_AND_RETURN_VALUE(patch_stream, -1);
+    uint64_t patch_size;
+    TEST_AND_RETURN_VALUE(patch_stream->GetSize(&patch_size), -1);
+    Buffer patch(patch_size);
+    TEST_AND_RETURN_VALUE(patch_stream->Read(patch.data(), patch.size()), -1);
+    TEST_AND_RETURN_VALUE(
+        LogPuffCacheSimulation(patch, StringToSizes(FLAGS_cache_sizes),
+                               FLAGS_puff_speed),
+        -1);
+    return 0;
+  }
+
   TEST_AND_RETURN_VALUE(!FLAGS_src_file.empty(), -1);
-  TEST_AND_RETURN_VALUE(!FLAGS_dst_file.empty(), -1);
+  // Validating only reports the deflates that are not reproduced.
+  TEST_AND_RETURN_VALUE(
+      FLAGS_operation == "validate" || !FLAGS_dst_file.empty(), -1);
 
   auto src_deflates_byte = StringToExtents<ByteExtent>(FLAGS_src_deflates_byte);
   auto dst_deflates_byte = StringToExtents<ByteExtent>(FLAGS_dst_deflates_byte);
@@ -221,7 +412,7 @@ int main(int argc, char** argv) {
   auto src_extents = StringToExtents<ByteExtent>(FLAGS_src_extents);
   auto dst_extents = StringToExtents<ByteExtent>(FLAGS_dst_extents);
 
-  auto src_stream = FileStream::Open(FLAGS_src_file, true, false);
+  auto src_stream = MmapFileStream::Open(FLAGS_src_file);
   TEST_AND_RETURN_VALUE(src_stream, -1);
   if (!src_extents.empty()) {
     src_stream =
@@ -229,46 +420,76 @@ int main(int argc, char** argv) {
     TEST_AND_RETURN_VALUE(src_stream, -1);
   }
 
-  if (FLAGS_operation == "puff" || FLAGS_operation == "puffhuff") {
-    TEST_AND_RETURN_VALUE(
-        LocateDeflatesBasedOnFileType(src_stream, FLAGS_src_file,
-                                      FLAGS_src_file_type, &src_deflates_byte),
-        -1);
+  // The stats are only recorded when asked for.
+  puffin::Stats stats;
+  auto* stats_out = FLAGS_stats ? &stats : nullptr;
 
-    if (src_deflates_bit.empty() && src_deflates_byte.empty()) {
-      LOG(WARNING) << "You should pass source deflates, is this intentional?";
-    }
-    if (src_deflates_bit.empty()) {
-      TEST_AND_RETURN_VALUE(FindDeflateSubBlocks(src_stream, src_deflates_byte,
-                                                 &src_deflates_bit),
-                            -1);
-    }
-    TEST_AND_RETURN_VALUE(dst_puffs.empty(), -1);
-    uint64_t dst_puff_size;
-    TEST_AND_RETURN_VALUE(FindPuffLocations(src_stream, src_deflates_bit,
-                                            &dst_puffs, &dst_puff_size),
+  // The source deflate and puff locations are taken from the index if given.
+  puffin::PuffIndex src_index;
+  bool has_src_index = !FLAGS_src_index.empty();
+  if (has_src_index) {
+    TEST_AND_RETURN_VALUE(puffin::LoadPuffIndex(FLAGS_src_index, &src_index),
                           -1);
+  }
+
+  puffin::PuffFormat puff_format;
+  TEST_AND_RETURN_VALUE(VersionToPuffFormat(FLAGS_puff_format, &puff_format),
+                        -1);
 
+  if (FLAGS_operation == "puff" || FLAGS_operation == "puffhuff") {
+    TEST_AND_RETURN_VALUE(dst_puffs.empty(), -1);
     auto dst_stream = FileStream::Open(FLAGS_dst_file, false, true);
     TEST_AND_RETURN_VALUE(dst_stream, -1);
-    auto puffer = std::make_shared<Puffer>();
-    auto reader =
-        PuffinStream::CreateForPuff(std::move(src_stream), puffer,
-                                    dst_puff_size, src_deflates_bit, dst_puffs);
-
     Buffer puff_buffer;
     auto writer = FLAGS_operation == "puffhuff"
                       ? MemoryStream::CreateForWrite(&puff_buffer)
                       : std::move(dst_stream);
 
+    uint64_t dst_puff_size;
     Buffer buffer(1024 * 1024);
-    uint64_t bytes_wrote = 0;
-    while (bytes_wrote < dst_puff_size) {
-      auto write_size = std::min(static_cast<uint64_t>(buffer.size()),
-                                 dst_puff_size - bytes_wrote);
-      TEST_AND_RETURN_VALUE(reader->Read(buffer.data(), write_size), -1);
-      TEST_AND_RETURN_VALUE(writer->Write(buffer.data(), write_size), -1);
-      bytes_wrote += write_size;
+    if (has_src_index) {
+      TEST_AND_RETURN_VALUE(puff_format == puffin::PuffFormat::kV1, -1);
+      TEST_AND_RETURN_VALUE(puffin::CheckPuffIndex(src_stream, src_index), -1);
+      src_deflates_bit = src_index.deflates;
+      dst_puffs = src_index.puffs;
+      dst_puff_size = src_index.puff_size;
+
+      auto puffer = std::make_shared<Puffer>();
+      PuffinStream::PuffOptions puff_options;
+      puff_options.stats = stats_out;
+      puff_options.readahead_depth = FLAGS_readahead;
+      auto reader = PuffinStream::CreateForPuff(std::move(src_stream), puffer,
+                                                dst_puff_size, src_deflates_bit,
+                                                dst_puffs, puff_options);
+
+      uint64_t bytes_wrote = 0;
+      while (bytes_wrote < dst_puff_size) {
+        auto write_size = std::min(static_cast<uint64_t>(buffer.size()),
+                                   dst_puff_size - bytes_wrote);
+        TEST_AND_RETURN_VALUE(reader->Read(buffer.data(), write_size), -1);
+        TEST_AND_RETURN_VALUE(writer->Write(buffer.data(), write_size), -1);
+        bytes_wrote += write_size;
+      }
+    } else {
+      TEST_AND_RETURN_VALUE(LocateDeflatesBasedOnFileType(
+                                src_stream, FLAGS_src_file,
+                                FLAGS_src_file_type, &src_deflates_byte),
+                            -1);
+
+      if (src_deflates_bit.empty() && src_deflates_byte.empty()) {
+        LOG(WARNING) << "You should pass source deflates, is this intentional?";
+      }
+      if (src_deflates_bit.empty()) {
+        TEST_AND_RETURN_VALUE(
+            FindDeflateSubBlocks(src_stream, src_deflates_byte,
+                                 &src_deflates_bit, FLAGS_threads),
+            -1);
+      }
+      // The puffs are found while puffing, so the deflates are decoded once.
+      TEST_AND_RETURN_VALUE(
+          PuffDeflates(src_stream, src_deflates_bit, writer, &dst_puffs,
+                       &dst_puff_size, FLAGS_threads, stats_out, puff_format),
+          -1);
     }
 
     // puffhuff operation puffs a stream and huffs it back to the target stream
@@ -280,9 +501,12 @@ int main(int argc, char** argv) {
 
       auto read_puff_stream = MemoryStream::CreateForRead(puff_buffer);
       auto huffer = std::make_shared<Huffer>();
+      PuffinStream::HuffOptions huff_options;
+      huff_options.stats = stats_out;
+      huff_options.puff_format = puff_format;
       auto huff_writer = PuffinStream::CreateForHuff(
           std::move(dst_stream), huffer, dst_puff_size, dst_deflates_bit,
-          src_puffs);
+          src_puffs, huff_options);
 
       uint64_t bytes_read = 0;
       while (bytes_read < dst_puff_size) {
@@ -306,9 +530,12 @@ int main(int argc, char** argv) {
     TEST_AND_RETURN_VALUE(dst_file, -1);
 
     auto huffer = std::make_shared<Huffer>();
-    auto dst_stream = PuffinStream::CreateForHuff(std::move(dst_file), huffer,
-                                                  src_stream_size,
-                                                  dst_deflates_bit, src_puffs);
+    PuffinStream::HuffOptions huff_options;
+    huff_options.stats = stats_out;
+    huff_options.puff_format = puff_format;
+    auto dst_stream = PuffinStream::CreateForHuff(
+        std::move(dst_file), huffer, src_stream_size, dst_deflates_bit,
+        src_puffs, huff_options);
 
     Buffer buffer(1024 * 1024);
     uint64_t bytes_read = 0;
@@ -320,19 +547,22 @@ int main(int argc, char** argv) {
       bytes_read += read_size;
     }
   } else if (FLAGS_operation == "puffdiff") {
-    auto dst_stream = FileStream::Open(FLAGS_dst_file, true, false);
+    auto dst_stream = MmapFileStream::Open(FLAGS_dst_file);
     TEST_AND_RETURN_VALUE(dst_stream, -1);
 
-    TEST_AND_RETURN_VALUE(
-        LocateDeflatesBasedOnFileType(src_stream, FLAGS_src_file,
-                                      FLAGS_src_file_type, &src_deflates_byte),
-        -1);
+    if (!has_src_index) {
+      TEST_AND_RETURN_VALUE(LocateDeflatesBasedOnFileType(
+                                src_stream, FLAGS_src_file,
+                                FLAGS_src_file_type, &src_deflates_byte),
+                            -1);
+    }
     TEST_AND_RETURN_VALUE(
         LocateDeflatesBasedOnFileType(dst_stream, FLAGS_dst_file,
                                       FLAGS_dst_file_type, &dst_deflates_byte),
         -1);
 
-    if (src_deflates_bit.empty() && src_deflates_byte.empty()) {
+    if (!has_src_index && src_deflates_bit.empty() &&
+        src_deflates_byte.empty()) {
       LOG(WARNING) << "You should pass source deflates, is this intentional?";
     }
     if (dst_deflates_bit.empty() && dst_deflates_byte.empty()) {
@@ -344,31 +574,49 @@ int main(int argc, char** argv) {
       TEST_AND_RETURN_VALUE(dst_stream, -1);
     }
 
-    if (src_deflates_bit.empty()) {
-      TEST_AND_RETURN_VALUE(FindDeflateSubBlocks(src_stream, src_deflates_byte,
-                                                 &src_deflates_bit),
-                            -1);
+    if (has_src_index) {
+      src_deflates_bit = src_index.deflates;
+    } else if (src_deflates_bit.empty()) {
+      TEST_AND_RETURN_VALUE(
+          FindDeflateSubBlocks(src_stream, src_deflates_byte,
+                               &src_deflates_bit, FLAGS_threads),
+          -1);
     }
 
     if (dst_deflates_bit.empty()) {
-      TEST_AND_RETURN_VALUE(FindDeflateSubBlocks(dst_stream, dst_deflates_byte,
-                                                 &dst_deflates_bit),
-                            -1);
+      TEST_AND_RETURN_VALUE(
+          FindDeflateSubBlocks(dst_stream, dst_deflates_byte,
+                               &dst_deflates_bit, FLAGS_threads),
+          -1);
     }
 
-    Buffer puffdiff_delta;
+    puffin::PatchCodec codec;
+    TEST_AND_RETURN_VALUE(StringToPatchCodec(FLAGS_patch_codec, &codec), -1);
+    auto engine = puffin::CreateBsdiffEngine(codec);
+    TEST_AND_RETURN_VALUE(engine, -1);
+
+    auto patch_stream = FileStream::Open(FLAGS_patch_file, false, true);
+    TEST_AND_RETURN_VALUE(patch_stream, -1);
+    puffin::PuffDiffOptions options;
+    options.num_threads = FLAGS_threads;
+    options.mmap_puffs = FLAGS_mmap_puffs;
+    options.cache_plan_size = FLAGS_cache_plan ? FLAGS_cache_size : 0;
+    options.stats = stats_out;
+    options.src_index = has_src_index ? &src_index : nullptr;
+    options.num_chunks = FLAGS_patch_chunks;
+    options.engine = engine;
+    options.add_dst_crc32s = FLAGS_dst_crc32s;
+    options.puff_format = puff_format;
     TEST_AND_RETURN_VALUE(
         puffin::PuffDiff(std::move(src_stream), std::move(dst_stream),
                          src_deflates_bit, dst_deflates_bit, "/tmp/patch.tmp",
-                         &puffdiff_delta),
+                         patch_stream, options),
         -1);
     if (FLAGS_verbose) {
-      LOG(INFO) << "patch_size: " << puffdiff_delta.size();
+      uint64_t patch_size;
+      TEST_AND_RETURN_VALUE(patch_stream->GetSize(&patch_size), -1);
+      LOG(INFO) << "patch_size: " << patch_size;
     }
-    auto patch_stream = FileStream::Open(FLAGS_patch_file, false, true);
-    TEST_AND_RETURN_VALUE(patch_stream, -1);
-    TEST_AND_RETURN_VALUE(
-        patch_stream->Write(puffdiff_delta.data(), puffdiff_delta.size()), -1);
   } else if (FLAGS_operation == "puffpatch") {
     auto patch_stream = FileStream::Open(FLAGS_patch_file, true, false);
     TEST_AND_RETURN_VALUE(patch_stream, -1);
@@ -378,20 +626,96 @@ int main(int argc, char** argv) {
     Buffer puffdiff_delta(patch_size);
     TEST_AND_RETURN_VALUE(
         patch_stream->Read(puffdiff_delta.data(), puffdiff_delta.size()), -1);
-    auto dst_stream = FileStream::Open(FLAGS_dst_file, false, true);
-    TEST_AND_RETURN_VALUE(dst_stream, -1);
+    UniqueStreamPtr dst_stream;
     if (!dst_extents.empty()) {
+      dst_stream = FileStream::Open(FLAGS_dst_file, false, true);
+      TEST_AND_RETURN_VALUE(dst_stream, -1);
       dst_stream =
           ExtentStream::CreateForWrite(std::move(dst_stream), dst_extents);
       TEST_AND_RETURN_VALUE(dst_stream, -1);
+    } else {
+      // The whole target file is written through a mapping of its final size.
+      uint64_t dst_size;
+      TEST_AND_RETURN_VALUE(
+          puffin::GetPuffPatchDestinationSize(
+              puffdiff_delta.data(), puffdiff_delta.size(), &dst_size),
+          -1);
+      // Block devices can not be truncated to that size, so they are written
+      // through a file stream instead. A file that does not exist yet is
+      // created as a regular one.
+      struct stat st;
+      if (stat(FLAGS_dst_file.c_str(), &st) != 0 || S_ISREG(st.st_mode)) {
+        dst_stream = MmapFileStream::OpenForWrite(FLAGS_dst_file, dst_size);
+      } else {
+        dst_stream = FileStream::Open(FLAGS_dst_file, false, true);
+      }
+      TEST_AND_RETURN_VALUE(dst_stream, -1);
     }
     // Apply the patch. Use 50MB cache, it should be enough for most of the
     // operations.
     TEST_AND_RETURN_VALUE(
         puffin::PuffPatch(std::move(src_stream), std::move(dst_stream),
                           puffdiff_delta.data(), puffdiff_delta.size(),
-                          FLAGS_cache_size),  // max_cache_size
+                          FLAGS_cache_size,  // max_cache_size
+                          FLAGS_threads, stats_out),
         -1);
+  } else if (FLAGS_operation == "validate") {
+    // Round-trips each deflate on its own instead of the whole puff stream
+    // like puffhuff, and lists the ones to exclude. Fails if there are any.
+    if (has_src_index) {
+      TEST_AND_RETURN_VALUE(puffin::CheckPuffIndex(src_stream, src_index), -1);
+      src_deflates_bit = src_index.deflates;
+    } else {
+      TEST_AND_RETURN_VALUE(LocateDeflatesBasedOnFileType(
+                                src_stream, FLAGS_src_file,
+                                FLAGS_src_file_type, &src_deflates_byte),
+                            -1);
+    }
+    if (src_deflates_bit.empty()) {
+      TEST_AND_RETURN_VALUE(
+          FindDeflateSubBlocks(src_stream, src_deflates_byte,
+                               &src_deflates_bit, FLAGS_threads),
+          -1);
+    }
+    vector<size_t> bad_deflates;
+    TEST_AND_RETURN_VALUE(
+        puffin::ValidateDeflates(src_stream, src_deflates_bit, &bad_deflates,
+                                 FLAGS_threads, stats_out),
+        -1);
+    vector<BitExtent> bad_extents, good_extents;
+    auto bad_iter = bad_deflates.begin();
+    for (size_t index = 0; index < src_deflates_bit.size(); index++) {
+      if (bad_iter != bad_deflates.end() && *bad_iter == index) {
+        bad_extents.push_back(src_deflates_bit[index]);
+        bad_iter++;
+      } else {
+        good_extents.push_back(src_deflates_bit[index]);
+      }
+    }
+    LOG(INFO) << "deflates: " << src_deflates_bit.size()
+              << " reproduced: " << good_extents.size();
+    LOG(INFO) << "not reproduced: " << puffin::ExtentsToString(bad_extents);
+    // The deflates to pass as --src_deflates_bit or --dst_deflates_bit.
+    LOG(INFO) << "reproduced: " << puffin::ExtentsToString(good_extents);
+    TEST_AND_RETURN_VALUE(bad_extents.empty(), -1);
+  } else if (FLAGS_operation == "index") {
+    TEST_AND_RETURN_VALUE(
+        LocateDeflatesBasedOnFileType(src_stream, FLAGS_src_file,
+                                      FLAGS_src_file_type, &src_deflates_byte),
+        -1);
+    if (src_deflates_bit.empty()) {
+      TEST_AND_RETURN_VALUE(
+          FindDeflateSubBlocks(src_stream, src_deflates_byte,
+                               &src_deflates_bit, FLAGS_threads),
+          -1);
+    }
+    TEST_AND_RETURN_VALUE(puffin::CreatePuffIndex(src_stream, src_deflates_bit,
+                                                  &src_index, FLAGS_threads),
+                          -1);
+    auto index_stream = FileStream::Open(FLAGS_dst_file, false, true);
+    TEST_AND_RETURN_VALUE(index_stream, -1);
+    TEST_AND_RETURN_VALUE(puffin::SavePuffIndex(src_index, index_stream), -1);
+    src_puffs = src_index.puffs;
   }
 
   if (FLAGS_verbose) {
@@ -408,5 +732,8 @@ int main(int argc, char** argv) {
     LOG(INFO) << "src_extents: " << puffin::ExtentsToString(src_extents);
     LOG(INFO) << "dst_extents: " << puffin::ExtentsToString(dst_extents);
   }
+  if (FLAGS_stats) {
+    LOG(INFO) << "stats:\n" << stats.ToString();
+  }
   return 0;
 }
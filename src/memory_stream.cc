@@ -23,15 +23,30 @@ UniqueStreamPtr MemoryStream::CreateForWrite(Buffer* memory) {
   return UniqueStreamPtr(new MemoryStream(nullptr, memory));
 }
 
-MemoryStream::MemoryStream(const Buffer* read_memory, Buffer* write_memory)
+UniqueStreamPtr MemoryStream::CreateForWrite(uint8_t* memory, size_t size) {
+  TEST_AND_RETURN_VALUE(memory != nullptr || size == 0, nullptr);
+  return UniqueStreamPtr(new MemoryStream(nullptr, nullptr, memory, size));
+}
+
+MemoryStream::MemoryStream(const Buffer* read_memory,
+                           Buffer* write_memory,
+                           uint8_t* fixed_memory,
+                           size_t fixed_size)
     : read_memory_(read_memory),
       write_memory_(write_memory),
+      fixed_memory_(fixed_memory),
+      fixed_size_(fixed_size),
       offset_(0),
       open_(true) {}
 
 bool MemoryStream::GetSize(uint64_t* size) const {
-  *size =
-      read_memory_ != nullptr ? read_memory_->size() : write_memory_->size();
+  if (read_memory_ != nullptr) {
+    *size = read_memory_->size();
+  } else if (write_memory_ != nullptr) {
+    *size = write_memory_->size();
+  } else {
+    *size = fixed_size_;
+  }
   return true;
 }
 
@@ -58,10 +73,29 @@ bool MemoryStream::Read(void* buffer, size_t length) {
   return true;
 }
 
+bool MemoryStream::ReadZeroCopy(const uint8_t** data, size_t length) {
+  if (read_memory_ == nullptr) {
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(open_);
+  TEST_AND_RETURN_FALSE(offset_ + length <= read_memory_->size());
+  *data = read_memory_->data() + offset_;
+  offset_ += length;
+  return true;
+}
+
 bool MemoryStream::Write(const void* buffer, size_t length) {
   // TODO(ahassani): Add a maximum size limit to prevent malicious attacks.
   TEST_AND_RETURN_FALSE(open_);
-  TEST_AND_RETURN_FALSE(write_memory_ != nullptr);
+  if (write_memory_ == nullptr) {
+    TEST_AND_RETURN_FALSE(read_memory_ == nullptr);
+    TEST_AND_RETURN_FALSE(offset_ + length <= fixed_size_);
+    if (length > 0) {
+      memcpy(fixed_memory_ + offset_, buffer, length);
+    }
+    offset_ += length;
+    return true;
+  }
   if (offset_ + length > write_memory_->size()) {
     write_memory_->resize(offset_ + length);
   }
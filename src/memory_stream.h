@@ -26,16 +26,28 @@ class MemoryStream : public StreamInterface {
   // the |memory|.
   static UniqueStreamPtr CreateForWrite(Buffer* memory);
 
+  // Creates a stream for writing into the fixed |size| bytes of |memory|,
+  // e.g. a buffer preallocated for the destination of a patch (see
+  // |GetPuffPatchDestinationSize|), as is without ever reallocating it. Writes
+  // past the end of |memory| fail. The stream does not own |memory|.
+  static UniqueStreamPtr CreateForWrite(uint8_t* memory, size_t size);
+
   bool GetSize(uint64_t* size) const override;
   bool GetOffset(uint64_t* offset) const override;
   bool Seek(uint64_t offset) override;
   bool Read(void* buffer, size_t length) override;
+  bool ReadZeroCopy(const uint8_t** data, size_t length) override;
   bool Write(const void* buffer, size_t length) override;
   bool Close() override;
 
  private:
-  // Ctor. Exactly one of the |read_memory| or |write_memory| should be nullptr.
-  MemoryStream(const Buffer* read_memory, Buffer* write_memory);
+  // Ctor. Exactly one of the |read_memory|, |write_memory| or |fixed_memory|
+  // should not be nullptr, except that |fixed_memory| can be null if
+  // |fixed_size| is zero.
+  MemoryStream(const Buffer* read_memory,
+               Buffer* write_memory,
+               uint8_t* fixed_memory = nullptr,
+               size_t fixed_size = 0);
 
   // The memory buffer for reading.
   const Buffer* read_memory_;
@@ -43,6 +55,10 @@ class MemoryStream : public StreamInterface {
   // The memory buffer for writing. It can grow as we write into it.
   Buffer* write_memory_;
 
+  // The fixed-size memory for writing, if neither of the above is set.
+  uint8_t* fixed_memory_;
+  size_t fixed_size_;
+
   // The current offset.
   uint64_t offset_;
 
@@ -0,0 +1,130 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/mmap_file_stream.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/set_errors.h"
+
+namespace puffin {
+
+using std::string;
+
+UniqueStreamPtr MmapFileStream::Open(const string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  TEST_AND_RETURN_VALUE(fd >= 0, nullptr);
+  // The size is found by seeking to the end instead of with |fstat|, which
+  // reports a size of zero for block devices.
+  auto end = lseek(fd, 0, SEEK_END);
+  if (end < 0) {
+    close(fd);
+    LOG(ERROR) << "Failed to get the size of " << path;
+    return nullptr;
+  }
+
+  uint64_t size = end;
+  void* data = nullptr;
+  if (size > 0) {
+    data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  // The mapping keeps its own reference to the file.
+  close(fd);
+  TEST_AND_RETURN_VALUE(data != MAP_FAILED, nullptr);
+  return UniqueStreamPtr(
+      new MmapFileStream(static_cast<uint8_t*>(data), size, false));
+}
+
+UniqueStreamPtr MmapFileStream::OpenForWrite(const string& path,
+                                             uint64_t size) {
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  TEST_AND_RETURN_VALUE(fd >= 0, nullptr);
+  if (ftruncate(fd, size) != 0) {
+    close(fd);
+    LOG(ERROR) << "Failed to set the size of " << path << " to " << size;
+    return nullptr;
+  }
+
+  void* data = nullptr;
+  if (size > 0) {
+    data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  // The mapping keeps its own reference to the file.
+  close(fd);
+  TEST_AND_RETURN_VALUE(data != MAP_FAILED, nullptr);
+  return UniqueStreamPtr(
+      new MmapFileStream(static_cast<uint8_t*>(data), size, true));
+}
+
+MmapFileStream::MmapFileStream(uint8_t* data, uint64_t size, bool writable)
+    : data_(data), size_(size), writable_(writable), offset_(0) {}
+
+MmapFileStream::~MmapFileStream() {
+  Unmap();
+}
+
+bool MmapFileStream::GetSize(uint64_t* size) const {
+  *size = size_;
+  return true;
+}
+
+bool MmapFileStream::GetOffset(uint64_t* offset) const {
+  *offset = offset_;
+  return true;
+}
+
+bool MmapFileStream::Seek(uint64_t offset) {
+  TEST_AND_RETURN_FALSE(offset <= size_);
+  offset_ = offset;
+  return true;
+}
+
+bool MmapFileStream::Read(void* buffer, size_t length) {
+  const uint8_t* data;
+  TEST_AND_RETURN_FALSE(ReadZeroCopy(&data, length));
+  memcpy(buffer, data, length);
+  return true;
+}
+
+bool MmapFileStream::ReadZeroCopy(const uint8_t** data, size_t length) {
+  TEST_AND_RETURN_FALSE(data_ != nullptr || size_ == 0);
+  TEST_AND_RETURN_FALSE(offset_ + length <= size_);
+  *data = data_ + offset_;
+  offset_ += length;
+  return true;
+}
+
+bool MmapFileStream::Write(const void* buffer, size_t length) {
+  if (!writable_) {
+    LOG(ERROR) << "MmapFileStream is not opened for writing.";
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(data_ != nullptr || size_ == 0);
+  TEST_AND_RETURN_FALSE(offset_ + length <= size_);
+  if (length > 0) {
+    memcpy(data_ + offset_, buffer, length);
+  }
+  offset_ += length;
+  return true;
+}
+
+bool MmapFileStream::Close() {
+  return Unmap();
+}
+
+bool MmapFileStream::Unmap() {
+  if (data_ == nullptr) {
+    return true;
+  }
+  auto result = munmap(data_, size_);
+  data_ = nullptr;
+  size_ = 0;
+  offset_ = 0;
+  return result == 0;
+}
+
+}  // namespace puffin
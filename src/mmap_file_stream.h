@@ -0,0 +1,67 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_MMAP_FILE_STREAM_H_
+#define SRC_MMAP_FILE_STREAM_H_
+
+#include <string>
+
+#include "puffin/common.h"
+#include "puffin/stream.h"
+
+namespace puffin {
+
+// A stream over a file that is mapped into memory. Reads are copied from the
+// mapped memory without any system calls and |ReadZeroCopy| returns pointers
+// into the mapping directly. It is read-only unless it is opened with
+// |OpenForWrite|, in which case writes are copied into the mapping directly.
+class MmapFileStream : public StreamInterface {
+ public:
+  ~MmapFileStream() override;
+
+  // Maps the file at |path|, which can also be a block device, into memory and
+  // creates a stream for reading it.
+  static UniqueStreamPtr Open(const std::string& path);
+
+  // Creates (or truncates) the file at |path| with a size of |size|, maps it
+  // into memory and creates a stream for writing it, e.g. the destination of a
+  // patch whose size is known before patching (see
+  // |GetPuffPatchDestinationSize|). The file can not grow, so writes past
+  // |size| fail. The written bytes reach the file when the mapping is closed.
+  static UniqueStreamPtr OpenForWrite(const std::string& path, uint64_t size);
+
+  bool GetSize(uint64_t* size) const override;
+  bool GetOffset(uint64_t* offset) const override;
+  bool Seek(uint64_t offset) override;
+  bool Read(void* buffer, size_t length) override;
+  bool ReadZeroCopy(const uint8_t** data, size_t length) override;
+  bool Write(const void* buffer, size_t length) override;
+  bool Close() override;
+
+ private:
+  // |data| is the mapped memory of size |size|. It can be null if |size| is
+  // zero. It can be written into if |writable|.
+  MmapFileStream(uint8_t* data, uint64_t size, bool writable);
+
+  // Unmaps the memory if it is still mapped.
+  bool Unmap();
+
+  // The mapped memory of the file.
+  uint8_t* data_;
+
+  // The size of the file.
+  uint64_t size_;
+
+  // True if the file is mapped for writing.
+  bool writable_;
+
+  // The current offset.
+  uint64_t offset_;
+
+  DISALLOW_COPY_AND_ASSIGN(MmapFileStream);
+};
+
+}  // namespace puffin
+
+#endif  // SRC_MMAP_FILE_STREAM_H_
@@ -0,0 +1,145 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_PACKED_EXTENTS_H_
+#define SRC_PACKED_EXTENTS_H_
+
+#include <limits>
+#include <vector>
+
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/puffin.pb.h"
+#include "puffin/src/set_errors.h"
+
+namespace puffin {
+
+// Copies |from| into |to| as |metadata::BitExtent| messages, multiplying the
+// offsets and lengths by |coef| (e.g. eight for byte extents).
+template <typename T>
+void CopyVectorToRpf(
+    const T& from,
+    google::protobuf::RepeatedPtrField<metadata::BitExtent>* to,
+    size_t coef) {
+  to->Reserve(from.size());
+  for (const auto& ext : from) {
+    auto tmp = to->Add();
+    tmp->set_offset(ext.offset * coef);
+    tmp->set_length(ext.length * coef);
+  }
+}
+
+// The reverse of |CopyVectorToRpf|.
+template <typename T>
+void CopyRpfToVector(
+    const google::protobuf::RepeatedPtrField<metadata::BitExtent>& from,
+    T* to,
+    size_t coef) {
+  to->clear();
+  to->reserve(from.size());
+  for (const auto& ext : from) {
+    to->emplace_back(ext.offset() / coef, ext.length() / coef);
+  }
+}
+
+// Packs |extents| into the packed repeated field |packed| as pairs of the gap
+// between the end of the previous extent (or zero) and the start of the
+// extent, followed by its length. Both are usually small, so they take one or
+// two bytes as varints instead of a |metadata::BitExtent| message per extent,
+// and they are unpacked without allocating a message per extent. Returns false
+// (leaving |packed| empty) if |extents| are not sorted and non-overlapping.
+template <typename T>
+bool PackExtents(const std::vector<T>& extents,
+                 google::protobuf::RepeatedField<uint64_t>* packed) {
+  packed->Clear();
+  packed->Reserve(extents.size() * 2);
+  uint64_t end = 0;
+  for (const auto& ext : extents) {
+    if (ext.offset < end) {
+      packed->Clear();
+      return false;
+    }
+    packed->AddAlreadyReserved(ext.offset - end);
+    packed->AddAlreadyReserved(ext.length);
+    end = ext.offset + ext.length;
+  }
+  return true;
+}
+
+// Unpacks the extents packed by |PackExtents| from |packed| into |extents|.
+// Fails if |packed| is malformed.
+template <typename T>
+bool UnpackExtents(const google::protobuf::RepeatedField<uint64_t>& packed,
+                   std::vector<T>* extents) {
+  TEST_AND_RETURN_FALSE(packed.size() % 2 == 0);
+  extents->clear();
+  extents->reserve(packed.size() / 2);
+  const auto kMax = std::numeric_limits<uint64_t>::max();
+  uint64_t end = 0;
+  for (int idx = 0; idx < packed.size(); idx += 2) {
+    auto gap = packed.Get(idx);
+    auto length = packed.Get(idx + 1);
+    TEST_AND_RETURN_FALSE(gap <= kMax - end && length <= kMax - end - gap);
+    extents->emplace_back(end + gap, length);
+    end += gap + length;
+  }
+  return true;
+}
+
+// Sets |extents| into |packed| if they can be packed, or into |legacy| (with
+// |coef| like |CopyVectorToRpf|) otherwise.
+template <typename T>
+void SetExtents(
+    const std::vector<T>& extents,
+    size_t coef,
+    google::protobuf::RepeatedField<uint64_t>* packed,
+    google::protobuf::RepeatedPtrField<metadata::BitExtent>* legacy) {
+  legacy->Clear();
+  if (!PackExtents(extents, packed)) {
+    CopyVectorToRpf(extents, legacy, coef);
+  }
+}
+
+// The reverse of |SetExtents|. The extents are taken from |legacy| if they
+// are not packed, like in the metadata written before they were packed.
+template <typename T>
+bool GetExtents(const google::protobuf::RepeatedField<uint64_t>& packed,
+                const google::protobuf::RepeatedPtrField<metadata::BitExtent>&
+                    legacy,
+                size_t coef,
+                std::vector<T>* extents) {
+  if (packed.empty()) {
+    CopyRpfToVector(legacy, extents, coef);
+    return true;
+  }
+  TEST_AND_RETURN_FALSE(legacy.empty());
+  return UnpackExtents(packed, extents);
+}
+
+// Sets the deflates, puffs and puff size of a stream into |info|.
+inline void SetStreamInfo(const std::vector<BitExtent>& deflates,
+                          const std::vector<ByteExtent>& puffs,
+                          uint64_t puff_size,
+                          metadata::StreamInfo* info) {
+  SetExtents(deflates, 1, info->mutable_packed_deflates(),
+             info->mutable_deflates());
+  SetExtents(puffs, 8, info->mutable_packed_puffs(), info->mutable_puffs());
+  info->set_puff_length(puff_size);
+}
+
+// The reverse of |SetStreamInfo|.
+inline bool GetStreamInfo(const metadata::StreamInfo& info,
+                          std::vector<BitExtent>* deflates,
+                          std::vector<ByteExtent>* puffs,
+                          uint64_t* puff_size) {
+  TEST_AND_RETURN_FALSE(GetExtents(info.packed_deflates(), info.deflates(), 1,
+                                   deflates));
+  TEST_AND_RETURN_FALSE(
+      GetExtents(info.packed_puffs(), info.puffs(), 8, puffs));
+  *puff_size = info.puff_length();
+  return true;
+}
+
+}  // namespace puffin
+
+#endif  // SRC_PACKED_EXTENTS_H_
@@ -2,16 +2,28 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <endian.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "gtest/gtest.h"
 
 #include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/diff_engine.h"
 #include "puffin/src/include/puffin/puffdiff.h"
 #include "puffin/src/include/puffin/puffpatch.h"
+#include "puffin/src/include/puffin/stats.h"
 #include "puffin/src/include/puffin/utils.h"
+#include "puffin/src/file_stream.h"
 #include "puffin/src/memory_stream.h"
+#include "puffin/src/mmap_file_stream.h"
+#include "puffin/src/packed_extents.h"
 #include "puffin/src/puffin_stream.h"
 #include "puffin/src/sample_generator.h"
 #include "puffin/src/set_errors.h"
@@ -50,6 +62,22 @@ void TestPatching(const Buffer& src_buf,
   EXPECT_EQ(dst_buf_out, dst_buf);
 }
 
+namespace {
+
+// Sets |dst_buf| to two copies of |kDeflates9| and |dst_deflates| to their
+// deflates, so there is a byte-aligned deflate a second chunk can start at.
+void MakeDoubledDeflates9(Buffer* dst_buf, vector<BitExtent>* dst_deflates) {
+  *dst_buf = kDeflates9;
+  dst_buf->insert(dst_buf->end(), kDeflates9.begin(), kDeflates9.end());
+  *dst_deflates = kSubblockDeflateExtents9;
+  for (const auto& deflate : kSubblockDeflateExtents9) {
+    dst_deflates->emplace_back(deflate.offset + kDeflates9.size() * 8,
+                               deflate.length);
+  }
+}
+
+}  // namespace
+
 TEST(PatchingTest, Patching8To9Test) {
   TestPatching(kDeflates8, kDeflates9, kSubblockDeflateExtents8,
                kSubblockDeflateExtents9, kPatch8To9);
@@ -69,6 +97,516 @@ TEST(PatchingTest, Patching8ToNoDeflateTest) {
                kPatch8ToNoDeflate);
 }
 
+// Patches created before the extents were packed are still applied.
+TEST(PatchingTest, LegacyPatchTest) {
+  Buffer dst_buf_out;
+  ASSERT_TRUE(PuffPatch(MemoryStream::CreateForRead(kDeflates8),
+                        MemoryStream::CreateForWrite(&dst_buf_out),
+                        kLegacyPatch8To9.data(), kLegacyPatch8To9.size()));
+  EXPECT_EQ(dst_buf_out, kDeflates9);
+}
+
+TEST(PatchingTest, PackedExtentsTest) {
+  google::protobuf::RepeatedField<uint64_t> packed;
+  vector<BitExtent> extents;
+  ASSERT_TRUE(PackExtents(kSubblockDeflateExtents8, &packed));
+  EXPECT_EQ(packed.size(), 6);
+  ASSERT_TRUE(UnpackExtents(packed, &extents));
+  EXPECT_EQ(extents, kSubblockDeflateExtents8);
+
+  // Overlapping extents are not packed.
+  EXPECT_FALSE(PackExtents(vector<BitExtent>{{10, 20}, {15, 1}}, &packed));
+  EXPECT_TRUE(packed.empty());
+
+  // An odd number of values or extents past the end of the address space are
+  // malformed.
+  packed.Add(1);
+  EXPECT_FALSE(UnpackExtents(packed, &extents));
+  packed.Add(std::numeric_limits<uint64_t>::max());
+  EXPECT_FALSE(UnpackExtents(packed, &extents));
+}
+
+// Makes sure the patches of |PuffDiffer| which reuses the source and its suffix
+// array are the same as the ones of |PuffDiff|.
+TEST(PatchingTest, PuffDifferTest) {
+  string tmp_path;
+  ASSERT_TRUE(MakeTempFile(&tmp_path, nullptr));
+  ScopedPathUnlinker scoped_unlinker(tmp_path);
+  auto differ =
+      PuffDiffer::Create(MemoryStream::CreateForRead(kDeflates8),
+                         kSubblockDeflateExtents8, tmp_path);
+  ASSERT_TRUE(differ);
+
+  const Buffer kNoDeflate = {11, 22, 33, 44};
+  const vector<const Buffer*> dsts = {&kDeflates9, &kNoDeflate, &kDeflates9};
+  const vector<vector<BitExtent>> dst_deflates = {kSubblockDeflateExtents9, {},
+                                                  kSubblockDeflateExtents9};
+  const vector<const Buffer*> patches = {&kPatch8To9, &kPatch8ToNoDeflate,
+                                         &kPatch8To9};
+  vector<Buffer> patches_out(dsts.size());
+  vector<PuffDiffTarget> targets(dsts.size());
+  vector<std::unique_ptr<ScopedPathUnlinker>> unlinkers;
+  for (size_t i = 0; i < dsts.size(); i++) {
+    targets[i].dst = MemoryStream::CreateForRead(*dsts[i]);
+    targets[i].dst_deflates = dst_deflates[i];
+    ASSERT_TRUE(MakeTempFile(&targets[i].tmp_filepath, nullptr));
+    unlinkers.emplace_back(new ScopedPathUnlinker(targets[i].tmp_filepath));
+    targets[i].patch = MemoryStream::CreateForWrite(&patches_out[i]);
+  }
+  ASSERT_TRUE(differ->Diff(&targets, 2));
+  for (size_t i = 0; i < dsts.size(); i++) {
+    EXPECT_EQ(patches_out[i], *patches[i]);
+  }
+
+  // Once more after the suffix array is built.
+  Buffer patch_out;
+  ASSERT_TRUE(differ->Diff(MemoryStream::CreateForRead(kDeflates8),
+                           kSubblockDeflateExtents8, tmp_path,
+                           MemoryStream::CreateForWrite(&patch_out)));
+  Buffer patch;
+  ASSERT_TRUE(PuffDiff(kDeflates8, kDeflates8, kSubblockDeflateExtents8,
+                       kSubblockDeflateExtents8, tmp_path, &patch));
+  EXPECT_EQ(patch_out, patch);
+}
+
+// Makes sure a destination split into chunks is patched correctly on multiple
+// threads.
+TEST(PatchingTest, PatchingChunksTest) {
+  Buffer dst_buf;
+  vector<BitExtent> dst_deflates;
+  MakeDoubledDeflates9(&dst_buf, &dst_deflates);
+
+  string patch_path;
+  ASSERT_TRUE(MakeTempFile(&patch_path, nullptr));
+  ScopedPathUnlinker scoped_unlinker(patch_path);
+  Buffer patch, chunked_patch;
+  ASSERT_TRUE(PuffDiff(kDeflates8, dst_buf, kSubblockDeflateExtents8,
+                       dst_deflates, patch_path, &patch));
+  PuffDiffOptions options;
+  options.num_chunks = 2;
+  ASSERT_TRUE(PuffDiff(kDeflates8, dst_buf, kSubblockDeflateExtents8,
+                       dst_deflates, patch_path, &chunked_patch, options));
+  EXPECT_NE(patch, chunked_patch);
+
+  for (size_t num_threads : {1, 2}) {
+    Buffer dst_buf_out;
+    ASSERT_TRUE(PuffPatch(MemoryStream::CreateForRead(kDeflates8),
+                          MemoryStream::CreateForWrite(&dst_buf_out),
+                          chunked_patch.data(), chunked_patch.size(), 0,
+                          num_threads));
+    EXPECT_EQ(dst_buf_out, dst_buf);
+  }
+
+  // Feed the patches to |PuffPatcher| in pieces of different sizes.
+  for (const auto* cur_patch : {&patch, &chunked_patch}) {
+    for (size_t num_threads : {1, 2}) {
+      for (size_t piece_size : {1, 7, 1000}) {
+        Buffer dst_buf_out;
+        auto patcher = PuffPatcher::Create(
+            MemoryStream::CreateForRead(kDeflates8),
+            MemoryStream::CreateForWrite(&dst_buf_out), 0, num_threads);
+        ASSERT_TRUE(patcher);
+        for (size_t offset = 0; offset < cur_patch->size();
+             offset += piece_size) {
+          ASSERT_TRUE(patcher->Write(
+              cur_patch->data() + offset,
+              std::min(piece_size, cur_patch->size() - offset)));
+        }
+        ASSERT_TRUE(patcher->Finish());
+        EXPECT_EQ(dst_buf_out, dst_buf);
+      }
+    }
+  }
+
+  // An incomplete patch is not applied.
+  Buffer dst_buf_out;
+  auto patcher =
+      PuffPatcher::Create(MemoryStream::CreateForRead(kDeflates8),
+                          MemoryStream::CreateForWrite(&dst_buf_out));
+  ASSERT_TRUE(patcher->Write(chunked_patch.data(), chunked_patch.size() - 1));
+  EXPECT_FALSE(patcher->Finish());
+}
+
+// Makes sure a deflate of the destination identical to one of the source is
+// copied from the source instead of patched, including when it is a whole
+// chunk.
+TEST(PatchingTest, DeflateCopiesTest) {
+  vector<Buffer> deflates(3);
+  for (size_t idx = 0; idx < deflates.size(); idx++) {
+    Buffer text;
+    uint32_t seed = idx + 1;
+    for (size_t count = 0; count < 4000; count++) {
+      seed = seed * 1103515245 + 12345;
+      text.push_back('a' + (seed >> 16) % 16);
+    }
+    deflates[idx].resize(text.size() * 2);
+    ASSERT_TRUE(sample_generator::CompressToDeflate(
+        text, &deflates[idx], Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY));
+  }
+  // The source has the first and the last deflate, and the destination the
+  // second and the last one, each after a few raw bytes.
+  auto make_stream = [&](const vector<size_t>& ids, Buffer* buf,
+                         vector<BitExtent>* subblocks) {
+    vector<ByteExtent> deflate_extents;
+    for (auto id : ids) {
+      buf->insert(buf->end(), {1, 2, 3});
+      deflate_extents.emplace_back(buf->size(), deflates[id].size());
+      buf->insert(buf->end(), deflates[id].begin(), deflates[id].end());
+    }
+    return FindDeflateSubBlocks(MemoryStream::CreateForRead(*buf),
+                                deflate_extents, subblocks);
+  };
+  Buffer src_buf, dst_buf;
+  vector<BitExtent> src_deflates, dst_deflates;
+  ASSERT_TRUE(make_stream({0, 2}, &src_buf, &src_deflates));
+  ASSERT_TRUE(make_stream({1, 2}, &dst_buf, &dst_deflates));
+
+  string patch_path;
+  ASSERT_TRUE(MakeTempFile(&patch_path, nullptr));
+  ScopedPathUnlinker scoped_unlinker(patch_path);
+  for (size_t num_chunks : {1, 2}) {
+    PuffDiffOptions options;
+    options.num_chunks = num_chunks;
+    Buffer patch;
+    ASSERT_TRUE(PuffDiff(src_buf, dst_buf, src_deflates, dst_deflates,
+                         patch_path, &patch, options));
+    for (size_t num_threads : {1, 2}) {
+      Stats stats;
+      Buffer dst_buf_out;
+      ASSERT_TRUE(PuffPatch(MemoryStream::CreateForRead(src_buf),
+                            MemoryStream::CreateForWrite(&dst_buf_out),
+                            patch.data(), patch.size(), 0, num_threads,
+                            &stats));
+      EXPECT_EQ(dst_buf_out, dst_buf);
+      EXPECT_EQ(stats.deflates_copied, 1u);
+      EXPECT_EQ(stats.copy_bytes, deflates[2].size());
+
+      dst_buf_out.clear();
+      auto patcher = PuffPatcher::Create(
+          MemoryStream::CreateForRead(src_buf),
+          MemoryStream::CreateForWrite(&dst_buf_out), 0, num_threads);
+      ASSERT_TRUE(patcher);
+      for (size_t offset = 0; offset < patch.size(); offset += 7) {
+        ASSERT_TRUE(patcher->Write(patch.data() + offset,
+                                   std::min<size_t>(7, patch.size() - offset)));
+      }
+      ASSERT_TRUE(patcher->Finish());
+      EXPECT_EQ(dst_buf_out, dst_buf);
+    }
+  }
+}
+
+// Makes sure the patches applied with a |PuffPatchContext| reuse the puffs of
+// the source deflates read by the earlier ones.
+TEST(PatchingTest, PuffPatchContextTest) {
+  string patch_path;
+  ASSERT_TRUE(MakeTempFile(&patch_path, nullptr));
+  ScopedPathUnlinker scoped_unlinker(patch_path);
+  Buffer patch;
+  ASSERT_TRUE(PuffDiff(kDeflates8, kDeflates9, kSubblockDeflateExtents8,
+                       kSubblockDeflateExtents9, patch_path, &patch));
+
+  auto context = PuffPatchContext::Create(0, 1024, 4 * 4096);
+  ASSERT_TRUE(context);
+  const vector<ByteExtent> kSrcExtents = {{1000, kDeflates8.size()}};
+  for (auto expect_hits : {false, true}) {
+    Stats stats;
+    Buffer dst_buf_out;
+    ASSERT_TRUE(PuffPatch(context.get(),
+                          MemoryStream::CreateForRead(kDeflates8), kSrcExtents,
+                          MemoryStream::CreateForWrite(&dst_buf_out),
+                          patch.data(), patch.size(), 1, &stats));
+    EXPECT_EQ(dst_buf_out, kDeflates9);
+    EXPECT_EQ(stats.kept_puff_hits > 0, expect_hits);
+  }
+
+  // The source read at another location is puffed again.
+  Stats stats;
+  Buffer dst_buf_out;
+  auto patcher = PuffPatcher::Create(
+      context.get(), MemoryStream::CreateForRead(kDeflates8),
+      {{2000, kDeflates8.size()}}, MemoryStream::CreateForWrite(&dst_buf_out),
+      1, &stats);
+  ASSERT_TRUE(patcher);
+  ASSERT_TRUE(patcher->Write(patch.data(), patch.size()));
+  ASSERT_TRUE(patcher->Finish());
+  EXPECT_EQ(dst_buf_out, kDeflates9);
+  EXPECT_EQ(stats.kept_puff_hits, 0u);
+}
+
+TEST(PatchingTest, PatchCodecsTest) {
+  string patch_path;
+  ASSERT_TRUE(MakeTempFile(&patch_path, nullptr));
+  ScopedPathUnlinker scoped_unlinker(patch_path);
+  for (auto codec :
+       {PatchCodec::kBz2, PatchCodec::kBrotli, PatchCodec::kNone}) {
+    auto engine = CreateBsdiffEngine(codec);
+    ASSERT_TRUE(engine);
+    EXPECT_EQ(engine->codec(), codec);
+    PuffDiffOptions options;
+    options.engine = engine;
+    Buffer patch;
+    ASSERT_TRUE(PuffDiff(kDeflates8, kDeflates9, kSubblockDeflateExtents8,
+                         kSubblockDeflateExtents9, patch_path, &patch,
+                         options));
+
+    Buffer dst_buf_out;
+    ASSERT_TRUE(PuffPatch(MemoryStream::CreateForRead(kDeflates8),
+                          MemoryStream::CreateForWrite(&dst_buf_out),
+                          patch.data(), patch.size()));
+    EXPECT_EQ(dst_buf_out, kDeflates9);
+  }
+  EXPECT_FALSE(CreateBsdiffEngine(static_cast<PatchCodec>(3)));
+}
+
+namespace {
+
+// An engine whose patches are just the destination puff streams.
+class CopyEngine : public DiffEngine {
+ public:
+  CopyEngine() = default;
+  ~CopyEngine() override = default;
+
+  uint32_t id() const override { return 1; }
+
+  bool Diff(const uint8_t* /* src */,
+            size_t /* src_size */,
+            const uint8_t* dst,
+            size_t dst_size,
+            const string& patch_path,
+            std::unique_ptr<SourceIndex>* /* src_index */) const override {
+    auto patch = FileStream::Open(patch_path, false, true);
+    return patch && patch->Write(dst, dst_size) && patch->Close();
+  }
+
+  bool Patch(UniqueStreamPtr /* src */,
+             UniqueStreamPtr dst,
+             const uint8_t* patch,
+             size_t patch_size) const override {
+    return dst->Write(patch, patch_size) && dst->Close();
+  }
+};
+
+}  // namespace
+
+// Makes sure the patches are created and applied with the given engine, and
+// not applied by another engine.
+TEST(PatchingTest, DiffEngineTest) {
+  string patch_path;
+  ASSERT_TRUE(MakeTempFile(&patch_path, nullptr));
+  ScopedPathUnlinker scoped_unlinker(patch_path);
+  auto engine = std::make_shared<CopyEngine>();
+  PuffDiffOptions options;
+  options.engine = engine;
+  Buffer patch;
+  ASSERT_TRUE(PuffDiff(kDeflates8, kDeflates9, kSubblockDeflateExtents8,
+                       kSubblockDeflateExtents9, patch_path, &patch, options));
+
+  Buffer dst_buf_out;
+  ASSERT_TRUE(PuffPatch(MemoryStream::CreateForRead(kDeflates8),
+                        MemoryStream::CreateForWrite(&dst_buf_out),
+                        patch.data(), patch.size(), 0, 1, nullptr, engine));
+  EXPECT_EQ(dst_buf_out, kDeflates9);
+
+  dst_buf_out.clear();
+  EXPECT_FALSE(PuffPatch(MemoryStream::CreateForRead(kDeflates8),
+                         MemoryStream::CreateForWrite(&dst_buf_out),
+                         patch.data(), patch.size()));
+}
+
+// Makes sure the CRC-32s of the destination deflates are added to the patch
+// and checked while patching, also when the destination is split into chunks.
+TEST(PatchingTest, DstCrc32sTest) {
+  Buffer dst_buf;
+  vector<BitExtent> dst_deflates;
+  MakeDoubledDeflates9(&dst_buf, &dst_deflates);
+
+  string patch_path;
+  ASSERT_TRUE(MakeTempFile(&patch_path, nullptr));
+  ScopedPathUnlinker scoped_unlinker(patch_path);
+  for (size_t num_chunks : {1, 2}) {
+    PuffDiffOptions options;
+    options.num_chunks = num_chunks;
+    Buffer patch, patch_with_crc32s;
+    ASSERT_TRUE(PuffDiff(kDeflates8, dst_buf, kSubblockDeflateExtents8,
+                         dst_deflates, patch_path, &patch, options));
+    options.add_dst_crc32s = true;
+    ASSERT_TRUE(PuffDiff(kDeflates8, dst_buf, kSubblockDeflateExtents8,
+                         dst_deflates, patch_path, &patch_with_crc32s,
+                         options));
+    EXPECT_GT(patch_with_crc32s.size(), patch.size() + dst_deflates.size() * 4);
+
+    Buffer dst_buf_out;
+    Stats stats;
+    ASSERT_TRUE(PuffPatch(MemoryStream::CreateForRead(kDeflates8),
+                          MemoryStream::CreateForWrite(&dst_buf_out),
+                          patch_with_crc32s.data(), patch_with_crc32s.size(),
+                          0, 1, &stats));
+    EXPECT_EQ(dst_buf_out, dst_buf);
+    EXPECT_EQ(stats.deflates_verified, dst_deflates.size());
+  }
+}
+
+// Makes sure a patch made with the puffs of |PuffFormat::kV2| patches the same
+// destination as one made with the default ones.
+TEST(PatchingTest, PuffFormatTest) {
+  Buffer dst_buf;
+  vector<BitExtent> dst_deflates;
+  MakeDoubledDeflates9(&dst_buf, &dst_deflates);
+
+  string patch_path;
+  ASSERT_TRUE(MakeTempFile(&patch_path, nullptr));
+  ScopedPathUnlinker scoped_unlinker(patch_path);
+  for (size_t num_chunks : {1, 2}) {
+    PuffDiffOptions options;
+    options.num_chunks = num_chunks;
+    options.add_dst_crc32s = true;
+    options.puff_format = PuffFormat::kV2;
+    Buffer patch;
+    ASSERT_TRUE(PuffDiff(kDeflates8, dst_buf, kSubblockDeflateExtents8,
+                         dst_deflates, patch_path, &patch, options));
+
+    Buffer dst_buf_out;
+    Stats stats;
+    ASSERT_TRUE(PuffPatch(MemoryStream::CreateForRead(kDeflates8),
+                          MemoryStream::CreateForWrite(&dst_buf_out),
+                          patch.data(), patch.size(), 0, 1, &stats));
+    EXPECT_EQ(dst_buf_out, dst_buf);
+    EXPECT_EQ(stats.deflates_verified, dst_deflates.size());
+  }
+}
+
+// Makes sure the destination size is found from the patch header, and the
+// destination is patched into memory preallocated with that size.
+TEST(PatchingTest, PreallocatedDestinationTest) {
+  Buffer dst_buf;
+  vector<BitExtent> dst_deflates;
+  MakeDoubledDeflates9(&dst_buf, &dst_deflates);
+  const Buffer kNoDeflate = {11, 22, 33, 44};
+  struct {
+    const Buffer* dst;
+    vector<BitExtent> dst_deflates;
+    size_t num_chunks;
+  } tests[] = {{&kDeflates9, kSubblockDeflateExtents9, 1},
+               {&kDeflates8, kSubblockDeflateExtents8, 1},
+               {&kNoDeflate, {}, 1},
+               {&dst_buf, dst_deflates, 2}};
+  string patch_path;
+  ASSERT_TRUE(MakeTempFile(&patch_path, nullptr));
+  ScopedPathUnlinker scoped_unlinker(patch_path);
+  for (const auto& test : tests) {
+    PuffDiffOptions options;
+    options.num_chunks = test.num_chunks;
+    Buffer patch;
+    ASSERT_TRUE(PuffDiff(kDeflates8, *test.dst, kSubblockDeflateExtents8,
+                         test.dst_deflates, patch_path, &patch, options));
+    uint64_t dst_size;
+    ASSERT_TRUE(GetPuffPatchDestinationSize(patch.data(), patch.size(),
+                                            &dst_size));
+    EXPECT_EQ(dst_size, test.dst->size());
+    // Only the header is needed.
+    uint32_t header_size;
+    memcpy(&header_size, patch.data() + kMagicLength, sizeof(header_size));
+    auto header_end = kMagicLength + sizeof(header_size) + be32toh(header_size);
+    ASSERT_TRUE(GetPuffPatchDestinationSize(patch.data(), header_end,
+                                            &dst_size));
+    EXPECT_EQ(dst_size, test.dst->size());
+    EXPECT_FALSE(GetPuffPatchDestinationSize(patch.data(), header_end - 1,
+                                             &dst_size));
+
+    Buffer dst_buf_out(dst_size);
+    for (size_t num_threads : {1, 2}) {
+      ASSERT_TRUE(PuffPatch(
+          MemoryStream::CreateForRead(kDeflates8),
+          MemoryStream::CreateForWrite(dst_buf_out.data(), dst_buf_out.size()),
+          patch.data(), patch.size(), 0, num_threads));
+      EXPECT_EQ(dst_buf_out, *test.dst);
+    }
+    // The destination does not fit in less memory.
+    if (dst_size > 0) {
+      EXPECT_FALSE(PuffPatch(
+          MemoryStream::CreateForRead(kDeflates8),
+          MemoryStream::CreateForWrite(dst_buf_out.data(), dst_size - 1),
+          patch.data(), patch.size()));
+    }
+  }
+}
+
+// Makes sure patching into an existing file larger than the destination
+// leaves only the destination in it.
+TEST(PatchingTest, PatchIntoLargerFileTest) {
+  string patch_path, dst_path;
+  ASSERT_TRUE(MakeTempFile(&patch_path, nullptr));
+  ScopedPathUnlinker patch_unlinker(patch_path);
+  ASSERT_TRUE(MakeTempFile(&dst_path, nullptr));
+  ScopedPathUnlinker dst_unlinker(dst_path);
+
+  Buffer patch;
+  ASSERT_TRUE(PuffDiff(kDeflates8, kDeflates9, kSubblockDeflateExtents8,
+                       kSubblockDeflateExtents9, patch_path, &patch));
+  uint64_t dst_size;
+  ASSERT_TRUE(
+      GetPuffPatchDestinationSize(patch.data(), patch.size(), &dst_size));
+
+  auto stream = FileStream::Open(dst_path, false, true);
+  ASSERT_TRUE(stream);
+  Buffer garbage(kDeflates9.size() * 2, 0xAA);
+  ASSERT_TRUE(stream->Write(garbage.data(), garbage.size()));
+  ASSERT_TRUE(stream->Close());
+
+  ASSERT_TRUE(PuffPatch(MemoryStream::CreateForRead(kDeflates8),
+                        MmapFileStream::OpenForWrite(dst_path, dst_size),
+                        patch.data(), patch.size()));
+  stream = FileStream::Open(dst_path, true, false);
+  ASSERT_TRUE(stream);
+  uint64_t size;
+  ASSERT_TRUE(stream->GetSize(&size));
+  Buffer dst_buf(size);
+  ASSERT_TRUE(stream->Read(dst_buf.data(), dst_buf.size()));
+  EXPECT_EQ(dst_buf, kDeflates9);
+}
+
+// Makes sure the source puff cache of patching is simulated for each cache
+// size, and puffs less the larger the cache is.
+TEST(PatchingTest, SimulatePuffCacheTest) {
+  string patch_path;
+  ASSERT_TRUE(MakeTempFile(&patch_path, nullptr));
+  ScopedPathUnlinker scoped_unlinker(patch_path);
+  for (size_t num_chunks : {1, 2}) {
+    PuffDiffOptions options;
+    options.num_chunks = num_chunks;
+    Buffer patch;
+    ASSERT_TRUE(PuffDiff(kDeflates8, kDeflates9, kSubblockDeflateExtents8,
+                         kSubblockDeflateExtents9, patch_path, &patch,
+                         options));
+    vector<uint64_t> cache_sizes = {0, 4096, 3 * 4096};
+    vector<PuffCacheSimulation> simulations;
+    ASSERT_TRUE(SimulatePuffCache(patch.data(), patch.size(), cache_sizes,
+                                  &simulations));
+    ASSERT_EQ(simulations.size(), cache_sizes.size());
+    for (size_t idx = 0; idx < simulations.size(); idx++) {
+      const auto& simulation = simulations[idx];
+      EXPECT_EQ(simulation.max_cache_size, cache_sizes[idx]);
+      EXPECT_GT(simulation.puff_reads, 0u);
+      EXPECT_EQ(simulation.puff_reads, simulations[0].puff_reads);
+      EXPECT_LE(simulation.repuff_bytes, simulation.puff_bytes);
+      if (idx > 0) {
+        EXPECT_LE(simulation.puff_bytes, simulations[idx - 1].puff_bytes);
+      }
+    }
+    // Nothing is cached without a cache, and all the source puffs fit in the
+    // largest one, but each chunk has its own.
+    EXPECT_EQ(simulations[0].cache_hits, 0u);
+    if (num_chunks == 1) {
+      EXPECT_EQ(simulations.back().repuff_bytes, 0u);
+    }
+  }
+
+  vector<PuffCacheSimulation> simulations;
+  EXPECT_FALSE(SimulatePuffCache(kDeflates8.data(), kDeflates8.size(), {0},
+                                 &simulations));
+}
+
 // TODO(ahassani): add tests for:
 //   TestPatchingEmptyTo9
 //   TestPatchingNoDeflateTo9
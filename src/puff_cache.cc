@@ -0,0 +1,63 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/puff_cache.h"
+
+#include <cstring>
+#include <utility>
+
+namespace puffin {
+
+PuffCache::PuffCache(uint64_t max_size) : max_size_(max_size), cur_size_(0) {}
+
+bool PuffCache::Get(const BitExtent& deflate,
+                    uint8_t* puff,
+                    uint64_t puff_length,
+                    PuffFormat format) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto iter = cache_index_.find(Key(deflate.offset, deflate.length, format));
+  if (iter == cache_index_.end() ||
+      iter->second->second.size() != puff_length) {
+    return false;
+  }
+  // Move it to the front as the most recently used one.
+  caches_.splice(caches_.begin(), caches_, iter->second);
+  memcpy(puff, caches_.front().second.data(), puff_length);
+  return true;
+}
+
+void PuffCache::Put(const BitExtent& deflate,
+                    const uint8_t* puff,
+                    uint64_t puff_length,
+                    PuffFormat format) {
+  if (puff_length > max_size_) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  Key key(deflate.offset, deflate.length, format);
+  if (cache_index_.find(key) != cache_index_.end()) {
+    return;
+  }
+  // Evict the least recently used puffs until the new one fits, reusing the
+  // buffer of the last one evicted for it.
+  Buffer buffer;
+  while (cur_size_ + puff_length > max_size_) {
+    auto& victim = caches_.back();
+    cur_size_ -= victim.second.size();
+    cache_index_.erase(victim.first);
+    buffer = std::move(victim.second);
+    caches_.pop_back();
+  }
+  buffer.assign(puff, puff + puff_length);
+  caches_.emplace_front(key, std::move(buffer));
+  cache_index_[key] = caches_.begin();
+  cur_size_ += puff_length;
+}
+
+uint64_t PuffCache::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return cur_size_;
+}
+
+}  // namespace puffin
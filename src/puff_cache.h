@@ -0,0 +1,72 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_PUFF_CACHE_H_
+#define SRC_PUFF_CACHE_H_
+
+#include <list>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <utility>
+
+#include "puffin/src/include/puffin/common.h"
+
+namespace puffin {
+
+// A cache of puffs keyed by the location of their deflates in a source that
+// does not change, e.g. a partition read by many patch operations, so the
+// streams of later operations find the deflates puffed by earlier ones. Unlike
+// the puff caches of |PuffinStream|, it outlives the streams, and the puffs are
+// copied in and out of it. The least recently used puffs are evicted when it is
+// full. The puffs of the same deflate in different |PuffFormat|s are kept
+// separately. It is thread safe.
+class PuffCache {
+ public:
+  // |max_size| IN  The maximum total size (in bytes) of the puffs kept.
+  explicit PuffCache(uint64_t max_size);
+  ~PuffCache() = default;
+
+  // Copies the puff of the deflate at |deflate| in the source into |puff| if
+  // it is cached in |format| with the size |puff_length|.
+  bool Get(const BitExtent& deflate,
+           uint8_t* puff,
+           uint64_t puff_length,
+           PuffFormat format = PuffFormat::kV1);
+
+  // Keeps a copy of the |puff_length| bytes of |puff|, the puff of the deflate
+  // at |deflate| in the source in |format|. Puffs larger than |max_size()| are
+  // not kept.
+  void Put(const BitExtent& deflate,
+           const uint8_t* puff,
+           uint64_t puff_length,
+           PuffFormat format = PuffFormat::kV1);
+
+  // Returns the total size of the puffs kept.
+  uint64_t size() const;
+
+  uint64_t max_size() const { return max_size_; }
+
+ private:
+  // The offset and length of a deflate, and the format of its puff.
+  using Key = std::tuple<uint64_t, uint64_t, PuffFormat>;
+  // The puffs ordered from the most recently used to the least recently used
+  // one, with their keys.
+  using CacheList = std::list<std::pair<Key, Buffer>>;
+
+  const uint64_t max_size_;
+
+  // Guards all the members below.
+  mutable std::mutex mutex_;
+  uint64_t cur_size_;
+  CacheList caches_;
+  // The location of each puff in |caches_| indexed by its key.
+  std::map<Key, CacheList::iterator> cache_index_;
+
+  DISALLOW_COPY_AND_ASSIGN(PuffCache);
+};
+
+}  // namespace puffin
+
+#endif  // SRC_PUFF_CACHE_H_
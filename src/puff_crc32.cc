@@ -0,0 +1,191 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/puff_crc32.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "puffin/src/puff_data.h"
+#include "puffin/src/set_errors.h"
+
+namespace puffin {
+
+namespace {
+// The maximum distance of a length/distance pair, which is the size of the
+// data kept in the window.
+constexpr size_t kMaxDistance = 32768;
+
+// The item header of a length/distance pair that is an end of block.
+constexpr uint8_t kEndOfBlockLength = 259 - 127 - 3;
+
+// The maximum size of the metadata of a block (see |PuffData|).
+constexpr size_t kMaxBlockMetadataSize = 1 + 3 + 286 + 30 + 19;
+
+inline uint16_t ReadUint16(const uint8_t* data) {
+  return (data[0] << 8) | data[1];
+}
+}  // namespace
+
+PuffCrc32::PuffCrc32(PuffFormat format)
+    : format_(format), window_(2 * kMaxDistance) {
+  Start();
+}
+
+void PuffCrc32::Start(bool keep_history) {
+  state_ = State::kBlockMetadataSize;
+  bytes_left_ = 0;
+  pending_size_ = 0;
+  if (!keep_history) {
+    window_pos_ = 0;
+    data_size_ = 0;
+  }
+  crc_pos_ = window_pos_;
+  crc_ = crc32(0L, Z_NULL, 0);
+  missing_history_ = false;
+}
+
+bool PuffCrc32::Write(const uint8_t* puff, size_t length) {
+  while (length > 0) {
+    if (state_ == State::kBlockMetadata || state_ == State::kLiterals) {
+      auto count = std::min<uint64_t>(length, bytes_left_);
+      if (state_ == State::kLiterals) {
+        AddLiterals(puff, count);
+      }
+      puff += count;
+      length -= count;
+      bytes_left_ -= count;
+      if (bytes_left_ == 0) {
+        state_ = State::kItem;
+      }
+      continue;
+    }
+
+    if (pending_size_ == 0) {
+      auto item_size = GetItemSize(puff, length);
+      if (item_size != 0 && item_size <= length) {
+        TEST_AND_RETURN_FALSE(ProcessItem(puff, item_size));
+        puff += item_size;
+        length -= item_size;
+        continue;
+      }
+    }
+    // The item is split between this write and the next ones.
+    pending_[pending_size_++] = *puff++;
+    length--;
+    auto item_size = GetItemSize(pending_, pending_size_);
+    if (item_size != 0 && item_size == pending_size_) {
+      pending_size_ = 0;
+      TEST_AND_RETURN_FALSE(ProcessItem(pending_, item_size));
+    }
+  }
+  return true;
+}
+
+bool PuffCrc32::Finish(uint32_t* crc) {
+  TEST_AND_RETURN_FALSE(state_ == State::kBlockMetadataSize &&
+                        pending_size_ == 0);
+  *crc = crc32(crc_, window_.data() + crc_pos_, window_pos_ - crc_pos_);
+  crc_ = *crc;
+  crc_pos_ = window_pos_;
+  return true;
+}
+
+size_t PuffCrc32::GetItemSize(const uint8_t* data, size_t length) const {
+  if (state_ == State::kBlockMetadataSize) {
+    return PeekPuffValueSize(format_, data[0]);
+  }
+  auto low_bits = data[0] & 0x7F;
+  if (data[0] & kLenDistHeader) {
+    size_t header_size = 1;
+    if (low_bits == 127) {
+      if (length < 2) {
+        return 0;
+      }
+      if (data[1] == kEndOfBlockLength) {
+        return 2;
+      }
+      header_size = 2;
+    }
+    if (length <= header_size) {
+      return 0;
+    }
+    return header_size + PeekPuffValueSize(format_, data[header_size]);
+  }
+  return low_bits < 127 ? 1 : 3;
+}
+
+bool PuffCrc32::ProcessItem(const uint8_t* data, size_t /* item_size */) {
+  if (state_ == State::kBlockMetadataSize) {
+    bytes_left_ = ReadPuffValue(format_, data) + 1;
+    TEST_AND_RETURN_FALSE(bytes_left_ <= kMaxBlockMetadataSize);
+    state_ = State::kBlockMetadata;
+    return true;
+  }
+  auto low_bits = data[0] & 0x7F;
+  if (data[0] & kLenDistHeader) {
+    size_t length = (low_bits < 127 ? low_bits : data[1] + 127) + 3;
+    if (length == 259) {
+      state_ = State::kBlockMetadataSize;
+      return true;
+    }
+    TEST_AND_RETURN_FALSE(length <= 258);
+    // The distances are zero-based in the puff stream.
+    size_t distance = ReadPuffValue(format_, data + (low_bits < 127 ? 1 : 2));
+    distance++;
+    return AddCopy(length, distance);
+  }
+  bytes_left_ = (low_bits < 127 ? low_bits : ReadUint16(data + 1) + 127) + 1;
+  state_ = State::kLiterals;
+  return true;
+}
+
+void PuffCrc32::AddLiterals(const uint8_t* data, size_t length) {
+  while (length > 0) {
+    auto count = std::min(length, kMaxDistance);
+    MakeRoom(count);
+    memcpy(window_.data() + window_pos_, data, count);
+    window_pos_ += count;
+    data_size_ += count;
+    data += count;
+    length -= count;
+  }
+}
+
+bool PuffCrc32::AddCopy(size_t length, size_t distance) {
+  TEST_AND_RETURN_FALSE(distance <= kMaxDistance);
+  MakeRoom(length);
+  auto dst = window_.data() + window_pos_;
+  auto src = dst - distance;
+  if (distance > std::min<uint64_t>(data_size_, window_pos_)) {
+    // The data it copies was not written, so put anything in its place.
+    missing_history_ = true;
+    memset(dst, 0, length);
+  } else if (distance >= length) {
+    memcpy(dst, src, length);
+  } else {
+    // The copy overlaps the bytes it produces.
+    for (size_t idx = 0; idx < length; idx++) {
+      dst[idx] = src[idx];
+    }
+  }
+  window_pos_ += length;
+  data_size_ += length;
+  return true;
+}
+
+void PuffCrc32::MakeRoom(size_t length) {
+  if (window_pos_ + length <= window_.size()) {
+    return;
+  }
+  crc_ = crc32(crc_, window_.data() + crc_pos_, window_pos_ - crc_pos_);
+  auto keep = std::min(window_pos_, kMaxDistance);
+  memmove(window_.data(), window_.data() + window_pos_ - keep, keep);
+  window_pos_ = keep;
+  crc_pos_ = keep;
+}
+
+}  // namespace puffin
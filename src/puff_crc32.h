@@ -0,0 +1,99 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_PUFF_CRC32_H_
+#define SRC_PUFF_CRC32_H_
+
+#include <cstddef>
+
+#include "puffin/src/include/puffin/common.h"
+
+namespace puffin {
+
+// Computes the CRC-32 of the uncompressed data of a deflate from its puff, the
+// same checksum a gzip member or a zip entry has for it. The puff is consumed
+// piece by piece as it arrives, and the literals and the copies of the
+// length/distance pairs are expanded into a window of the last 32 KiB of the
+// data the checksum is computed over (by zlib) in large runs.
+//
+// The deflate can be a subblock of a deflate stream, whose copies reach back
+// into the data of the subblocks before it. Those are available if they were
+// written before it (see |Start|), otherwise |missing_history| is set.
+class PuffCrc32 {
+ public:
+  // |format| is the encoding of the puffs written.
+  explicit PuffCrc32(PuffFormat format = PuffFormat::kV1);
+  ~PuffCrc32() = default;
+
+  // Starts over for the puff of another deflate. If |keep_history|, the data of
+  // the deflates written before stays available to its copies, which is the
+  // case for the next subblock of the same deflate stream.
+  void Start(bool keep_history = false);
+
+  // Consumes the next |length| bytes of the puff in |puff|. Fails if they are
+  // not a valid continuation of the puff.
+  bool Write(const uint8_t* puff, size_t length);
+
+  // Returns the CRC-32 of the data of the whole puff written since |Start| in
+  // |crc|. Fails if the puff ends in the middle of a block.
+  bool Finish(uint32_t* crc);
+
+  // True if a copy of the puff written since |Start| reached back before the
+  // data available, so the CRC-32 is not the one of its data.
+  bool missing_history() const { return missing_history_; }
+
+ private:
+  // The kind of data expected next in the puff.
+  enum class State {
+    // The size of the metadata of a block.
+    kBlockMetadataSize,
+    // |bytes_left_| more bytes of the metadata of a block.
+    kBlockMetadata,
+    // The header of the literals, a length/distance pair or an end of block.
+    kItem,
+    // |bytes_left_| more literals.
+    kLiterals,
+  };
+
+  // Returns the size of the next item (other than its literals) starting with
+  // the |length| bytes of |data|, or zero if |data| is too short to tell.
+  size_t GetItemSize(const uint8_t* data, size_t length) const;
+
+  // Processes the item of size |item_size| in |data|.
+  bool ProcessItem(const uint8_t* data, size_t item_size);
+
+  // Adds the |length| bytes in |data| to the uncompressed data.
+  void AddLiterals(const uint8_t* data, size_t length);
+
+  // Adds the |length| bytes |distance| bytes back to the uncompressed data.
+  bool AddCopy(size_t length, size_t distance);
+
+  // Makes room for at least |length| more bytes at the end of |window_|,
+  // keeping its last 32 KiB after the checksum is computed over the rest.
+  void MakeRoom(size_t length);
+
+  PuffFormat format_;
+
+  State state_;
+  uint64_t bytes_left_;
+  // The first bytes of an item that is split between two |Write|s.
+  uint8_t pending_[4];
+  size_t pending_size_;
+
+  // The uncompressed data not dropped yet. The checksum is computed over the
+  // bytes up to |crc_pos_| so far, and |window_pos_| is the end of the data.
+  Buffer window_;
+  size_t window_pos_;
+  size_t crc_pos_;
+  uint32_t crc_;
+  // The size of the uncompressed data so far, including the history.
+  uint64_t data_size_;
+  bool missing_history_;
+
+  DISALLOW_COPY_AND_ASSIGN(PuffCrc32);
+};
+
+}  // namespace puffin
+
+#endif  // SRC_PUFF_CRC32_H_
@@ -7,7 +7,8 @@
 
 #include <cstddef>
 #include <cstdint>
-#include <functional>
+
+#include "puffin/src/include/puffin/common.h"
 
 namespace puffin {
 
@@ -34,14 +35,13 @@ struct PuffData {
     kEndOfBlock,
   } type;
 
-  // A function that once set, can read raw bytes from whatever its parameters
-  // are set. This function reads |count| bytes from |buffer| and advances its
-  // read offset forward. The next call to this function will start reading
-  // after the last read byte. It returns false if it cannot read or the |count|
-  // is larger than what is availabe in the buffer.
+  // A pointer to the |length| raw bytes of the literals. It points directly
+  // into the buffer of whoever produced this data (e.g. the deflate or the puff
+  // buffer) so the literals can be copied with one |memcpy|. It is only valid
+  // as long as that buffer is.
   // Used by:
   // PuffData::Type::kLiterals
-  std::function<bool(uint8_t* buffer, size_t count)> read_fn;
+  const uint8_t* literals;
 
   // Used by:
   // PuffData::Type::kBlockMetadata
@@ -74,6 +74,52 @@ struct PuffData {
 constexpr uint8_t kLiteralsHeader = 0x00;
 constexpr uint8_t kLenDistHeader = 0x80;
 
+// The maximum number of literals in a series of literals in the puff stream.
+constexpr size_t kLiteralsMaxLength = (1 << 16) + 127;  // 65663
+
+// The zero-based distances of the length/distance pairs and the sizes of the
+// block metadata (minus one) are less than 32768. |PuffFormat::kV1| writes them
+// in two bytes in big-endian. |PuffFormat::kV2| writes the ones less than 128
+// in one byte, and the others in two bytes in big-endian with the most
+// significant bit set.
+
+// Returns the size of |value| in the puff stream of |format|.
+inline size_t GetPuffValueSize(PuffFormat format, size_t value) {
+  return format == PuffFormat::kV1 || value > 127 ? 2 : 1;
+}
+
+// Returns the size of the value starting with |first_byte| in the puff stream
+// of |format|.
+inline size_t PeekPuffValueSize(PuffFormat format, uint8_t first_byte) {
+  return format == PuffFormat::kV1 || (first_byte & 0x80) ? 2 : 1;
+}
+
+// Writes |value| into |buffer| and returns its size.
+inline size_t WritePuffValue(PuffFormat format, size_t value, uint8_t* buffer) {
+  if (GetPuffValueSize(format, value) == 1) {
+    buffer[0] = static_cast<uint8_t>(value);
+    return 1;
+  }
+  buffer[0] = static_cast<uint8_t>(value >> 8);
+  if (format != PuffFormat::kV1) {
+    buffer[0] |= 0x80;
+  }
+  buffer[1] = static_cast<uint8_t>(value);
+  return 2;
+}
+
+// Reads the value at the start of |buffer|, which has at least as many bytes as
+// |PeekPuffValueSize| returns.
+inline size_t ReadPuffValue(PuffFormat format, const uint8_t* buffer) {
+  if (format == PuffFormat::kV1) {
+    return (buffer[0] << 8) | buffer[1];
+  }
+  if (buffer[0] & 0x80) {
+    return ((buffer[0] & 0x7F) << 8) | buffer[1];
+  }
+  return buffer[0];
+}
+
 }  // namespace puffin
 
 #endif  // SRC_PUFF_DATA_H_
@@ -0,0 +1,159 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/include/puffin/puff_index.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/utils.h"
+#include "puffin/src/mmap_file_stream.h"
+#include "puffin/src/packed_extents.h"
+#include "puffin/src/puffin.pb.h"
+#include "puffin/src/set_errors.h"
+
+namespace puffin {
+
+using std::string;
+using std::vector;
+
+namespace {
+
+// Structure of a puff index
+// +-------+-----------------------+
+// |P|U|F|X| metadata::PuffIndex   |
+// +-------+-----------------------+
+const char kIndexMagic[] = "PUFX";
+const size_t kIndexMagicLength = 4;
+// Version two packs the extents (see |PackExtents|).
+const int32_t kIndexVersion = 2;
+
+// The size of the chunks the file is read in for calculating its CRC-32.
+constexpr size_t kCrcBufferSize = 1024 * 1024;  // 1 MiB
+
+// Calculates the size and CRC-32 of the whole |src|.
+bool CalculateCrc32(const UniqueStreamPtr& src,
+                    uint64_t* size,
+                    uint32_t* crc) {
+  TEST_AND_RETURN_FALSE(src->GetSize(size));
+  TEST_AND_RETURN_FALSE(src->Seek(0));
+  Buffer buffer;
+  uLong result = crc32(0L, Z_NULL, 0);
+  for (uint64_t offset = 0; offset < *size;) {
+    auto count = std::min<uint64_t>(*size - offset, kCrcBufferSize);
+    const uint8_t* data;
+    if (!src->ReadZeroCopy(&data, count)) {
+      buffer.resize(count);
+      TEST_AND_RETURN_FALSE(src->Read(buffer.data(), count));
+      data = buffer.data();
+    }
+    result = crc32(result, data, count);
+    offset += count;
+  }
+  *crc = result;
+  return src->Seek(0);
+}
+
+}  // namespace
+
+bool CreatePuffIndex(const UniqueStreamPtr& src,
+                     const vector<BitExtent>& deflates,
+                     PuffIndex* index,
+                     size_t num_threads) {
+  index->deflates = deflates;
+  index->puffs.clear();
+  index->subblock_deflates.clear();
+  index->subblock_puffs.clear();
+  TEST_AND_RETURN_FALSE(FindPuffLocations(
+      src, deflates, &index->puffs, &index->puff_size,
+      &index->subblock_deflates, &index->subblock_puffs, num_threads));
+  TEST_AND_RETURN_FALSE(
+      CalculateCrc32(src, &index->file_size, &index->file_crc32));
+  return true;
+}
+
+bool CheckPuffIndex(const UniqueStreamPtr& src, const PuffIndex& index) {
+  uint64_t size;
+  TEST_AND_RETURN_FALSE(src->GetSize(&size));
+  if (size != index.file_size) {
+    LOG(ERROR) << "The index is for a file of size " << index.file_size
+               << ", but the file has size " << size;
+    return false;
+  }
+  uint32_t crc;
+  TEST_AND_RETURN_FALSE(CalculateCrc32(src, &size, &crc));
+  if (crc != index.file_crc32) {
+    LOG(ERROR) << "The index is for a different file with the same size.";
+    return false;
+  }
+  return true;
+}
+
+bool SavePuffIndex(const PuffIndex& index,
+                   const UniqueStreamPtr& index_stream) {
+  metadata::PuffIndex pb_index;
+  pb_index.set_version(kIndexVersion);
+  pb_index.set_file_size(index.file_size);
+  pb_index.set_file_crc32(index.file_crc32);
+  SetStreamInfo(index.deflates, index.puffs, index.puff_size,
+                pb_index.mutable_stream());
+  SetExtents(index.subblock_deflates, 1,
+             pb_index.mutable_packed_subblock_deflates(),
+             pb_index.mutable_subblock_deflates());
+  SetExtents(index.subblock_puffs, 8, pb_index.mutable_packed_subblock_puffs(),
+             pb_index.mutable_subblock_puffs());
+
+  string data;
+  TEST_AND_RETURN_FALSE(pb_index.SerializeToString(&data));
+  TEST_AND_RETURN_FALSE(index_stream->Write(kIndexMagic, kIndexMagicLength));
+  TEST_AND_RETURN_FALSE(index_stream->Write(data.data(), data.size()));
+  return true;
+}
+
+bool LoadPuffIndex(const uint8_t* data, size_t size, PuffIndex* index) {
+  TEST_AND_RETURN_FALSE(size >= kIndexMagicLength);
+  if (memcmp(data, kIndexMagic, kIndexMagicLength) != 0) {
+    LOG(ERROR) << "Magic number for the puff index is incorrect.";
+    return false;
+  }
+  metadata::PuffIndex pb_index;
+  TEST_AND_RETURN_FALSE(pb_index.ParseFromArray(data + kIndexMagicLength,
+                                                size - kIndexMagicLength));
+  if (pb_index.version() < 1 || pb_index.version() > kIndexVersion) {
+    LOG(ERROR) << "Unsupported puff index version: " << pb_index.version();
+    return false;
+  }
+  index->file_size = pb_index.file_size();
+  index->file_crc32 = pb_index.file_crc32();
+  TEST_AND_RETURN_FALSE(GetStreamInfo(pb_index.stream(), &index->deflates,
+                                      &index->puffs, &index->puff_size));
+  TEST_AND_RETURN_FALSE(GetExtents(pb_index.packed_subblock_deflates(),
+                                   pb_index.subblock_deflates(), 1,
+                                   &index->subblock_deflates));
+  TEST_AND_RETURN_FALSE(GetExtents(pb_index.packed_subblock_puffs(),
+                                   pb_index.subblock_puffs(), 8,
+                                   &index->subblock_puffs));
+  TEST_AND_RETURN_FALSE(index->deflates.size() == index->puffs.size());
+  TEST_AND_RETURN_FALSE(index->subblock_deflates.size() ==
+                        index->subblock_puffs.size());
+  return true;
+}
+
+bool LoadPuffIndex(const string& path, PuffIndex* index) {
+  auto index_stream = MmapFileStream::Open(path);
+  TEST_AND_RETURN_FALSE(index_stream);
+  uint64_t size;
+  TEST_AND_RETURN_FALSE(index_stream->GetSize(&size));
+  const uint8_t* data;
+  TEST_AND_RETURN_FALSE(index_stream->ReadZeroCopy(&data, size));
+  return LoadPuffIndex(data, size, index);
+}
+
+}  // namespace puffin
@@ -2,6 +2,9 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <algorithm>
+#include <vector>
+
 #include "gtest/gtest.h"
 
 #include "puffin/src/include/puffin/errors.h"
@@ -29,12 +32,10 @@ void TestLiteralLength(size_t length) {
   ASSERT_EQ(pd.length, 1);
 
   // We insert |length| bytes.
+  Buffer literals(length, 10);
   pd.type = PuffData::Type::kLiterals;
   pd.length = length;
-  pd.read_fn = [](uint8_t* buffer, size_t count) {
-    std::fill(buffer, buffer + count, 10);
-    return true;
-  };
+  pd.literals = literals.data();
   ASSERT_TRUE(pw.Insert(pd, &error));
   ASSERT_TRUE(pw.Flush(&error));
 
@@ -52,9 +53,7 @@ void TestLiteralLength(size_t length) {
     ASSERT_EQ(pd.type, PuffData::Type::kLiterals);
     ASSERT_EQ(pd.length, length);
     for (size_t i = 0; i < pd.length; i++) {
-      uint8_t byte;
-      pd.read_fn(&byte, 1);
-      EXPECT_EQ(byte, 10);
+      EXPECT_EQ(pd.literals[i], 10);
     }
   }
 }
@@ -158,22 +157,11 @@ TEST(PuffIOTest, InputOutputTest) {
   uint8_t tmp[] = {1, 2, 100};
   {
     PuffData pd;
-    size_t index = 0;
     pd.type = PuffData::Type::kLiterals;
     pd.length = 3;
-    pd.read_fn = [&tmp, &index](uint8_t* buffer, size_t count) {
-      if (count > 3 - index)
-        return false;
-      if (buffer != nullptr) {
-        memcpy(buffer, &tmp[index], count);
-      }
-      index += count;
-      return true;
-    };
+    pd.literals = tmp;
     ASSERT_TRUE(pw.Insert(pd, &error));
     ASSERT_TRUE(pw.Flush(&error));
-    // We have to refresh the read_fn function for the second insert.
-    index = 0;
     ASSERT_TRUE(epw.Insert(pd, &error));
     ASSERT_TRUE(epw.Flush(&error));
   }
@@ -187,24 +175,19 @@ TEST(PuffIOTest, InputOutputTest) {
     ASSERT_TRUE(epw.Flush(&error));
   }
 
-  uint8_t tmp3[3];
   {
     PuffData pd;
     ASSERT_TRUE(pr.GetNext(&pd, &error));
     ASSERT_EQ(pd.type, PuffData::Type::kLiterals);
     ASSERT_EQ(pd.length, 3);
-    ASSERT_TRUE(pd.read_fn(tmp3, 3));
-    ASSERT_FALSE(pd.read_fn(tmp3, 1));
-    ASSERT_EQ(0, memcmp(tmp3, tmp, 3));
+    ASSERT_EQ(0, memcmp(pd.literals, tmp, 3));
   }
   {
     PuffData pd;
     ASSERT_TRUE(pr.GetNext(&pd, &error));
     ASSERT_EQ(pd.type, PuffData::Type::kLiterals);
     ASSERT_EQ(pd.length, 1);
-    ASSERT_TRUE(pd.read_fn(tmp3, 1));
-    ASSERT_EQ(tmp3[0], 10);
-    ASSERT_FALSE(pd.read_fn(tmp3, 2));
+    ASSERT_EQ(pd.literals[0], 10);
   }
   {
     PuffData pd;
@@ -340,12 +323,10 @@ TEST(PuffIOTest, MaxLiteralsTest) {
   pd.length = 1;
   ASSERT_TRUE(pw.Insert(pd, &error));
 
+  Buffer literals(1 << 16, 10);
   pd.type = PuffData::Type::kLiterals;
   pd.length = (1 << 16);
-  pd.read_fn = [](uint8_t* buffer, size_t count) {
-    std::fill(buffer, buffer + count, 10);
-    return true;
-  };
+  pd.literals = literals.data();
   ASSERT_TRUE(pw.Insert(pd, &error));
   ASSERT_TRUE(pw.Flush(&error));
 
@@ -358,9 +339,7 @@ TEST(PuffIOTest, MaxLiteralsTest) {
   ASSERT_EQ(pd.type, PuffData::Type::kLiterals);
   ASSERT_EQ(pd.length, 1 << 16);
   for (size_t i = 0; i < pd.length; i++) {
-    uint8_t byte;
-    pd.read_fn(&byte, 1);
-    ASSERT_EQ(byte, 10);
+    ASSERT_EQ(pd.literals[i], 10);
   }
 
   BufferPuffWriter pw2(buf.data(), buf.size());
@@ -391,17 +370,203 @@ TEST(PuffIOTest, MaxLiteralsTest) {
   ASSERT_EQ(pd.type, PuffData::Type::kLiterals);
   ASSERT_EQ(pd.length, (1 << 16) + 127);
   for (size_t i = 0; i < pd.length; i++) {
-    uint8_t byte;
-    pd.read_fn(&byte, 1);
-    ASSERT_EQ(byte, 12);
+    ASSERT_EQ(pd.literals[i], 12);
   }
 
   ASSERT_TRUE(pr2.GetNext(&pd, &error));
   ASSERT_EQ(pd.type, PuffData::Type::kLiterals);
   ASSERT_EQ(pd.length, 1);
-  uint8_t byte;
-  pd.read_fn(&byte, 1);
-  ASSERT_EQ(byte, 13);
+  ASSERT_EQ(pd.literals[0], 13);
+}
+
+// Testing |PuffSizeWriter| computes the same size as |BufferPuffWriter|.
+TEST(PuffIOTest, PuffSizeWriterTest) {
+  Buffer buf(3 * ((1 << 16) + 127) + 100);
+  BufferPuffWriter pw(buf.data(), buf.size());
+  PuffSizeWriter sw;
+  PuffData pd;
+  Error error;
+  auto insert = [&pw, &sw, &pd, &error]() {
+    ASSERT_TRUE(pw.Insert(pd, &error));
+    ASSERT_TRUE(sw.Insert(pd, &error));
+    ASSERT_EQ(pw.Size(), sw.Size());
+  };
+  Buffer literals(1 << 16, 10);
+
+  pd.type = PuffData::Type::kBlockMetadata;
+  pd.length = 10;
+  insert();
+  for (size_t length : {1, 126, 127, 128, 1 << 16}) {
+    pd.type = PuffData::Type::kLiterals;
+    pd.length = length;
+    pd.literals = literals.data();
+    insert();
+    pd.type = PuffData::Type::kLenDist;
+    pd.length = length < 130 ? 3 : 258;
+    pd.distance = 1;
+    insert();
+  }
+
+  // A series of literals longer than the maximum is broken in two.
+  pd.type = PuffData::Type::kLiteral;
+  pd.byte = 10;
+  for (size_t idx = 0; idx < (1 << 16) + 200; idx++) {
+    insert();
+  }
+  pd.type = PuffData::Type::kEndOfBlock;
+  insert();
+  ASSERT_TRUE(pw.Flush(&error));
+  ASSERT_TRUE(sw.Flush(&error));
+  ASSERT_EQ(pw.Size(), sw.Size());
+}
+
+// Testing a growable |BufferPuffWriter| writes the same puff stream as one with
+// a buffer large enough from the start.
+TEST(PuffIOTest, GrowableBufferPuffWriterTest) {
+  Buffer buf((1 << 17) + 100);
+  Buffer growable_buf;
+  BufferPuffWriter pw(buf.data(), buf.size());
+  BufferPuffWriter gpw(&growable_buf);
+  PuffData pd;
+  Error error;
+  Buffer literals(1 << 16, 10);
+
+  pd.type = PuffData::Type::kBlockMetadata;
+  pd.length = 10;
+  ASSERT_TRUE(pw.Insert(pd, &error));
+  ASSERT_TRUE(gpw.Insert(pd, &error));
+  for (size_t length : {1, 127, 128, 1 << 16}) {
+    pd.type = PuffData::Type::kLiterals;
+    pd.length = length;
+    pd.literals = literals.data();
+    ASSERT_TRUE(pw.Insert(pd, &error));
+    ASSERT_TRUE(gpw.Insert(pd, &error));
+    pd.type = PuffData::Type::kLenDist;
+    pd.length = length < 130 ? 3 : 258;
+    pd.distance = 1;
+    ASSERT_TRUE(pw.Insert(pd, &error));
+    ASSERT_TRUE(gpw.Insert(pd, &error));
+  }
+  pd.type = PuffData::Type::kEndOfBlock;
+  ASSERT_TRUE(pw.Insert(pd, &error));
+  ASSERT_TRUE(gpw.Insert(pd, &error));
+  ASSERT_TRUE(pw.Flush(&error));
+  ASSERT_TRUE(gpw.Flush(&error));
+  ASSERT_EQ(pw.Size(), gpw.Size());
+  ASSERT_GE(growable_buf.size(), gpw.Size());
+  ASSERT_TRUE(std::equal(buf.begin(), buf.begin() + pw.Size(),
+                         growable_buf.begin()));
+
+  // A buffer that is not growable still fails when it is full.
+  BufferPuffWriter small_pw(buf.data(), 1);
+  pd.type = PuffData::Type::kEndOfBlock;
+  ASSERT_FALSE(small_pw.Insert(pd, &error));
+  ASSERT_EQ(error, Error::kInsufficientOutput);
+}
+
+// Testing inserting a series of literals at once writes the same puff stream as
+// inserting them one by one, including series longer than the maximum.
+TEST(PuffIOTest, LiteralsBatchTest) {
+  for (size_t length : {1, 127, 128, 1000, (1 << 16) + 127, (1 << 16) + 300}) {
+    Buffer literals(length);
+    for (size_t idx = 0; idx < length; idx++) {
+      literals[idx] = idx * 7;
+    }
+    Buffer buf1(length + 100), buf2(length + 100);
+    BufferPuffWriter pw1(buf1.data(), buf1.size());
+    BufferPuffWriter pw2(buf2.data(), buf2.size());
+    PuffData pd;
+    Error error;
+    pd.type = PuffData::Type::kBlockMetadata;
+    pd.length = 1;
+    ASSERT_TRUE(pw1.Insert(pd, &error));
+    ASSERT_TRUE(pw2.Insert(pd, &error));
+
+    pd.type = PuffData::Type::kLiterals;
+    pd.length = length;
+    pd.literals = literals.data();
+    ASSERT_TRUE(pw1.Insert(pd, &error));
+    pd.type = PuffData::Type::kLiteral;
+    for (auto literal : literals) {
+      pd.byte = literal;
+      ASSERT_TRUE(pw2.Insert(pd, &error));
+    }
+
+    pd.type = PuffData::Type::kEndOfBlock;
+    ASSERT_TRUE(pw1.Insert(pd, &error));
+    ASSERT_TRUE(pw2.Insert(pd, &error));
+    ASSERT_TRUE(pw1.Flush(&error));
+    ASSERT_TRUE(pw2.Flush(&error));
+    ASSERT_EQ(pw1.Size(), pw2.Size());
+    ASSERT_EQ(buf1, buf2);
+  }
+}
+
+// Testing the puffs of |PuffFormat::kV2| read back the same, the one-byte
+// distances and block metadata sizes make them smaller than the ones of
+// |PuffFormat::kV1|, and |PuffSizeWriter| computes their size.
+TEST(PuffIOTest, PuffFormatV2Test) {
+  Buffer buf1(1000), buf2(1000);
+  BufferPuffWriter pw1(buf1.data(), buf1.size());
+  BufferPuffWriter pw2(buf2.data(), buf2.size(), PuffFormat::kV2);
+  PuffSizeWriter sw2(PuffFormat::kV2);
+  std::vector<PuffData> pds;
+  PuffData pd;
+  Error error;
+  for (size_t metadata_length : {1, 128, 129, 339}) {
+    pd.type = PuffData::Type::kBlockMetadata;
+    pd.length = metadata_length;
+    for (size_t idx = 0; idx < metadata_length; idx++) {
+      pd.block_metadata[idx] = idx;
+    }
+    pds.push_back(pd);
+    for (size_t distance : {1, 128, 129, 256, 32768}) {
+      pd.type = PuffData::Type::kLenDist;
+      pd.length = distance < 200 ? 3 : 258;
+      pd.distance = distance;
+      pds.push_back(pd);
+    }
+    pd.type = PuffData::Type::kEndOfBlock;
+    pds.push_back(pd);
+  }
+  for (const auto& data : pds) {
+    ASSERT_TRUE(pw1.Insert(data, &error));
+    ASSERT_TRUE(pw2.Insert(data, &error));
+    ASSERT_TRUE(sw2.Insert(data, &error));
+    ASSERT_EQ(pw2.Size(), sw2.Size());
+  }
+  ASSERT_TRUE(pw1.Flush(&error));
+  ASSERT_TRUE(pw2.Flush(&error));
+  // One byte less for the two distances of each of the four blocks and the two
+  // metadata sizes that are at most 128.
+  ASSERT_EQ(pw2.Size(), pw1.Size() - 4 * 2 - 2);
+
+  BufferPuffReader pr(buf2.data(), pw2.Size(), PuffFormat::kV2);
+  for (const auto& data : pds) {
+    ASSERT_TRUE(pr.GetNext(&pd, &error));
+    ASSERT_EQ(pd.type, data.type);
+    if (data.type == PuffData::Type::kEndOfBlock) {
+      continue;
+    }
+    ASSERT_EQ(pd.length, data.length);
+    if (data.type == PuffData::Type::kLenDist) {
+      ASSERT_EQ(pd.distance, data.distance);
+    } else {
+      ASSERT_TRUE(std::equal(pd.block_metadata, pd.block_metadata + pd.length,
+                             data.block_metadata));
+    }
+  }
+  ASSERT_EQ(pr.BytesLeft(), 0);
+
+  // The first length/distance pair is the two bytes after the two of the first
+  // block metadata, and it is not read if its distance is cut off.
+  BufferPuffReader pr4(buf2.data(), 4, PuffFormat::kV2);
+  ASSERT_TRUE(pr4.GetNext(&pd, &error));
+  ASSERT_TRUE(pr4.GetNext(&pd, &error));
+  ASSERT_EQ(pd.distance, 1);
+  BufferPuffReader pr3(buf2.data(), 3, PuffFormat::kV2);
+  ASSERT_TRUE(pr3.GetNext(&pd, &error));
+  ASSERT_FALSE(pr3.GetNext(&pd, &error));
 }
 
 }  // namespace puffin
@@ -52,15 +52,18 @@ bool BufferPuffReader::GetNext(PuffData* data, Error* error) {
       }
 
       // Boundary check
-      TEST_AND_RETURN_FALSE_SET_ERROR(index_ + 1 < puff_size_,
+      TEST_AND_RETURN_FALSE_SET_ERROR(index_ < puff_size_,
+                                      Error::kInsufficientInput);
+      auto distance_size = PeekPuffValueSize(format_, puff_buf_in_[index_]);
+      TEST_AND_RETURN_FALSE_SET_ERROR(index_ + distance_size <= puff_size_,
                                       Error::kInsufficientInput);
-      auto distance = ReadByteArrayToUint16(&puff_buf_in_[index_]);
+      auto distance = ReadPuffValue(format_, &puff_buf_in_[index_]);
       // The distance in RFC is in the range [1..32768], but in the puff spec,
       // we write zero-based distance in the puff stream.
       TEST_AND_RETURN_FALSE_SET_ERROR(distance < (1 << 15),
                                       Error::kInsufficientInput);
       distance++;
-      index_ += 2;
+      index_ += distance_size;
 
       pd.type = PuffData::Type::kLenDist;
       pd.length = length;
@@ -89,22 +92,20 @@ bool BufferPuffReader::GetNext(PuffData* data, Error* error) {
                                       Error::kInsufficientInput);
       pd.type = PuffData::Type::kLiterals;
       pd.length = length;
-      pd.read_fn = [this, length](uint8_t* buffer, size_t count) mutable {
-        TEST_AND_RETURN_FALSE(count <= length);
-        memcpy(buffer, &puff_buf_in_[index_], count);
-        index_ += count;
-        length -= count;
-        return true;
-      };
+      pd.literals = &puff_buf_in_[index_];
+      index_ += length;
       return true;
     }
   } else {  // Block metadata
     pd.type = PuffData::Type::kBlockMetadata;
     // Boundary check
-    TEST_AND_RETURN_FALSE_SET_ERROR(index_ + 2 < puff_size_,
+    TEST_AND_RETURN_FALSE_SET_ERROR(index_ < puff_size_,
                                     Error::kInsufficientInput);
-    length = ReadByteArrayToUint16(&puff_buf_in_[index_]) + 1;
-    index_ += 2;
+    auto length_size = PeekPuffValueSize(format_, puff_buf_in_[index_]);
+    TEST_AND_RETURN_FALSE_SET_ERROR(index_ + length_size < puff_size_,
+                                    Error::kInsufficientInput);
+    length = ReadPuffValue(format_, &puff_buf_in_[index_]) + 1;
+    index_ += length_size;
     DVLOG(2) << "Read block metadata length: " << length;
     // Boundary check
     TEST_AND_RETURN_FALSE_SET_ERROR(index_ + length <= puff_size_,
@@ -118,8 +119,4 @@ bool BufferPuffReader::GetNext(PuffData* data, Error* error) {
   return true;
 }
 
-size_t BufferPuffReader::BytesLeft() const {
-  return puff_size_ - index_;
-}
-
 }  // namespace puffin
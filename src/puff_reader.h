@@ -33,23 +33,29 @@ class PuffReaderInterface {
   virtual size_t BytesLeft() const = 0;
 };
 
-class BufferPuffReader : public PuffReaderInterface {
+// A raw buffer implementation of |PuffReaderInterface|. It is final so its
+// functions are not called virtually in the template entry points of |Huffer|.
+class BufferPuffReader final : public PuffReaderInterface {
  public:
   // Sets the parameters of puff buffer.
   //
   // |puff_buf|  IN  The input puffed stream. It is owned by the caller and must
   //                 be valid during the lifetime of the object.
   // |puff_size| IN  The size of the puffed stream.
-  BufferPuffReader(const uint8_t* puff_buf, size_t puff_size)
+  // |format|    IN  The encoding of the puffed stream.
+  BufferPuffReader(const uint8_t* puff_buf,
+                   size_t puff_size,
+                   PuffFormat format = PuffFormat::kV1)
       : puff_buf_in_(puff_buf),
         puff_size_(puff_size),
+        format_(format),
         index_(0),
         state_(State::kReadingBlockMetadata) {}
 
   ~BufferPuffReader() override = default;
 
   bool GetNext(PuffData* pd, Error* error) override;
-  size_t BytesLeft() const override;
+  inline size_t BytesLeft() const override { return puff_size_ - index_; }
 
  private:
   // The pointer to the puffed stream. This should not be deallocated.
@@ -58,6 +64,8 @@ class BufferPuffReader : public PuffReaderInterface {
   // The size of the puffed buffer.
   size_t puff_size_;
 
+  PuffFormat format_;
+
   // Index to the offset of the next data in the puff buffer.
   size_t index_;
 
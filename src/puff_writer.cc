@@ -21,67 +21,49 @@ inline void WriteUint16ToByteArray(uint16_t value, uint8_t* buffer) {
   *(buffer + 1) = value & 0x00FF;
 }
 
-constexpr size_t kLiteralsMaxLength = (1 << 16) + 127;  // 65663
+// The smallest size a growable puff buffer starts with.
+constexpr size_t kMinGrowablePuffSize = 4096;
 }  // namespace
 
+BufferPuffWriter::BufferPuffWriter(Buffer* puff_buffer, PuffFormat format)
+    : puff_buffer_(puff_buffer),
+      format_(format),
+      index_(0),
+      len_index_(0),
+      cur_literals_length_(0),
+      state_(State::kWritingNonLiteral) {
+  // The buffer can not be empty, or |puff_buf_out_| could be null, which means
+  // only the size is computed.
+  if (puff_buffer_->size() < kMinGrowablePuffSize) {
+    puff_buffer_->resize(kMinGrowablePuffSize);
+  }
+  puff_buf_out_ = puff_buffer_->data();
+  puff_size_ = puff_buffer_->size();
+}
+
+bool BufferPuffWriter::Grow(size_t size, Error* error) {
+  TEST_AND_RETURN_FALSE_SET_ERROR(puff_buffer_ != nullptr,
+                                  Error::kInsufficientOutput);
+  puff_buffer_->resize(std::max(size, puff_buffer_->size() * 2));
+  puff_buf_out_ = puff_buffer_->data();
+  puff_size_ = puff_buffer_->size();
+  return true;
+}
+
 bool BufferPuffWriter::Insert(const PuffData& pd, Error* error) {
+  size_t distance_size;
+  size_t length_size;
   switch (pd.type) {
     case PuffData::Type::kLiterals:
-      if (pd.length == 0) {
-        return true;
-      }
-    // We don't break here. It will be processed in kLiteral;
-    case PuffData::Type::kLiteral: {
       DVLOG(2) << "Write literals length: " << pd.length;
-      size_t length = pd.type == PuffData::Type::kLiteral ? 1 : pd.length;
-      if (state_ == State::kWritingNonLiteral) {
-        len_index_ = index_;
-        index_++;
-        state_ = State::kWritingSmallLiteral;
-      }
-      if (state_ == State::kWritingSmallLiteral) {
-        if ((cur_literals_length_ + length) > 127) {
-          if (puff_buf_out_ != nullptr) {
-            // Boundary check
-            TEST_AND_RETURN_FALSE_SET_ERROR(index_ + 2 <= puff_size_,
-                                            Error::kInsufficientOutput);
-
-            // Shift two bytes forward to open space for length value.
-            memmove(&puff_buf_out_[len_index_ + 3],
-                    &puff_buf_out_[len_index_ + 1], cur_literals_length_);
-          }
-          index_ += 2;
-          state_ = State::kWritingLargeLiteral;
-        }
-      }
-
-      if (puff_buf_out_ != nullptr) {
-        // Boundary check
-        TEST_AND_RETURN_FALSE_SET_ERROR(index_ + length <= puff_size_,
-                                        Error::kInsufficientOutput);
-        if (pd.type == PuffData::Type::kLiteral) {
-          puff_buf_out_[index_] = pd.byte;
-        } else {
-          TEST_AND_RETURN_FALSE_SET_ERROR(
-              pd.read_fn(&puff_buf_out_[index_], length),
-              Error::kInsufficientInput);
-        }
-      } else if (pd.type == PuffData::Type::kLiterals) {
-        TEST_AND_RETURN_FALSE_SET_ERROR(pd.read_fn(nullptr, length),
-                                        Error::kInsufficientInput);
-      }
-
-      index_ += length;
-      cur_literals_length_ += length;
+      TEST_AND_RETURN_FALSE(WriteLiterals(pd.literals, pd.length, error));
+      break;
 
-      // Technically with the current structure of the puff stream, we cannot
-      // have total length of more than 65663 bytes for a series of literals. So
-      // we have to cap it at 65663 and continue afterwards.
-      if (cur_literals_length_ == kLiteralsMaxLength) {
-        TEST_AND_RETURN_FALSE(FlushLiterals(error));
-      }
+    case PuffData::Type::kLiteral:
+      DVLOG(2) << "Write literals length: 1";
+      TEST_AND_RETURN_FALSE(WriteLiterals(&pd.byte, 1, error));
       break;
-    }
+
     case PuffData::Type::kLenDist:
       DVLOG(2) << "Write length: " << pd.length << " distance: " << pd.distance;
       TEST_AND_RETURN_FALSE(FlushLiterals(error));
@@ -89,11 +71,11 @@ bool BufferPuffWriter::Insert(const PuffData& pd, Error* error) {
                                       Error::kInvalidInput);
       TEST_AND_RETURN_FALSE_SET_ERROR(pd.distance <= 32768 && pd.distance >= 1,
                                       Error::kInvalidInput);
+      distance_size = GetPuffValueSize(format_, pd.distance - 1);
       if (pd.length < 130) {
         if (puff_buf_out_ != nullptr) {
           // Boundary check
-          TEST_AND_RETURN_FALSE_SET_ERROR(index_ + 3 <= puff_size_,
-                                          Error::kInsufficientOutput);
+          TEST_AND_RETURN_FALSE(HasSpace(index_ + 1 + distance_size, error));
 
           puff_buf_out_[index_++] =
               kLenDistHeader | static_cast<uint8_t>(pd.length - 3);
@@ -103,8 +85,7 @@ bool BufferPuffWriter::Insert(const PuffData& pd, Error* error) {
       } else {
         if (puff_buf_out_ != nullptr) {
           // Boundary check
-          TEST_AND_RETURN_FALSE_SET_ERROR(index_ + 4 <= puff_size_,
-                                          Error::kInsufficientOutput);
+          TEST_AND_RETURN_FALSE(HasSpace(index_ + 2 + distance_size, error));
 
           puff_buf_out_[index_++] = kLenDistHeader | 127;
           puff_buf_out_[index_++] = static_cast<uint8_t>(pd.length - 3 - 127);
@@ -115,9 +96,9 @@ bool BufferPuffWriter::Insert(const PuffData& pd, Error* error) {
 
       if (puff_buf_out_ != nullptr) {
         // Write the distance in the range [1..32768] zero-based.
-        WriteUint16ToByteArray(pd.distance - 1, &puff_buf_out_[index_]);
+        WritePuffValue(format_, pd.distance - 1, &puff_buf_out_[index_]);
       }
-      index_ += 2;
+      index_ += distance_size;
       len_index_ = index_;
       state_ = State::kWritingNonLiteral;
       break;
@@ -128,14 +109,15 @@ bool BufferPuffWriter::Insert(const PuffData& pd, Error* error) {
       TEST_AND_RETURN_FALSE_SET_ERROR(
           pd.length <= sizeof(pd.block_metadata) && pd.length > 0,
           Error::kInvalidInput);
+      length_size = GetPuffValueSize(format_, pd.length - 1);
       if (puff_buf_out_ != nullptr) {
         // Boundary check
-        TEST_AND_RETURN_FALSE_SET_ERROR(index_ + pd.length + 2 <= puff_size_,
-                                        Error::kInsufficientOutput);
+        TEST_AND_RETURN_FALSE(
+            HasSpace(index_ + pd.length + length_size, error));
 
-        WriteUint16ToByteArray(pd.length - 1, &puff_buf_out_[index_]);
+        WritePuffValue(format_, pd.length - 1, &puff_buf_out_[index_]);
       }
-      index_ += 2;
+      index_ += length_size;
 
       if (puff_buf_out_ != nullptr) {
         memcpy(&puff_buf_out_[index_], pd.block_metadata, pd.length);
@@ -150,8 +132,7 @@ bool BufferPuffWriter::Insert(const PuffData& pd, Error* error) {
       TEST_AND_RETURN_FALSE(FlushLiterals(error));
       if (puff_buf_out_ != nullptr) {
         // Boundary check
-        TEST_AND_RETURN_FALSE_SET_ERROR(index_ + 2 <= puff_size_,
-                                        Error::kInsufficientOutput);
+        TEST_AND_RETURN_FALSE(HasSpace(index_ + 2, error));
 
         puff_buf_out_[index_++] = kLenDistHeader | 127;
         puff_buf_out_[index_++] = static_cast<uint8_t>(259 - 3 - 127);
@@ -172,6 +153,59 @@ bool BufferPuffWriter::Insert(const PuffData& pd, Error* error) {
   return true;
 }
 
+bool BufferPuffWriter::WriteLiterals(const uint8_t* literals,
+                                     size_t length,
+                                     Error* error) {
+  while (length > 0) {
+    // Technically with the current structure of the puff stream, we cannot
+    // have total length of more than 65663 bytes for a series of literals. So
+    // we have to cap it at 65663 and continue afterwards.
+    auto count = std::min(length, kLiteralsMaxLength - cur_literals_length_);
+    if (state_ == State::kWritingNonLiteral) {
+      // The length of the series is known up front if all the literals come at
+      // once, so the header of large literals can be reserved here.
+      len_index_ = index_;
+      if (count > 127) {
+        index_ += 3;
+        state_ = State::kWritingLargeLiteral;
+      } else {
+        index_++;
+        state_ = State::kWritingSmallLiteral;
+      }
+    }
+    if (state_ == State::kWritingSmallLiteral) {
+      if ((cur_literals_length_ + count) > 127) {
+        if (puff_buf_out_ != nullptr) {
+          // Boundary check
+          TEST_AND_RETURN_FALSE(HasSpace(index_ + 2, error));
+
+          // Shift two bytes forward to open space for length value.
+          memmove(&puff_buf_out_[len_index_ + 3],
+                  &puff_buf_out_[len_index_ + 1], cur_literals_length_);
+        }
+        index_ += 2;
+        state_ = State::kWritingLargeLiteral;
+      }
+    }
+
+    if (puff_buf_out_ != nullptr) {
+      // Boundary check
+      TEST_AND_RETURN_FALSE(HasSpace(index_ + count, error));
+      memcpy(&puff_buf_out_[index_], literals, count);
+    }
+
+    index_ += count;
+    cur_literals_length_ += count;
+    literals += count;
+    length -= count;
+
+    if (cur_literals_length_ == kLiteralsMaxLength) {
+      TEST_AND_RETURN_FALSE(FlushLiterals(error));
+    }
+  }
+  return true;
+}
+
 bool BufferPuffWriter::FlushLiterals(Error* error) {
   if (cur_literals_length_ == 0) {
     return true;
@@ -224,8 +258,4 @@ bool BufferPuffWriter::Flush(Error* error) {
   return true;
 }
 
-size_t BufferPuffWriter::Size() {
-  return index_;
-}
-
 }  // namespace puffin
@@ -5,12 +5,14 @@
 #ifndef SRC_PUFF_WRITER_H_
 #define SRC_PUFF_WRITER_H_
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 
 #include "puffin/src/include/puffin/common.h"
 #include "puffin/src/include/puffin/errors.h"
 #include "puffin/src/puff_data.h"
+#include "puffin/src/set_errors.h"
 
 namespace puffin {
 
@@ -38,37 +40,71 @@ class PuffWriterInterface {
   virtual size_t Size() = 0;
 };
 
-class BufferPuffWriter : public PuffWriterInterface {
+// A raw buffer implementation of |PuffWriterInterface|. It is final so its
+// functions are not called virtually in the template entry points of |Puffer|.
+class BufferPuffWriter final : public PuffWriterInterface {
  public:
   // Sets the parameters of puff buffer.
   //
   // |puff_buf|  IN  The input puffed stream. It is owned by the caller and must
   //                 be valid during the lifetime of the object.
   // |puff_size| IN  The size of the puffed stream.
-  BufferPuffWriter(uint8_t* puff_buf, size_t puff_size)
+  // |format|    IN  The encoding of the puffed stream.
+  BufferPuffWriter(uint8_t* puff_buf,
+                   size_t puff_size,
+                   PuffFormat format = PuffFormat::kV1)
       : puff_buf_out_(puff_buf),
         puff_size_(puff_size),
+        puff_buffer_(nullptr),
+        format_(format),
         index_(0),
         len_index_(0),
         cur_literals_length_(0),
         state_(State::kWritingNonLiteral) {}
 
+  // Writes into |puff_buffer| instead, which grows whenever the puff does not
+  // fit, so the size of the puff does not have to be known up front. The puff
+  // is the first |Size()| bytes of |puff_buffer| after |Flush|.
+  //
+  // |puff_buffer| IN  The buffer for the puff. It is owned by the caller and
+  //                   must be valid during the lifetime of the object. Its
+  //                   initial size is kept as the initial capacity.
+  // |format|      IN  The encoding of the puff.
+  explicit BufferPuffWriter(Buffer* puff_buffer,
+                            PuffFormat format = PuffFormat::kV1);
+
   ~BufferPuffWriter() override = default;
 
   bool Insert(const PuffData& pd, Error* error) override;
   bool Flush(Error* error) override;
-  size_t Size() override;
+  inline size_t Size() override { return index_; }
 
  private:
+  // Writes |length| bytes of |literals| into the current series of literals.
+  // It starts a new series if there is none or the current one is full.
+  bool WriteLiterals(const uint8_t* literals, size_t length, Error* error);
+
   // Flushes the literals into the output and resets the state.
   bool FlushLiterals(Error* error);
 
+  // Makes sure the puffed buffer has at least |size| bytes, growing it if it
+  // is growable.
+  inline bool HasSpace(size_t size, Error* error) {
+    return size <= puff_size_ || Grow(size, error);
+  }
+  bool Grow(size_t size, Error* error);
+
   // The pointer to the puffed stream. This should not be deallocated.
   uint8_t* puff_buf_out_;
 
   // The size of the puffed buffer.
   size_t puff_size_;
 
+  // The buffer |puff_buf_out_| points into if it is growable, or null.
+  Buffer* puff_buffer_;
+
+  PuffFormat format_;
+
   // The offset to the next data in the buffer.
   size_t index_;
 
@@ -89,6 +125,116 @@ class BufferPuffWriter : public PuffWriterInterface {
   DISALLOW_COPY_AND_ASSIGN(BufferPuffWriter);
 };
 
+// A |PuffWriterInterface| that does not write anything and only computes the
+// size of the puff stream |BufferPuffWriter| would have written. It is final
+// and fully inline, so a |Puffer| specialized for it only keeps the length
+// counters of the output path.
+class PuffSizeWriter final : public PuffWriterInterface {
+ public:
+  explicit PuffSizeWriter(PuffFormat format = PuffFormat::kV1)
+      : format_(format), index_(0), cur_literals_length_(0) {}
+  ~PuffSizeWriter() override = default;
+
+  inline bool Insert(const PuffData& pd, Error* error) override {
+    switch (pd.type) {
+      case PuffData::Type::kLiterals:
+        AddLiterals(pd.length);
+        break;
+
+      case PuffData::Type::kLiteral:
+        AddLiterals(1);
+        break;
+
+      case PuffData::Type::kLenDist:
+        TEST_AND_RETURN_FALSE_SET_ERROR(pd.length <= 258 && pd.length >= 3,
+                                        Error::kInvalidInput);
+        TEST_AND_RETURN_FALSE_SET_ERROR(
+            pd.distance <= 32768 && pd.distance >= 1, Error::kInvalidInput);
+        AddLenDist(pd.length, pd.distance);
+        break;
+
+      case PuffData::Type::kBlockMetadata:
+        TEST_AND_RETURN_FALSE_SET_ERROR(
+            pd.length <= sizeof(pd.block_metadata) && pd.length > 0,
+            Error::kInvalidInput);
+        AddBlockMetadata(pd.length);
+        break;
+
+      case PuffData::Type::kEndOfBlock:
+        AddEndOfBlock();
+        break;
+
+      default:
+        LOG(ERROR) << "Invalid PuffData::Type";
+        *error = Error::kInvalidInput;
+        return false;
+    }
+    *error = Error::kSuccess;
+    return true;
+  }
+
+  inline bool Flush(Error* /* error */) override {
+    cur_literals_length_ = 0;
+    return true;
+  }
+
+  inline size_t Size() override { return index_; }
+
+  // The functions below add the size of one kind of |PuffData| without
+  // checking it. They are used by |Puffer::ScanDeflate| which does not create
+  // the |PuffData|s at all.
+
+  // Adds the size of |length| literals, including the size of the header of
+  // the series of literals they belong to.
+  inline void AddLiterals(size_t length) {
+    while (length > 0) {
+      if (cur_literals_length_ == 0) {
+        index_++;  // The header of small literals.
+      }
+      auto count = std::min(length, kLiteralsMaxLength - cur_literals_length_);
+      if (cur_literals_length_ <= 127 && cur_literals_length_ + count > 127) {
+        index_ += 2;  // The extra length bytes of large literals.
+      }
+      cur_literals_length_ += count;
+      index_ += count;
+      length -= count;
+      if (cur_literals_length_ == kLiteralsMaxLength) {
+        cur_literals_length_ = 0;
+      }
+    }
+  }
+
+  // Adds the size of a length/distance pair of length |length| and distance
+  // |distance|.
+  inline void AddLenDist(size_t length, size_t distance) {
+    cur_literals_length_ = 0;
+    index_ += (length < 130 ? 1 : 2) + GetPuffValueSize(format_, distance - 1);
+  }
+
+  // Adds the size of a block metadata of |length| bytes.
+  inline void AddBlockMetadata(size_t length) {
+    cur_literals_length_ = 0;
+    index_ += length + GetPuffValueSize(format_, length - 1);
+  }
+
+  // Adds the size of an end of block.
+  inline void AddEndOfBlock() {
+    cur_literals_length_ = 0;
+    index_ += 2;
+  }
+
+ private:
+  PuffFormat format_;
+
+  // The size of the puff stream so far.
+  size_t index_;
+
+  // The number of literals in the current series of literals.
+  size_t cur_literals_length_;
+
+  DISALLOW_COPY_AND_ASSIGN(PuffSizeWriter);
+};
+
 }  // namespace puffin
 
 #endif  // SRC_PUFF_WRITER_H_
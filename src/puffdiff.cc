@@ -5,41 +5,349 @@
 #include "puffin/src/include/puffin/puffdiff.h"
 
 #include <endian.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <zlib.h>
 
+#include <algorithm>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "bsdiff/bsdiff.h"
+#include "bsdiff/constants.h"
+#include "bsdiff/patch_writer_factory.h"
 
+#include "puffin/src/bit_reader.h"
+#include "puffin/src/cache_plan.h"
+#include "puffin/src/deflate_copies.h"
 #include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/diff_engine.h"
+#include "puffin/src/include/puffin/puff_index.h"
 #include "puffin/src/include/puffin/puffer.h"
 #include "puffin/src/include/puffin/puffpatch.h"
+#include "puffin/src/include/puffin/stats.h"
 #include "puffin/src/include/puffin/utils.h"
 #include "puffin/src/file_stream.h"
 #include "puffin/src/memory_stream.h"
+#include "puffin/src/packed_extents.h"
+#include "puffin/src/puff_crc32.h"
+#include "puffin/src/puff_writer.h"
 #include "puffin/src/puffin.pb.h"
 #include "puffin/src/puffin_stream.h"
 #include "puffin/src/set_errors.h"
+#include "puffin/src/thread_pool.h"
 
 namespace puffin {
 
 using std::string;
 using std::vector;
 
+// A buffer for holding a puff stream. It is either in memory or, if a file path
+// is given, a temporary file that is mapped into memory. The pages of a shared
+// file mapping can be written back to the file and dropped by the kernel, so
+// large puff streams do not have to stay completely in memory.
+class PuffBuffer {
+ public:
+  PuffBuffer() : data_(nullptr), size_(0), fd_(-1) {}
+  ~PuffBuffer() {
+    if (data_ != nullptr && fd_ >= 0) {
+      munmap(data_, size_);
+    }
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+    if (!path_.empty()) {
+      unlink(path_.c_str());
+    }
+  }
+
+  // Allocates |size| bytes. If |path| is not empty, the buffer is backed by a
+  // file at |path| which is removed when this object is destroyed.
+  bool Allocate(const string& path, uint64_t size) {
+    TEST_AND_RETURN_FALSE(data_ == nullptr && fd_ < 0);
+    size_ = size;
+    if (path.empty()) {
+      buffer_.resize(size);
+      data_ = buffer_.data();
+      return true;
+    }
+    TEST_AND_RETURN_FALSE(OpenFile(path));
+    TEST_AND_RETURN_FALSE(ftruncate(fd_, size) == 0);
+    return MapFile();
+  }
+
+  // Opens a stream for writing a puff stream whose size is not known yet into
+  // the buffer, which is available in |data| after |Finish|. If |path| is not
+  // empty, the puff stream is written into a file at |path| like |Allocate|.
+  UniqueStreamPtr OpenForWrite(const string& path) {
+    TEST_AND_RETURN_VALUE(data_ == nullptr && fd_ < 0, nullptr);
+    if (path.empty()) {
+      return MemoryStream::CreateForWrite(&buffer_);
+    }
+    TEST_AND_RETURN_VALUE(OpenFile(path), nullptr);
+    return FileStream::Open(path, false, true);
+  }
+
+  // Makes the |size| bytes written with the stream of |OpenForWrite| available
+  // in |data|. The stream should be closed first.
+  bool Finish(uint64_t size) {
+    TEST_AND_RETURN_FALSE(data_ == nullptr);
+    size_ = size;
+    if (fd_ < 0) {
+      TEST_AND_RETURN_FALSE(buffer_.size() == size);
+      data_ = buffer_.data();
+      return true;
+    }
+    struct stat file_stat;
+    TEST_AND_RETURN_FALSE(fstat(fd_, &file_stat) == 0);
+    TEST_AND_RETURN_FALSE(static_cast<uint64_t>(file_stat.st_size) == size);
+    return MapFile();
+  }
+
+  uint8_t* data() { return data_; }
+  uint64_t size() const { return size_; }
+
+ private:
+  // Creates the empty file at |path| the buffer is backed by.
+  bool OpenFile(const string& path) {
+    path_ = path;
+    fd_ = open(path_.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    TEST_AND_RETURN_FALSE(fd_ >= 0);
+    return true;
+  }
+
+  // Maps the |size_| bytes of the file into memory.
+  bool MapFile() {
+    if (size_ > 0) {
+      void* data =
+          mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+      TEST_AND_RETURN_FALSE(data != MAP_FAILED);
+      data_ = static_cast<uint8_t*>(data);
+    }
+    return true;
+  }
+
+  Buffer buffer_;
+  uint8_t* data_;
+  uint64_t size_;
+  string path_;
+  int fd_;
+
+  DISALLOW_COPY_AND_ASSIGN(PuffBuffer);
+};
+
 namespace {
 
-template <typename T>
-void CopyVectorToRpf(
-    const T& from,
-    google::protobuf::RepeatedPtrField<metadata::BitExtent>* to,
-    size_t coef) {
-  to->Reserve(from.size());
-  for (const auto& ext : from) {
-    auto tmp = to->Add();
-    tmp->set_offset(ext.offset * coef);
-    tmp->set_length(ext.length * coef);
+// The version of the patches created (see |metadata::PatchHeader|), of the
+// ones with copies, and of the ones with puffs in other formats than
+// |PuffFormat::kV1|.
+constexpr int32_t kPatchVersion = 3;
+constexpr int32_t kCopiesPatchVersion = 4;
+constexpr int32_t kPuffFormatPatchVersion = 5;
+
+// The smallest part of the destination copied from the source. The copies of
+// smaller parts would take more space in the patch header than bsdiff takes for
+// them.
+constexpr uint64_t kMinCopyLength = 256;
+
+// The size of the buffer used for copying the bsdiff patch into the puffin
+// patch.
+constexpr size_t kPatchCopyBufferSize = 1024 * 1024;  // 1 MiB
+
+// Removes the files at |paths| when destroyed.
+class ScopedPathsUnlinker {
+ public:
+  explicit ScopedPathsUnlinker(const vector<string>& paths) : paths_(paths) {}
+  ~ScopedPathsUnlinker() {
+    for (const auto& path : paths_) {
+      unlink(path.c_str());
+    }
+  }
+
+ private:
+  vector<string> paths_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedPathsUnlinker);
+};
+
+// A part of the destination that is diffed independently of the other parts.
+struct PatchChunk {
+  PatchChunk(const ByteExtent& dst, const ByteExtent& dst_puff)
+      : dst(dst), dst_puff(dst_puff) {}
+
+  // The location of the chunk in the destination deflate and puff streams.
+  ByteExtent dst;
+  ByteExtent dst_puff;
+  // The ranges of the source puff stream bspatch reads for the chunk.
+  vector<ByteExtent> src_reads;
+  // The file the bsdiff patch of the chunk is written into.
+  string bsdiff_patch_path;
+  UniqueStreamPtr bsdiff_patch;
+};
+
+// Computes the CRC-32 of the uncompressed data of each of the |deflates| from
+// its puff (in |puff_format|) in |puffs| of |puff_data| into |crc32s| on
+// |num_threads| threads. The copies of a subblock can reach back into the
+// subblocks right before it, so each run of contiguous deflates is done by one
+// thread in order.
+bool GetPuffCrc32s(const uint8_t* puff_data,
+                   const vector<BitExtent>& deflates,
+                   const vector<ByteExtent>& puffs,
+                   size_t num_threads,
+                   PuffFormat puff_format,
+                   vector<uint32_t>* crc32s) {
+  if (num_threads == 0) {
+    num_threads = ThreadPool::GetDefaultNumThreads();
+  }
+  vector<size_t> run_starts;
+  for (size_t idx = 0; idx < deflates.size(); idx++) {
+    if (idx == 0 || deflates[idx].offset !=
+                        deflates[idx - 1].offset + deflates[idx - 1].length) {
+      run_starts.push_back(idx);
+    }
+  }
+  run_starts.push_back(deflates.size());
+
+  crc32s->resize(puffs.size());
+  vector<std::unique_ptr<PuffCrc32>> puff_crc32s(num_threads);
+  return ParallelFor(run_starts.size() - 1, num_threads, [&](size_t run,
+                                                             size_t worker) {
+    auto& puff_crc32 = puff_crc32s[worker];
+    if (!puff_crc32) {
+      puff_crc32.reset(new PuffCrc32(puff_format));
+    }
+    for (auto idx = run_starts[run]; idx < run_starts[run + 1]; idx++) {
+      puff_crc32->Start(idx != run_starts[run]);
+      const auto& puff = puffs[idx];
+      TEST_AND_RETURN_FALSE(
+          puff_crc32->Write(puff_data + puff.offset, puff.length));
+      TEST_AND_RETURN_FALSE(puff_crc32->Finish(&(*crc32s)[idx]));
+    }
+    return true;
+  });
+}
+
+// Splits the destination deflate stream of size |dst_size| (and its puff stream
+// of size |dst_puff_size|) into at most |num_chunks| chunks of about the same
+// puff size. A chunk can only start at a byte-aligned deflate in |deflates|, so
+// the chunks can be huffed independently, and not inside one of the |copies|.
+void SplitIntoChunks(const vector<BitExtent>& deflates,
+                     const vector<ByteExtent>& puffs,
+                     const vector<DeflateCopy>& copies,
+                     uint64_t dst_size,
+                     uint64_t dst_puff_size,
+                     size_t num_chunks,
+                     vector<PatchChunk>* chunks) {
+  uint64_t start = 0;
+  uint64_t puff_start = 0;
+  size_t copy_idx = 0;
+  for (size_t idx = 0; idx < deflates.size() && chunks->size() + 1 < num_chunks;
+       idx++) {
+    // Aim for the rest of the puff stream to be split evenly between the rest
+    // of the chunks.
+    auto target = puff_start + (dst_puff_size - puff_start) /
+                                   (num_chunks - chunks->size());
+    if (deflates[idx].offset % 8 != 0 || puffs[idx].offset < target) {
+      continue;
+    }
+    while (copy_idx < copies.size() &&
+           (copies[copy_idx].dst.offset + copies[copy_idx].dst.length) * 8 <=
+               deflates[idx].offset) {
+      copy_idx++;
+    }
+    if (copy_idx < copies.size() &&
+        copies[copy_idx].dst.offset * 8 < deflates[idx].offset) {
+      continue;
+    }
+    auto end = deflates[idx].offset / 8;
+    auto puff_end = puffs[idx].offset;
+    chunks->emplace_back(ByteExtent(start, end - start),
+                         ByteExtent(puff_start, puff_end - puff_start));
+    start = end;
+    puff_start = puff_end;
+  }
+  chunks->emplace_back(ByteExtent(start, dst_size - start),
+                       ByteExtent(puff_start, dst_puff_size - puff_start));
+}
+
+// Finds the parts of a deflate stream with |deflates| and |puffs| that can be
+// copied into |parts|, and their puffs into |part_puffs|. These are the runs of
+// consecutive deflates that start at a byte boundary and are not followed by
+// another deflate in their last byte, so they can be copied byte by byte.
+void FindCopyableParts(const vector<BitExtent>& deflates,
+                       const vector<ByteExtent>& puffs,
+                       vector<ByteExtent>* parts,
+                       vector<ByteExtent>* part_puffs) {
+  for (size_t idx = 0; idx < deflates.size();) {
+    auto start = deflates[idx].offset;
+    auto end = start + deflates[idx].length;
+    for (idx++; idx < deflates.size() && deflates[idx].offset == end; idx++) {
+      end += deflates[idx].length;
+    }
+    ByteExtent part(start / 8, (end + 7) / 8 - start / 8);
+    if (start % 8 != 0 || part.length < kMinCopyLength ||
+        (idx < deflates.size() &&
+         deflates[idx].offset < (part.offset + part.length) * 8)) {
+      continue;
+    }
+    ByteExtent puff(0, 0);
+    if (FindPuffOfBytes(deflates, puffs, part, &puff)) {
+      parts->push_back(part);
+      part_puffs->push_back(puff);
+    }
+  }
+}
+
+// Finds the parts of the destination deflate stream with |dst_deflates| and
+// |dst_puffs| that are identical to parts of the source deflate stream with
+// |src_deflates| and |src_puffs|, so |PuffPatch| can copy them. The parts are
+// compared by their puffs in the puff streams |src_puff| and |dst_puff|, since
+// a puff is the same only if its deflate is (and huffing it gives back the
+// deflate).
+void FindDeflateCopies(const vector<BitExtent>& src_deflates,
+                       const vector<ByteExtent>& src_puffs,
+                       const uint8_t* src_puff,
+                       const vector<BitExtent>& dst_deflates,
+                       const vector<ByteExtent>& dst_puffs,
+                       const uint8_t* dst_puff,
+                       vector<DeflateCopy>* copies) {
+  vector<ByteExtent> src_parts, src_part_puffs;
+  FindCopyableParts(src_deflates, src_puffs, &src_parts, &src_part_puffs);
+  if (src_parts.empty()) {
+    return;
+  }
+  auto hash = [](const uint8_t* puff_data, const ByteExtent& puff) {
+    return (static_cast<uint64_t>(
+                crc32(0L, puff_data + puff.offset, puff.length))
+            << 32) |
+           (puff.length & 0xFFFFFFFF);
+  };
+  std::unordered_multimap<uint64_t, size_t> src_part_ids;
+  for (size_t idx = 0; idx < src_parts.size(); idx++) {
+    src_part_ids.emplace(hash(src_puff, src_part_puffs[idx]), idx);
+  }
+
+  vector<ByteExtent> dst_parts, dst_part_puffs;
+  FindCopyableParts(dst_deflates, dst_puffs, &dst_parts, &dst_part_puffs);
+  for (size_t idx = 0; idx < dst_parts.size(); idx++) {
+    const auto& puff = dst_part_puffs[idx];
+    auto range = src_part_ids.equal_range(hash(dst_puff, puff));
+    for (auto it = range.first; it != range.second; it++) {
+      const auto& src_part_puff = src_part_puffs[it->second];
+      if (src_part_puff.length == puff.length &&
+          memcmp(src_puff + src_part_puff.offset, dst_puff + puff.offset,
+                 puff.length) == 0) {
+        copies->emplace_back(src_parts[it->second].offset, dst_parts[idx]);
+        copies->back().dst_puff = puff;
+        break;
+      }
+    }
   }
 }
 
@@ -47,102 +355,605 @@ void CopyVectorToRpf(
 // +-------+------------------+-------------+--------------+
 // |P|U|F|1| PatchHeader Size | PatchHeader | bsdiff_patch |
 // +-------+------------------+-------------+--------------+
-bool CreatePatch(const Buffer& bsdiff_patch,
+// If the destination is split into more than one chunk or has |copies|, the
+// bsdiff patches of all |chunks| follow the header one after another. The
+// bsdiff patches are copied from the patch files into |patch| in pieces, so
+// they never have to be completely in memory.
+bool CreatePatch(const vector<PatchChunk>& chunks,
+                 const vector<DeflateCopy>& copies,
                  const vector<BitExtent>& src_deflates,
                  const vector<BitExtent>& dst_deflates,
                  const vector<ByteExtent>& src_puffs,
                  const vector<ByteExtent>& dst_puffs,
                  uint64_t src_puff_size,
                  uint64_t dst_puff_size,
-                 Buffer* patch) {
+                 const CachePlan* src_cache_plan,
+                 uint64_t cache_plan_size,
+                 uint32_t engine_id,
+                 PatchCodec codec,
+                 const vector<uint32_t>& dst_crc32s,
+                 PuffFormat puff_format,
+                 const UniqueStreamPtr& patch) {
   metadata::PatchHeader header;
-  header.set_version(1);
+  if (puff_format != PuffFormat::kV1) {
+    header.set_version(kPuffFormatPatchVersion);
+  } else {
+    header.set_version(copies.empty() ? kPatchVersion : kCopiesPatchVersion);
+  }
+  header.set_diff_engine(engine_id);
+  header.set_patch_codec(static_cast<uint32_t>(codec));
+  header.set_puff_format(static_cast<uint32_t>(puff_format));
 
-  CopyVectorToRpf(src_deflates, header.mutable_src()->mutable_deflates(), 1);
-  CopyVectorToRpf(dst_deflates, header.mutable_dst()->mutable_deflates(), 1);
-  CopyVectorToRpf(src_puffs, header.mutable_src()->mutable_puffs(), 8);
-  CopyVectorToRpf(dst_puffs, header.mutable_dst()->mutable_puffs(), 8);
+  SetStreamInfo(src_deflates, src_puffs, src_puff_size, header.mutable_src());
+  SetStreamInfo(dst_deflates, dst_puffs, dst_puff_size, header.mutable_dst());
 
-  header.mutable_src()->set_puff_length(src_puff_size);
-  header.mutable_dst()->set_puff_length(dst_puff_size);
+  if (src_cache_plan != nullptr) {
+    auto plan = header.mutable_src_cache_plan();
+    plan->set_max_cache_size(cache_plan_size);
+    const auto& puff_reads = src_cache_plan->puff_reads;
+    plan->mutable_puff_reads()->Reserve(puff_reads.size());
+    for (auto puff_id : puff_reads) {
+      plan->add_puff_reads(puff_id);
+    }
+    // The cached reads are kept as a bitmap, the first read in the lowest bit.
+    string cached_reads((puff_reads.size() + 7) / 8, '\0');
+    for (size_t idx = 0; idx < src_cache_plan->cached_reads.size(); idx++) {
+      if (src_cache_plan->cached_reads[idx]) {
+        cached_reads[idx / 8] |= 1 << (idx % 8);
+      }
+    }
+    plan->set_cached_reads(cached_reads);
+  }
+
+  vector<uint64_t> bsdiff_patch_sizes(chunks.size());
+  for (size_t idx = 0; idx < chunks.size(); idx++) {
+    TEST_AND_RETURN_FALSE(
+        chunks[idx].bsdiff_patch->GetSize(&bsdiff_patch_sizes[idx]));
+  }
+  if (chunks.size() > 1 || !copies.empty()) {
+    header.mutable_chunks()->Reserve(chunks.size());
+    for (size_t idx = 0; idx < chunks.size(); idx++) {
+      const auto& chunk = chunks[idx];
+      auto pb_chunk = header.add_chunks();
+      pb_chunk->set_dst_offset(chunk.dst.offset);
+      pb_chunk->set_dst_length(chunk.dst.length);
+      pb_chunk->set_dst_puff_offset(chunk.dst_puff.offset);
+      pb_chunk->set_dst_puff_length(chunk.dst_puff.length);
+      CopyVectorToRpf(chunk.src_reads, pb_chunk->mutable_src_reads(), 8);
+      pb_chunk->set_patch_length(bsdiff_patch_sizes[idx]);
+    }
+  }
+  header.mutable_copies()->Reserve(copies.size());
+  for (const auto& copy : copies) {
+    auto pb_copy = header.add_copies();
+    pb_copy->set_src_offset(copy.src_offset);
+    pb_copy->set_dst_offset(copy.dst.offset);
+    pb_copy->set_length(copy.dst.length);
+  }
+  header.mutable_dst_crc32s()->Reserve(dst_crc32s.size());
+  for (auto crc : dst_crc32s) {
+    header.add_dst_crc32s(crc);
+  }
 
   const uint32_t header_size = header.ByteSize();
 
   uint64_t offset = 0;
-  patch->resize(kMagicLength + sizeof(header_size) + header_size +
-                bsdiff_patch.size());
+  Buffer patch_header(kMagicLength + sizeof(header_size) + header_size);
 
-  memcpy(patch->data() + offset, kMagic, kMagicLength);
+  memcpy(patch_header.data() + offset, kMagic, kMagicLength);
   offset += kMagicLength;
 
   // Read header size from big-endian mode.
   uint32_t be_header_size = htobe32(header_size);
-  memcpy(patch->data() + offset, &be_header_size, sizeof(be_header_size));
+  memcpy(patch_header.data() + offset, &be_header_size,
+         sizeof(be_header_size));
   offset += 4;
 
   TEST_AND_RETURN_FALSE(
-      header.SerializeToArray(patch->data() + offset, header_size));
-  offset += header_size;
-
-  memcpy(patch->data() + offset, bsdiff_patch.data(), bsdiff_patch.size());
+      header.SerializeToArray(patch_header.data() + offset, header_size));
+  TEST_AND_RETURN_FALSE(
+      patch->Write(patch_header.data(), patch_header.size()));
 
-  if (bsdiff_patch.size() > patch->size()) {
-    LOG(ERROR) << "Puffin patch is invalid";
+  Buffer buffer;
+  for (size_t idx = 0; idx < chunks.size(); idx++) {
+    const auto& bsdiff_patch = chunks[idx].bsdiff_patch;
+    auto bsdiff_patch_size = bsdiff_patch_sizes[idx];
+    TEST_AND_RETURN_FALSE(bsdiff_patch->Seek(0));
+    buffer.resize(std::min<uint64_t>(bsdiff_patch_size, kPatchCopyBufferSize));
+    for (uint64_t copied = 0; copied < bsdiff_patch_size;) {
+      auto count =
+          std::min<uint64_t>(bsdiff_patch_size - copied, buffer.size());
+      TEST_AND_RETURN_FALSE(bsdiff_patch->Read(buffer.data(), count));
+      TEST_AND_RETURN_FALSE(patch->Write(buffer.data(), count));
+      copied += count;
+    }
   }
   return true;
 }
 
+// Puffs the deflate stream |stream| completely into |puff_buffer| and returns
+// the location of the puffs in |puffs|. The deflates are puffed on
+// |num_threads| threads at the same time. If |puff_path| is not empty, the puff
+// stream is written into a memory-mapped file at |puff_path|. If |index| is not
+// null, the puffs are taken from it after checking it is for |stream|.
+// Otherwise the puffs are found while puffing with |PuffDeflates|, so each
+// deflate is only decoded once. The puffs of an index are in |PuffFormat::kV1|,
+// so |index| must be null for other values of |puff_format|.
+bool PuffDeflateStream(UniqueStreamPtr stream,
+                       const vector<BitExtent>& deflates,
+                       size_t num_threads,
+                       const string& puff_path,
+                       const PuffIndex* index,
+                       PuffFormat puff_format,
+                       PuffBuffer* puff_buffer,
+                       vector<ByteExtent>* puffs) {
+  uint64_t puff_size;
+  if (index != nullptr) {
+    TEST_AND_RETURN_FALSE(puff_format == PuffFormat::kV1);
+    TEST_AND_RETURN_FALSE(index->deflates == deflates);
+    TEST_AND_RETURN_FALSE(CheckPuffIndex(stream, *index));
+    *puffs = index->puffs;
+    puff_size = index->puff_size;
+  } else {
+    auto puff_stream = puff_buffer->OpenForWrite(puff_path);
+    TEST_AND_RETURN_FALSE(puff_stream);
+    TEST_AND_RETURN_FALSE(PuffDeflates(stream, deflates, puff_stream, puffs,
+                                       &puff_size, num_threads, nullptr,
+                                       puff_format));
+    TEST_AND_RETURN_FALSE(puff_stream->Close());
+    return puff_buffer->Finish(puff_size);
+  }
+  TEST_AND_RETURN_FALSE(stream->Seek(0));
+  TEST_AND_RETURN_FALSE(puff_buffer->Allocate(puff_path, puff_size));
+  auto puff_data = puff_buffer->data();
+
+  // |puffin_stream| owns |stream| from now on, but we still need to read the
+  // deflates directly from it.
+  auto* deflate_stream = stream.get();
+  auto puffin_stream =
+      PuffinStream::CreateForPuff(std::move(stream), std::make_shared<Puffer>(),
+                                  puff_size, deflates, *puffs);
+  TEST_AND_RETURN_FALSE(puffin_stream);
+  if (num_threads == 1) {
+    TEST_AND_RETURN_FALSE(puffin_stream->Read(puff_data, puff_size));
+    return true;
+  }
+
+  // Copy the raw data between the puffs first. |puffin_stream| takes care of
+  // the bytes that are shared between the deflates and the raw data.
+  uint64_t offset = 0;
+  for (size_t index = 0; index <= puffs->size(); index++) {
+    auto end = index < puffs->size() ? (*puffs)[index].offset : puff_size;
+    if (end > offset) {
+      TEST_AND_RETURN_FALSE(puffin_stream->Seek(offset));
+      TEST_AND_RETURN_FALSE(
+          puffin_stream->Read(puff_data + offset, end - offset));
+    }
+    if (index < puffs->size()) {
+      offset = end + (*puffs)[index].length;
+    }
+  }
+
+  // Then puff each deflate directly into its location in |puff_buffer|.
+  if (num_threads == 0) {
+    num_threads = ThreadPool::GetDefaultNumThreads();
+  }
+  vector<Puffer> puffers(num_threads);
+  vector<Buffer> deflate_buffers(num_threads);
+  std::mutex stream_mutex;
+  return ParallelFor(
+      deflates.size(), num_threads, [&](size_t index, size_t worker) {
+        const auto& deflate = deflates[index];
+        const auto& puff = (*puffs)[index];
+        auto& deflate_buffer = deflate_buffers[worker];
+        auto start_byte = deflate.offset / 8;
+        auto end_byte = (deflate.offset + deflate.length + 7) / 8;
+        auto deflate_size = end_byte - start_byte;
+        const uint8_t* deflate_data;
+        {
+          std::lock_guard<std::mutex> lock(stream_mutex);
+          TEST_AND_RETURN_FALSE(deflate_stream->Seek(start_byte));
+          if (!deflate_stream->ReadZeroCopy(&deflate_data, deflate_size)) {
+            deflate_buffer.resize(deflate_size);
+            TEST_AND_RETURN_FALSE(
+                deflate_stream->Read(deflate_buffer.data(), deflate_size));
+            deflate_data = deflate_buffer.data();
+          }
+        }
+        BufferBitReader bit_reader(deflate_data, deflate_size);
+        // Drop the first unused bits.
+        size_t extra_bits_len = deflate.offset & 7;
+        TEST_AND_RETURN_FALSE(bit_reader.CacheBits(extra_bits_len));
+        bit_reader.DropBits(extra_bits_len);
+
+        BufferPuffWriter puff_writer(puff_data + puff.offset, puff.length);
+        Error error;
+        TEST_AND_RETURN_FALSE(puffers[worker].PuffDeflate(
+            &bit_reader, &puff_writer, nullptr, &error));
+        TEST_AND_RETURN_FALSE(deflate_size == bit_reader.Offset());
+        TEST_AND_RETURN_FALSE(puff.length == puff_writer.Size());
+        return true;
+      });
+}
+
+// The suffix array bsdiff builds for a source.
+class BsdiffSourceIndex : public DiffEngine::SourceIndex {
+ public:
+  explicit BsdiffSourceIndex(bsdiff::SuffixArrayIndexInterface* sai)
+      : sai_(sai) {}
+  ~BsdiffSourceIndex() override = default;
+
+  bsdiff::SuffixArrayIndexInterface* sai() const { return sai_.get(); }
+
+ private:
+  std::unique_ptr<bsdiff::SuffixArrayIndexInterface> sai_;
+
+  DISALLOW_COPY_AND_ASSIGN(BsdiffSourceIndex);
+};
+
+class BsdiffEngine : public DiffEngine {
+ public:
+  BsdiffEngine(PatchCodec codec, int brotli_quality)
+      : bspatch_engine_(CreateBspatchEngine()),
+        codec_(codec),
+        brotli_quality_(brotli_quality) {}
+  ~BsdiffEngine() override = default;
+
+  uint32_t id() const override { return kBsdiffEngineId; }
+
+  PatchCodec codec() const override { return codec_; }
+
+  bool Diff(const uint8_t* src,
+            size_t src_size,
+            const uint8_t* dst,
+            size_t dst_size,
+            const string& patch_path,
+            std::unique_ptr<SourceIndex>* src_index) const override {
+    if (src_index == nullptr) {
+      TEST_AND_RETURN_FALSE(
+          RunBsdiff(src, src_size, dst, dst_size, patch_path, nullptr));
+      return true;
+    }
+    // bsdiff builds the suffix array into |sai| if it is null, and only reads
+    // it otherwise.
+    bsdiff::SuffixArrayIndexInterface* sai = nullptr;
+    if (*src_index) {
+      sai = static_cast<BsdiffSourceIndex*>(src_index->get())->sai();
+    }
+    bool build_sai = sai == nullptr;
+    auto result = RunBsdiff(src, src_size, dst, dst_size, patch_path, &sai);
+    if (build_sai && sai != nullptr) {
+      src_index->reset(new BsdiffSourceIndex(sai));
+    }
+    TEST_AND_RETURN_FALSE(result);
+    return true;
+  }
+
+  bool Patch(UniqueStreamPtr src,
+             UniqueStreamPtr dst,
+             const uint8_t* patch,
+             size_t patch_size) const override {
+    return bspatch_engine_->Patch(std::move(src), std::move(dst), patch,
+                                  patch_size);
+  }
+
+  bool GetSourceReads(const uint8_t* patch,
+                      size_t patch_size,
+                      uint64_t src_size,
+                      vector<ByteExtent>* reads) const override {
+    return bspatch_engine_->GetSourceReads(patch, patch_size, src_size, reads);
+  }
+
+  bool SupportsCodec(PatchCodec codec) const override {
+    return bspatch_engine_->SupportsCodec(codec);
+  }
+
+ private:
+  // Writes the legacy bsdiff format for |PatchCodec::kBz2|, so the default
+  // patches stay the same. Otherwise the BSDF2 format with the compressor of
+  // |codec_| is written.
+  bool RunBsdiff(const uint8_t* src,
+                 size_t src_size,
+                 const uint8_t* dst,
+                 size_t dst_size,
+                 const string& patch_path,
+                 bsdiff::SuffixArrayIndexInterface** sai) const {
+    if (codec_ == PatchCodec::kBz2) {
+      return 0 == bsdiff::bsdiff(src, src_size, dst, dst_size,
+                                 patch_path.c_str(), sai);
+    }
+    auto compressor = codec_ == PatchCodec::kBrotli
+                          ? bsdiff::CompressorType::kBrotli
+                          : bsdiff::CompressorType::kNoCompression;
+    auto patch_writer =
+        bsdiff::CreateBSDF2PatchWriter(patch_path, compressor, brotli_quality_);
+    TEST_AND_RETURN_FALSE(patch_writer);
+    return 0 == bsdiff::bsdiff(src, src_size, dst, dst_size,
+                               patch_writer.get(), sai);
+  }
+
+  std::shared_ptr<PatchEngine> bspatch_engine_;
+  PatchCodec codec_;
+  int brotli_quality_;
+
+  DISALLOW_COPY_AND_ASSIGN(BsdiffEngine);
+};
+
 }  // namespace
 
+std::shared_ptr<DiffEngine> CreateBsdiffEngine(PatchCodec codec,
+                                               int brotli_quality) {
+  TEST_AND_RETURN_VALUE(codec == PatchCodec::kBz2 ||
+                            codec == PatchCodec::kBrotli ||
+                            codec == PatchCodec::kNone,
+                        nullptr);
+  return std::make_shared<BsdiffEngine>(codec, brotli_quality);
+}
+
+PuffDiffer::PuffDiffer(std::unique_ptr<PuffBuffer> src_puff_buffer,
+                       const vector<BitExtent>& src_deflates,
+                       const vector<ByteExtent>& src_puffs,
+                       const PuffDiffOptions& options,
+                       std::shared_ptr<DiffEngine> engine)
+    : src_puff_buffer_(std::move(src_puff_buffer)),
+      src_deflates_(src_deflates),
+      src_puffs_(src_puffs),
+      num_threads_(options.num_threads),
+      mmap_puffs_(options.mmap_puffs),
+      engine_(std::move(engine)),
+      puff_format_(options.puff_format),
+      src_index_built_(false) {}
+
+PuffDiffer::~PuffDiffer() = default;
+
+std::unique_ptr<PuffDiffer> PuffDiffer::Create(
+    UniqueStreamPtr src,
+    const vector<BitExtent>& src_deflates,
+    const string& tmp_filepath,
+    const PuffDiffOptions& options) {
+  // The puff locations of an index are only the ones of |PuffFormat::kV1|.
+  auto src_index =
+      options.puff_format == PuffFormat::kV1 ? options.src_index : nullptr;
+  auto stats = options.stats;
+  std::unique_ptr<PuffBuffer> src_puff_buffer(new PuffBuffer());
+  vector<ByteExtent> src_puffs;
+  {
+    ScopedStatsTimer timer(stats, &Stats::puff_time_ns);
+    TEST_AND_RETURN_VALUE(
+        PuffDeflateStream(std::move(src), src_deflates, options.num_threads,
+                          options.mmap_puffs ? tmp_filepath + ".src_puff" : "",
+                          src_index, options.puff_format,
+                          src_puff_buffer.get(), &src_puffs),
+        nullptr);
+  }
+  if (stats != nullptr) {
+    stats->deflates_puffed += src_deflates.size();
+    stats->puff_bytes += BytesInByteExtents(src_puffs);
+  }
+  auto engine = options.engine ? options.engine : CreateBsdiffEngine();
+  return std::unique_ptr<PuffDiffer>(
+      new PuffDiffer(std::move(src_puff_buffer), src_deflates, src_puffs,
+                     options, std::move(engine)));
+}
+
+bool PuffDiffer::RunDiff(const uint8_t* dst,
+                         size_t dst_size,
+                         const string& patch_path) {
+  auto run_diff = [&](std::unique_ptr<DiffEngine::SourceIndex>* src_index) {
+    return engine_->Diff(src_puff_buffer_->data(), src_puff_buffer_->size(),
+                         dst, dst_size, patch_path, src_index);
+  };
+  // The first diff builds the index of the source puff stream (if the engine
+  // uses one) into |src_index_|. The diffs started meanwhile wait for it, and
+  // then only read it.
+  {
+    std::lock_guard<std::mutex> lock(src_index_mutex_);
+    if (!src_index_built_) {
+      TEST_AND_RETURN_FALSE(run_diff(&src_index_));
+      src_index_built_ = true;
+      return true;
+    }
+  }
+  TEST_AND_RETURN_FALSE(run_diff(src_index_ ? &src_index_ : nullptr));
+  return true;
+}
+
+bool PuffDiffer::Diff(UniqueStreamPtr dst,
+                      const vector<BitExtent>& dst_deflates,
+                      const string& tmp_filepath,
+                      const UniqueStreamPtr& patch,
+                      const PuffDiffOptions& options) {
+  auto stats = options.stats;
+  auto cache_plan_size = options.cache_plan_size;
+  uint64_t dst_size;
+  TEST_AND_RETURN_FALSE(dst->GetSize(&dst_size));
+  PuffBuffer dst_puff_buffer;
+  vector<ByteExtent> dst_puffs;
+  {
+    ScopedStatsTimer timer(stats, &Stats::puff_time_ns);
+    TEST_AND_RETURN_FALSE(PuffDeflateStream(
+        std::move(dst), dst_deflates, num_threads_,
+        mmap_puffs_ ? tmp_filepath + ".dst_puff" : "", nullptr, puff_format_,
+        &dst_puff_buffer, &dst_puffs));
+  }
+  if (stats != nullptr) {
+    stats->deflates_puffed += dst_deflates.size();
+    stats->puff_bytes += BytesInByteExtents(dst_puffs);
+  }
+
+  vector<uint32_t> dst_crc32s;
+  if (options.add_dst_crc32s) {
+    TEST_AND_RETURN_FALSE(GetPuffCrc32s(dst_puff_buffer.data(), dst_deflates,
+                                        dst_puffs, num_threads_, puff_format_,
+                                        &dst_crc32s));
+  }
+
+  // The parts of the destination that are identical to the source are copied
+  // by |PuffPatch| instead of being diffed.
+  vector<DeflateCopy> copies;
+  FindDeflateCopies(src_deflates_, src_puffs_, src_puff_buffer_->data(),
+                    dst_deflates, dst_puffs, dst_puff_buffer.data(), &copies);
+
+  // The bsdiff patch of the first chunk is written into |tmp_filepath| and the
+  // others next to it, so the chunks can be diffed at the same time.
+  vector<PatchChunk> chunks;
+  SplitIntoChunks(dst_deflates, dst_puffs, copies, dst_size,
+                  dst_puff_buffer.size(),
+                  std::max<size_t>(options.num_chunks, 1), &chunks);
+  vector<string> chunk_paths;
+  for (size_t idx = 0; idx < chunks.size(); idx++) {
+    chunks[idx].bsdiff_patch_path =
+        idx == 0 ? tmp_filepath
+                 : tmp_filepath + ".chunk" + std::to_string(idx);
+    if (idx > 0) {
+      chunk_paths.push_back(chunks[idx].bsdiff_patch_path);
+    }
+  }
+  ScopedPathsUnlinker chunk_paths_unlinker(chunk_paths);
+
+  {
+    ScopedStatsTimer timer(stats, &Stats::bsdiff_time_ns);
+    TEST_AND_RETURN_FALSE(ParallelFor(
+        chunks.size(), num_threads_, [&](size_t index, size_t) {
+          const auto& chunk = chunks[index];
+          auto chunk_puff = dst_puff_buffer.data() + chunk.dst_puff.offset;
+          vector<ByteExtent> dst_parts, dst_puff_parts;
+          RemoveCopies(chunk.dst, chunk.dst_puff, copies, &dst_parts,
+                       &dst_puff_parts);
+          if (dst_puff_parts.empty()) {
+            // The whole chunk is copied, so its bsdiff patch is empty.
+            auto bsdiff_patch =
+                FileStream::Open(chunk.bsdiff_patch_path, false, true);
+            TEST_AND_RETURN_FALSE(bsdiff_patch);
+            TEST_AND_RETURN_FALSE(
+                truncate(chunk.bsdiff_patch_path.c_str(), 0) == 0);
+            return bsdiff_patch->Close();
+          }
+          if (dst_puff_parts.size() == 1 &&
+              dst_puff_parts[0].length == chunk.dst_puff.length) {
+            return RunDiff(chunk_puff, chunk.dst_puff.length,
+                           chunk.bsdiff_patch_path);
+          }
+          // Only the puffs of the parts around the copies are diffed, one
+          // after another.
+          Buffer patched_puff;
+          for (const auto& part : dst_puff_parts) {
+            patched_puff.insert(patched_puff.end(), chunk_puff + part.offset,
+                                chunk_puff + part.offset + part.length);
+          }
+          return RunDiff(patched_puff.data(), patched_puff.size(),
+                         chunk.bsdiff_patch_path);
+        }));
+  }
+
+  for (auto& chunk : chunks) {
+    chunk.bsdiff_patch = FileStream::Open(chunk.bsdiff_patch_path, true, false);
+    TEST_AND_RETURN_FALSE(chunk.bsdiff_patch);
+  }
+
+  auto get_src_reads = [&](const PatchChunk& chunk,
+                           vector<ByteExtent>* src_reads) {
+    uint64_t bsdiff_patch_size;
+    TEST_AND_RETURN_FALSE(chunk.bsdiff_patch->GetSize(&bsdiff_patch_size));
+    Buffer bsdiff_patch_data(bsdiff_patch_size);
+    TEST_AND_RETURN_FALSE(
+        chunk.bsdiff_patch->Read(bsdiff_patch_data.data(), bsdiff_patch_size));
+    return engine_->GetSourceReads(bsdiff_patch_data.data(),
+                                   bsdiff_patch_size, src_puff_buffer_->size(),
+                                   src_reads);
+  };
+
+  // Plan the puff cache of |PuffPatch| by following the source reads of
+  // bspatch. Chunks are patched at the same time, so instead of a plan for all
+  // of them, the source reads of each chunk are kept in the patch if the
+  // engine can find them.
+  CachePlan src_cache_plan;
+  bool use_cache_plan =
+      cache_plan_size > 0 && chunks.size() == 1 && copies.empty();
+  if (use_cache_plan) {
+    vector<ByteExtent> src_reads;
+    TEST_AND_RETURN_FALSE(get_src_reads(chunks[0], &src_reads));
+    GetPuffReads(src_reads, src_puffs_, &src_cache_plan.puff_reads);
+    MakeCachePlan(src_puffs_, cache_plan_size, &src_cache_plan);
+  } else if (chunks.size() > 1 || !copies.empty()) {
+    for (auto& chunk : chunks) {
+      uint64_t bsdiff_patch_size;
+      TEST_AND_RETURN_FALSE(chunk.bsdiff_patch->GetSize(&bsdiff_patch_size));
+      if (bsdiff_patch_size == 0) {
+        continue;
+      }
+      vector<ByteExtent> src_reads;
+      if (!get_src_reads(chunk, &src_reads)) {
+        break;
+      }
+      // Merge the adjacent reads to keep the patch header small.
+      for (const auto& read : src_reads) {
+        auto& reads = chunk.src_reads;
+        if (!reads.empty() &&
+            reads.back().offset + reads.back().length == read.offset) {
+          reads.back().length += read.length;
+        } else {
+          reads.push_back(read);
+        }
+      }
+    }
+  }
+
+  TEST_AND_RETURN_FALSE(CreatePatch(
+      chunks, copies, src_deflates_, dst_deflates, src_puffs_, dst_puffs,
+      src_puff_buffer_->size(), dst_puff_buffer.size(),
+      use_cache_plan ? &src_cache_plan : nullptr, cache_plan_size,
+      engine_->id(), engine_->codec(), dst_crc32s, puff_format_, patch));
+  for (const auto& chunk : chunks) {
+    TEST_AND_RETURN_FALSE(chunk.bsdiff_patch->Close());
+  }
+  return true;
+}
+
+bool PuffDiffer::Diff(vector<PuffDiffTarget>* targets,
+                      size_t num_diffs,
+                      const PuffDiffOptions& options) {
+  return ParallelFor(targets->size(), num_diffs, [&](size_t index, size_t) {
+    auto& target = (*targets)[index];
+    return Diff(std::move(target.dst), target.dst_deflates,
+                target.tmp_filepath, target.patch, options);
+  });
+}
+
 bool PuffDiff(UniqueStreamPtr src,
               UniqueStreamPtr dst,
               const vector<BitExtent>& src_deflates,
               const vector<BitExtent>& dst_deflates,
               const string& tmp_filepath,
-              Buffer* patch) {
-  auto puffer = std::make_shared<Puffer>();
-  auto puff_deflate_stream =
-      [&puffer](UniqueStreamPtr stream, const vector<BitExtent>& deflates,
-                Buffer* puff_buffer, vector<ByteExtent>* puffs) {
-        uint64_t puff_size;
-        TEST_AND_RETURN_FALSE(stream->Seek(0));
-        TEST_AND_RETURN_FALSE(
-            FindPuffLocations(stream, deflates, puffs, &puff_size));
-        TEST_AND_RETURN_FALSE(stream->Seek(0));
-        auto src_puffin_stream = PuffinStream::CreateForPuff(
-            std::move(stream), puffer, puff_size, deflates, *puffs);
-        puff_buffer->resize(puff_size);
-        TEST_AND_RETURN_FALSE(
-            src_puffin_stream->Read(puff_buffer->data(), puff_buffer->size()));
-        return true;
-      };
-
-  Buffer src_puff_buffer;
-  Buffer dst_puff_buffer;
-  vector<ByteExtent> src_puffs, dst_puffs;
-  TEST_AND_RETURN_FALSE(puff_deflate_stream(std::move(src), src_deflates,
-                                            &src_puff_buffer, &src_puffs));
-  TEST_AND_RETURN_FALSE(puff_deflate_stream(std::move(dst), dst_deflates,
-                                            &dst_puff_buffer, &dst_puffs));
+              const UniqueStreamPtr& patch,
+              const PuffDiffOptions& options) {
+  auto differ =
+      PuffDiffer::Create(std::move(src), src_deflates, tmp_filepath, options);
+  TEST_AND_RETURN_FALSE(differ);
+  return differ->Diff(std::move(dst), dst_deflates, tmp_filepath, patch,
+                      options);
+}
 
-  TEST_AND_RETURN_FALSE(
-      0 == bsdiff::bsdiff(src_puff_buffer.data(), src_puff_buffer.size(),
-                          dst_puff_buffer.data(), dst_puff_buffer.size(),
-                          tmp_filepath.c_str(), nullptr));
-
-  auto bsdiff_patch = FileStream::Open(tmp_filepath, true, false);
-  TEST_AND_RETURN_FALSE(bsdiff_patch);
-  uint64_t patch_size;
-  TEST_AND_RETURN_FALSE(bsdiff_patch->GetSize(&patch_size));
-  Buffer bsdiff_patch_buf(patch_size);
-  TEST_AND_RETURN_FALSE(
-      bsdiff_patch->Read(bsdiff_patch_buf.data(), bsdiff_patch_buf.size()));
-  TEST_AND_RETURN_FALSE(bsdiff_patch->Close());
+bool PuffDiff(UniqueStreamPtr src,
+              UniqueStreamPtr dst,
+              const vector<BitExtent>& src_deflates,
+              const vector<BitExtent>& dst_deflates,
+              const string& tmp_filepath,
+              Buffer* patch) {
+  return PuffDiff(std::move(src), std::move(dst), src_deflates, dst_deflates,
+                  tmp_filepath, patch, PuffDiffOptions());
+}
 
-  TEST_AND_RETURN_FALSE(CreatePatch(
-      bsdiff_patch_buf, src_deflates, dst_deflates, src_puffs, dst_puffs,
-      src_puff_buffer.size(), dst_puff_buffer.size(), patch));
-  return true;
+bool PuffDiff(UniqueStreamPtr src,
+              UniqueStreamPtr dst,
+              const vector<BitExtent>& src_deflates,
+              const vector<BitExtent>& dst_deflates,
+              const string& tmp_filepath,
+              Buffer* patch,
+              const PuffDiffOptions& options) {
+  patch->clear();
+  return PuffDiff(std::move(src), std::move(dst), src_deflates, dst_deflates,
+                  tmp_filepath, MemoryStream::CreateForWrite(patch), options);
 }
 
 bool PuffDiff(const Buffer& src,
@@ -151,9 +962,20 @@ bool PuffDiff(const Buffer& src,
               const vector<BitExtent>& dst_deflates,
               const string& tmp_filepath,
               Buffer* patch) {
+  return PuffDiff(src, dst, src_deflates, dst_deflates, tmp_filepath, patch,
+                  PuffDiffOptions());
+}
+
+bool PuffDiff(const Buffer& src,
+              const Buffer& dst,
+              const vector<BitExtent>& src_deflates,
+              const vector<BitExtent>& dst_deflates,
+              const string& tmp_filepath,
+              Buffer* patch,
+              const PuffDiffOptions& options) {
   return PuffDiff(MemoryStream::CreateForRead(src),
                   MemoryStream::CreateForRead(dst), src_deflates, dst_deflates,
-                  tmp_filepath, patch);
+                  tmp_filepath, patch, options);
 }
 
 }  // namespace puffin
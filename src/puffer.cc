@@ -23,22 +23,125 @@ namespace puffin {
 using std::vector;
 using std::string;
 
-Puffer::Puffer() : dyn_ht_(new HuffmanTable()), fix_ht_(new HuffmanTable()) {}
+namespace {
 
-Puffer::~Puffer() {}
+// The maximum number of decoded literals that are staged before they are
+// inserted into the puff writer as one |PuffData::Type::kLiterals|.
+constexpr size_t kLiteralsStagingSize = 4096;
 
-bool Puffer::PuffDeflate(BitReaderInterface* br,
-                         PuffWriterInterface* pw,
-                         vector<BitExtent>* deflates,
-                         Error* error) const {
+// Reads the next literal/length symbol of a block coded with |ht| into |entry|
+// and the value of its extra bits into |extra_bits_value|.
+template <typename BitReaderType>
+inline bool ReadLitLenSymbol(HuffmanTable* ht,
+                             BitReaderType* br,
+                             uint32_t* entry,
+                             uint32_t* extra_bits_value,
+                             Error* error) {
+  auto max_bits = ht->LitLenMaxBits();
+  // The fast path caches the longest literal/length code and its extra bits at
+  // once, so no more boundary checks is needed for this symbol.
+  if (br->CacheBits(max_bits + kMaxLengthExtraBits)) {
+    auto bits = br->ReadBits(max_bits + kMaxLengthExtraBits);
+    *entry = ht->LitLenEntry(bits);
+    TEST_AND_RETURN_FALSE_SET_ERROR(HuffmanTable::IsValidEntry(*entry),
+                                    Error::kInvalidInput);
+    auto nbits = HuffmanTable::EntryBits(*entry);
+    auto extra_bits_len = HuffmanTable::EntryExtraBits(*entry);
+    *extra_bits_value = (bits >> nbits) & ((1U << extra_bits_len) - 1);
+    br->DropBits(nbits + extra_bits_len);
+    return true;
+  }
+  if (!br->CacheBits(max_bits)) {
+    // It could be the end of buffer and the bit length of the end_of_block
+    // symbol has less than maximum bit length of current Huffman table. So
+    // only asking for the size of end of block symbol (256).
+    TEST_AND_RETURN_FALSE_SET_ERROR(ht->EndOfBlockBitLength(&max_bits),
+                                    Error::kInvalidInput);
+  }
+  TEST_AND_RETURN_FALSE_SET_ERROR(br->CacheBits(max_bits),
+                                  Error::kInsufficientInput);
+  *entry = ht->LitLenEntry(br->ReadBits(max_bits));
+  TEST_AND_RETURN_FALSE_SET_ERROR(HuffmanTable::IsValidEntry(*entry),
+                                  Error::kInvalidInput);
+  br->DropBits(HuffmanTable::EntryBits(*entry));
+  *extra_bits_value = 0;
+  auto extra_bits_len = HuffmanTable::EntryExtraBits(*entry);
+  if (extra_bits_len) {
+    TEST_AND_RETURN_FALSE_SET_ERROR(br->CacheBits(extra_bits_len),
+                                    Error::kInsufficientInput);
+    *extra_bits_value = br->ReadBits(extra_bits_len);
+    br->DropBits(extra_bits_len);
+  }
+  return true;
+}
+
+// Similar to |ReadLitLenSymbol|, but reads a distance symbol.
+template <typename BitReaderType>
+inline bool ReadDistanceSymbol(HuffmanTable* ht,
+                               BitReaderType* br,
+                               uint32_t* entry,
+                               uint32_t* extra_bits_value,
+                               Error* error) {
+  auto max_bits = ht->DistanceMaxBits();
+  if (br->CacheBits(max_bits + kMaxDistanceExtraBits)) {
+    auto bits = br->ReadBits(max_bits + kMaxDistanceExtraBits);
+    *entry = ht->DistanceEntry(bits);
+    TEST_AND_RETURN_FALSE_SET_ERROR(HuffmanTable::IsValidEntry(*entry),
+                                    Error::kInvalidInput);
+    auto nbits = HuffmanTable::EntryBits(*entry);
+    auto extra_bits_len = HuffmanTable::EntryExtraBits(*entry);
+    *extra_bits_value = (bits >> nbits) & ((1U << extra_bits_len) - 1);
+    br->DropBits(nbits + extra_bits_len);
+    return true;
+  }
+  TEST_AND_RETURN_FALSE_SET_ERROR(br->CacheBits(max_bits),
+                                  Error::kInsufficientInput);
+  *entry = ht->DistanceEntry(br->ReadBits(max_bits));
+  TEST_AND_RETURN_FALSE_SET_ERROR(HuffmanTable::IsValidEntry(*entry),
+                                  Error::kInvalidInput);
+  br->DropBits(HuffmanTable::EntryBits(*entry));
+  *extra_bits_value = 0;
+  auto extra_bits_len = HuffmanTable::EntryExtraBits(*entry);
+  if (extra_bits_len) {
+    TEST_AND_RETURN_FALSE_SET_ERROR(br->CacheBits(extra_bits_len),
+                                    Error::kInsufficientInput);
+    *extra_bits_value = br->ReadBits(extra_bits_len);
+    br->DropBits(extra_bits_len);
+  }
+  return true;
+}
+
+// The implementation of |Puffer::PuffDeflate|. It is a template on the types of
+// the bit reader and the puff writer so calls to final types like
+// |BufferBitReader| and |PuffSizeWriter| can be inlined.
+template <typename BitReaderType, typename PuffWriterType>
+bool PuffDeflateImpl(HuffmanTable* fix_ht,
+                     HuffmanTable* dyn_ht,
+                     BitReaderType* br,
+                     PuffWriterType* pw,
+                     vector<BitExtent>* deflates,
+                     vector<ByteExtent>* puffs,
+                     Error* error) {
   *error = Error::kSuccess;
   PuffData pd;
   HuffmanTable* cur_ht;
+  // Runs of literals are decoded into |literals| and inserted all at once, so
+  // the writer knows the length of the run up front.
+  uint8_t literals[kLiteralsStagingSize];
+  size_t num_literals = 0;
+  auto insert_literals = [&pd, &literals, &num_literals, pw, error]() {
+    pd.type = PuffData::Type::kLiterals;
+    pd.length = num_literals;
+    pd.literals = literals;
+    num_literals = 0;
+    return pw->Insert(pd, error);
+  };
   // No bits left to read, return. We try to cache at least eight bits because
   // the minimum length of a deflate bit stream is 8: (fixed huffman table) 3
   // bits header + 5 bits just one len/dist symbol.
   while (br->CacheBits(8)) {
     auto start_bit_offset = br->OffsetInBits();
+    auto start_puff_offset = pw->Size();
 
     TEST_AND_RETURN_FALSE_SET_ERROR(br->CacheBits(3),
                                     Error::kInsufficientInput);
@@ -87,9 +190,8 @@ bool Puffer::PuffDeflate(BitReaderInterface* br,
         // Insert all the raw literals.
         pd.type = PuffData::Type::kLiterals;
         pd.length = len;
-        TEST_AND_RETURN_FALSE_SET_ERROR(
-            br->GetByteReaderFn(pd.length, &pd.read_fn),
-            Error::kInsufficientInput);
+        TEST_AND_RETURN_FALSE_SET_ERROR(br->ReadBytes(pd.length, &pd.literals),
+                                        Error::kInsufficientInput);
         TEST_AND_RETURN_FALSE(pw->Insert(pd, error));
 
         pd.type = PuffData::Type::kEndOfBlock;
@@ -99,14 +201,18 @@ bool Puffer::PuffDeflate(BitReaderInterface* br,
           deflates->emplace_back(start_bit_offset,
                                  br->OffsetInBits() - start_bit_offset);
         }
+        if (puffs != nullptr) {
+          puffs->emplace_back(start_puff_offset,
+                              pw->Size() - start_puff_offset);
+        }
 
         // continue the loop. Do not read any literal/length/distance.
         continue;
       }
 
       case BlockType::kFixed:
-        fix_ht_->BuildFixedHuffmanTable();
-        cur_ht = fix_ht_.get();
+        fix_ht->BuildFixedHuffmanTable();
+        cur_ht = fix_ht;
         pd.type = PuffData::Type::kBlockMetadata;
         pd.block_metadata[0] = block_header;
         pd.length = 1;
@@ -117,11 +223,11 @@ bool Puffer::PuffDeflate(BitReaderInterface* br,
         pd.type = PuffData::Type::kBlockMetadata;
         pd.block_metadata[0] = block_header;
         pd.length = sizeof(pd.block_metadata) - 1;
-        TEST_AND_RETURN_FALSE(dyn_ht_->BuildDynamicHuffmanTable(
+        TEST_AND_RETURN_FALSE(dyn_ht->BuildDynamicHuffmanTable(
             br, &pd.block_metadata[1], &pd.length, error));
         pd.length += 1;  // For the header.
         TEST_AND_RETURN_FALSE(pw->Insert(pd, error));
-        cur_ht = dyn_ht_.get();
+        cur_ht = dyn_ht;
         break;
 
       default:
@@ -133,74 +239,106 @@ bool Puffer::PuffDeflate(BitReaderInterface* br,
 
     while (true) {  // Breaks when the end of block is reached.
       auto max_bits = cur_ht->LitLenMaxBits();
-      if (!br->CacheBits(max_bits)) {
-        // It could be the end of buffer and the bit length of the end_of_block
-        // symbol has less than maximum bit length of current Huffman table. So
-        // only asking for the size of end of block symbol (256).
-        TEST_AND_RETURN_FALSE_SET_ERROR(cur_ht->EndOfBlockBitLength(&max_bits),
+      uint32_t entry;
+      uint32_t extra_bits_value;
+      // The fast path caches the longest literal/length code and its extra bits
+      // at once, so no more boundary checks is needed for this symbol.
+      if (br->CacheBits(max_bits + kMaxLengthExtraBits)) {
+        auto bits = br->ReadBits(max_bits + kMaxLengthExtraBits);
+        entry = cur_ht->LitLenEntry(bits);
+        TEST_AND_RETURN_FALSE_SET_ERROR(HuffmanTable::IsValidEntry(entry),
+                                        Error::kInvalidInput);
+        auto nbits = HuffmanTable::EntryBits(entry);
+        auto extra_bits_len = HuffmanTable::EntryExtraBits(entry);
+        extra_bits_value = (bits >> nbits) & ((1U << extra_bits_len) - 1);
+        br->DropBits(nbits + extra_bits_len);
+      } else {
+        if (!br->CacheBits(max_bits)) {
+          // It could be the end of buffer and the bit length of the
+          // end_of_block symbol has less than maximum bit length of current
+          // Huffman table. So only asking for the size of end of block symbol
+          // (256).
+          TEST_AND_RETURN_FALSE_SET_ERROR(
+              cur_ht->EndOfBlockBitLength(&max_bits), Error::kInvalidInput);
+        }
+        TEST_AND_RETURN_FALSE_SET_ERROR(br->CacheBits(max_bits),
+                                        Error::kInsufficientInput);
+        entry = cur_ht->LitLenEntry(br->ReadBits(max_bits));
+        TEST_AND_RETURN_FALSE_SET_ERROR(HuffmanTable::IsValidEntry(entry),
                                         Error::kInvalidInput);
+        br->DropBits(HuffmanTable::EntryBits(entry));
+        extra_bits_value = 0;
+        auto extra_bits_len = HuffmanTable::EntryExtraBits(entry);
+        if (extra_bits_len) {
+          TEST_AND_RETURN_FALSE_SET_ERROR(br->CacheBits(extra_bits_len),
+                                          Error::kInsufficientInput);
+          extra_bits_value = br->ReadBits(extra_bits_len);
+          br->DropBits(extra_bits_len);
+        }
       }
-      TEST_AND_RETURN_FALSE_SET_ERROR(br->CacheBits(max_bits),
-                                      Error::kInsufficientInput);
-      auto bits = br->ReadBits(max_bits);
-      uint16_t lit_len_alphabet;
-      size_t nbits;
-      TEST_AND_RETURN_FALSE_SET_ERROR(
-          cur_ht->LitLenAlphabet(bits, &lit_len_alphabet, &nbits),
-          Error::kInvalidInput);
-      br->DropBits(nbits);
+
+      auto lit_len_alphabet = HuffmanTable::EntryAlphabet(entry);
       if (lit_len_alphabet < 256) {
-        pd.type = PuffData::Type::kLiteral;
-        pd.byte = lit_len_alphabet;
-        TEST_AND_RETURN_FALSE(pw->Insert(pd, error));
+        literals[num_literals++] = lit_len_alphabet;
+        if (num_literals == kLiteralsStagingSize) {
+          TEST_AND_RETURN_FALSE(insert_literals());
+        }
+        continue;
+      }
 
-      } else if (256 == lit_len_alphabet) {
+      if (num_literals > 0) {
+        TEST_AND_RETURN_FALSE(insert_literals());
+      }
+      if (256 == lit_len_alphabet) {
         pd.type = PuffData::Type::kEndOfBlock;
         TEST_AND_RETURN_FALSE(pw->Insert(pd, error));
         if (deflates != nullptr) {
           deflates->emplace_back(start_bit_offset,
                                  br->OffsetInBits() - start_bit_offset);
         }
+        if (puffs != nullptr) {
+          puffs->emplace_back(start_puff_offset,
+                              pw->Size() - start_puff_offset);
+        }
         break;  // Breaks the loop.
       } else {
         TEST_AND_RETURN_FALSE_SET_ERROR(lit_len_alphabet <= 285,
                                         Error::kInvalidInput);
         // Reading length.
-        auto len_code_start = lit_len_alphabet - 257;
-        auto extra_bits_len = kLengthExtraBits[len_code_start];
-        uint16_t extra_bits_value = 0;
-        if (extra_bits_len) {
-          TEST_AND_RETURN_FALSE_SET_ERROR(br->CacheBits(extra_bits_len),
-                                          Error::kInsufficientInput);
-          extra_bits_value = br->ReadBits(extra_bits_len);
-          br->DropBits(extra_bits_len);
-        }
-        auto length = kLengthBases[len_code_start] + extra_bits_value;
-
-        TEST_AND_RETURN_FALSE_SET_ERROR(
-            br->CacheBits(cur_ht->DistanceMaxBits()),
-            Error::kInsufficientInput);
-        auto bits = br->ReadBits(cur_ht->DistanceMaxBits());
-        uint16_t distance_alphabet;
-        size_t nbits;
-        TEST_AND_RETURN_FALSE_SET_ERROR(
-            cur_ht->DistanceAlphabet(bits, &distance_alphabet, &nbits),
-            Error::kInvalidInput);
-        br->DropBits(nbits);
+        auto length = kLengthBases[lit_len_alphabet - 257] + extra_bits_value;
 
         // Reading distance.
-        extra_bits_len = kDistanceExtraBits[distance_alphabet];
-        extra_bits_value = 0;
-        if (extra_bits_len) {
-          TEST_AND_RETURN_FALSE_SET_ERROR(br->CacheBits(extra_bits_len),
+        auto distance_max_bits = cur_ht->DistanceMaxBits();
+        if (br->CacheBits(distance_max_bits + kMaxDistanceExtraBits)) {
+          auto bits = br->ReadBits(distance_max_bits + kMaxDistanceExtraBits);
+          entry = cur_ht->DistanceEntry(bits);
+          TEST_AND_RETURN_FALSE_SET_ERROR(HuffmanTable::IsValidEntry(entry),
+                                          Error::kInvalidInput);
+          auto nbits = HuffmanTable::EntryBits(entry);
+          auto extra_bits_len = HuffmanTable::EntryExtraBits(entry);
+          extra_bits_value = (bits >> nbits) & ((1U << extra_bits_len) - 1);
+          br->DropBits(nbits + extra_bits_len);
+        } else {
+          TEST_AND_RETURN_FALSE_SET_ERROR(br->CacheBits(distance_max_bits),
                                           Error::kInsufficientInput);
-          extra_bits_value = br->ReadBits(extra_bits_len);
-          br->DropBits(extra_bits_len);
+          entry = cur_ht->DistanceEntry(br->ReadBits(distance_max_bits));
+          TEST_AND_RETURN_FALSE_SET_ERROR(HuffmanTable::IsValidEntry(entry),
+                                          Error::kInvalidInput);
+          br->DropBits(HuffmanTable::EntryBits(entry));
+          extra_bits_value = 0;
+          auto extra_bits_len = HuffmanTable::EntryExtraBits(entry);
+          if (extra_bits_len) {
+            TEST_AND_RETURN_FALSE_SET_ERROR(br->CacheBits(extra_bits_len),
+                                            Error::kInsufficientInput);
+            extra_bits_value = br->ReadBits(extra_bits_len);
+            br->DropBits(extra_bits_len);
+          }
         }
 
         pd.type = PuffData::Type::kLenDist;
         pd.length = length;
-        pd.distance = kDistanceBases[distance_alphabet] + extra_bits_value;
+        pd.distance = kDistanceBases[HuffmanTable::EntryAlphabet(entry)] +
+                      extra_bits_value;
         TEST_AND_RETURN_FALSE(pw->Insert(pd, error));
       }
     }
@@ -209,4 +347,208 @@ bool Puffer::PuffDeflate(BitReaderInterface* br,
   return true;
 }
 
+// The implementation of |Puffer::ScanDeflate|. It decodes the symbols like
+// |PuffDeflateImpl|, but does not keep the literals or create any |PuffData|.
+// The size of the puff is counted directly into |psw|, and the data of the
+// uncompressed blocks are skipped using their LEN.
+template <typename BitReaderType>
+bool ScanDeflateImpl(HuffmanTable* fix_ht,
+                     HuffmanTable* dyn_ht,
+                     BitReaderType* br,
+                     PuffSizeWriter* psw,
+                     vector<BitExtent>* deflates,
+                     vector<ByteExtent>* puffs,
+                     Error* error) {
+  *error = Error::kSuccess;
+  uint8_t block_metadata[sizeof(PuffData::block_metadata)];
+  HuffmanTable* cur_ht;
+  // See |PuffDeflateImpl| for why at least eight bits are cached.
+  while (br->CacheBits(8)) {
+    auto start_bit_offset = br->OffsetInBits();
+    auto start_puff_offset = psw->Size();
+    auto add_extents = [&]() {
+      if (deflates != nullptr) {
+        deflates->emplace_back(start_bit_offset,
+                               br->OffsetInBits() - start_bit_offset);
+      }
+      if (puffs != nullptr) {
+        puffs->emplace_back(start_puff_offset,
+                            psw->Size() - start_puff_offset);
+      }
+    };
+
+    TEST_AND_RETURN_FALSE_SET_ERROR(br->CacheBits(3),
+                                    Error::kInsufficientInput);
+    br->DropBits(1);  // BFINAL
+    uint8_t type = br->ReadBits(2);  // BTYPE
+    br->DropBits(2);
+    switch (static_cast<BlockType>(type)) {
+      case BlockType::kUncompressed: {
+        br->SkipBoundaryBits();
+        TEST_AND_RETURN_FALSE_SET_ERROR(br->CacheBits(32),
+                                        Error::kInsufficientInput);
+        auto len = br->ReadBits(16);  // LEN
+        br->DropBits(16);
+        auto nlen = br->ReadBits(16);  // NLEN
+        br->DropBits(16);
+        if ((len ^ nlen) != 0xFFFF) {
+          LOG(ERROR) << "Length of uncompressed data is invalid;"
+                     << " LEN(" << len << ") NLEN(" << nlen << ")";
+          *error = Error::kInvalidInput;
+          return false;
+        }
+        const uint8_t* literals;
+        TEST_AND_RETURN_FALSE_SET_ERROR(br->ReadBytes(len, &literals),
+                                        Error::kInsufficientInput);
+        psw->AddBlockMetadata(1);
+        psw->AddLiterals(len);
+        psw->AddEndOfBlock();
+        add_extents();
+        continue;
+      }
+
+      case BlockType::kFixed:
+        fix_ht->BuildFixedHuffmanTable();
+        cur_ht = fix_ht;
+        psw->AddBlockMetadata(1);
+        break;
+
+      case BlockType::kDynamic: {
+        size_t length = sizeof(block_metadata) - 1;
+        TEST_AND_RETURN_FALSE(dyn_ht->BuildDynamicHuffmanTable(
+            br, &block_metadata[1], &length, error));
+        psw->AddBlockMetadata(length + 1);  // For the header.
+        cur_ht = dyn_ht;
+        break;
+      }
+
+      default:
+        LOG(ERROR) << "Invalid block compression type: "
+                   << static_cast<int>(type);
+        *error = Error::kInvalidInput;
+        return false;
+    }
+
+    // Only the number of literals in a row is needed for the size of the puff.
+    size_t num_literals = 0;
+    while (true) {  // Breaks when the end of block is reached.
+      uint32_t entry;
+      uint32_t extra_bits_value;
+      TEST_AND_RETURN_FALSE(
+          ReadLitLenSymbol(cur_ht, br, &entry, &extra_bits_value, error));
+      auto lit_len_alphabet = HuffmanTable::EntryAlphabet(entry);
+      if (lit_len_alphabet < 256) {
+        num_literals++;
+        continue;
+      }
+
+      if (num_literals > 0) {
+        psw->AddLiterals(num_literals);
+        num_literals = 0;
+      }
+      if (256 == lit_len_alphabet) {
+        psw->AddEndOfBlock();
+        add_extents();
+        break;  // Breaks the loop.
+      }
+      TEST_AND_RETURN_FALSE_SET_ERROR(lit_len_alphabet <= 285,
+                                      Error::kInvalidInput);
+      auto length = kLengthBases[lit_len_alphabet - 257] + extra_bits_value;
+      // Only the size of the distance is needed, which depends on its value in
+      // some formats.
+      TEST_AND_RETURN_FALSE(
+          ReadDistanceSymbol(cur_ht, br, &entry, &extra_bits_value, error));
+      auto distance =
+          kDistanceBases[HuffmanTable::EntryAlphabet(entry)] + extra_bits_value;
+      psw->AddLenDist(length, distance);
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+Puffer::Puffer()
+    : dyn_ht_(new HuffmanTable(kDefaultMaxCachedTables)),
+      fix_ht_(new HuffmanTable()) {}
+
+Puffer::~Puffer() {}
+
+bool Puffer::PuffDeflate(BitReaderInterface* br,
+                         PuffWriterInterface* pw,
+                         vector<BitExtent>* deflates,
+                         Error* error) const {
+  return PuffDeflate(br, pw, deflates, nullptr, error);
+}
+
+bool Puffer::PuffDeflate(BitReaderInterface* br,
+                         PuffSizeWriter* pw,
+                         vector<BitExtent>* deflates,
+                         Error* error) const {
+  return PuffDeflate(br, pw, deflates, nullptr, error);
+}
+
+bool Puffer::PuffDeflate(BitReaderInterface* br,
+                         PuffWriterInterface* pw,
+                         vector<BitExtent>* deflates,
+                         vector<ByteExtent>* puffs,
+                         Error* error) const {
+  return PuffDeflateImpl(fix_ht_.get(), dyn_ht_.get(), br, pw, deflates, puffs,
+                         error);
+}
+
+bool Puffer::PuffDeflate(BitReaderInterface* br,
+                         PuffSizeWriter* pw,
+                         vector<BitExtent>* deflates,
+                         vector<ByteExtent>* puffs,
+                         Error* error) const {
+  return PuffDeflateImpl(fix_ht_.get(), dyn_ht_.get(), br, pw, deflates, puffs,
+                         error);
+}
+
+bool Puffer::PuffDeflate(BufferBitReader* br,
+                         BufferPuffWriter* pw,
+                         vector<BitExtent>* deflates,
+                         Error* error) const {
+  return PuffDeflate(br, pw, deflates, nullptr, error);
+}
+
+bool Puffer::PuffDeflate(BufferBitReader* br,
+                         PuffSizeWriter* pw,
+                         vector<BitExtent>* deflates,
+                         Error* error) const {
+  return PuffDeflate(br, pw, deflates, nullptr, error);
+}
+
+bool Puffer::PuffDeflate(BufferBitReader* br,
+                         BufferPuffWriter* pw,
+                         vector<BitExtent>* deflates,
+                         vector<ByteExtent>* puffs,
+                         Error* error) const {
+  return PuffDeflateImpl(fix_ht_.get(), dyn_ht_.get(), br, pw, deflates, puffs,
+                         error);
+}
+
+bool Puffer::PuffDeflate(BufferBitReader* br,
+                         PuffSizeWriter* pw,
+                         vector<BitExtent>* deflates,
+                         vector<ByteExtent>* puffs,
+                         Error* error) const {
+  return PuffDeflateImpl(fix_ht_.get(), dyn_ht_.get(), br, pw, deflates, puffs,
+                         error);
+}
+
+bool Puffer::ScanDeflate(BufferBitReader* br,
+                         vector<BitExtent>* deflates,
+                         vector<ByteExtent>* puffs,
+                         uint64_t* puff_size,
+                         Error* error,
+                         PuffFormat format) const {
+  PuffSizeWriter psw(format);
+  TEST_AND_RETURN_FALSE(ScanDeflateImpl(fix_ht_.get(), dyn_ht_.get(), br, &psw,
+                                        deflates, puffs, error));
+  *puff_size = psw.Size();
+  return true;
+}
+
 }  // namespace puffin
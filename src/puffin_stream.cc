@@ -12,22 +12,47 @@
 
 #include "puffin/src/bit_reader.h"
 #include "puffin/src/bit_writer.h"
+#include "puffin/src/buffer_pool.h"
 #include "puffin/src/include/puffin/common.h"
 #include "puffin/src/include/puffin/huffer.h"
 #include "puffin/src/include/puffin/puffer.h"
 #include "puffin/src/include/puffin/stream.h"
+#include "puffin/src/incremental_huffer.h"
+#include "puffin/src/puff_cache.h"
+#include "puffin/src/puff_crc32.h"
 #include "puffin/src/puff_reader.h"
 #include "puffin/src/puff_writer.h"
 #include "puffin/src/set_errors.h"
+#include "puffin/src/thread_pool.h"
 
 namespace puffin {
 
+constexpr uint64_t PuffinStream::kDefaultMaxReadaheadSize;
+
 using std::vector;
 using std::unique_ptr;
 using std::shared_ptr;
 
 namespace {
 
+// The number of entries of the read plan searched for a read that does not
+// match the next entry.
+constexpr size_t kReadPlanSearchLength = 16;
+
+// The maximum number of entries of the read plan ahead of the current read
+// that are prefetched.
+constexpr size_t kPrefetchLength = 4;
+
+// The puffs huffed on worker threads are buffered whole, so only the ones up to
+// this size are. The larger ones, and all of them when huffing on the calling
+// thread, are huffed as they are written.
+constexpr uint64_t kMaxBufferedPuffSize = 1024 * 1024;  // 1 MiB
+
+// Returns the number of bytes the bits of |deflate| are in.
+inline uint64_t GetByteLength(const BitExtent& deflate) {
+  return (deflate.offset + deflate.length + 7) / 8 - deflate.offset / 8;
+}
+
 bool CheckArgsIntegrity(uint64_t puff_size,
                         const std::vector<BitExtent>& deflates,
                         const std::vector<ByteExtent>& puffs) {
@@ -52,38 +77,127 @@ bool CheckArgsIntegrity(uint64_t puff_size,
   return true;
 }
 
+// Huffs the puff of |deflate| in |puff| (in |format|) into |deflate_buffer|.
+// |first_bits| are the non-deflate bits of the first byte of |deflate|. If
+// |extra_byte| is one, the byte after the puff in |puff| fills the rest of the
+// last byte. Records the huffing in |stats| if it is not null.
+bool HuffPuff(Huffer* huffer,
+              PuffFormat format,
+              const BitExtent& deflate,
+              uint8_t first_bits,
+              const uint8_t* puff,
+              uint64_t puff_length,
+              size_t extra_byte,
+              Buffer* deflate_buffer,
+              Stats* stats) {
+  ScopedStatsTimer timer(stats, &Stats::huff_time_ns);
+  if (stats != nullptr) {
+    stats->deflates_huffed++;
+    stats->huff_bytes += puff_length;
+  }
+  auto start_byte = deflate.offset / 8;
+  auto end_byte = (deflate.offset + deflate.length + 7) / 8;
+  auto bytes_to_write = end_byte - start_byte;
+
+  deflate_buffer->resize(bytes_to_write);
+  BufferBitWriter bit_writer(deflate_buffer->data(), bytes_to_write);
+  BufferPuffReader puff_reader(puff, puff_length, format);
+
+  // Write the non-deflate bits of the first byte if it has any.
+  TEST_AND_RETURN_FALSE(bit_writer.WriteBits(deflate.offset & 7, first_bits));
+
+  Error error;
+  TEST_AND_RETURN_FALSE(huffer->HuffDeflate(&puff_reader, &bit_writer, &error));
+  TEST_AND_RETURN_FALSE(bit_writer.Size() == bytes_to_write);
+  TEST_AND_RETURN_FALSE(puff_reader.BytesLeft() == 0);
+
+  if (extra_byte == 1) {
+    deflate_buffer->data()[bytes_to_write - 1] |=
+        puff[puff_length] << ((deflate.offset + deflate.length) & 7);
+  }
+  return true;
+}
+
 }  // namespace
 
-UniqueStreamPtr PuffinStream::CreateForPuff(
-    UniqueStreamPtr stream,
-    std::shared_ptr<Puffer> puffer,
-    uint64_t puff_size,
-    const std::vector<BitExtent>& deflates,
-    const std::vector<ByteExtent>& puffs,
-    size_t max_cache_size) {
+UniqueStreamPtr PuffinStream::CreateForPuff(UniqueStreamPtr stream,
+                                            std::shared_ptr<Puffer> puffer,
+                                            uint64_t puff_size,
+                                            const vector<BitExtent>& deflates,
+                                            const vector<ByteExtent>& puffs,
+                                            size_t max_cache_size) {
+  PuffOptions options;
+  options.max_cache_size = max_cache_size;
+  return CreateForPuff(std::move(stream), puffer, puff_size, deflates, puffs,
+                       options);
+}
+
+UniqueStreamPtr PuffinStream::CreateForPuff(UniqueStreamPtr stream,
+                                            std::shared_ptr<Puffer> puffer,
+                                            uint64_t puff_size,
+                                            const vector<BitExtent>& deflates,
+                                            const vector<ByteExtent>& puffs,
+                                            const PuffOptions& options) {
   TEST_AND_RETURN_VALUE(CheckArgsIntegrity(puff_size, deflates, puffs),
                         nullptr);
+  TEST_AND_RETURN_VALUE(CheckArgsIntegrity(puff_size, options.subblock_deflates,
+                                           options.subblock_puffs),
+                        nullptr);
   TEST_AND_RETURN_VALUE(stream->Seek(0), nullptr);
 
-  UniqueStreamPtr puffin_stream(new PuffinStream(std::move(stream), puffer,
-                                                 nullptr, puff_size, deflates,
-                                                 puffs, max_cache_size));
+  UniqueStreamPtr puffin_stream(
+      new PuffinStream(std::move(stream), puffer, nullptr, puff_size, deflates,
+                       puffs, options, HuffOptions()));
   TEST_AND_RETURN_VALUE(puffin_stream->Seek(0), nullptr);
   return puffin_stream;
 }
 
-UniqueStreamPtr PuffinStream::CreateForHuff(
-    UniqueStreamPtr stream,
-    std::shared_ptr<Huffer> huffer,
-    uint64_t puff_size,
-    const std::vector<BitExtent>& deflates,
-    const std::vector<ByteExtent>& puffs) {
+UniqueStreamPtr PuffinStream::CreateForPuff(UniqueStreamPtr stream,
+                                            std::shared_ptr<Puffer> puffer,
+                                            const PuffIndex& index,
+                                            size_t max_cache_size) {
+  PuffOptions options;
+  options.max_cache_size = max_cache_size;
+  return CreateForPuff(std::move(stream), puffer, index, options);
+}
+
+UniqueStreamPtr PuffinStream::CreateForPuff(UniqueStreamPtr stream,
+                                            std::shared_ptr<Puffer> puffer,
+                                            const PuffIndex& index,
+                                            const PuffOptions& options) {
+  TEST_AND_RETURN_VALUE(options.puff_format == PuffFormat::kV1, nullptr);
+  auto index_options = options;
+  index_options.subblock_deflates = index.subblock_deflates;
+  index_options.subblock_puffs = index.subblock_puffs;
+  return CreateForPuff(std::move(stream), puffer, index.puff_size,
+                       index.deflates, index.puffs, index_options);
+}
+
+UniqueStreamPtr PuffinStream::CreateForHuff(UniqueStreamPtr stream,
+                                            std::shared_ptr<Huffer> huffer,
+                                            uint64_t puff_size,
+                                            const vector<BitExtent>& deflates,
+                                            const vector<ByteExtent>& puffs) {
+  return CreateForHuff(std::move(stream), huffer, puff_size, deflates, puffs,
+                       HuffOptions());
+}
+
+UniqueStreamPtr PuffinStream::CreateForHuff(UniqueStreamPtr stream,
+                                            std::shared_ptr<Huffer> huffer,
+                                            uint64_t puff_size,
+                                            const vector<BitExtent>& deflates,
+                                            const vector<ByteExtent>& puffs,
+                                            const HuffOptions& options) {
   TEST_AND_RETURN_VALUE(CheckArgsIntegrity(puff_size, deflates, puffs),
                         nullptr);
+  TEST_AND_RETURN_VALUE(
+      options.crc32s.empty() || options.crc32s.size() == deflates.size(),
+      nullptr);
   TEST_AND_RETURN_VALUE(stream->Seek(0), nullptr);
 
-  UniqueStreamPtr puffin_stream(new PuffinStream(
-      std::move(stream), nullptr, huffer, puff_size, deflates, puffs, 0));
+  UniqueStreamPtr puffin_stream(
+      new PuffinStream(std::move(stream), nullptr, huffer, puff_size, deflates,
+                       puffs, PuffOptions(), options));
   TEST_AND_RETURN_VALUE(puffin_stream->Seek(0), nullptr);
   return puffin_stream;
 }
@@ -94,22 +208,48 @@ PuffinStream::PuffinStream(UniqueStreamPtr stream,
                            uint64_t puff_size,
                            const vector<BitExtent>& deflates,
                            const vector<ByteExtent>& puffs,
-                           size_t max_cache_size)
+                           const PuffOptions& puff_options,
+                           const HuffOptions& huff_options)
     : stream_(std::move(stream)),
       puffer_(puffer),
       huffer_(huffer),
+      puff_format_(puffer ? puff_options.puff_format
+                          : huff_options.puff_format),
       puff_stream_size_(puff_size),
       deflates_(deflates),
       puffs_(puffs),
       puff_pos_(0),
       skip_bytes_(0),
       deflate_bit_pos_(0),
+      first_bits_(0),
       last_byte_(0),
       extra_byte_(0),
       is_for_puff_(puffer_ ? true : false),
       closed_(false),
-      max_cache_size_(max_cache_size),
-      cur_cache_size_(0) {
+      subblock_deflates_(puff_options.subblock_deflates),
+      subblock_puffs_(puff_options.subblock_puffs),
+      max_cache_size_(puff_options.max_cache_size),
+      buffer_pool_(puff_options.buffer_pool),
+      stats_(puffer ? puff_options.stats : huff_options.stats),
+      puff_cache_(puff_options.puff_cache),
+      cache_extents_(puff_options.cache_extents),
+      read_plan_pos_(0),
+      deflate_cache_pool_(puff_options.deflate_cache_pool),
+      uncached_puff_id_(puffs.size() + 1),
+      readahead_depth_(puff_options.readahead_depth),
+      max_readahead_size_(puff_options.max_readahead_size),
+      readahead_size_(0),
+      max_buffered_puff_size_(0),
+      huffing_incrementally_(false),
+      extra_byte_value_(0),
+      crc32s_(huff_options.crc32s),
+      max_huff_tasks_(0) {
+  uint64_t extent_start = 0;
+  for (const auto& extent : cache_extents_) {
+    cache_extent_starts_.push_back(extent_start);
+    extent_start += extent.length;
+  }
+
   // Building upper bounds for faster seek.
   upper_bounds_.reserve(puffs.size());
   for (const auto& puff : puffs) {
@@ -129,22 +269,108 @@ PuffinStream::PuffinStream(UniqueStreamPtr stream,
 
   deflates_.emplace_back(deflate_stream_size * 8, 0);
   puffs_.emplace_back(puff_stream_size_, 0);
+  cache_index_.resize(puffs_.size(), caches_.end());
+  if (!crc32s_.empty()) {
+    puff_crc32_.reset(new PuffCrc32(puff_format_));
+  }
+  if (deflate_cache_pool_) {
+    cached_deflates_.resize(deflates_.size());
+    deflate_cache_index_.resize(deflates_.size(), deflate_cache_lru_.end());
+  }
 
   // Look for the largest puff and deflate extents and get proper size buffers.
   uint64_t max_puff_length = 0;
   for (const auto& puff : puffs) {
     max_puff_length = std::max(max_puff_length, puff.length);
   }
-  puff_buffer_.reset(new Buffer(max_puff_length + 1));
+  if (is_for_puff_) {
+    puff_buffer_.reset(new Buffer(max_puff_length + 1));
+  }
   if (max_cache_size_ < max_puff_length) {
     max_cache_size_ = 0;  // It means we are not caching puffs.
   }
+  if (max_cache_size_ != 0 && !buffer_pool_) {
+    buffer_pool_ = std::make_shared<BufferPool>(max_cache_size_);
+  }
 
-  uint64_t max_deflate_length = 0;
-  for (const auto& deflate : deflates) {
-    max_deflate_length = std::max(max_deflate_length, deflate.length * 8);
+  const auto& cache_plan = puff_options.cache_plan;
+  if (max_cache_size_ != 0 && !cache_plan.puff_reads.empty()) {
+    read_plan_ = cache_plan.puff_reads;
+    const auto& cached_reads = cache_plan.cached_reads;
+    if (std::any_of(read_plan_.begin(), read_plan_.end(),
+                    [&puffs](size_t puff_id) {
+                      return puff_id >= puffs.size();
+                    }) ||
+        (!cached_reads.empty() && cached_reads.size() != read_plan_.size())) {
+      LOG(ERROR) << "Ignoring an invalid cache plan.";
+      read_plan_.clear();
+    }
+    next_reads_.resize(read_plan_.size());
+    next_read_of_puff_.resize(puffs_.size(), read_plan_.size());
+    for (size_t pos = read_plan_.size(); pos-- > 0;) {
+      next_reads_[pos] = next_read_of_puff_[read_plan_[pos]];
+      next_read_of_puff_[read_plan_[pos]] = pos;
+      if (!cached_reads.empty() && !cached_reads[pos]) {
+        next_reads_[pos] = read_plan_.size();
+      }
+    }
+    if (!read_plan_.empty()) {
+      prefetch_puffer_.reset(new Puffer());
+      prefetch_pool_.reset(new ThreadPool(1));
+    }
+  }
+
+  if (is_for_puff_ && readahead_depth_ > 0) {
+    readahead_pool_.reset(new ThreadPool(1));
+  }
+
+  if (is_for_puff_) {
+    uint64_t max_deflate_length = 0;
+    for (const auto& deflate : deflates) {
+      max_deflate_length = std::max(max_deflate_length, deflate.length * 8);
+    }
+    deflate_buffer_.reset(new Buffer(max_deflate_length + 2));
+  } else {
+    // Only the empty puffs are huffed into it on the calling thread.
+    deflate_buffer_.reset(new Buffer());
+  }
+
+  auto num_threads = huff_options.num_threads;
+  if (num_threads == 0) {
+    num_threads = ThreadPool::GetDefaultNumThreads();
+  }
+  if (!is_for_puff_ && num_threads > 1 && deflates.size() > 1) {
+    // Each worker thread needs its own |Huffer|. Keep at most two tasks per
+    // thread in flight so the memory used by the tasks stays bounded.
+    free_huffers_.push_back(huffer_);
+    for (size_t idx = 1; idx < num_threads; idx++) {
+      free_huffers_.push_back(std::make_shared<Huffer>());
+    }
+    max_huff_tasks_ = 2 * num_threads;
+    huff_pool_.reset(new ThreadPool(num_threads));
+    max_buffered_puff_size_ = kMaxBufferedPuffSize;
+  }
+  if (!is_for_puff_) {
+    // Only the puffs huffed on the worker threads and the empty ones are
+    // buffered, the others are huffed as they are written.
+    puff_buffer_.reset(
+        new Buffer(std::min(max_puff_length, max_buffered_puff_size_) + 1));
+  }
+}
+
+PuffinStream::~PuffinStream() {
+  prefetch_pool_.reset();
+  readahead_pool_.reset();
+  // Give the cache buffers back in case |buffer_pool_| is shared.
+  for (auto& cache : caches_) {
+    buffer_pool_->Release(std::move(cache.second));
+  }
+  for (auto deflate_id : deflate_cache_lru_) {
+    deflate_cache_pool_->Release(std::move(cached_deflates_[deflate_id]));
+  }
+  for (auto& task : prefetch_tasks_) {
+    buffer_pool_->Release(std::move(task->buffer));
   }
-  deflate_buffer_.reset(new Buffer(max_deflate_length + 2));
 }
 
 bool PuffinStream::GetSize(uint64_t* size) const {
@@ -193,13 +419,23 @@ bool PuffinStream::Seek(uint64_t offset) {
   }
   skip_bytes_ = offset - puff_pos_;
   if (!is_for_puff_ && offset == 0) {
-    TEST_AND_RETURN_FALSE(stream_->Seek(0));
+    // Finish the pending writes before the ones after the seek.
+    TEST_AND_RETURN_FALSE(FlushHuffTasks(0));
+    TEST_AND_RETURN_FALSE(StreamSeek(0));
     TEST_AND_RETURN_FALSE(SetExtraByte());
+    huffing_incrementally_ = false;
+    if (incremental_huffer_) {
+      incremental_huffer_->ClearOutput();
+    }
   }
   return true;
 }
 
 bool PuffinStream::Close() {
+  TEST_AND_RETURN_FALSE(FlushHuffTasks(0));
+  // Nothing should read |stream_| after closing it.
+  prefetch_pool_.reset();
+  readahead_pool_.reset();
   closed_ = true;
   return stream_->Close();
 }
@@ -224,8 +460,11 @@ bool PuffinStream::Read(void* buffer, size_t count) {
       auto bytes_to_read = std::min(length - bytes_read, end_byte - start_byte);
       TEST_AND_RETURN_FALSE(bytes_to_read >= 1);
 
-      TEST_AND_RETURN_FALSE(stream_->Seek(start_byte));
-      TEST_AND_RETURN_FALSE(stream_->Read(bytes + bytes_read, bytes_to_read));
+      {
+        std::lock_guard<std::mutex> lock(stream_mutex_);
+        TEST_AND_RETURN_FALSE(StreamSeek(start_byte));
+        TEST_AND_RETURN_FALSE(StreamRead(bytes + bytes_read, bytes_to_read));
+      }
 
       // If true, we read the first byte of the curret deflate. So we have to
       // mask out the deflate bits (which are most significant bits.)
@@ -269,39 +508,39 @@ bool PuffinStream::Read(void* buffer, size_t count) {
           (length - bytes_read >= cur_puff_->length);
 
       auto cur_puff_idx = std::distance(puffs_.begin(), cur_puff_);
-      if (max_cache_size_ == 0 ||
-          !GetPuffCache(cur_puff_idx, cur_puff_->length, &puff_buffer_)) {
+      auto bytes_to_copy =
+          std::min(length - bytes_read, cur_puff_->length - skip_bytes_);
+      // The offset of |skip_bytes_| in |puff_buffer_|.
+      auto puff_buffer_offset = skip_bytes_;
+      BitExtent subblock_deflate(0, 0);
+      ByteExtent subblock_puff(0, 0);
+      if (max_cache_size_ == 0 && !puff_directly_into_buffer &&
+          FindSubblocks(cur_puff_->offset + skip_bytes_, bytes_to_copy,
+                        &subblock_deflate, &subblock_puff)) {
+        // Only puff the subblocks that are needed.
+        TEST_AND_RETURN_FALSE(PuffDeflateExtent(
+            subblock_deflate, puff_buffer_->data(), subblock_puff.length));
+        std::lock_guard<std::mutex> lock(stream_mutex_);
+        TEST_AND_RETURN_FALSE(StreamSeek(start_byte + bytes_to_read));
+        puff_buffer_offset =
+            cur_puff_->offset + skip_bytes_ - subblock_puff.offset;
+      } else if (max_cache_size_ == 0 ||
+                 !GetPuffCache(cur_puff_idx, cur_puff_->length,
+                               &puff_buffer_)) {
         // Did not find the puff buffer in cache. We have to build it.
-        deflate_buffer_->resize(bytes_to_read);
-        TEST_AND_RETURN_FALSE(stream_->Seek(start_byte));
-        TEST_AND_RETURN_FALSE(
-            stream_->Read(deflate_buffer_->data(), bytes_to_read));
-        BufferBitReader bit_reader(deflate_buffer_->data(), bytes_to_read);
-
-        BufferPuffWriter puff_writer(puff_directly_into_buffer
-                                         ? bytes + bytes_read
-                                         : puff_buffer_->data(),
-                                     cur_puff_->length);
-
-        // Drop the first unused bits.
-        size_t extra_bits_len = cur_deflate_->offset & 7;
-        TEST_AND_RETURN_FALSE(bit_reader.CacheBits(extra_bits_len));
-        bit_reader.DropBits(extra_bits_len);
-
-        Error error;
-        TEST_AND_RETURN_FALSE(
-            puffer_->PuffDeflate(&bit_reader, &puff_writer, nullptr, &error));
-        TEST_AND_RETURN_FALSE(bytes_to_read == bit_reader.Offset());
-        TEST_AND_RETURN_FALSE(cur_puff_->length == puff_writer.Size());
+        TEST_AND_RETURN_FALSE(PuffDeflateExtent(
+            *cur_deflate_,
+            puff_directly_into_buffer ? bytes + bytes_read
+                                      : puff_buffer_->data(),
+            cur_puff_->length));
       } else {
         // Just seek to proper location.
-        TEST_AND_RETURN_FALSE(stream_->Seek(start_byte + bytes_to_read));
+        std::lock_guard<std::mutex> lock(stream_mutex_);
+        TEST_AND_RETURN_FALSE(StreamSeek(start_byte + bytes_to_read));
       }
       // Copy from puff buffer to output if needed.
-      auto bytes_to_copy =
-          std::min(length - bytes_read, cur_puff_->length - skip_bytes_);
       if (!puff_directly_into_buffer) {
-        memcpy(bytes + bytes_read, puff_buffer_->data() + skip_bytes_,
+        memcpy(bytes + bytes_read, puff_buffer_->data() + puff_buffer_offset,
                bytes_to_copy);
       }
 
@@ -342,7 +581,7 @@ bool PuffinStream::Write(const void* buffer, size_t count) {
       auto copy_len =
           std::min((cur_deflate_->offset / 8) - (deflate_bit_pos_ / 8),
                    length - bytes_wrote);
-      TEST_AND_RETURN_FALSE(stream_->Write(bytes + bytes_wrote, copy_len));
+      TEST_AND_RETURN_FALSE(WriteRaw(bytes + bytes_wrote, copy_len));
       bytes_wrote += copy_len;
       puff_pos_ += copy_len;
       deflate_bit_pos_ += copy_len * 8;
@@ -356,7 +595,7 @@ bool PuffinStream::Write(const void* buffer, size_t count) {
       // |deflate_bit_pos_| now should be in the same byte as
       // |cur_deflate->offset|.
       if (deflate_bit_pos_ < cur_deflate_->offset) {
-        last_byte_ |= bytes[bytes_wrote++] << (deflate_bit_pos_ & 7);
+        first_bits_ |= bytes[bytes_wrote++] << (deflate_bit_pos_ & 7);
         skip_bytes_ = 0;
         deflate_bit_pos_ = cur_deflate_->offset;
         puff_pos_++;
@@ -365,50 +604,47 @@ bool PuffinStream::Write(const void* buffer, size_t count) {
 
       auto copy_len = std::min(length - bytes_wrote,
                                cur_puff_->length + extra_byte_ - skip_bytes_);
-      TEST_AND_RETURN_FALSE(puff_buffer_->size() >= skip_bytes_ + copy_len);
-      memcpy(puff_buffer_->data() + skip_bytes_, bytes + bytes_wrote, copy_len);
+      if (puff_crc32_ && skip_bytes_ < cur_puff_->length) {
+        // The extra byte is not part of the puff.
+        TEST_AND_RETURN_FALSE(puff_crc32_->Write(
+            bytes + bytes_wrote,
+            std::min(copy_len, cur_puff_->length - skip_bytes_)));
+      }
+      bool incremental = cur_puff_->length > max_buffered_puff_size_;
+      if (incremental) {
+        TEST_AND_RETURN_FALSE(HuffIncrementally(bytes + bytes_wrote, copy_len));
+      } else {
+        TEST_AND_RETURN_FALSE(puff_buffer_->size() >= skip_bytes_ + copy_len);
+        memcpy(puff_buffer_->data() + skip_bytes_, bytes + bytes_wrote,
+               copy_len);
+      }
       skip_bytes_ += copy_len;
       bytes_wrote += copy_len;
 
       if (skip_bytes_ == cur_puff_->length + extra_byte_) {
-        // |puff_buffer_| is full, now huff into the |deflate_buffer_|.
-        auto start_byte = cur_deflate_->offset / 8;
-        auto end_byte = (cur_deflate_->offset + cur_deflate_->length + 7) / 8;
-        auto bytes_to_write = end_byte - start_byte;
-
-        deflate_buffer_->resize(bytes_to_write);
-        BufferBitWriter bit_writer(deflate_buffer_->data(), bytes_to_write);
-        BufferPuffReader puff_reader(puff_buffer_->data(), cur_puff_->length);
-
-        // Write last byte if it has any.
-        TEST_AND_RETURN_FALSE(
-            bit_writer.WriteBits(cur_deflate_->offset & 7, last_byte_));
-        last_byte_ = 0;
-
-        Error error;
-        TEST_AND_RETURN_FALSE(
-            huffer_->HuffDeflate(&puff_reader, &bit_writer, &error));
-        TEST_AND_RETURN_FALSE(bit_writer.Size() == bytes_to_write);
-        TEST_AND_RETURN_FALSE(puff_reader.BytesLeft() == 0);
+        if (puff_crc32_) {
+          TEST_AND_RETURN_FALSE(VerifyCrc32());
+        }
+        if (incremental) {
+          TEST_AND_RETURN_FALSE(FinishIncrementalHuff());
+        } else if (huff_pool_) {
+          // |puff_buffer_| is full, now huff it on a worker thread.
+          TEST_AND_RETURN_FALSE(ScheduleHuff());
+        } else {
+          TEST_AND_RETURN_FALSE(HuffPuff(
+              huffer_.get(), puff_format_, *cur_deflate_, first_bits_,
+              puff_buffer_->data(), cur_puff_->length, extra_byte_,
+              deflate_buffer_.get(), stats_));
+          TEST_AND_RETURN_FALSE(WriteDeflate(*cur_deflate_, extra_byte_,
+                                             deflate_buffer_.get()));
+        }
+        first_bits_ = 0;
 
         deflate_bit_pos_ = cur_deflate_->offset + cur_deflate_->length;
         if (extra_byte_ == 1) {
-          deflate_buffer_->data()[bytes_to_write - 1] |=
-              puff_buffer_->data()[cur_puff_->length] << (deflate_bit_pos_ & 7);
           deflate_bit_pos_ = (deflate_bit_pos_ + 7) & ~7ull;
-        } else if ((deflate_bit_pos_ & 7) != 0) {
-          // This happens if current and next deflate finish and end on the same
-          // byte, then we cannot write into output until we have huffed the
-          // next puff buffer, so untill then we cache it into |last_byte_| and
-          // we won't write it out.
-          last_byte_ = deflate_buffer_->data()[bytes_to_write - 1];
-          bytes_to_write--;
         }
 
-        // Write |deflate_buffer_| into output.
-        TEST_AND_RETURN_FALSE(
-            stream_->Write(deflate_buffer_->data(), bytes_to_write));
-
         // Move to the next deflate/puff.
         puff_pos_ += skip_bytes_;
         skip_bytes_ = 0;
@@ -424,6 +660,221 @@ bool PuffinStream::Write(const void* buffer, size_t count) {
   }
 
   TEST_AND_RETURN_FALSE(bytes_wrote == length);
+  if (puff_pos_ + skip_bytes_ == puff_stream_size_) {
+    // The whole puff stream is written.
+    TEST_AND_RETURN_FALSE(FlushHuffTasks(0));
+  }
+  return true;
+}
+
+bool PuffinStream::VerifyCrc32() {
+  uint32_t crc;
+  TEST_AND_RETURN_FALSE(puff_crc32_->Finish(&crc));
+  // A deflate whose copies reach back into a deflate not written into this
+  // stream (e.g. a subblock after one copied from the source) cannot be
+  // checked.
+  if (!puff_crc32_->missing_history()) {
+    auto deflate_id = std::distance(deflates_.begin(), cur_deflate_);
+    if (crc != crc32s_[deflate_id]) {
+      LOG(ERROR) << "The CRC-32 of deflate " << deflate_id << " at bit "
+                 << cur_deflate_->offset << " is " << crc << " instead of "
+                 << crc32s_[deflate_id] << ".";
+      return false;
+    }
+    if (stats_ != nullptr) {
+      stats_->deflates_verified++;
+    }
+  }
+  // The next deflate can copy from this one if it is the next subblock of the
+  // same deflate stream.
+  auto next_deflate = cur_deflate_ + 1;
+  puff_crc32_->Start(next_deflate != deflates_.end() &&
+                     next_deflate->offset ==
+                         cur_deflate_->offset + cur_deflate_->length);
+  return true;
+}
+
+bool PuffinStream::HuffIncrementally(const uint8_t* bytes, uint64_t length) {
+  if (!huffing_incrementally_) {
+    // The deflates before it should be written first.
+    TEST_AND_RETURN_FALSE(FlushHuffTasks(0));
+    if (!incremental_huffer_) {
+      incremental_huffer_.reset(new IncrementalHuffer(puff_format_));
+    }
+    // The last byte of the previous deflate has only the bits before this one,
+    // so it is written with them.
+    TEST_AND_RETURN_FALSE(
+        incremental_huffer_->Start(*cur_deflate_, first_bits_ | last_byte_));
+    last_byte_ = 0;
+    huffing_incrementally_ = true;
+    if (stats_ != nullptr) {
+      stats_->deflates_huffed++;
+      stats_->huff_bytes += cur_puff_->length;
+    }
+  }
+  // The extra byte is not part of the puff.
+  auto puff_length =
+      std::min(length, cur_puff_->length - std::min(skip_bytes_,
+                                                    cur_puff_->length));
+  while (puff_length > 0) {
+    size_t consumed;
+    {
+      ScopedStatsTimer timer(stats_, &Stats::huff_time_ns);
+      TEST_AND_RETURN_FALSE(
+          incremental_huffer_->Write(bytes, puff_length, &consumed));
+    }
+    if (consumed < puff_length) {
+      // The output buffer is full.
+      TEST_AND_RETURN_FALSE(StreamWrite(incremental_huffer_->output(),
+                                        incremental_huffer_->output_size()));
+      incremental_huffer_->ClearOutput();
+    }
+    bytes += consumed;
+    puff_length -= consumed;
+    length -= consumed;
+  }
+  if (length > 0) {
+    TEST_AND_RETURN_FALSE(length == 1 && extra_byte_ == 1);
+    extra_byte_value_ = *bytes;
+  }
+  return true;
+}
+
+bool PuffinStream::FinishIncrementalHuff() {
+  TEST_AND_RETURN_FALSE(huffing_incrementally_);
+  huffing_incrementally_ = false;
+  {
+    ScopedStatsTimer timer(stats_, &Stats::huff_time_ns);
+    TEST_AND_RETURN_FALSE(incremental_huffer_->Finish());
+  }
+  auto output = incremental_huffer_->output();
+  auto output_size = incremental_huffer_->output_size();
+  auto end_bit = cur_deflate_->offset + cur_deflate_->length;
+  if ((end_bit & 7) != 0) {
+    // The last byte is partial, so it is always in the output.
+    TEST_AND_RETURN_FALSE(output_size > 0);
+    if (extra_byte_ == 1) {
+      output[output_size - 1] |= extra_byte_value_ << (end_bit & 7);
+    } else {
+      // It is shared with the next deflate, see |WriteDeflate|.
+      last_byte_ = output[--output_size];
+    }
+  }
+  TEST_AND_RETURN_FALSE(StreamWrite(output, output_size));
+  incremental_huffer_->ClearOutput();
+  return true;
+}
+
+bool PuffinStream::WriteDeflate(const BitExtent& deflate,
+                                size_t extra_byte,
+                                Buffer* deflate_buffer) {
+  auto bytes_to_write = deflate_buffer->size();
+  TEST_AND_RETURN_FALSE(bytes_to_write > 0 ||
+                        (deflate.length == 0 && (deflate.offset & 7) == 0));
+  if (bytes_to_write > 0) {
+    (*deflate_buffer)[0] |= last_byte_;
+  }
+  last_byte_ = 0;
+
+  auto end_bit = deflate.offset + deflate.length;
+  if (extra_byte == 0 && (end_bit & 7) != 0) {
+    // This happens if current and next deflate finish and end on the same
+    // byte, then we cannot write into output until we have huffed the next
+    // puff buffer, so untill then we cache it into |last_byte_| and we won't
+    // write it out.
+    last_byte_ = (*deflate_buffer)[bytes_to_write - 1];
+    bytes_to_write--;
+  }
+
+  // Write |deflate_buffer| into output.
+  TEST_AND_RETURN_FALSE(StreamWrite(deflate_buffer->data(), bytes_to_write));
+  return true;
+}
+
+bool PuffinStream::WriteRaw(const uint8_t* bytes, size_t length) {
+  if (huff_tasks_.empty()) {
+    return StreamWrite(bytes, length);
+  }
+  auto task = GetFreeHuffTask(false, BitExtent(0, 0));
+  task->output.assign(bytes, bytes + length);
+  task->done = true;
+  task->success = true;
+  huff_tasks_.push_back(task);
+  return FlushHuffTasks(max_huff_tasks_);
+}
+
+shared_ptr<PuffinStream::HuffTask> PuffinStream::GetFreeHuffTask(
+    bool is_deflate, const BitExtent& deflate) {
+  if (free_huff_tasks_.empty()) {
+    return std::make_shared<HuffTask>(is_deflate, deflate);
+  }
+  auto task = free_huff_tasks_.back();
+  free_huff_tasks_.pop_back();
+  task->is_deflate = is_deflate;
+  task->deflate = deflate;
+  task->first_bits = 0;
+  task->extra_byte = 0;
+  task->done = false;
+  task->success = false;
+  return task;
+}
+
+bool PuffinStream::ScheduleHuff() {
+  TEST_AND_RETURN_FALSE(FlushHuffTasks(max_huff_tasks_ - 1));
+  auto task = GetFreeHuffTask(true, *cur_deflate_);
+  task->first_bits = first_bits_;
+  task->extra_byte = extra_byte_;
+  task->puff.assign(puff_buffer_->begin(),
+                    puff_buffer_->begin() + cur_puff_->length + extra_byte_);
+  huff_tasks_.push_back(task);
+
+  huff_pool_->Schedule([this, task]() {
+    shared_ptr<Huffer> huffer;
+    {
+      std::lock_guard<std::mutex> lock(huff_mutex_);
+      huffer = free_huffers_.back();
+      free_huffers_.pop_back();
+    }
+    auto success = HuffPuff(huffer.get(), puff_format_, task->deflate,
+                            task->first_bits, task->puff.data(),
+                            task->puff.size() - task->extra_byte,
+                            task->extra_byte, &task->output, stats_);
+    {
+      std::lock_guard<std::mutex> lock(huff_mutex_);
+      free_huffers_.push_back(huffer);
+      task->success = success;
+      task->done = true;
+    }
+    huff_cv_.notify_all();
+  });
+  return true;
+}
+
+bool PuffinStream::FlushHuffTasks(size_t max_pending) {
+  while (!huff_tasks_.empty()) {
+    auto task = huff_tasks_.front();
+    {
+      std::unique_lock<std::mutex> lock(huff_mutex_);
+      if (!task->done) {
+        if (huff_tasks_.size() <= max_pending) {
+          break;
+        }
+        huff_cv_.wait(lock, [&task] { return task->done; });
+      }
+    }
+    huff_tasks_.pop_front();
+    TEST_AND_RETURN_FALSE(task->success);
+    if (task->is_deflate) {
+      TEST_AND_RETURN_FALSE(
+          WriteDeflate(task->deflate, task->extra_byte, &task->output));
+    } else {
+      TEST_AND_RETURN_FALSE(
+          StreamWrite(task->output.data(), task->output.size()));
+    }
+    if (free_huff_tasks_.size() < max_huff_tasks_) {
+      free_huff_tasks_.push_back(task);
+    }
+  }
   return true;
 }
 
@@ -442,54 +893,530 @@ bool PuffinStream::SetExtraByte() {
   return true;
 }
 
-bool PuffinStream::GetPuffCache(int puff_id,
+bool PuffinStream::StreamSeek(uint64_t offset) {
+  ScopedStatsTimer timer(stats_, &Stats::io_time_ns);
+  if (stats_ != nullptr) {
+    stats_->stream_seeks++;
+  }
+  return stream_->Seek(offset);
+}
+
+bool PuffinStream::StreamRead(void* buffer, size_t length) {
+  ScopedStatsTimer timer(stats_, &Stats::io_time_ns);
+  if (stats_ != nullptr) {
+    stats_->stream_reads++;
+  }
+  return stream_->Read(buffer, length);
+}
+
+bool PuffinStream::StreamReadZeroCopy(const uint8_t** data, size_t length) {
+  ScopedStatsTimer timer(stats_, &Stats::io_time_ns);
+  // Only count the reads that succeed, the others are retried with |Read()|.
+  auto result = stream_->ReadZeroCopy(data, length);
+  if (result && stats_ != nullptr) {
+    stats_->stream_reads++;
+  }
+  return result;
+}
+
+bool PuffinStream::StreamWrite(const void* buffer, size_t length) {
+  ScopedStatsTimer timer(stats_, &Stats::io_time_ns);
+  if (stats_ != nullptr) {
+    stats_->stream_writes++;
+  }
+  return stream_->Write(buffer, length);
+}
+
+bool PuffinStream::PuffDeflateExtent(const BitExtent& deflate,
+                                     uint8_t* puff_buffer,
+                                     uint64_t puff_length) {
+  return PuffDeflateExtent(puffer_.get(), deflate_buffer_.get(), deflate,
+                           puff_buffer, puff_length);
+}
+
+bool PuffinStream::PuffDeflateExtent(Puffer* puffer,
+                                     Buffer* deflate_buffer,
+                                     const BitExtent& deflate,
+                                     uint8_t* puff_buffer,
+                                     uint64_t puff_length) {
+  // The deflate may have been puffed by another stream of the same source.
+  BitExtent cache_key(0, 0);
+  bool use_puff_cache = puff_cache_ && GetPuffCacheKey(deflate, &cache_key);
+  if (use_puff_cache && puff_cache_->Get(cache_key, puff_buffer, puff_length,
+                                         puff_format_)) {
+    if (stats_ != nullptr) {
+      stats_->kept_puff_hits++;
+    }
+    return true;
+  }
+
+  auto start_byte = deflate.offset / 8;
+  auto end_byte = (deflate.offset + deflate.length + 7) / 8;
+  auto bytes_to_read = end_byte - start_byte;
+  const uint8_t* deflate_data;
+  // Holds the kept bytes of the deflate while they are puffed.
+  SharedBufferPtr cached_deflate;
+  // Only the deflates puffed by |Read| are read ahead. This waits for the
+  // background read, which needs |stream_mutex_|, so it is done before taking
+  // it.
+  bool read_ahead = readahead_pool_ &&
+                    deflate_buffer == deflate_buffer_.get() &&
+                    TakeReadahead(deflate, deflate_buffer);
+  {
+    std::lock_guard<std::mutex> lock(stream_mutex_);
+    size_t deflate_id;
+    bool is_kept = deflate_cache_pool_ && FindDeflate(deflate, &deflate_id);
+    if (is_kept) {
+      cached_deflate = GetCachedDeflate(deflate_id);
+    }
+    if (cached_deflate) {
+      deflate_data = cached_deflate->data() + start_byte -
+                     deflates_[deflate_id].offset / 8;
+    } else {
+      if (read_ahead) {
+        deflate_data = deflate_buffer->data();
+      } else {
+        TEST_AND_RETURN_FALSE(StreamSeek(start_byte));
+        // Avoid copying the deflate if the stream allows reading it in place.
+        if (!StreamReadZeroCopy(&deflate_data, bytes_to_read)) {
+          deflate_buffer->resize(bytes_to_read);
+          TEST_AND_RETURN_FALSE(
+              StreamRead(deflate_buffer->data(), bytes_to_read));
+          deflate_data = deflate_buffer->data();
+        }
+      }
+      // Only whole deflates are kept.
+      if (is_kept && deflate.offset == deflates_[deflate_id].offset &&
+          deflate.length == deflates_[deflate_id].length) {
+        CacheDeflate(deflate_id, deflate_data, bytes_to_read);
+      }
+    }
+  }
+  ScopedStatsTimer timer(stats_, &Stats::puff_time_ns);
+  if (stats_ != nullptr) {
+    stats_->deflates_puffed++;
+    stats_->puff_bytes += puff_length;
+  }
+  BufferBitReader bit_reader(deflate_data, bytes_to_read);
+  BufferPuffWriter puff_writer(puff_buffer, puff_length, puff_format_);
+
+  // Drop the first unused bits.
+  size_t extra_bits_len = deflate.offset & 7;
+  TEST_AND_RETURN_FALSE(bit_reader.CacheBits(extra_bits_len));
+  bit_reader.DropBits(extra_bits_len);
+
+  Error error;
+  TEST_AND_RETURN_FALSE(
+      puffer->PuffDeflate(&bit_reader, &puff_writer, nullptr, &error));
+  TEST_AND_RETURN_FALSE(bytes_to_read == bit_reader.Offset());
+  TEST_AND_RETURN_FALSE(puff_length == puff_writer.Size());
+  if (use_puff_cache) {
+    puff_cache_->Put(cache_key, puff_buffer, puff_length, puff_format_);
+  }
+  return true;
+}
+
+bool PuffinStream::FindDeflate(const BitExtent& deflate,
+                               size_t* deflate_id) const {
+  // Find the last deflate that starts at or before |deflate|. The last entry
+  // of |deflates_| is the empty one at the end of the stream.
+  auto iter = std::upper_bound(
+      deflates_.begin(), deflates_.end() - 1, deflate.offset,
+      [](uint64_t offset, const BitExtent& extent) {
+        return offset < extent.offset;
+      });
+  if (iter == deflates_.begin()) {
+    return false;
+  }
+  --iter;
+  if (deflate.offset + deflate.length > iter->offset + iter->length) {
+    return false;
+  }
+  *deflate_id = std::distance(deflates_.begin(), iter);
+  return true;
+}
+
+bool PuffinStream::TakeReadahead(const BitExtent& deflate,
+                                 Buffer* deflate_buffer) {
+  size_t deflate_id;
+  if (!FindDeflate(deflate, &deflate_id) ||
+      deflate.offset != deflates_[deflate_id].offset ||
+      deflate.length != deflates_[deflate_id].length) {
+    return false;
+  }
+  bool success = false;
+  {
+    std::unique_lock<std::mutex> lock(readahead_mutex_);
+    std::shared_ptr<ReadaheadTask> task;
+    // Drop the deflates read ahead that this read skipped or went past, e.g.
+    // after a |Seek|.
+    for (auto iter = readahead_tasks_.begin();
+         iter != readahead_tasks_.end();) {
+      auto id = (*iter)->deflate_id;
+      if (id == deflate_id) {
+        task = *iter;
+      } else if (id < deflate_id || id > deflate_id + readahead_depth_) {
+        (*iter)->cancelled = true;
+        readahead_size_ -= GetByteLength(deflates_[id]);
+        iter = readahead_tasks_.erase(iter);
+        continue;
+      }
+      ++iter;
+    }
+    if (task) {
+      readahead_cv_.wait(lock, [&task] { return task->done; });
+      success = task->success;
+      if (success) {
+        deflate_buffer->swap(task->buffer);
+        if (stats_ != nullptr) {
+          stats_->readahead_hits++;
+        }
+      }
+      readahead_size_ -= GetByteLength(deflate);
+      readahead_tasks_.erase(
+          std::find(readahead_tasks_.begin(), readahead_tasks_.end(), task));
+    }
+  }
+  ScheduleReadaheads(deflate_id);
+  return success;
+}
+
+void PuffinStream::ScheduleReadaheads(size_t deflate_id) {
+  std::lock_guard<std::mutex> lock(readahead_mutex_);
+  // The last entry of |deflates_| is the empty one at the end of the stream.
+  auto end_id = std::min(deflate_id + readahead_depth_ + 1,
+                         deflates_.size() - 1);
+  for (auto id = deflate_id + 1; id < end_id; id++) {
+    auto is_scheduled = std::any_of(
+        readahead_tasks_.begin(), readahead_tasks_.end(),
+        [id](const std::shared_ptr<ReadaheadTask>& task) {
+          return task->deflate_id == id;
+        });
+    // The cached puffs do not need their deflates.
+    if (is_scheduled || cache_index_[id] != caches_.end()) {
+      continue;
+    }
+    auto length = GetByteLength(deflates_[id]);
+    if (readahead_size_ + length > max_readahead_size_) {
+      break;
+    }
+    readahead_size_ += length;
+    auto task = std::make_shared<ReadaheadTask>(id);
+    readahead_tasks_.push_back(task);
+    auto start_byte = deflates_[id].offset / 8;
+    readahead_pool_->Schedule([this, task, start_byte, length] {
+      {
+        std::lock_guard<std::mutex> task_lock(readahead_mutex_);
+        if (task->cancelled) {
+          task->done = true;
+          return;
+        }
+      }
+      // Nothing else touches the buffer of |task| until it is done.
+      bool success;
+      {
+        std::lock_guard<std::mutex> stream_lock(stream_mutex_);
+        task->buffer.resize(length);
+        success = StreamSeek(start_byte) &&
+                  StreamRead(task->buffer.data(), length);
+      }
+      {
+        std::lock_guard<std::mutex> task_lock(readahead_mutex_);
+        task->success = success;
+        task->done = true;
+      }
+      readahead_cv_.notify_all();
+    });
+  }
+}
+
+SharedBufferPtr PuffinStream::GetCachedDeflate(size_t deflate_id) {
+  auto& iter = deflate_cache_index_[deflate_id];
+  if (iter == deflate_cache_lru_.end()) {
+    return nullptr;
+  }
+  deflate_cache_lru_.splice(deflate_cache_lru_.begin(), deflate_cache_lru_,
+                            iter);
+  if (stats_ != nullptr) {
+    stats_->deflate_cache_hits++;
+  }
+  return cached_deflates_[deflate_id];
+}
+
+void PuffinStream::CacheDeflate(size_t deflate_id,
+                                const uint8_t* data,
+                                uint64_t length) {
+  auto buffer = deflate_cache_pool_->TryGet(length);
+  while (!buffer && !deflate_cache_lru_.empty()) {
+    auto victim = deflate_cache_lru_.back();
+    // Another thread may still be puffing from it.
+    if (cached_deflates_[victim].use_count() > 1) {
+      return;
+    }
+    deflate_cache_lru_.pop_back();
+    deflate_cache_index_[victim] = deflate_cache_lru_.end();
+    deflate_cache_pool_->Release(std::move(cached_deflates_[victim]));
+    buffer = deflate_cache_pool_->TryGet(length);
+  }
+  if (!buffer) {
+    return;
+  }
+  memcpy(buffer->data(), data, length);
+  cached_deflates_[deflate_id] = std::move(buffer);
+  deflate_cache_lru_.push_front(deflate_id);
+  deflate_cache_index_[deflate_id] = deflate_cache_lru_.begin();
+}
+
+bool PuffinStream::GetPuffCacheKey(const BitExtent& deflate,
+                                   BitExtent* key) const {
+  if (cache_extents_.empty()) {
+    *key = deflate;
+    return true;
+  }
+  auto start_byte = deflate.offset / 8;
+  auto end_byte = (deflate.offset + deflate.length + 7) / 8;
+  // Find the last extent that starts at or before |start_byte|.
+  auto iter = std::upper_bound(cache_extent_starts_.begin(),
+                               cache_extent_starts_.end(), start_byte);
+  if (iter == cache_extent_starts_.begin()) {
+    return false;
+  }
+  auto idx = std::distance(cache_extent_starts_.begin(), iter) - 1;
+  const auto& extent = cache_extents_[idx];
+  if (end_byte - cache_extent_starts_[idx] > extent.length) {
+    return false;
+  }
+  *key = BitExtent(
+      (extent.offset + start_byte - cache_extent_starts_[idx]) * 8 +
+          (deflate.offset & 7),
+      deflate.length);
+  return true;
+}
+
+bool PuffinStream::FindSubblocks(uint64_t puff_offset,
+                                 uint64_t length,
+                                 BitExtent* deflate,
+                                 ByteExtent* puff) const {
+  // Find the last subblock that starts at or before |puff_offset|.
+  auto first = std::upper_bound(
+      subblock_puffs_.begin(), subblock_puffs_.end(), puff_offset,
+      [](uint64_t offset, const ByteExtent& subblock) {
+        return offset < subblock.offset;
+      });
+  if (first == subblock_puffs_.begin()) {
+    return false;
+  }
+  first--;
+  auto last = first;
+  while (last->offset + last->length < puff_offset + length) {
+    if (++last == subblock_puffs_.end()) {
+      return false;
+    }
+  }
+  // The subblocks should be inside the current puff.
+  if (first->offset < cur_puff_->offset ||
+      last->offset + last->length > cur_puff_->offset + cur_puff_->length) {
+    return false;
+  }
+
+  const auto& first_deflate =
+      subblock_deflates_[std::distance(subblock_puffs_.begin(), first)];
+  const auto& last_deflate =
+      subblock_deflates_[std::distance(subblock_puffs_.begin(), last)];
+  if (first_deflate.offset < cur_deflate_->offset ||
+      last_deflate.offset + last_deflate.length >
+          cur_deflate_->offset + cur_deflate_->length) {
+    return false;
+  }
+  auto deflate_end = last_deflate.offset + last_deflate.length;
+  *deflate =
+      BitExtent(first_deflate.offset, deflate_end - first_deflate.offset);
+  auto puff_end = last->offset + last->length;
+  *puff = ByteExtent(first->offset, puff_end - first->offset);
+  return true;
+}
+
+bool PuffinStream::GetPuffCache(size_t puff_id,
                                 uint64_t puff_size,
                                 SharedBufferPtr* buffer) {
-  bool found = false;
-  // Search for it.
-  std::pair<int, SharedBufferPtr> cache;
-  // TODO(*): Find a faster way of doing this? Maybe change the data structure
-  // that supports faster search.
-  for (auto iter = caches_.begin(); iter != caches_.end(); ++iter) {
-    if (iter->first == puff_id) {
-      cache = std::move(*iter);
-      found = true;
-      // Remove it so later we can add it to the begining of the list.
-      caches_.erase(iter);
-      break;
+  if (prefetch_pool_) {
+    CollectPrefetches(puff_id);
+  }
+  bool in_plan = !read_plan_.empty() && AdvanceReadPlan(puff_id);
+  bool found = true;
+  auto& iter = cache_index_[puff_id];
+  if (iter != caches_.end()) {
+    // Move it to the front of the list so it becomes the most recently used
+    // one.
+    caches_.splice(caches_.begin(), caches_, iter);
+    *buffer = iter->second;
+  } else if (in_plan && next_read_of_puff_[puff_id] == read_plan_.size()) {
+    // The plan does not keep this puff, so do not evict any other puff for it.
+    if (!uncached_buffer_) {
+      uncached_buffer_ = std::make_shared<Buffer>();
     }
+    found = uncached_puff_id_ == puff_id;
+    uncached_buffer_->resize(puff_size);
+    uncached_puff_id_ = puff_id;
+    *buffer = uncached_buffer_;
+  } else {
+    // If not found, get a buffer for it and insert it in the front of the list.
+    caches_.emplace_front(puff_id, GetFreeBuffer(puff_size));
+    iter = caches_.begin();
+    *buffer = iter->second;
+    found = false;
   }
+  if (in_plan && prefetch_pool_) {
+    SchedulePrefetches(puff_id);
+  }
+  if (stats_ != nullptr) {
+    if (found) {
+      stats_->cache_hits++;
+    } else {
+      stats_->cache_misses++;
+    }
+    stats_->UpdatePeakCacheSize(buffer_pool_->size());
+  }
+  return found;
+}
 
-  // If not found, either create one or get one from the list.
-  if (!found) {
-    // If |caches_| were full, remove last ones in the list (least used), until
-    // we have enough space for the new cache.
-    while (!caches_.empty() && cur_cache_size_ + puff_size > max_cache_size_) {
-      cache = std::move(caches_.back());
-      caches_.pop_back();  // Remove it from the list.
-      cur_cache_size_ -= cache.second->capacity();
+SharedBufferPtr PuffinStream::GetFreeBuffer(uint64_t puff_size) {
+  while (true) {
+    auto buffer = buffer_pool_->TryGet(puff_size);
+    if (buffer) {
+      return buffer;
+    }
+    if (caches_.empty()) {
+      // The stream cannot work without at least one cache.
+      return buffer_pool_->Get(puff_size);
     }
-    // If we have not populated the cache yet, create one.
-    if (!cache.second) {
-      cache.second.reset(new Buffer(puff_size));
+    // If |caches_| were full, evict the last one in the list (least used), or
+    // the one read furthest in the future, and give its buffer back to the
+    // pool for reuse.
+    auto victim = read_plan_.empty() ? std::prev(caches_.end())
+                                     : GetFurthestCache(puffs_.size());
+    if (stats_ != nullptr) {
+      stats_->cache_evictions++;
     }
-    cache.second->resize(puff_size);
+    cache_index_[victim->first] = caches_.end();
+    buffer_pool_->Release(std::move(victim->second));
+    caches_.erase(victim);
+  }
+}
 
-    constexpr uint64_t kMaxSizeDifference = 20 * 1024;
-    if (puff_size + kMaxSizeDifference < cache.second->capacity()) {
-      cache.second->shrink_to_fit();
+PuffinStream::CacheList::iterator PuffinStream::GetFurthestCache(
+    size_t exclude_id) {
+  // On ties, prefer the least recently used one.
+  auto furthest = caches_.end();
+  for (auto iter = caches_.begin(); iter != caches_.end(); ++iter) {
+    if (iter->first != exclude_id &&
+        (furthest == caches_.end() ||
+         next_read_of_puff_[iter->first] >=
+             next_read_of_puff_[furthest->first])) {
+      furthest = iter;
     }
+  }
+  return furthest;
+}
 
-    cur_cache_size_ += cache.second->capacity();
-    cache.first = puff_id;
+void PuffinStream::CollectPrefetches(size_t puff_id) {
+  std::unique_lock<std::mutex> lock(prefetch_mutex_);
+  bool wait = std::any_of(
+      prefetch_tasks_.begin(), prefetch_tasks_.end(),
+      [puff_id](const shared_ptr<PrefetchTask>& task) {
+        return task->puff_id == puff_id;
+      });
+  // The prefetches finish in the order they are scheduled.
+  while (!prefetch_tasks_.empty()) {
+    auto task = prefetch_tasks_.front();
+    if (!task->done) {
+      if (!wait) {
+        break;
+      }
+      prefetch_cv_.wait(lock, [&task] { return task->done; });
+    }
+    prefetch_tasks_.pop_front();
+    if (task->puff_id == puff_id) {
+      wait = false;
+    }
+    if (task->success) {
+      caches_.emplace_front(task->puff_id, std::move(task->buffer));
+      cache_index_[task->puff_id] = caches_.begin();
+    } else {
+      // Leave it to be puffed (and its error handled) when it is read.
+      buffer_pool_->Release(std::move(task->buffer));
+    }
   }
+}
 
-  *buffer = cache.second;
-  // By now we have either removed a cache or created new one. Now we have to
-  // insert it in the front of the list so it becomes the most recently used
-  // one.
-  caches_.push_front(std::move(cache));
-  return found;
+bool PuffinStream::AdvanceReadPlan(size_t puff_id) {
+  if (read_plan_pos_ > 0 && read_plan_[read_plan_pos_ - 1] == puff_id) {
+    // Still reading the same puff.
+    return true;
+  }
+  // The reads can diverge from the plan (e.g. reading past the end of the
+  // stream), so look for the read of the puff in the next few entries.
+  auto search_end =
+      std::min(read_plan_pos_ + kReadPlanSearchLength, read_plan_.size());
+  size_t pos = std::distance(
+      read_plan_.begin(),
+      std::find(read_plan_.begin() + read_plan_pos_,
+                read_plan_.begin() + search_end, puff_id));
+  if (pos == search_end) {
+    return false;
+  }
+  for (; read_plan_pos_ <= pos; read_plan_pos_++) {
+    next_read_of_puff_[read_plan_[read_plan_pos_]] =
+        next_reads_[read_plan_pos_];
+  }
+  return true;
+}
+
+void PuffinStream::SchedulePrefetches(size_t puff_id) {
+  // Prefetch the next puffs that are not cached yet, as long as there is enough
+  // memory for them without evicting any puff that is read before them.
+  auto prefetch_end =
+      std::min(read_plan_pos_ + kPrefetchLength, read_plan_.size());
+  for (auto pos = read_plan_pos_; pos < prefetch_end; pos++) {
+    auto prefetch_id = read_plan_[pos];
+    if (cache_index_[prefetch_id] != caches_.end() ||
+        std::any_of(prefetch_tasks_.begin(), prefetch_tasks_.end(),
+                    [prefetch_id](const shared_ptr<PrefetchTask>& task) {
+                      return task->puff_id == prefetch_id;
+                    })) {
+      continue;
+    }
+    SharedBufferPtr buffer;
+    while (!(buffer = buffer_pool_->TryGet(puffs_[prefetch_id].length))) {
+      auto victim = GetFurthestCache(puff_id);
+      if (victim == caches_.end() || next_read_of_puff_[victim->first] <= pos) {
+        return;
+      }
+      if (stats_ != nullptr) {
+        stats_->cache_evictions++;
+      }
+      cache_index_[victim->first] = caches_.end();
+      buffer_pool_->Release(std::move(victim->second));
+      caches_.erase(victim);
+    }
+
+    auto task = std::make_shared<PrefetchTask>(prefetch_id, buffer);
+    {
+      std::lock_guard<std::mutex> lock(prefetch_mutex_);
+      prefetch_tasks_.push_back(task);
+    }
+    prefetch_pool_->Schedule([this, task]() {
+      auto success = PuffDeflateExtent(
+          prefetch_puffer_.get(), &prefetch_deflate_buffer_,
+          deflates_[task->puff_id], task->buffer->data(), task->buffer->size());
+      {
+        std::lock_guard<std::mutex> lock(prefetch_mutex_);
+        task->success = success;
+        task->done = true;
+      }
+      prefetch_cv_.notify_all();
+    });
+  }
 }
 
 }  // namespace puffin
@@ -5,19 +5,31 @@
 #ifndef SRC_PUFFIN_STREAM_H_
 #define SRC_PUFFIN_STREAM_H_
 
+#include <condition_variable>
+#include <deque>
 #include <list>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "puffin/src/cache_plan.h"
 #include "puffin/src/include/puffin/common.h"
 #include "puffin/src/include/puffin/huffer.h"
+#include "puffin/src/include/puffin/puff_index.h"
 #include "puffin/src/include/puffin/puffer.h"
+#include "puffin/src/include/puffin/stats.h"
 #include "puffin/src/include/puffin/stream.h"
 
 namespace puffin {
 
+class BufferPool;
+class IncrementalHuffer;
+class PuffCache;
+class PuffCrc32;
+class ThreadPool;
+
 // A class for puffing a deflate stream and huffing into a deflate stream. The
 // puff stream is "imaginary", which means it doesn't really exists; It is build
 // and used on demand. This class uses a given deflate stream, and puffs the
@@ -30,7 +42,84 @@ namespace puffin {
 // reading and writing at the same time.
 class PuffinStream : public StreamInterface {
  public:
-  ~PuffinStream() override = default;
+  // The default memory limit of reading the deflates ahead (see
+  // |PuffOptions::max_readahead_size|).
+  static constexpr uint64_t kDefaultMaxReadaheadSize = 4 * 1024 * 1024;
+
+  // The optional settings of a |PuffinStream| for reading puffs (see
+  // |CreateForPuff|).
+  struct PuffOptions {
+    // The amount of memory to use for caching puff buffers. If the amount is
+    // smaller than the maximum puff buffer size in |puffs|, then its value will
+    // be set to zero and no puff will be cached.
+    size_t max_cache_size = 0;
+    // The location of deflate subblocks in the deflate stream used as
+    // checkpoints (see |FindPuffLocations|). When puffs are not cached, only
+    // the subblocks that cover the requested range are puffed.
+    std::vector<BitExtent> subblock_deflates;
+    // The location of the puffs of |subblock_deflates| in the puff stream.
+    std::vector<ByteExtent> subblock_puffs;
+    // The pool the puff caches are allocated from. It can be shared with other
+    // streams to limit all of them by its memory budget. If null, a pool of
+    // |max_cache_size| bytes is used.
+    std::shared_ptr<BufferPool> buffer_pool;
+    // The order the puffs are going to be read in (e.g. by bspatch). If not
+    // empty and puffs are cached, the upcoming puffs are puffed into the cache
+    // on a background thread before they are read, and the cache evicts the
+    // puffs read furthest in the future instead of the least recently used
+    // ones. The reads not marked as cached in the plan are not kept in the
+    // cache.
+    CachePlan cache_plan;
+    // If not null, the puffing, caching and the calls on the deflate stream are
+    // recorded into it. It should outlive the stream.
+    Stats* stats = nullptr;
+    // If not null, the puffs of the deflates are looked up in this cache before
+    // puffing them, and kept in it after.
+    std::shared_ptr<PuffCache> puff_cache;
+    // The location of the deflate stream in the source |puff_cache| is keyed
+    // by. If empty, the deflate stream is the whole source. The deflates not
+    // inside one of the extents are not looked up.
+    std::vector<ByteExtent> cache_extents;
+    // If not null, the bytes of the deflates puffed are kept in buffers from
+    // this pool, so a deflate is puffed again (e.g. after its puff is evicted
+    // from the puff cache) without reading the deflate stream. The deflates are
+    // smaller than their puffs, so more of them fit in the same memory. The
+    // least recently used ones are dropped when the pool is full.
+    std::shared_ptr<BufferPool> deflate_cache_pool;
+    // If not zero, the bytes of this many deflates after the one being puffed
+    // are read from the deflate stream on a background thread, so reading the
+    // next deflates overlaps with puffing the current one when the stream is
+    // read sequentially.
+    size_t readahead_depth = 0;
+    // The maximum total size of the deflates read ahead. Fewer deflates are
+    // read ahead if they do not fit.
+    uint64_t max_readahead_size = kDefaultMaxReadaheadSize;
+    // The encoding of the puffs, which the puff locations and the size of the
+    // puff stream are of.
+    PuffFormat puff_format = PuffFormat::kV1;
+  };
+
+  // The optional settings of a |PuffinStream| for writing puffs (see
+  // |CreateForHuff|).
+  struct HuffOptions {
+    // The number of threads used for huffing the puffs. If it is not one, each
+    // completed puff is huffed by a pool of worker threads while the next puffs
+    // are being written, and the deflates are written into the deflate stream
+    // in order. If zero, the number of available cores is used.
+    size_t num_threads = 1;
+    // If not null, the huffing and the calls on the deflate stream are recorded
+    // into it. It should outlive the stream.
+    Stats* stats = nullptr;
+    // If not empty, the CRC-32 of the uncompressed data of each of the
+    // deflates. Each puff is checked against it while it is written, and the
+    // write fails on the first mismatch. A subblock copying from a subblock
+    // before it that is not one of the deflates is not checked.
+    std::vector<uint32_t> crc32s;
+    // The encoding of the puffs written.
+    PuffFormat puff_format = PuffFormat::kV1;
+  };
+
+  ~PuffinStream() override;
 
   // Creates a |PuffinStream| for reading puff buffers from a deflate stream.
   // |stream|    IN  The deflate stream.
@@ -39,10 +128,8 @@ class PuffinStream : public StreamInterface {
   //                 completely puffed.
   // |deflates|  IN  The location of deflates in |stream|.
   // |puffs|     IN  The location of puffs into the final puff stream.
-  // |max_cache_size| IN  The amount of memory to use for caching puff buffers.
-  //                      If the mount is smaller than the maximum puff buffer
-  //                      size in |puffs|, then its value will be set to zero
-  //                      and no puff will be cached.
+  // |max_cache_size| IN  The amount of memory to use for caching puff buffers
+  //                      (see |PuffOptions::max_cache_size|).
   static UniqueStreamPtr CreateForPuff(UniqueStreamPtr stream,
                                        std::shared_ptr<Puffer> puffer,
                                        uint64_t puff_size,
@@ -50,6 +137,29 @@ class PuffinStream : public StreamInterface {
                                        const std::vector<ByteExtent>& puffs,
                                        size_t max_cache_size = 0);
 
+  // Similar to the function above, but with the settings in |options|.
+  static UniqueStreamPtr CreateForPuff(UniqueStreamPtr stream,
+                                       std::shared_ptr<Puffer> puffer,
+                                       uint64_t puff_size,
+                                       const std::vector<BitExtent>& deflates,
+                                       const std::vector<ByteExtent>& puffs,
+                                       const PuffOptions& options);
+
+  // Similar to the functions above, but takes the deflates, puffs (and their
+  // subblocks) and the size of the puff stream from |index|, e.g. one loaded by
+  // |LoadPuffIndex|. It should be checked with |CheckPuffIndex| against
+  // |stream| beforehand. The subblocks in |options| are ignored, and its
+  // |puff_format| should be |PuffFormat::kV1|, the encoding of the puffs of an
+  // index.
+  static UniqueStreamPtr CreateForPuff(UniqueStreamPtr stream,
+                                       std::shared_ptr<Puffer> puffer,
+                                       const PuffIndex& index,
+                                       size_t max_cache_size = 0);
+  static UniqueStreamPtr CreateForPuff(UniqueStreamPtr stream,
+                                       std::shared_ptr<Puffer> puffer,
+                                       const PuffIndex& index,
+                                       const PuffOptions& options);
+
   // Creates a |PuffinStream| for writing puff buffers into a deflate stream.
   // |stream|    IN  The deflate stream.
   // |huffer|    IN  The |Huffer| used for huffing into the |stream|.
@@ -63,6 +173,14 @@ class PuffinStream : public StreamInterface {
                                        const std::vector<BitExtent>& deflates,
                                        const std::vector<ByteExtent>& puffs);
 
+  // Similar to the function above, but with the settings in |options|.
+  static UniqueStreamPtr CreateForHuff(UniqueStreamPtr stream,
+                                       std::shared_ptr<Huffer> huffer,
+                                       uint64_t puff_size,
+                                       const std::vector<BitExtent>& deflates,
+                                       const std::vector<ByteExtent>& puffs,
+                                       const HuffOptions& options);
+
   bool GetSize(uint64_t* size) const override;
 
   // Returns the current offset in the imaginary puff stream.
@@ -80,7 +198,12 @@ class PuffinStream : public StreamInterface {
   // wrote from beginning to end with no retraction or random change of offset.
   // This function, writes non-puff data directly to |stream_| and caches the
   // puff data into |puff_buffer_|. When |puff_buffer_| is full, it huffs it
-  // into |deflate_buffer_| and writes it to |stream_|.
+  // into |deflate_buffer_| and writes it to |stream_|. If huffing on worker
+  // threads, the data is written into |stream_| once all the deflates before it
+  // are huffed, and at the latest when the whole puff stream is written or
+  // |Close()| is called. The puffs huffed on the calling thread, and the large
+  // ones when huffing on worker threads, are not buffered but huffed as they
+  // are written, so the memory used does not depend on the size of the puffs.
   bool Write(const void* buffer, size_t length) override;
 
   bool Close() override;
@@ -93,22 +216,200 @@ class PuffinStream : public StreamInterface {
                uint64_t puff_size,
                const std::vector<BitExtent>& deflates,
                const std::vector<ByteExtent>& puffs,
-               size_t max_cache_size);
+               const PuffOptions& puff_options,
+               const HuffOptions& huff_options);
 
  private:
+  // The list of puff buffer caches ordered from the most recently used to the
+  // least recently used one.
+  using CacheList = std::list<std::pair<size_t, SharedBufferPtr>>;
+
+  // A deflate to be huffed by the worker threads, or non-deflate data to be
+  // written after the deflates before it.
+  struct HuffTask {
+    HuffTask(bool is_deflate, const BitExtent& deflate)
+        : is_deflate(is_deflate),
+          deflate(deflate),
+          first_bits(0),
+          extra_byte(0),
+          done(false),
+          success(false) {}
+
+    bool is_deflate;
+    BitExtent deflate;
+    // The bits of the first byte of |deflate| that are before |deflate|.
+    uint8_t first_bits;
+    // See |extra_byte_|.
+    size_t extra_byte;
+    // The puff of |deflate| followed by the extra byte if |extra_byte| is one.
+    Buffer puff;
+    // The huffed deflate or the non-deflate data.
+    Buffer output;
+    // Guarded by |huff_mutex_|.
+    bool done;
+    bool success;
+  };
+
+  // Writes the huffed |deflate| in |deflate_buffer| into |stream_| after
+  // merging it with |last_byte_|. If the last byte of |deflate| is shared with
+  // the next deflate, it is kept in |last_byte_| instead.
+  bool WriteDeflate(const BitExtent& deflate,
+                    size_t extra_byte,
+                    Buffer* deflate_buffer);
+
+  // Writes non-deflate data into |stream_|, or queues it after the pending
+  // huff tasks.
+  bool WriteRaw(const uint8_t* bytes, size_t length);
+
+  // Returns a task from |free_huff_tasks_|, or a new one if there is none.
+  std::shared_ptr<HuffTask> GetFreeHuffTask(bool is_deflate,
+                                            const BitExtent& deflate);
+
+  // Schedules huffing the current puff in |puff_buffer_| on |huff_pool_|.
+  bool ScheduleHuff();
+
+  // Writes the finished tasks in |huff_tasks_| into |stream_| in order. Waits
+  // for the unfinished ones until at most |max_pending| tasks are left.
+  bool FlushHuffTasks(size_t max_pending);
+
   // See |extra_byte_|.
   bool SetExtraByte();
 
+  // Huffs the next |length| bytes of the current puff (and its extra byte) in
+  // |bytes| with |incremental_huffer_| and writes the deflate bytes it is done
+  // with into |stream_|.
+  bool HuffIncrementally(const uint8_t* bytes, uint64_t length);
+
+  // Finishes huffing the current puff with |incremental_huffer_| and writes
+  // the rest of its deflate like |WriteDeflate|.
+  bool FinishIncrementalHuff();
+
+  // Call the same functions of |stream_| and record the calls in |stats_|.
+  bool StreamSeek(uint64_t offset);
+  bool StreamRead(void* buffer, size_t length);
+  bool StreamReadZeroCopy(const uint8_t** data, size_t length);
+  bool StreamWrite(const void* buffer, size_t length);
+
+  // A puff being puffed into the cache ahead of reading it.
+  struct PrefetchTask {
+    PrefetchTask(size_t puff_id, SharedBufferPtr buffer)
+        : puff_id(puff_id), buffer(buffer), done(false), success(false) {}
+
+    size_t puff_id;
+    SharedBufferPtr buffer;
+    // Guarded by |prefetch_mutex_|.
+    bool done;
+    bool success;
+  };
+
+  // The bytes of a deflate being read ahead of puffing it.
+  struct ReadaheadTask {
+    explicit ReadaheadTask(size_t deflate_id)
+        : deflate_id(deflate_id), done(false), success(false),
+          cancelled(false) {}
+
+    size_t deflate_id;
+    Buffer buffer;
+    // Guarded by |readahead_mutex_|.
+    bool done;
+    bool success;
+    // True if the bytes are not needed anymore, so they are not read if the
+    // task has not started yet.
+    bool cancelled;
+  };
+
+  // Puffs the deflate bits in |deflate| into |puff_buffer|. |puff_length| is
+  // the expected size of the puff.
+  bool PuffDeflateExtent(const BitExtent& deflate,
+                         uint8_t* puff_buffer,
+                         uint64_t puff_length);
+
+  // Similar to the function above, but uses |puffer| and |deflate_buffer| so it
+  // can be called from the prefetch thread.
+  bool PuffDeflateExtent(Puffer* puffer,
+                         Buffer* deflate_buffer,
+                         const BitExtent& deflate,
+                         uint8_t* puff_buffer,
+                         uint64_t puff_length);
+
+  // Checks the whole puff of |cur_deflate_| written into |puff_crc32_| against
+  // its expected CRC-32, and starts |puff_crc32_| for the next one.
+  bool VerifyCrc32();
+
+  // Finds the deflate in |deflates_| that |deflate| is a part of, or returns
+  // false if none.
+  bool FindDeflate(const BitExtent& deflate, size_t* deflate_id) const;
+
+  // Moves the bytes of |deflate| read ahead into |deflate_buffer| if it is a
+  // whole deflate that was read ahead, waiting for them if they are still
+  // being read, and returns true if so. Then schedules reading the deflates
+  // after it ahead.
+  bool TakeReadahead(const BitExtent& deflate, Buffer* deflate_buffer);
+
+  // Schedules reading the deflates after the |deflate_id|th one ahead, up to
+  // |readahead_depth_| of them, and drops the other ones read ahead.
+  void ScheduleReadaheads(size_t deflate_id);
+
+  // Returns the kept bytes of the |deflate_id|th deflate, or null if they are
+  // not kept. Should be called with |stream_mutex_| held.
+  SharedBufferPtr GetCachedDeflate(size_t deflate_id);
+
+  // Keeps the |length| bytes of the |deflate_id|th deflate in |data|, dropping
+  // the least recently used ones if |deflate_cache_pool_| is full. Should be
+  // called with |stream_mutex_| held.
+  void CacheDeflate(size_t deflate_id, const uint8_t* data, uint64_t length);
+
+  // Finds the location |key| of |deflate| in the source |puff_cache_| is keyed
+  // by. Returns false if it is not inside one of |cache_extents_|.
+  bool GetPuffCacheKey(const BitExtent& deflate, BitExtent* key) const;
+
+  // Finds the smallest range of consecutive subblocks of the current puff that
+  // covers |length| bytes starting from |puff_offset| in the puff stream. The
+  // range is returned in |deflate| and |puff|. Returns false if no such range
+  // exists.
+  bool FindSubblocks(uint64_t puff_offset,
+                     uint64_t length,
+                     BitExtent* deflate,
+                     ByteExtent* puff) const;
+
   // Returns the cache for the |puff_id|th puff. If it does not find it, either
-  // returns the least accessed cached (if cache is full) or creates a new empty
-  // buffer. It returns false if it cannot find the |puff_id|th puff cache.
-  bool GetPuffCache(int puff_id, uint64_t puff_size, SharedBufferPtr* buffer);
+  // reuses the buffer of the least recently used caches (if cache is full) or
+  // creates a new empty buffer. It returns false if it cannot find the
+  // |puff_id|th puff cache. The lookup is done in constant time.
+  bool GetPuffCache(size_t puff_id,
+                    uint64_t puff_size,
+                    SharedBufferPtr* buffer);
+
+  // Returns a buffer of size |puff_size| for caching a puff from
+  // |buffer_pool_|. It evicts the least recently used caches (or the ones read
+  // furthest in the future if there is a read plan) if there is not enough
+  // memory left in the pool for the buffer.
+  SharedBufferPtr GetFreeBuffer(uint64_t puff_size);
+
+  // Returns the cache in |caches_| read furthest in the future according to
+  // |read_plan_|, excluding the |exclude_id|th puff.
+  CacheList::iterator GetFurthestCache(size_t exclude_id);
+
+  // Moves the finished prefetches into |caches_|. If |puff_id| is being
+  // prefetched, waits for it to finish first.
+  void CollectPrefetches(size_t puff_id);
+
+  // Moves |read_plan_pos_| past the read of the |puff_id|th puff. Returns false
+  // if the read is not found in the next few entries of |read_plan_|.
+  bool AdvanceReadPlan(size_t puff_id);
+
+  // Schedules prefetching the puffs read after the current entry of
+  // |read_plan_|, which is the read of the |puff_id|th puff.
+  void SchedulePrefetches(size_t puff_id);
 
   UniqueStreamPtr stream_;
 
   std::shared_ptr<Puffer> puffer_;
   std::shared_ptr<Huffer> huffer_;
 
+  // The encoding of the puff stream.
+  PuffFormat puff_format_;
+
   // The size of the imaginary puff stream.
   uint64_t puff_stream_size_;
 
@@ -134,7 +435,10 @@ class PuffinStream : public StreamInterface {
   // needed when two deflate stream end on the same byte (with greater than zero
   // bit offset difference) or a deflate starts from middle of the byte. We need
   // to cache the value in here before we have the rest of the puff buffer to
-  // make the deflate.
+  // make the deflate. |first_bits_| keeps the non-deflate bits of the first
+  // byte of the current deflate, and |last_byte_| keeps the last byte of a
+  // huffed deflate that is shared with the next one.
+  uint8_t first_bits_;
   uint8_t last_byte_;
 
   // We have to figure out if we need to cache an extra puff byte for the last
@@ -152,13 +456,109 @@ class PuffinStream : public StreamInterface {
   UniqueBufferPtr deflate_buffer_;
   SharedBufferPtr puff_buffer_;
 
-  // The list of puff buffer caches.
-  std::list<std::pair<int, SharedBufferPtr>> caches_;
+  // The optional checkpoints for puffing part of a deflate. Each subblock in
+  // |subblock_deflates_| is puffed into the corresponding extent in
+  // |subblock_puffs_| independently of other subblocks.
+  std::vector<BitExtent> subblock_deflates_;
+  std::vector<ByteExtent> subblock_puffs_;
+
+  CacheList caches_;
+  // The location of each puff in |caches_| indexed by its puff id, or
+  // |caches_.end()| if it is not cached.
+  std::vector<CacheList::iterator> cache_index_;
   // The maximum memory (in bytes) kept for caching puff buffers by an object of
   // this class.
   size_t max_cache_size_;
-  // The current amount of memory (in bytes) used for caching puff buffers.
-  uint64_t cur_cache_size_;
+  // The pool of the buffers in |caches_|. The buffers of evicted caches are
+  // released into it for reuse.
+  std::shared_ptr<BufferPool> buffer_pool_;
+  // Not owned, can be null.
+  Stats* stats_;
+
+  // The puffs kept across streams, or null. |cache_extents_| are the extents
+  // of |stream_| in the source it is keyed by, and |cache_extent_starts_| the
+  // offsets of the extents in |stream_|.
+  std::shared_ptr<PuffCache> puff_cache_;
+  std::vector<ByteExtent> cache_extents_;
+  std::vector<uint64_t> cache_extent_starts_;
+
+  // The ids of the puffs in the order they are going to be read. Consecutive
+  // reads of the same puff are merged.
+  std::vector<size_t> read_plan_;
+  // The index of the next entry of |read_plan_| with the same puff as each
+  // entry, or the size of |read_plan_| if there is none or the puff should not
+  // be kept in the cache after the entry.
+  std::vector<size_t> next_reads_;
+  // The index of the next entry of |read_plan_| for each puff id.
+  std::vector<size_t> next_read_of_puff_;
+  // The entries of |read_plan_| before this index have been read.
+  size_t read_plan_pos_;
+  // The kept bytes of the deflates indexed by their id (see
+  // |deflate_cache_pool_|), ordered from the most recently used to the least
+  // recently used one in |deflate_cache_lru_|. Guarded by |stream_mutex_|.
+  std::shared_ptr<BufferPool> deflate_cache_pool_;
+  std::vector<SharedBufferPtr> cached_deflates_;
+  std::list<size_t> deflate_cache_lru_;
+  std::vector<std::list<size_t>::iterator> deflate_cache_index_;
+  // The buffer of the puffs that are read but not kept in the cache, and the id
+  // of the puff in it (or an invalid id if none).
+  SharedBufferPtr uncached_buffer_;
+  size_t uncached_puff_id_;
+
+  // Serializes the access to |stream_| between reading and prefetching.
+  std::mutex stream_mutex_;
+  // The prefetches in the order they are scheduled.
+  std::deque<std::shared_ptr<PrefetchTask>> prefetch_tasks_;
+  std::mutex prefetch_mutex_;
+  std::condition_variable prefetch_cv_;
+  // Used only by the prefetch thread.
+  std::unique_ptr<Puffer> prefetch_puffer_;
+  Buffer prefetch_deflate_buffer_;
+
+  // The deflates being read ahead (see |readahead_depth| of |CreateForPuff|)
+  // in the order they are scheduled, and the total size of their bytes.
+  size_t readahead_depth_;
+  uint64_t max_readahead_size_;
+  std::deque<std::shared_ptr<ReadaheadTask>> readahead_tasks_;
+  uint64_t readahead_size_;
+  std::mutex readahead_mutex_;
+  std::condition_variable readahead_cv_;
+
+  // The puffs larger than this are huffed by |incremental_huffer_| as they are
+  // written instead of being buffered in |puff_buffer_|.
+  uint64_t max_buffered_puff_size_;
+  std::unique_ptr<IncrementalHuffer> incremental_huffer_;
+  // True if the current puff is being huffed by |incremental_huffer_|.
+  bool huffing_incrementally_;
+  // The extra byte of the current puff (see |extra_byte_|) when huffing it
+  // incrementally.
+  uint8_t extra_byte_value_;
+
+  // The expected CRC-32s of the deflates, if any, and the checksum of the puff
+  // being written.
+  std::vector<uint32_t> crc32s_;
+  std::unique_ptr<PuffCrc32> puff_crc32_;
+
+  // The tasks for huffing on worker threads, in the order of writing.
+  std::deque<std::shared_ptr<HuffTask>> huff_tasks_;
+  // The maximum number of tasks in |huff_tasks_| before waiting on them.
+  size_t max_huff_tasks_;
+  // The written tasks kept for reuse, so their puff and output buffers are not
+  // reallocated for every deflate.
+  std::vector<std::shared_ptr<HuffTask>> free_huff_tasks_;
+  // The |Huffer|s not used by any worker thread. Guarded by |huff_mutex_|.
+  std::vector<std::shared_ptr<Huffer>> free_huffers_;
+  std::mutex huff_mutex_;
+  std::condition_variable huff_cv_;
+  // The worker threads for huffing, or null if huffing on the calling thread.
+  // The thread pools are declared last so their threads are joined before the
+  // rest of the members are destroyed.
+  std::unique_ptr<ThreadPool> huff_pool_;
+  // The thread puffing the upcoming puffs of |read_plan_|, or null if not
+  // prefetching.
+  std::unique_ptr<ThreadPool> prefetch_pool_;
+  // The thread reading the deflates ahead, or null if not reading ahead.
+  std::unique_ptr<ThreadPool> readahead_pool_;
 
   DISALLOW_COPY_AND_ASSIGN(PuffinStream);
 };
@@ -2,6 +2,8 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <zlib.h>
+
 #include <algorithm>
 #include <string>
 #include <vector>
@@ -13,8 +15,11 @@
 #include "puffin/src/include/puffin/common.h"
 #include "puffin/src/include/puffin/huffer.h"
 #include "puffin/src/include/puffin/puffer.h"
+#include "puffin/src/include/puffin/stats.h"
 #include "puffin/src/include/puffin/utils.h"
+#include "puffin/src/incremental_huffer.h"
 #include "puffin/src/memory_stream.h"
+#include "puffin/src/puff_crc32.h"
 #include "puffin/src/puff_reader.h"
 #include "puffin/src/puff_writer.h"
 #include "puffin/src/puffin_stream.h"
@@ -48,7 +53,7 @@ class PuffinTest : public ::testing::Test {
           start++;
 
         case PuffData::Type::kLiterals:
-          pd.read_fn(start, pd.length);
+          memcpy(start, pd.literals, pd.length);
           start += pd.length;
           break;
 
@@ -124,6 +129,23 @@ class PuffinTest : public ::testing::Test {
     ASSERT_EQ(puff_size, expected_puff.size());
     out_puff->resize(puff_size);
     ASSERT_EQ(expected_puff, *out_puff);
+
+    // Scanning should find the same subblocks and puff size as puffing.
+    vector<BitExtent> deflates, scanned_deflates;
+    vector<ByteExtent> puffs, scanned_puffs;
+    BufferBitReader bit_reader(compressed.data(), comp_size);
+    PuffSizeWriter puff_writer;
+    ASSERT_TRUE(puffer_.PuffDeflate(&bit_reader, &puff_writer, &deflates,
+                                    &puffs, &error));
+    BufferBitReader scan_bit_reader(compressed.data(), comp_size);
+    uint64_t scanned_puff_size;
+    ASSERT_TRUE(puffer_.ScanDeflate(&scan_bit_reader, &scanned_deflates,
+                                    &scanned_puffs, &scanned_puff_size,
+                                    &error));
+    ASSERT_EQ(scan_bit_reader.Offset(), comp_size);
+    ASSERT_EQ(scanned_puff_size, expected_puff.size());
+    ASSERT_EQ(scanned_deflates, deflates);
+    ASSERT_EQ(scanned_puffs, puffs);
   }
 
   // Should fail when trying to puff |compressed|.
@@ -153,6 +175,30 @@ class PuffinTest : public ::testing::Test {
     ASSERT_EQ(expected_huff, *out_huff);
   }
 
+  // Huffs |puffed| with an |IncrementalHuffer| in pieces of |piece_size| bytes
+  // and checks its equality with |expected_huff|.
+  void TestIncrementalHuff(const Buffer& puffed,
+                           const Buffer& expected_huff,
+                           size_t piece_size) {
+    IncrementalHuffer huffer;
+    ASSERT_TRUE(huffer.Start(BitExtent(0, expected_huff.size() * 8), 0));
+    Buffer out_huff;
+    for (size_t offset = 0; offset < puffed.size();) {
+      size_t consumed;
+      ASSERT_TRUE(huffer.Write(puffed.data() + offset,
+                               std::min(piece_size, puffed.size() - offset),
+                               &consumed));
+      offset += consumed;
+      out_huff.insert(out_huff.end(), huffer.output(),
+                      huffer.output() + huffer.output_size());
+      huffer.ClearOutput();
+    }
+    ASSERT_TRUE(huffer.Finish());
+    out_huff.insert(out_huff.end(), huffer.output(),
+                    huffer.output() + huffer.output_size());
+    ASSERT_EQ(expected_huff, out_huff);
+  }
+
   // Should fail while huffing |puffed|
   void FailHuffDeflate(const Buffer& puffed,
                        Error expected_error,
@@ -182,13 +228,32 @@ class PuffinTest : public ::testing::Test {
     ASSERT_EQ(original, *uncompress);
   }
 
+  // Computes the CRC-32 of |puffed| in pieces of |piece_size| bytes and checks
+  // its equality with the CRC-32 of |original|.
+  void TestPuffCrc32(const Buffer& puffed,
+                     const Buffer& original,
+                     size_t piece_size) {
+    PuffCrc32 puff_crc32;
+    for (size_t offset = 0; offset < puffed.size(); offset += piece_size) {
+      auto size = std::min(piece_size, puffed.size() - offset);
+      ASSERT_TRUE(puff_crc32.Write(puffed.data() + offset, size));
+    }
+    uint32_t crc;
+    ASSERT_TRUE(puff_crc32.Finish(&crc));
+    ASSERT_EQ(crc, crc32(0L, original.data(), original.size()));
+  }
+
   void CheckSample(const Buffer original,
                    const Buffer compressed,
                    const Buffer puffed) {
     Buffer puff, uncompress, huff;
     TestPuffDeflate(compressed, puffed, &puff);
     TestHuffDeflate(puffed, compressed, &huff);
+    TestIncrementalHuff(puffed, compressed, 1);
+    TestIncrementalHuff(puffed, compressed, puffed.size());
     Decompress(puffed, original, &uncompress);
+    TestPuffCrc32(puffed, original, 1);
+    TestPuffCrc32(puffed, original, puffed.size());
   }
 
   void CheckBitExtentsPuffAndHuff(const Buffer& deflate_buffer,
@@ -225,6 +290,30 @@ class PuffinTest : public ::testing::Test {
     ASSERT_TRUE(
         src_puffin_stream->Write(puff_buffer.data(), puff_buffer.size()));
     EXPECT_EQ(out_deflate_buffer, deflate_buffer);
+
+    // The puffs are huffed as they are written, so writing them one byte at a
+    // time should write the same deflate stream.
+    out_deflate_buffer.clear();
+    deflate_stream = MemoryStream::CreateForWrite(&out_deflate_buffer);
+    src_puffin_stream =
+        PuffinStream::CreateForHuff(std::move(deflate_stream), huffer,
+                                    puff_size, deflate_extents, puff_extents);
+    for (auto byte : puff_buffer) {
+      ASSERT_TRUE(src_puffin_stream->Write(&byte, 1));
+    }
+    EXPECT_EQ(out_deflate_buffer, deflate_buffer);
+
+    // Huffing on worker threads should write the same deflate stream.
+    out_deflate_buffer.clear();
+    deflate_stream = MemoryStream::CreateForWrite(&out_deflate_buffer);
+    PuffinStream::HuffOptions options;
+    options.num_threads = 3;
+    src_puffin_stream = PuffinStream::CreateForHuff(
+        std::move(deflate_stream), huffer, puff_size, deflate_extents,
+        puff_extents, options);
+    ASSERT_TRUE(
+        src_puffin_stream->Write(puff_buffer.data(), puff_buffer.size()));
+    EXPECT_EQ(out_deflate_buffer, deflate_buffer);
   }
 
  protected:
@@ -262,6 +351,15 @@ TEST_F(PuffinTest, DynamicHuffmanTest) {
   CheckSample(kRaw10, kDeflate10, kPuff10);
 }
 
+// Tests a dynamic Huffman table is reused when it is repeated in later deflate
+// blocks, with other blocks in between.
+TEST_F(PuffinTest, DynamicHuffmanCacheTest) {
+  CheckSample(kRaw10, kDeflate10, kPuff10);
+  CheckSample(kRaw4, kDeflate4, kPuff4);
+  CheckSample(kRaw10, kDeflate10, kPuff10);
+  CheckSample(kRaw10, kDeflate10, kPuff10);
+}
+
 // Tests an uncompressed deflate block with invalid LEN/NLEN.
 TEST_F(PuffinTest, PuffDeflateFailedTest) {
   Buffer puffed;
@@ -299,6 +397,88 @@ TEST_F(PuffinTest, BitExtentPuffAndHuffTest) {
                              kPuffExtents11);
 }
 
+TEST_F(PuffinTest, PuffCrc32Test) {
+  // Enough repetitive data for the copies to reach back across the sliding of
+  // the window.
+  Buffer original;
+  for (size_t idx = 0; original.size() < 300000; idx++) {
+    auto text = "puffin " + std::to_string(idx % 1000) + " ";
+    original.insert(original.end(), text.begin(), text.end());
+  }
+  Buffer deflate(original.size());
+  ASSERT_TRUE(sample_generator::CompressToDeflate(
+      original, &deflate, Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY));
+
+  Buffer puffed(original.size() * 2);
+  BufferBitReader bit_reader(deflate.data(), deflate.size());
+  BufferPuffWriter puff_writer(puffed.data(), puffed.size());
+  Error error;
+  ASSERT_TRUE(puffer_.PuffDeflate(&bit_reader, &puff_writer, nullptr, &error));
+  puffed.resize(puff_writer.Size());
+
+  TestPuffCrc32(puffed, original, 1);
+  TestPuffCrc32(puffed, original, 1000);
+  TestPuffCrc32(puffed, original, puffed.size());
+
+  // A puff that ends in the middle of a block fails.
+  PuffCrc32 puff_crc32;
+  ASSERT_TRUE(puff_crc32.Write(puffed.data(), puffed.size() - 1));
+  uint32_t crc;
+  ASSERT_FALSE(puff_crc32.Finish(&crc));
+}
+
+// Makes sure the puffs written into a |PuffinStream| are checked against the
+// CRC-32s of their deflates.
+TEST_F(PuffinTest, PuffinStreamCrc32Test) {
+  // The subblocks are contiguous, so the checksum of each one can copy from
+  // the ones before it.
+  vector<uint32_t> crc32s;
+  PuffCrc32 puff_crc32;
+  for (size_t idx = 0; idx < kPuffExtents11.size(); idx++) {
+    const auto& puff = kPuffExtents11[idx];
+    puff_crc32.Start(idx > 0);
+    ASSERT_TRUE(puff_crc32.Write(kPuff11.data() + puff.offset, puff.length));
+    uint32_t crc;
+    ASSERT_TRUE(puff_crc32.Finish(&crc));
+    crc32s.push_back(crc);
+  }
+
+  auto huffer = std::make_shared<Huffer>();
+  PuffinStream::HuffOptions options;
+  options.crc32s = crc32s;
+  for (size_t piece_size : {size_t(1), kPuff11.size()}) {
+    Buffer out_deflate_buffer;
+    Stats stats;
+    options.stats = &stats;
+    auto stream = PuffinStream::CreateForHuff(
+        MemoryStream::CreateForWrite(&out_deflate_buffer), huffer,
+        kPuff11.size(), kSubblockDeflateExtents11, kPuffExtents11, options);
+    ASSERT_TRUE(stream);
+    for (size_t offset = 0; offset < kPuff11.size(); offset += piece_size) {
+      ASSERT_TRUE(stream->Write(kPuff11.data() + offset,
+                                std::min(piece_size, kPuff11.size() - offset)));
+    }
+    EXPECT_EQ(out_deflate_buffer, kDeflate11);
+    EXPECT_EQ(stats.deflates_verified, crc32s.size());
+  }
+
+  // A wrong checksum fails the write.
+  options.stats = nullptr;
+  options.crc32s.back()++;
+  Buffer out_deflate_buffer;
+  auto stream = PuffinStream::CreateForHuff(
+      MemoryStream::CreateForWrite(&out_deflate_buffer), huffer, kPuff11.size(),
+      kSubblockDeflateExtents11, kPuffExtents11, options);
+  ASSERT_TRUE(stream);
+  EXPECT_FALSE(stream->Write(kPuff11.data(), kPuff11.size()));
+
+  // So does a wrong number of them.
+  options.crc32s.pop_back();
+  EXPECT_FALSE(PuffinStream::CreateForHuff(
+      MemoryStream::CreateForWrite(&out_deflate_buffer), huffer, kPuff11.size(),
+      kSubblockDeflateExtents11, kPuffExtents11, options));
+}
+
 // TODO(ahassani): add tests for:
 //   TestPatchingEmptyTo9
 //   TestPatchingNoDeflateTo9
@@ -9,19 +9,33 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include "bsdiff/bspatch.h"
 #include "bsdiff/file_interface.h"
 
+#include "puffin/src/buffer_pool.h"
+#include "puffin/src/buffered_write_stream.h"
+#include "puffin/src/cache_plan.h"
+#include "puffin/src/deflate_copies.h"
+#include "puffin/src/extent_stream.h"
 #include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/diff_engine.h"
 #include "puffin/src/include/puffin/huffer.h"
 #include "puffin/src/include/puffin/puffer.h"
+#include "puffin/src/include/puffin/stats.h"
 #include "puffin/src/include/puffin/stream.h"
+#include "puffin/src/packed_extents.h"
+#include "puffin/src/puff_cache.h"
 #include "puffin/src/puffin.pb.h"
 #include "puffin/src/puffin_stream.h"
 #include "puffin/src/set_errors.h"
+#include "puffin/src/thread_pool.h"
 
 namespace puffin {
 
@@ -33,58 +47,301 @@ const size_t kMagicLength = 4;
 
 namespace {
 
-template <typename T>
-void CopyRpfToVector(
-    const google::protobuf::RepeatedPtrField<metadata::BitExtent>& from,
-    T* to,
-    size_t coef) {
-  to->reserve(from.size());
-  for (const auto& ext : from) {
-    to->emplace_back(ext.offset() / coef, ext.length() / coef);
+// A part of the destination patched independently of the other parts (see
+// |metadata::PatchChunk|).
+struct PatchChunk {
+  PatchChunk(const ByteExtent& dst, const ByteExtent& dst_puff)
+      : dst(dst),
+        dst_puff(dst_puff),
+        patched_puff_size(0),
+        patch_offset(0),
+        patch_length(0) {}
+
+  // The location of the chunk in the destination deflate and puff streams.
+  ByteExtent dst;
+  ByteExtent dst_puff;
+  // The parts of the chunk around the copies inside it relative to its start,
+  // and the size of their puffs. Only these parts are patched.
+  vector<ByteExtent> dst_parts;
+  uint64_t patched_puff_size;
+  // The deflates and puffs of |dst_parts| relative to their start, as if the
+  // parts were one after another.
+  vector<BitExtent> dst_deflates;
+  vector<ByteExtent> dst_puffs;
+  // The expected CRC-32s of |dst_deflates|, if the patch has them.
+  vector<uint32_t> dst_crc32s;
+  vector<ByteExtent> src_reads;
+  // The location of the bsdiff patch of the chunk in the puffin patch.
+  size_t patch_offset;
+  size_t patch_length;
+};
+
+// Populates the parts, deflates, puffs and CRC-32s (if |dst_crc32s| is not
+// empty) of each chunk in |chunks| from the ones of the whole destination,
+// leaving out the ones in |copies|. Fails if the chunks do not split the
+// destination into consecutive parts holding whole deflates, or the copies are
+// not inside them.
+bool SplitDeflatesIntoChunks(const vector<BitExtent>& dst_deflates,
+                             const vector<ByteExtent>& dst_puffs,
+                             const vector<uint32_t>& dst_crc32s,
+                             uint64_t dst_puff_size,
+                             const vector<DeflateCopy>& copies,
+                             vector<PatchChunk>* chunks) {
+  TEST_AND_RETURN_FALSE(dst_deflates.size() == dst_puffs.size());
+  size_t idx = 0;
+  size_t copy_idx = 0;
+  uint64_t end = 0;
+  uint64_t puff_end = 0;
+  for (auto& chunk : *chunks) {
+    TEST_AND_RETURN_FALSE(chunk.dst.offset == end);
+    TEST_AND_RETURN_FALSE(chunk.dst_puff.offset == puff_end);
+    end += chunk.dst.length;
+    puff_end += chunk.dst_puff.length;
+    auto first_copy = copy_idx;
+    for (; copy_idx < copies.size() && copies[copy_idx].dst.offset < end;
+         copy_idx++) {
+      const auto& copy = copies[copy_idx];
+      TEST_AND_RETURN_FALSE(copy.dst.offset + copy.dst.length <= end);
+      TEST_AND_RETURN_FALSE(copy.dst_puff.offset >= chunk.dst_puff.offset &&
+                            copy.dst_puff.offset + copy.dst_puff.length <=
+                                puff_end);
+    }
+    vector<ByteExtent> dst_puff_parts;
+    RemoveCopies(chunk.dst, chunk.dst_puff, copies, &chunk.dst_parts,
+                 &dst_puff_parts);
+    for (const auto& part : dst_puff_parts) {
+      chunk.patched_puff_size += part.length;
+    }
+
+    // The size and puff size of the copies before the current deflate.
+    uint64_t copied = 0;
+    uint64_t puff_copied = 0;
+    auto next_copy = first_copy;
+    for (; idx < dst_deflates.size() && dst_deflates[idx].offset < end * 8;
+         idx++) {
+      const auto& deflate = dst_deflates[idx];
+      const auto& puff = dst_puffs[idx];
+      TEST_AND_RETURN_FALSE(deflate.offset + deflate.length <= end * 8);
+      TEST_AND_RETURN_FALSE(puff.offset >= chunk.dst_puff.offset &&
+                            puff.offset + puff.length <= puff_end);
+      for (; next_copy < copy_idx; next_copy++) {
+        const auto& copy = copies[next_copy];
+        if ((copy.dst.offset + copy.dst.length) * 8 > deflate.offset) {
+          break;
+        }
+        copied += copy.dst.length;
+        puff_copied += copy.dst_puff.length;
+      }
+      if (next_copy < copy_idx &&
+          copies[next_copy].dst.offset * 8 <= deflate.offset) {
+        // The deflate is copied.
+        continue;
+      }
+      chunk.dst_deflates.emplace_back(
+          deflate.offset - (chunk.dst.offset + copied) * 8, deflate.length);
+      chunk.dst_puffs.emplace_back(
+          puff.offset - chunk.dst_puff.offset - puff_copied, puff.length);
+      if (!dst_crc32s.empty()) {
+        chunk.dst_crc32s.push_back(dst_crc32s[idx]);
+      }
+    }
   }
+  TEST_AND_RETURN_FALSE(idx == dst_deflates.size());
+  TEST_AND_RETURN_FALSE(copy_idx == copies.size());
+  TEST_AND_RETURN_FALSE(puff_end == dst_puff_size);
+  return true;
 }
 
-bool DecodePatch(const uint8_t* patch,
-                 size_t patch_length,
-                 size_t* bsdiff_patch_offset,
-                 size_t* bsdiff_patch_size,
-                 vector<BitExtent>* src_deflates,
-                 vector<BitExtent>* dst_deflates,
-                 vector<ByteExtent>* src_puffs,
-                 vector<ByteExtent>* dst_puffs,
-                 uint64_t* src_puff_size,
-                 uint64_t* dst_puff_size) {
-  size_t offset = 0;
+// The header of a puffin patch decoded by |DecodePatchHeader|.
+struct DecodedPatch {
+  // The location of the bsdiff patch in the puffin patch, if it is not split
+  // into |chunks|.
+  size_t bsdiff_patch_offset = 0;
+  size_t bsdiff_patch_size = 0;
+  vector<BitExtent> src_deflates;
+  vector<BitExtent> dst_deflates;
+  vector<ByteExtent> src_puffs;
+  vector<ByteExtent> dst_puffs;
+  // Empty if the patch does not have the CRC-32s of |dst_deflates|.
+  vector<uint32_t> dst_crc32s;
+  uint64_t src_puff_size = 0;
+  uint64_t dst_puff_size = 0;
+  CachePlan src_cache_plan;
+  uint64_t src_cache_plan_size = 0;
+  vector<PatchChunk> chunks;
+  vector<DeflateCopy> copies;
+  uint32_t engine_id = kBsdiffEngineId;
+  PatchCodec codec = PatchCodec::kBz2;
+  PuffFormat puff_format = PuffFormat::kV1;
+};
+
+// The size of the magic and the header size in front of the header.
+const size_t kHeaderPrefixLength = kMagicLength + sizeof(uint32_t);
+
+// Finds the end of the header of |patch| from its first |patch_length| bytes,
+// which should be at least |kHeaderPrefixLength|. The bsdiff patches start
+// right after it.
+bool GetPatchHeaderEnd(const uint8_t* patch,
+                       size_t patch_length,
+                       size_t* header_end) {
   uint32_t header_size;
-  TEST_AND_RETURN_FALSE(patch_length >= (kMagicLength + sizeof(header_size)));
+  TEST_AND_RETURN_FALSE(patch_length >= kHeaderPrefixLength);
 
   string patch_magic(reinterpret_cast<const char*>(patch), kMagicLength);
   if (patch_magic != kMagic) {
     LOG(ERROR) << "Magic number for Puffin patch is incorrect: " << patch_magic;
     return false;
   }
-  offset += kMagicLength;
 
   // Read the header size from big-endian mode.
-  memcpy(&header_size, patch + offset, sizeof(header_size));
+  memcpy(&header_size, patch + kMagicLength, sizeof(header_size));
   header_size = be32toh(header_size);
-  offset += sizeof(header_size);
-  TEST_AND_RETURN_FALSE(header_size <= (patch_length - offset));
+  *header_end = kHeaderPrefixLength + header_size;
+  return true;
+}
 
+// Decodes the header of |patch| ending at |header_end| (see
+// |GetPatchHeaderEnd|) into |decoded|. Only the header has to be available.
+bool DecodePatchHeader(const uint8_t* patch,
+                       size_t header_end,
+                       DecodedPatch* decoded) {
   metadata::PatchHeader header;
-  TEST_AND_RETURN_FALSE(header.ParseFromArray(patch + offset, header_size));
-  offset += header_size;
+  TEST_AND_RETURN_FALSE(header.ParseFromArray(
+      patch + kHeaderPrefixLength, header_end - kHeaderPrefixLength));
+  if (header.version() < 1 || header.version() > 5) {
+    LOG(ERROR) << "Unsupported Puffin patch version: " << header.version();
+    return false;
+  }
 
-  CopyRpfToVector(header.src().deflates(), src_deflates, 1);
-  CopyRpfToVector(header.dst().deflates(), dst_deflates, 1);
-  CopyRpfToVector(header.src().puffs(), src_puffs, 8);
-  CopyRpfToVector(header.dst().puffs(), dst_puffs, 8);
+  TEST_AND_RETURN_FALSE(GetStreamInfo(header.src(), &decoded->src_deflates,
+                                      &decoded->src_puffs,
+                                      &decoded->src_puff_size));
+  TEST_AND_RETURN_FALSE(GetStreamInfo(header.dst(), &decoded->dst_deflates,
+                                      &decoded->dst_puffs,
+                                      &decoded->dst_puff_size));
+  if (header.dst_crc32s_size() > 0) {
+    TEST_AND_RETURN_FALSE(static_cast<size_t>(header.dst_crc32s_size()) ==
+                          decoded->dst_deflates.size());
+    decoded->dst_crc32s.assign(header.dst_crc32s().begin(),
+                               header.dst_crc32s().end());
+  }
+  decoded->engine_id = header.diff_engine();
+  decoded->codec = static_cast<PatchCodec>(header.patch_codec());
+  if (header.puff_format() != 0) {
+    TEST_AND_RETURN_FALSE(header.version() >= 5);
+    if (header.puff_format() != static_cast<uint32_t>(PuffFormat::kV2)) {
+      LOG(ERROR) << "Unsupported puff format: " << header.puff_format();
+      return false;
+    }
+  }
+  decoded->puff_format = static_cast<PuffFormat>(header.puff_format());
 
-  *src_puff_size = header.src().puff_length();
-  *dst_puff_size = header.dst().puff_length();
+  if (header.has_src_cache_plan()) {
+    const auto& plan = header.src_cache_plan();
+    decoded->src_cache_plan_size = plan.max_cache_size();
+    auto& puff_reads = decoded->src_cache_plan.puff_reads;
+    puff_reads.assign(plan.puff_reads().begin(), plan.puff_reads().end());
+    const auto& cached_reads = plan.cached_reads();
+    TEST_AND_RETURN_FALSE(cached_reads.size() == (puff_reads.size() + 7) / 8);
+    auto& cache_plan_reads = decoded->src_cache_plan.cached_reads;
+    cache_plan_reads.resize(puff_reads.size());
+    for (size_t idx = 0; idx < puff_reads.size(); idx++) {
+      cache_plan_reads[idx] = (cached_reads[idx / 8] >> (idx % 8)) & 1;
+    }
+  }
+
+  decoded->bsdiff_patch_offset = header_end;
 
-  *bsdiff_patch_offset = offset;
-  *bsdiff_patch_size = patch_length - offset;
+  if (header.version() == 2 || header.copies_size() > 0) {
+    TEST_AND_RETURN_FALSE(header.chunks_size() > 0);
+  }
+  if (header.copies_size() > 0) {
+    TEST_AND_RETURN_FALSE(header.version() >= 4);
+    auto* copies = &decoded->copies;
+    copies->reserve(header.copies_size());
+    uint64_t end = 0;
+    for (const auto& pb_copy : header.copies()) {
+      TEST_AND_RETURN_FALSE(pb_copy.dst_offset() >= end);
+      copies->emplace_back(pb_copy.src_offset(),
+                           ByteExtent(pb_copy.dst_offset(), pb_copy.length()));
+      auto& copy = copies->back();
+      TEST_AND_RETURN_FALSE(FindPuffOfBytes(
+          decoded->dst_deflates, decoded->dst_puffs, copy.dst, &copy.dst_puff));
+      end = copy.dst.offset + copy.dst.length;
+    }
+  }
+  if (header.version() >= 2 && header.chunks_size() > 0) {
+    auto* chunks = &decoded->chunks;
+    chunks->reserve(header.chunks_size());
+    size_t offset = header_end;
+    for (const auto& pb_chunk : header.chunks()) {
+      chunks->emplace_back(
+          ByteExtent(pb_chunk.dst_offset(), pb_chunk.dst_length()),
+          ByteExtent(pb_chunk.dst_puff_offset(), pb_chunk.dst_puff_length()));
+      auto& chunk = chunks->back();
+      CopyRpfToVector(pb_chunk.src_reads(), &chunk.src_reads, 8);
+      TEST_AND_RETURN_FALSE(pb_chunk.patch_length() <=
+                            std::numeric_limits<size_t>::max() - offset);
+      chunk.patch_offset = offset;
+      chunk.patch_length = pb_chunk.patch_length();
+      offset += chunk.patch_length;
+    }
+    TEST_AND_RETURN_FALSE(SplitDeflatesIntoChunks(
+        decoded->dst_deflates, decoded->dst_puffs, decoded->dst_crc32s,
+        decoded->dst_puff_size, decoded->copies, chunks));
+  }
+  return true;
+}
+
+// Decodes the header of the whole |patch| of |patch_length| bytes into
+// |decoded| and checks the bsdiff patches fill the rest of it.
+bool DecodePatch(const uint8_t* patch,
+                 size_t patch_length,
+                 DecodedPatch* decoded) {
+  size_t header_end;
+  TEST_AND_RETURN_FALSE(GetPatchHeaderEnd(patch, patch_length, &header_end));
+  TEST_AND_RETURN_FALSE(header_end <= patch_length);
+  TEST_AND_RETURN_FALSE(DecodePatchHeader(patch, header_end, decoded));
+  if (decoded->chunks.empty()) {
+    decoded->bsdiff_patch_size = patch_length - header_end;
+  } else {
+    const auto& last_chunk = decoded->chunks.back();
+    TEST_AND_RETURN_FALSE(last_chunk.patch_offset + last_chunk.patch_length ==
+                          patch_length);
+  }
+  return true;
+}
+
+// Finds the size of the destination deflate stream of |decoded| from the size
+// of its puff stream. The raw bytes after the last puff are the ones after the
+// last deflate.
+bool GetDstSize(const DecodedPatch& decoded, uint64_t* dst_size) {
+  const auto& deflates = decoded.dst_deflates;
+  const auto& puffs = decoded.dst_puffs;
+  TEST_AND_RETURN_FALSE(deflates.size() == puffs.size());
+  if (puffs.empty()) {
+    *dst_size = decoded.dst_puff_size;
+    return true;
+  }
+  auto puff_end = puffs.back().offset + puffs.back().length;
+  TEST_AND_RETURN_FALSE(puff_end <= decoded.dst_puff_size);
+  *dst_size = decoded.dst_puff_size - puff_end +
+              (deflates.back().offset + deflates.back().length) / 8;
+  return true;
+}
+
+// Returns false if |engine| can not apply |patch|.
+bool CheckEngine(const PatchEngine& engine, const DecodedPatch& patch) {
+  if (engine.id() != patch.engine_id) {
+    LOG(ERROR) << "The patch is created by engine " << patch.engine_id
+               << ", but it is applied by engine " << engine.id();
+    return false;
+  }
+  if (!engine.SupportsCodec(patch.codec)) {
+    LOG(ERROR) << "Unsupported patch codec: "
+               << static_cast<uint32_t>(patch.codec);
+    return false;
+  }
   return true;
 }
 
@@ -128,41 +385,747 @@ class BsdiffStream : public bsdiff::FileInterface {
   DISALLOW_COPY_AND_ASSIGN(BsdiffStream);
 };
 
+class BspatchEngine : public PatchEngine {
+ public:
+  BspatchEngine() = default;
+  ~BspatchEngine() override = default;
+
+  uint32_t id() const override { return kBsdiffEngineId; }
+
+  bool Patch(UniqueStreamPtr src,
+             UniqueStreamPtr dst,
+             const uint8_t* patch,
+             size_t patch_size) const override {
+    std::unique_ptr<bsdiff::FileInterface> reader(
+        new BsdiffStream(std::move(src)));
+    std::unique_ptr<bsdiff::FileInterface> writer(
+        new BsdiffStream(std::move(dst)));
+    return 0 == bspatch(reader, writer, patch, patch_size);
+  }
+
+  bool GetSourceReads(const uint8_t* patch,
+                      size_t patch_size,
+                      uint64_t src_size,
+                      vector<ByteExtent>* reads) const override {
+    return GetBspatchSourceReads(patch, patch_size, src_size, reads);
+  }
+
+  // bspatch detects the format of the patches and decompresses them while it
+  // is reading them.
+  bool SupportsCodec(PatchCodec codec) const override {
+    return codec == PatchCodec::kBz2 || codec == PatchCodec::kBrotli ||
+           codec == PatchCodec::kNone;
+  }
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(BspatchEngine);
+};
+
+// A stream over |length| bytes of |stream| starting from |offset|. The range
+// streams of the same |stream| can be used on different threads, as each read
+// or write seeks |stream| and accesses it while holding |mutex|. Closing it
+// does not close |stream|.
+class RangeStream : public StreamInterface {
+ public:
+  RangeStream(StreamInterface* stream,
+              std::mutex* mutex,
+              uint64_t offset,
+              uint64_t length)
+      : stream_(stream),
+        mutex_(mutex),
+        start_(offset),
+        size_(length),
+        offset_(0) {}
+  ~RangeStream() override = default;
+
+  bool GetSize(uint64_t* size) const override {
+    *size = size_;
+    return true;
+  }
+
+  bool GetOffset(uint64_t* offset) const override {
+    *offset = offset_;
+    return true;
+  }
+
+  bool Seek(uint64_t offset) override {
+    TEST_AND_RETURN_FALSE(offset <= size_);
+    offset_ = offset;
+    return true;
+  }
+
+  bool Read(void* buffer, size_t length) override {
+    TEST_AND_RETURN_FALSE(offset_ + length <= size_);
+    std::lock_guard<std::mutex> lock(*mutex_);
+    TEST_AND_RETURN_FALSE(stream_->Seek(start_ + offset_));
+    TEST_AND_RETURN_FALSE(stream_->Read(buffer, length));
+    offset_ += length;
+    return true;
+  }
+
+  bool ReadZeroCopy(const uint8_t** data, size_t length) override {
+    TEST_AND_RETURN_FALSE(offset_ + length <= size_);
+    std::lock_guard<std::mutex> lock(*mutex_);
+    TEST_AND_RETURN_FALSE(stream_->Seek(start_ + offset_));
+    if (!stream_->ReadZeroCopy(data, length)) {
+      return false;
+    }
+    offset_ += length;
+    return true;
+  }
+
+  bool Write(const void* buffer, size_t length) override {
+    TEST_AND_RETURN_FALSE(offset_ + length <= size_);
+    std::lock_guard<std::mutex> lock(*mutex_);
+    TEST_AND_RETURN_FALSE(stream_->Seek(start_ + offset_));
+    TEST_AND_RETURN_FALSE(stream_->Write(buffer, length));
+    offset_ += length;
+    return true;
+  }
+
+  bool Close() override { return true; }
+
+ private:
+  StreamInterface* stream_;
+  std::mutex* mutex_;
+  uint64_t start_;
+  uint64_t size_;
+  uint64_t offset_;
+
+  DISALLOW_COPY_AND_ASSIGN(RangeStream);
+};
+
+// The size of the buffer used for extending the destination.
+constexpr size_t kZeroBufferSize = 1024 * 1024;  // 1 MiB
+
+// The size of the pieces the copies of a patch are copied in.
+constexpr size_t kCopyBufferSize = 1024 * 1024;  // 1 MiB
+
+// The size of the buffers the many small writes of |PuffinStream| into the
+// destination (the deflate bytes and the raw bytes in between) are gathered
+// in.
+constexpr size_t kDstWriteBufferSize = 1024 * 1024;  // 1 MiB
+
+// The objects shared by the streams of a patch operation. They are created for
+// each operation, or reused from a |PuffPatchContext| across operations.
+struct PatchResources {
+  explicit PatchResources(size_t max_cache_size)
+      : max_cache_size(max_cache_size),
+        buffer_pool(std::make_shared<BufferPool>(max_cache_size)),
+        puffer(std::make_shared<Puffer>()),
+        huffer(std::make_shared<Huffer>()) {}
+
+  // All the puff caches are allocated from one pool, so |max_cache_size| is
+  // the budget of the whole patch operation.
+  size_t max_cache_size;
+  std::shared_ptr<BufferPool> buffer_pool;
+  // Used by the streams of a patch not split into chunks. The chunks use their
+  // own, as they are patched on different threads.
+  std::shared_ptr<Puffer> puffer;
+  std::shared_ptr<Huffer> huffer;
+  // The puffs kept across operations, or null, and the location of the source
+  // of the operation in the source it is keyed by.
+  std::shared_ptr<PuffCache> puff_cache;
+  vector<ByteExtent> src_extents;
+  // The pool the source streams keep the bytes of the deflates they puff in,
+  // or null (see |PuffinStream::PuffOptions|).
+  std::shared_ptr<BufferPool> deflate_cache_pool;
+};
+
+// Returns the settings of a stream reading the source puffs (in |puff_format|)
+// through |resources|, following |cache_plan| and recording into |stats|.
+PuffinStream::PuffOptions GetSrcPuffOptions(const PatchResources& resources,
+                                            PuffFormat puff_format,
+                                            const CachePlan& cache_plan,
+                                            Stats* stats) {
+  PuffinStream::PuffOptions options;
+  options.max_cache_size = resources.max_cache_size;
+  options.buffer_pool = resources.buffer_pool;
+  options.cache_plan = cache_plan;
+  options.stats = stats;
+  options.puff_cache = resources.puff_cache;
+  options.cache_extents = resources.src_extents;
+  options.deflate_cache_pool = resources.deflate_cache_pool;
+  options.puff_format = puff_format;
+  return options;
+}
+
+// Extends |stream| to |size| bytes by writing zeros at its end if it is
+// smaller, so it can be written at any offset before |size|. Streams like
+// |MemoryStream| cannot seek past their end.
+bool ExtendStream(const UniqueStreamPtr& stream, uint64_t size) {
+  uint64_t cur_size;
+  TEST_AND_RETURN_FALSE(stream->GetSize(&cur_size));
+  if (cur_size >= size) {
+    return true;
+  }
+  TEST_AND_RETURN_FALSE(stream->Seek(cur_size));
+  Buffer zeros(std::min<uint64_t>(size - cur_size, kZeroBufferSize));
+  while (cur_size < size) {
+    auto count = std::min<uint64_t>(size - cur_size, zeros.size());
+    TEST_AND_RETURN_FALSE(stream->Write(zeros.data(), count));
+    cur_size += count;
+  }
+  return true;
+}
+
+// Applies the chunks of a patch (see |metadata::PatchChunk|) independently of
+// each other. Each chunk reads the whole source through its own
+// |PuffinStream| and huffs its part of the destination, so chunks can be
+// patched on different threads at the same time. The puff caches of all of
+// them are allocated from the buffer pool of |resources|. The copies of the
+// patch (see |metadata::PatchCopy|) are copied from the source directly.
+class ChunksPatcher {
+ public:
+  ChunksPatcher(UniqueStreamPtr src,
+                UniqueStreamPtr dst,
+                const DecodedPatch* patch,
+                const PatchResources& resources,
+                std::shared_ptr<PatchEngine> engine,
+                Stats* stats)
+      : src_(std::move(src)),
+        dst_(std::move(dst)),
+        patch_(patch),
+        src_size_(0),
+        resources_(resources),
+        engine_(std::move(engine)),
+        stats_(stats) {}
+  ~ChunksPatcher() = default;
+
+  // Extends the destination, so the chunks can be written in any order.
+  bool Init() {
+    TEST_AND_RETURN_FALSE(src_->GetSize(&src_size_));
+    const auto& last_chunk = patch_->chunks.back();
+    return ExtendStream(dst_,
+                        last_chunk.dst.offset + last_chunk.dst.length);
+  }
+
+  // Copies the copies of the patch from the source into the destination,
+  // without puffing, patching or huffing them.
+  bool CopyDeflates() {
+    ScopedStatsTimer timer(stats_, &Stats::io_time_ns);
+    Buffer buffer;
+    for (const auto& copy : patch_->copies) {
+      TEST_AND_RETURN_FALSE(copy.src_offset <= src_size_ &&
+                            copy.dst.length <= src_size_ - copy.src_offset);
+      for (uint64_t copied = 0; copied < copy.dst.length;) {
+        auto count =
+            std::min<uint64_t>(copy.dst.length - copied, kCopyBufferSize);
+        const uint8_t* data;
+        {
+          std::lock_guard<std::mutex> lock(src_mutex_);
+          TEST_AND_RETURN_FALSE(src_->Seek(copy.src_offset + copied));
+          if (!src_->ReadZeroCopy(&data, count)) {
+            buffer.resize(count);
+            TEST_AND_RETURN_FALSE(src_->Read(buffer.data(), count));
+            data = buffer.data();
+          }
+        }
+        {
+          std::lock_guard<std::mutex> lock(dst_mutex_);
+          TEST_AND_RETURN_FALSE(dst_->Seek(copy.dst.offset + copied));
+          TEST_AND_RETURN_FALSE(dst_->Write(data, count));
+        }
+        copied += count;
+      }
+      if (stats_ != nullptr) {
+        stats_->deflates_copied++;
+        stats_->copy_bytes += copy.dst.length;
+      }
+    }
+    return true;
+  }
+
+  // Applies |chunk| of the patch with its bsdiff patch |chunk_patch|. It can
+  // be called from multiple threads at the same time.
+  bool Patch(const PatchChunk& chunk, const uint8_t* chunk_patch) {
+    if (chunk.dst_parts.empty()) {
+      // The whole chunk is copied.
+      TEST_AND_RETURN_FALSE(chunk.patch_length == 0);
+      return true;
+    }
+    CachePlan src_cache_plan;
+    if (resources_.max_cache_size > 0) {
+      GetPuffReads(chunk.src_reads, patch_->src_puffs,
+                   &src_cache_plan.puff_reads);
+    }
+    auto src_stream = PuffinStream::CreateForPuff(
+        UniqueStreamPtr(new RangeStream(src_.get(), &src_mutex_, 0,
+                                        src_size_)),
+        std::make_shared<Puffer>(), patch_->src_puff_size,
+        patch_->src_deflates, patch_->src_puffs,
+        GetSrcPuffOptions(resources_, patch_->puff_format, src_cache_plan,
+                          stats_));
+    TEST_AND_RETURN_FALSE(src_stream);
+    // Only the parts around the copies are huffed.
+    UniqueStreamPtr dst_range(new RangeStream(dst_.get(), &dst_mutex_,
+                                              chunk.dst.offset,
+                                              chunk.dst.length));
+    if (chunk.dst_parts.size() > 1 ||
+        chunk.dst_parts[0].length != chunk.dst.length) {
+      dst_range =
+          ExtentStream::CreateForWrite(std::move(dst_range), chunk.dst_parts);
+      TEST_AND_RETURN_FALSE(dst_range);
+    }
+    dst_range =
+        BufferedWriteStream::Create(std::move(dst_range), kDstWriteBufferSize);
+    TEST_AND_RETURN_FALSE(dst_range);
+    PuffinStream::HuffOptions huff_options;
+    huff_options.stats = stats_;
+    huff_options.crc32s = chunk.dst_crc32s;
+    huff_options.puff_format = patch_->puff_format;
+    auto dst_stream = PuffinStream::CreateForHuff(
+        std::move(dst_range), std::make_shared<Huffer>(),
+        chunk.patched_puff_size, chunk.dst_deflates, chunk.dst_puffs,
+        huff_options);
+    TEST_AND_RETURN_FALSE(dst_stream);
+    TEST_AND_RETURN_FALSE(engine_->Patch(std::move(src_stream),
+                                         std::move(dst_stream), chunk_patch,
+                                         chunk.patch_length));
+    return true;
+  }
+
+  // Closes the destination after all the chunks are patched.
+  bool Close() { return dst_->Close(); }
+
+ private:
+  UniqueStreamPtr src_;
+  UniqueStreamPtr dst_;
+  const DecodedPatch* patch_;
+  uint64_t src_size_;
+  PatchResources resources_;
+  std::shared_ptr<PatchEngine> engine_;
+  Stats* stats_;
+
+  std::mutex src_mutex_;
+  std::mutex dst_mutex_;
+
+  DISALLOW_COPY_AND_ASSIGN(ChunksPatcher);
+};
+
+// Applies the chunks of the whole |patch| on |num_threads| threads at the same
+// time.
+bool PatchChunks(ChunksPatcher* patcher,
+                 const uint8_t* patch,
+                 const DecodedPatch& decoded,
+                 size_t num_threads) {
+  TEST_AND_RETURN_FALSE(patcher->Init());
+  TEST_AND_RETURN_FALSE(patcher->CopyDeflates());
+  TEST_AND_RETURN_FALSE(ParallelFor(
+      decoded.chunks.size(), num_threads, [&](size_t index, size_t) {
+        const auto& chunk = decoded.chunks[index];
+        return patcher->Patch(chunk, &patch[chunk.patch_offset]);
+      }));
+  return patcher->Close();
+}
+
+// Applies the single bsdiff patch |bsdiff_patch| of size |bsdiff_patch_size|
+// of |decoded| with |engine|, huffing the destination on |num_threads|
+// threads.
+bool PatchSingle(UniqueStreamPtr src,
+                 UniqueStreamPtr dst,
+                 const uint8_t* bsdiff_patch,
+                 size_t bsdiff_patch_size,
+                 const DecodedPatch& decoded,
+                 const PatchResources& resources,
+                 size_t num_threads,
+                 const PatchEngine& engine,
+                 Stats* stats) {
+  auto max_cache_size = resources.max_cache_size;
+
+  // Follow the cache plan of the patch if it is made for at most
+  // |max_cache_size| bytes. Otherwise the source reads of the engine are found
+  // from the patch (e.g. the control entries of bspatch), so the source puffs
+  // can still be prefetched into the cache before they are read and evicted
+  // based on their next read. Patching still works without them.
+  CachePlan src_cache_plan;
+  if (decoded.src_cache_plan_size <= max_cache_size) {
+    src_cache_plan = decoded.src_cache_plan;
+  }
+  if (max_cache_size > 0 && src_cache_plan.puff_reads.empty()) {
+    vector<ByteExtent> src_reads;
+    if (engine.GetSourceReads(bsdiff_patch, bsdiff_patch_size,
+                              decoded.src_puff_size, &src_reads)) {
+      GetPuffReads(src_reads, decoded.src_puffs, &src_cache_plan.puff_reads);
+    }
+  }
+
+  // For reading from source.
+  auto reader = PuffinStream::CreateForPuff(
+      std::move(src), resources.puffer, decoded.src_puff_size,
+      decoded.src_deflates, decoded.src_puffs,
+      GetSrcPuffOptions(resources, decoded.puff_format, src_cache_plan, stats));
+  TEST_AND_RETURN_FALSE(reader);
+
+  // For writing into destination. The destination deflates are huffed on
+  // |num_threads| worker threads while the engine is producing the next puffs.
+  dst = BufferedWriteStream::Create(std::move(dst), kDstWriteBufferSize);
+  TEST_AND_RETURN_FALSE(dst);
+  PuffinStream::HuffOptions huff_options;
+  huff_options.num_threads = num_threads;
+  huff_options.stats = stats;
+  huff_options.crc32s = decoded.dst_crc32s;
+  huff_options.puff_format = decoded.puff_format;
+  auto writer = PuffinStream::CreateForHuff(
+      std::move(dst), resources.huffer, decoded.dst_puff_size,
+      decoded.dst_deflates, decoded.dst_puffs, huff_options);
+  TEST_AND_RETURN_FALSE(writer);
+
+  // Running the engine (e.g. bspatch) itself.
+  ScopedStatsTimer timer(stats, &Stats::bspatch_time_ns);
+  TEST_AND_RETURN_FALSE(engine.Patch(std::move(reader), std::move(writer),
+                                     bsdiff_patch, bsdiff_patch_size));
+  return true;
+}
+
+class PuffPatcherImpl : public PuffPatcher {
+ public:
+  PuffPatcherImpl(UniqueStreamPtr src,
+                  UniqueStreamPtr dst,
+                  const PatchResources& resources,
+                  size_t num_threads,
+                  Stats* stats,
+                  std::shared_ptr<PatchEngine> engine)
+      : src_(std::move(src)),
+        dst_(std::move(dst)),
+        resources_(resources),
+        num_threads_(num_threads),
+        stats_(stats),
+        engine_(std::move(engine)),
+        header_end_(0),
+        buffer_offset_(0),
+        next_chunk_(0),
+        failed_(false),
+        finished_(false) {}
+
+  // Waits for the chunks being patched, as they use the members.
+  ~PuffPatcherImpl() override { thread_pool_.reset(); }
+
+  bool Write(const uint8_t* data, size_t size) override {
+    TEST_AND_RETURN_FALSE(!finished_ && !failed_);
+    buffer_.insert(buffer_.end(), data, data + size);
+    if (header_end_ == 0) {
+      TEST_AND_RETURN_FALSE(DecodeHeader());
+    }
+    if (header_end_ != 0 && !patch_.chunks.empty()) {
+      TEST_AND_RETURN_FALSE(PatchCompleteChunks());
+    }
+    return true;
+  }
+
+  bool Finish() override {
+    TEST_AND_RETURN_FALSE(!finished_ && !failed_);
+    finished_ = true;
+    if (header_end_ == 0) {
+      LOG(ERROR) << "The patch ended before its header.";
+      return false;
+    }
+    if (patch_.chunks.empty()) {
+      return PatchSingle(std::move(src_), std::move(dst_), buffer_.data(),
+                         buffer_.size(), patch_, resources_, num_threads_,
+                         *engine_, stats_);
+    }
+    if (thread_pool_) {
+      thread_pool_->Wait();
+    }
+    TEST_AND_RETURN_FALSE(!failed_);
+    TEST_AND_RETURN_FALSE(next_chunk_ == patch_.chunks.size());
+    TEST_AND_RETURN_FALSE(buffer_.empty());
+    return chunks_patcher_->Close();
+  }
+
+ private:
+  // Decodes the header once it is in |buffer_|, and drops it from there.
+  bool DecodeHeader() {
+    if (buffer_.size() < kHeaderPrefixLength) {
+      return true;
+    }
+    size_t header_end;
+    TEST_AND_RETURN_FALSE(
+        GetPatchHeaderEnd(buffer_.data(), buffer_.size(), &header_end));
+    if (buffer_.size() < header_end) {
+      return true;
+    }
+    TEST_AND_RETURN_FALSE(
+        DecodePatchHeader(buffer_.data(), header_end, &patch_));
+    TEST_AND_RETURN_FALSE(CheckEngine(*engine_, patch_));
+    header_end_ = header_end;
+    buffer_.erase(buffer_.begin(), buffer_.begin() + header_end);
+    buffer_offset_ = header_end;
+
+    if (!patch_.chunks.empty()) {
+      chunks_patcher_.reset(new ChunksPatcher(std::move(src_), std::move(dst_),
+                                              &patch_, resources_, engine_,
+                                              stats_));
+      TEST_AND_RETURN_FALSE(chunks_patcher_->Init());
+      TEST_AND_RETURN_FALSE(chunks_patcher_->CopyDeflates());
+      if (num_threads_ != 1) {
+        thread_pool_.reset(new ThreadPool(num_threads_));
+      }
+    }
+    return true;
+  }
+
+  // Patches the chunks whose bsdiff patches are completely in |buffer_|, and
+  // drops them from there.
+  bool PatchCompleteChunks() {
+    while (next_chunk_ < patch_.chunks.size()) {
+      const auto& chunk = patch_.chunks[next_chunk_];
+      if (buffer_.size() < chunk.patch_length) {
+        break;
+      }
+      TEST_AND_RETURN_FALSE(chunk.patch_offset == buffer_offset_);
+      auto chunk_patch = std::make_shared<Buffer>(
+          buffer_.begin(), buffer_.begin() + chunk.patch_length);
+      buffer_.erase(buffer_.begin(), buffer_.begin() + chunk.patch_length);
+      buffer_offset_ += chunk.patch_length;
+      next_chunk_++;
+
+      auto patch_chunk = [this, &chunk, chunk_patch]() {
+        ScopedStatsTimer timer(stats_, &Stats::bspatch_time_ns);
+        if (!failed_ && !chunks_patcher_->Patch(chunk, chunk_patch->data())) {
+          failed_ = true;
+        }
+      };
+      if (thread_pool_) {
+        thread_pool_->Schedule(patch_chunk);
+      } else {
+        patch_chunk();
+      }
+    }
+    return !failed_;
+  }
+
+  UniqueStreamPtr src_;
+  UniqueStreamPtr dst_;
+  PatchResources resources_;
+  size_t num_threads_;
+  Stats* stats_;
+  std::shared_ptr<PatchEngine> engine_;
+
+  // The end of the header in the patch, or zero until it is decoded.
+  size_t header_end_;
+  DecodedPatch patch_;
+  // The part of the patch received but not patched yet, and its offset in
+  // the patch.
+  Buffer buffer_;
+  size_t buffer_offset_;
+
+  std::unique_ptr<ChunksPatcher> chunks_patcher_;
+  size_t next_chunk_;
+  std::atomic<bool> failed_;
+  bool finished_;
+
+  // Patches the chunks while the next ones are received, if there are more
+  // than one threads. Destroyed first, so it does not outlive the members its
+  // tasks use.
+  std::unique_ptr<ThreadPool> thread_pool_;
+
+  DISALLOW_COPY_AND_ASSIGN(PuffPatcherImpl);
+};
+
+class PuffPatchContextImpl : public PuffPatchContext {
+ public:
+  PuffPatchContextImpl(size_t max_cache_size,
+                       size_t max_kept_size,
+                       size_t max_deflate_cache_size)
+      : resources_(max_cache_size) {
+    if (max_kept_size > 0) {
+      resources_.puff_cache = std::make_shared<PuffCache>(max_kept_size);
+    }
+    if (max_deflate_cache_size > 0) {
+      resources_.deflate_cache_pool =
+          std::make_shared<BufferPool>(max_deflate_cache_size);
+    }
+  }
+  ~PuffPatchContextImpl() override = default;
+
+  // Returns the resources of an operation whose source is at |src_extents| in
+  // the source of the context.
+  PatchResources GetResources(const vector<ByteExtent>& src_extents) const {
+    auto resources = resources_;
+    resources.src_extents = src_extents;
+    return resources;
+  }
+
+ private:
+  PatchResources resources_;
+
+  DISALLOW_COPY_AND_ASSIGN(PuffPatchContextImpl);
+};
+
+// Applies the whole |patch| of size |patch_length| with the objects of
+// |resources|.
+bool PatchWithResources(UniqueStreamPtr src,
+                        UniqueStreamPtr dst,
+                        const uint8_t* patch,
+                        size_t patch_length,
+                        const PatchResources& resources,
+                        size_t num_threads,
+                        Stats* stats,
+                        std::shared_ptr<PatchEngine> engine) {
+  DecodedPatch decoded;
+  TEST_AND_RETURN_FALSE(DecodePatch(patch, patch_length, &decoded));
+  if (engine == nullptr) {
+    engine = CreateBspatchEngine();
+  }
+  TEST_AND_RETURN_FALSE(CheckEngine(*engine, decoded));
+
+  if (!decoded.chunks.empty()) {
+    ScopedStatsTimer timer(stats, &Stats::bspatch_time_ns);
+    ChunksPatcher patcher(std::move(src), std::move(dst), &decoded, resources,
+                          engine, stats);
+    return PatchChunks(&patcher, patch, decoded, num_threads);
+  }
+  return PatchSingle(std::move(src), std::move(dst),
+                     &patch[decoded.bsdiff_patch_offset],
+                     decoded.bsdiff_patch_size, decoded, resources, num_threads,
+                     *engine, stats);
+}
+
 }  // namespace
 
+std::shared_ptr<PatchEngine> CreateBspatchEngine() {
+  return std::make_shared<BspatchEngine>();
+}
+
+std::unique_ptr<PuffPatcher> PuffPatcher::Create(
+    UniqueStreamPtr src,
+    UniqueStreamPtr dst,
+    size_t max_cache_size,
+    size_t num_threads,
+    Stats* stats,
+    std::shared_ptr<PatchEngine> engine) {
+  TEST_AND_RETURN_VALUE(src && dst, nullptr);
+  if (engine == nullptr) {
+    engine = CreateBspatchEngine();
+  }
+  return std::unique_ptr<PuffPatcher>(new PuffPatcherImpl(
+      std::move(src), std::move(dst), PatchResources(max_cache_size),
+      num_threads, stats, std::move(engine)));
+}
+
+std::unique_ptr<PuffPatcher> PuffPatcher::Create(
+    PuffPatchContext* context,
+    UniqueStreamPtr src,
+    const vector<ByteExtent>& src_extents,
+    UniqueStreamPtr dst,
+    size_t num_threads,
+    Stats* stats,
+    std::shared_ptr<PatchEngine> engine) {
+  TEST_AND_RETURN_VALUE(context && src && dst, nullptr);
+  if (engine == nullptr) {
+    engine = CreateBspatchEngine();
+  }
+  auto context_impl = static_cast<PuffPatchContextImpl*>(context);
+  return std::unique_ptr<PuffPatcher>(new PuffPatcherImpl(
+      std::move(src), std::move(dst), context_impl->GetResources(src_extents),
+      num_threads, stats, std::move(engine)));
+}
+
+std::unique_ptr<PuffPatchContext> PuffPatchContext::Create(
+    size_t max_cache_size,
+    size_t max_kept_size,
+    size_t max_deflate_cache_size) {
+  return std::unique_ptr<PuffPatchContext>(new PuffPatchContextImpl(
+      max_cache_size, max_kept_size, max_deflate_cache_size));
+}
+
 bool PuffPatch(UniqueStreamPtr src,
                UniqueStreamPtr dst,
                const uint8_t* patch,
                size_t patch_length,
-               size_t max_cache_size) {
-  size_t bsdiff_patch_offset;  // bsdiff offset in |patch|.
-  size_t bsdiff_patch_size = 0;
-  vector<BitExtent> src_deflates, dst_deflates;
-  vector<ByteExtent> src_puffs, dst_puffs;
-  uint64_t src_puff_size, dst_puff_size;
-
-  // Decode the patch and get the bsdiff_patch.
-  TEST_AND_RETURN_FALSE(DecodePatch(patch, patch_length, &bsdiff_patch_offset,
-                                    &bsdiff_patch_size, &src_deflates,
-                                    &dst_deflates, &src_puffs, &dst_puffs,
-                                    &src_puff_size, &dst_puff_size));
-  auto puffer = std::make_shared<Puffer>();
-  auto huffer = std::make_shared<Huffer>();
+               size_t max_cache_size,
+               size_t num_threads,
+               Stats* stats,
+               std::shared_ptr<PatchEngine> engine) {
+  return PatchWithResources(std::move(src), std::move(dst), patch,
+                            patch_length, PatchResources(max_cache_size),
+                            num_threads, stats, std::move(engine));
+}
 
-  // For reading from source.
-  std::unique_ptr<bsdiff::FileInterface> reader(new BsdiffStream(
-      PuffinStream::CreateForPuff(std::move(src), puffer, src_puff_size,
-                                  src_deflates, src_puffs, max_cache_size)));
-
-  // For writing into destination.
-  std::unique_ptr<bsdiff::FileInterface> writer(
-      new BsdiffStream(PuffinStream::CreateForHuff(
-          std::move(dst), huffer, dst_puff_size, dst_deflates, dst_puffs)));
-
-  // Running bspatch itself.
-  TEST_AND_RETURN_FALSE(
-      0 ==
-      bspatch(reader, writer, &patch[bsdiff_patch_offset], bsdiff_patch_size));
+bool PuffPatch(PuffPatchContext* context,
+               UniqueStreamPtr src,
+               const vector<ByteExtent>& src_extents,
+               UniqueStreamPtr dst,
+               const uint8_t* patch,
+               size_t patch_length,
+               size_t num_threads,
+               Stats* stats,
+               std::shared_ptr<PatchEngine> engine) {
+  TEST_AND_RETURN_FALSE(context != nullptr);
+  auto context_impl = static_cast<PuffPatchContextImpl*>(context);
+  return PatchWithResources(std::move(src), std::move(dst), patch,
+                            patch_length,
+                            context_impl->GetResources(src_extents),
+                            num_threads, stats, std::move(engine));
+}
+
+bool GetPuffPatchDestinationSize(const uint8_t* patch,
+                                 size_t patch_length,
+                                 uint64_t* dst_size) {
+  size_t header_end;
+  TEST_AND_RETURN_FALSE(GetPatchHeaderEnd(patch, patch_length, &header_end));
+  TEST_AND_RETURN_FALSE(header_end <= patch_length);
+  DecodedPatch decoded;
+  TEST_AND_RETURN_FALSE(DecodePatchHeader(patch, header_end, &decoded));
+  return GetDstSize(decoded, dst_size);
+}
+
+bool SimulatePuffCache(const uint8_t* patch,
+                       size_t patch_length,
+                       const vector<uint64_t>& cache_sizes,
+                       vector<PuffCacheSimulation>* simulations,
+                       std::shared_ptr<PatchEngine> engine) {
+  DecodedPatch decoded;
+  TEST_AND_RETURN_FALSE(DecodePatch(patch, patch_length, &decoded));
+  if (engine == nullptr) {
+    engine = CreateBspatchEngine();
+  }
+  TEST_AND_RETURN_FALSE(CheckEngine(*engine, decoded));
+
+  // The source reads of the single patch, or of each patched chunk.
+  vector<vector<ByteExtent>> src_reads;
+  if (decoded.chunks.empty()) {
+    src_reads.emplace_back();
+    TEST_AND_RETURN_FALSE(engine->GetSourceReads(
+        &patch[decoded.bsdiff_patch_offset], decoded.bsdiff_patch_size,
+        decoded.src_puff_size, &src_reads.back()));
+  } else {
+    for (const auto& chunk : decoded.chunks) {
+      if (!chunk.dst_parts.empty()) {
+        src_reads.push_back(chunk.src_reads);
+      }
+    }
+  }
+
+  // Like |PuffinStream|, ignore a cache plan reading puffs that do not exist.
+  const auto& plan_reads = decoded.src_cache_plan.puff_reads;
+  bool valid_plan = std::all_of(
+      plan_reads.begin(), plan_reads.end(), [&decoded](size_t puff_id) {
+        return puff_id < decoded.src_puffs.size();
+      });
+
+  simulations->clear();
+  for (auto cache_size : cache_sizes) {
+    PuffCacheSimulation simulation;
+    simulation.max_cache_size = cache_size;
+    vector<bool> puffed(decoded.src_puffs.size(), false);
+    for (const auto& reads : src_reads) {
+      // The same plan |PatchSingle| and |ChunksPatcher::Patch| follow.
+      CachePlan plan;
+      if (decoded.chunks.empty() && valid_plan &&
+          decoded.src_cache_plan_size <= cache_size) {
+        plan = decoded.src_cache_plan;
+      }
+      if (plan.puff_reads.empty()) {
+        GetPuffReads(reads, decoded.src_puffs, &plan.puff_reads);
+      }
+      SimulateCache(decoded.src_puffs, plan, cache_size, &puffed,
+                    &simulation);
+    }
+    simulations->push_back(simulation);
+  }
   return true;
 }
 
@@ -13,6 +13,14 @@
 namespace puffin {
 namespace sample_generator {
 
+// Compresses |uncomp| into a raw deflate stream in |comp| with the zlib
+// |compression| level and |strategy|. |comp| should be large enough for the
+// compressed data and is resized to its size.
+bool CompressToDeflate(const Buffer& uncomp,
+                       Buffer* comp,
+                       int compression,
+                       int strategy);
+
 void PrintArray(const std::string& name, const Buffer& array);
 
 // Creates and prints a sample for for adding to the list of unit tests for
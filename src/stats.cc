@@ -0,0 +1,49 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/include/puffin/stats.h"
+
+#include <sstream>
+#include <string>
+
+namespace puffin {
+
+void Stats::UpdatePeakCacheSize(uint64_t cache_size) {
+  auto peak = peak_cache_size.load();
+  while (peak < cache_size &&
+         !peak_cache_size.compare_exchange_weak(peak, cache_size)) {
+  }
+}
+
+std::string Stats::ToString() const {
+  std::stringstream stream;
+  auto ms = [](const std::atomic<uint64_t>& time_ns) {
+    return time_ns / 1000000.0;
+  };
+  stream << "deflates_puffed: " << deflates_puffed << std::endl
+         << "puff_bytes: " << puff_bytes << std::endl
+         << "deflates_huffed: " << deflates_huffed << std::endl
+         << "huff_bytes: " << huff_bytes << std::endl
+         << "deflates_copied: " << deflates_copied << std::endl
+         << "copy_bytes: " << copy_bytes << std::endl
+         << "deflates_verified: " << deflates_verified << std::endl
+         << "cache_hits: " << cache_hits << std::endl
+         << "cache_misses: " << cache_misses << std::endl
+         << "cache_evictions: " << cache_evictions << std::endl
+         << "peak_cache_size: " << peak_cache_size << std::endl
+         << "kept_puff_hits: " << kept_puff_hits << std::endl
+         << "deflate_cache_hits: " << deflate_cache_hits << std::endl
+         << "readahead_hits: " << readahead_hits << std::endl
+         << "stream_seeks: " << stream_seeks << std::endl
+         << "stream_reads: " << stream_reads << std::endl
+         << "stream_writes: " << stream_writes << std::endl
+         << "puff_time_ms: " << ms(puff_time_ns) << std::endl
+         << "huff_time_ms: " << ms(huff_time_ns) << std::endl
+         << "io_time_ms: " << ms(io_time_ns) << std::endl
+         << "bsdiff_time_ms: " << ms(bsdiff_time_ns) << std::endl
+         << "bspatch_time_ms: " << ms(bspatch_time_ns) << std::endl;
+  return stream.str();
+}
+
+}  // namespace puffin
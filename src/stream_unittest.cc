@@ -8,9 +8,15 @@
 
 #include "puffin/src/include/puffin/huffer.h"
 #include "puffin/src/include/puffin/puffer.h"
+#include "puffin/src/include/puffin/stats.h"
+#include "puffin/src/include/puffin/utils.h"
+#include "puffin/src/buffer_pool.h"
+#include "puffin/src/buffered_write_stream.h"
 #include "puffin/src/extent_stream.h"
 #include "puffin/src/file_stream.h"
 #include "puffin/src/memory_stream.h"
+#include "puffin/src/mmap_file_stream.h"
+#include "puffin/src/puff_cache.h"
 #include "puffin/src/puffin_stream.h"
 #include "puffin/src/unittest_common.h"
 
@@ -172,6 +178,23 @@ TEST_F(StreamTest, MemoryStreamTest) {
 
   TestClose(read_stream.get());
   TestClose(write_stream.get());
+
+  // Writing into fixed-size memory does not go past its end.
+  Buffer fixed_buf(buf.size());
+  write_stream = MemoryStream::CreateForWrite(fixed_buf.data(), buf.size());
+  read_stream = MemoryStream::CreateForRead(fixed_buf);
+  TestWrite(write_stream.get(), read_stream.get());
+  TestSeek(write_stream.get(), false);
+  ASSERT_TRUE(write_stream->Seek(buf.size() - 1));
+  ASSERT_FALSE(write_stream->Write(buf.data(), 2));
+  ASSERT_TRUE(write_stream->Write(buf.data(), 1));
+  ASSERT_TRUE(write_stream->Write(buf.data(), 0));
+  uint64_t size;
+  ASSERT_TRUE(write_stream->GetSize(&size));
+  EXPECT_EQ(size, buf.size());
+  EXPECT_EQ(fixed_buf.size(), buf.size());
+  ASSERT_FALSE(write_stream->Read(buf.data(), 1));
+  TestClose(write_stream.get());
 }
 
 TEST_F(StreamTest, FileStreamTest) {
@@ -194,6 +217,70 @@ TEST_F(StreamTest, FileStreamTest) {
   TestClose(stream.get());
 }
 
+TEST_F(StreamTest, MmapFileStreamTest) {
+  string filepath("/tmp/test_filepath");
+  ScopedPathUnlinker scoped_unlinker(filepath);
+  ASSERT_FALSE(MmapFileStream::Open(filepath));
+
+  Buffer buf(105);
+  std::iota(buf.begin(), buf.end(), 0);
+  auto file_stream = FileStream::Open(filepath, false, true);
+  ASSERT_TRUE(file_stream->Write(buf.data(), buf.size()));
+  ASSERT_TRUE(file_stream->Close());
+
+  auto stream = MmapFileStream::Open(filepath);
+  ASSERT_TRUE(stream.get() != nullptr);
+  TestRead(stream.get(), buf);
+  ASSERT_FALSE(stream->Write(buf.data(), 1));
+  TestSeek(stream.get(), false);
+  TestClose(stream.get());
+
+  // A file of a known size is written through its mapping.
+  stream = MmapFileStream::OpenForWrite(filepath, buf.size());
+  ASSERT_TRUE(stream);
+  auto read_stream = FileStream::Open(filepath, true, false);
+  ASSERT_TRUE(read_stream);
+  TestWrite(stream.get(), read_stream.get());
+  ASSERT_TRUE(stream->Seek(0));
+  ASSERT_TRUE(stream->Write(buf.data(), buf.size()));
+  ASSERT_FALSE(stream->Write(buf.data(), 1));
+  TestSeek(stream.get(), false);
+  TestClose(stream.get());
+  TestRead(read_stream.get(), buf);
+  TestClose(read_stream.get());
+}
+
+TEST_F(StreamTest, ReadZeroCopyTest) {
+  Buffer buf(105);
+  std::iota(buf.begin(), buf.end(), 0);
+  const uint8_t* data;
+
+  auto read_stream = MemoryStream::CreateForRead(buf);
+  ASSERT_TRUE(read_stream->Seek(10));
+  ASSERT_TRUE(read_stream->ReadZeroCopy(&data, 20));
+  ASSERT_EQ(data, buf.data() + 10);
+  uint64_t offset;
+  ASSERT_TRUE(read_stream->GetOffset(&offset));
+  ASSERT_EQ(offset, 30);
+  ASSERT_FALSE(read_stream->ReadZeroCopy(&data, 100));
+
+  Buffer write_buf;
+  auto write_stream = MemoryStream::CreateForWrite(&write_buf);
+  ASSERT_FALSE(write_stream->ReadZeroCopy(&data, 0));
+
+  // Extent streams only support it inside an extent.
+  auto extent_stream = ExtentStream::CreateForRead(
+      MemoryStream::CreateForRead(buf), {{10, 10}, {30, 10}});
+  ASSERT_TRUE(extent_stream->Seek(5));
+  ASSERT_FALSE(extent_stream->ReadZeroCopy(&data, 10));
+  ASSERT_TRUE(extent_stream->ReadZeroCopy(&data, 5));
+  ASSERT_EQ(data, buf.data() + 15);
+  ASSERT_TRUE(extent_stream->ReadZeroCopy(&data, 10));
+  ASSERT_EQ(data, buf.data() + 30);
+  ASSERT_TRUE(extent_stream->GetOffset(&offset));
+  ASSERT_EQ(offset, 20);
+}
+
 TEST_F(StreamTest, PuffinStreamTest) {
   shared_ptr<Puffer> puffer(new Puffer());
   auto read_stream = PuffinStream::CreateForPuff(
@@ -211,6 +298,14 @@ TEST_F(StreamTest, PuffinStreamTest) {
   TestSeek(read_stream.get(), false);
   TestClose(read_stream.get());
 
+  // Test the stream with a puff cache large enough to keep all puffs.
+  read_stream = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(kDeflates8), puffer, kPuffs8.size(),
+      kSubblockDeflateExtents8, kPuffExtents8, kPuffs8.size());
+  TestRead(read_stream.get(), kPuffs8);
+  TestSeek(read_stream.get(), false);
+  TestClose(read_stream.get());
+
   Buffer buf(kDeflates8.size());
   shared_ptr<Huffer> huffer(new Huffer());
   auto write_stream = PuffinStream::CreateForHuff(
@@ -242,6 +337,487 @@ TEST_F(StreamTest, PuffinStreamTest) {
   // No TestSeek is needed as PuffinStream is not supposed to seek to anywhere
   // except 0.
   TestClose(write_stream.get());
+
+  // Test huffing on worker threads, both with the whole buffer and one byte at
+  // a time.
+  std::fill(buf.begin(), buf.end(), 0);
+  PuffinStream::HuffOptions huff_options;
+  huff_options.num_threads = 4;
+  write_stream = PuffinStream::CreateForHuff(
+      MemoryStream::CreateForWrite(&buf), huffer, kPuffs8.size(),
+      kSubblockDeflateExtents8, kPuffExtents8, huff_options);
+  ASSERT_TRUE(write_stream->Write(kPuffs8.data(), kPuffs8.size()));
+  ASSERT_EQ(buf, kDeflates8);
+
+  std::fill(buf.begin(), buf.end(), 0);
+  ASSERT_TRUE(write_stream->Seek(0));
+  for (const auto& byte : kPuffs8) {
+    ASSERT_TRUE(write_stream->Write(&byte, 1));
+  }
+  ASSERT_EQ(buf, kDeflates8);
+  TestClose(write_stream.get());
+}
+
+TEST_F(StreamTest, BufferPoolTest) {
+  BufferPool pool(16 * 1024);
+  auto buffer1 = pool.TryGet(5000);
+  ASSERT_TRUE(buffer1);
+  EXPECT_EQ(buffer1->size(), 5000);
+  // Rounded up to a multiple of a quarter of 4096.
+  EXPECT_EQ(pool.size(), 5120);
+  auto buffer2 = pool.TryGet(10000);
+  ASSERT_TRUE(buffer2);
+  EXPECT_EQ(pool.size(), 5120 + 10240);
+  // Not enough memory left.
+  EXPECT_FALSE(pool.TryGet(2000));
+  auto buffer3 = pool.Get(2000);
+  ASSERT_TRUE(buffer3);
+  EXPECT_EQ(pool.size(), 5120 + 10240 + 4096);
+
+  // A released buffer is reused without allocating.
+  auto data = buffer1->data();
+  pool.Release(std::move(buffer1));
+  auto buffer4 = pool.TryGet(4500);
+  ASSERT_TRUE(buffer4);
+  EXPECT_EQ(buffer4->data(), data);
+  EXPECT_EQ(buffer4->size(), 4500);
+  EXPECT_EQ(pool.size(), 5120 + 10240 + 4096);
+
+  // The free buffers are dropped to make room for new ones.
+  pool.Release(std::move(buffer2));
+  pool.Release(std::move(buffer3));
+  EXPECT_FALSE(pool.TryGet(11000));
+  EXPECT_EQ(pool.size(), 5120);
+  auto buffer5 = pool.TryGet(8000);
+  ASSERT_TRUE(buffer5);
+  EXPECT_EQ(pool.size(), 5120 + 8192);
+}
+
+// Tests the puff caches of two streams sharing one |BufferPool|.
+TEST_F(StreamTest, PuffinStreamSharedBufferPoolTest) {
+  shared_ptr<Puffer> puffer(new Puffer());
+  PuffinStream::PuffOptions options;
+  options.max_cache_size = kPuffs8.size();
+  options.buffer_pool = std::make_shared<BufferPool>(4096);
+  auto read_stream1 = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(kDeflates8), puffer, kPuffs8.size(),
+      kSubblockDeflateExtents8, kPuffExtents8, options);
+  auto read_stream2 = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(kDeflates8), puffer, kPuffs8.size(),
+      kSubblockDeflateExtents8, kPuffExtents8, options);
+  TestRead(read_stream1.get(), kPuffs8);
+  TestRead(read_stream2.get(), kPuffs8);
+  TestSeek(read_stream1.get(), false);
+  TestSeek(read_stream2.get(), false);
+  // The budget only fits one buffer, so each stream keeps a single cache and
+  // reuses its buffer after evicting it.
+  EXPECT_EQ(options.buffer_pool->size(), 2 * 4096);
+  TestClose(read_stream1.get());
+  TestClose(read_stream2.get());
+}
+
+TEST_F(StreamTest, PuffCacheTest) {
+  PuffCache cache(10);
+  const Buffer kPuff1 = {1, 2, 3, 4, 5, 6};
+  const Buffer kPuff2 = {7, 8, 9};
+  Buffer puff(kPuff1.size());
+  EXPECT_FALSE(cache.Get({0, 10}, puff.data(), puff.size()));
+  cache.Put({0, 10}, kPuff1.data(), kPuff1.size());
+  cache.Put({16, 5}, kPuff2.data(), kPuff2.size());
+  EXPECT_EQ(cache.size(), 9u);
+  ASSERT_TRUE(cache.Get({0, 10}, puff.data(), puff.size()));
+  EXPECT_EQ(puff, kPuff1);
+  // The puffs of other sizes are not found.
+  EXPECT_FALSE(cache.Get({16, 5}, puff.data(), puff.size()));
+
+  // The least recently used puff is evicted to make room for a new one.
+  cache.Put({32, 8}, kPuff2.data(), kPuff2.size());
+  EXPECT_EQ(cache.size(), 9u);
+  EXPECT_FALSE(cache.Get({16, 5}, puff.data(), kPuff2.size()));
+  EXPECT_TRUE(cache.Get({0, 10}, puff.data(), kPuff1.size()));
+  EXPECT_TRUE(cache.Get({32, 8}, puff.data(), kPuff2.size()));
+
+  // The puffs larger than the cache are not kept.
+  Buffer large_puff(11);
+  cache.Put({64, 100}, large_puff.data(), large_puff.size());
+  EXPECT_EQ(cache.size(), 9u);
+}
+
+// Tests the streams of different parts of a source sharing a |PuffCache|.
+TEST_F(StreamTest, PuffinStreamPuffCacheTest) {
+  shared_ptr<Puffer> puffer(new Puffer());
+  auto puff_cache = std::make_shared<PuffCache>(1024);
+  // The first two streams are at the same location in the source, which splits
+  // the second deflate. The third one is elsewhere.
+  const vector<ByteExtent> kExtents = {{100, 11},
+                                       {300, kDeflates8.size() - 11}};
+  const vector<ByteExtent> kOtherExtents = {{500, kDeflates8.size()}};
+  for (const auto& test : {std::make_pair(kExtents, 0u),
+                           std::make_pair(kExtents, 2u),
+                           std::make_pair(kOtherExtents, 0u),
+                           std::make_pair(vector<ByteExtent>(), 0u),
+                           std::make_pair(vector<ByteExtent>(), 3u)}) {
+    Stats stats;
+    PuffinStream::PuffOptions options;
+    options.stats = &stats;
+    options.puff_cache = puff_cache;
+    options.cache_extents = test.first;
+    auto stream = PuffinStream::CreateForPuff(
+        MemoryStream::CreateForRead(kDeflates8), puffer, kPuffs8.size(),
+        kSubblockDeflateExtents8, kPuffExtents8, options);
+    ASSERT_TRUE(stream);
+    Buffer puffs(kPuffs8.size());
+    ASSERT_TRUE(stream->Read(puffs.data(), puffs.size()));
+    EXPECT_EQ(puffs, kPuffs8);
+    EXPECT_EQ(stats.kept_puff_hits, test.second);
+    EXPECT_EQ(stats.deflates_puffed, 3 - test.second);
+  }
+}
+
+TEST_F(StreamTest, BufferedWriteStreamTest) {
+  const size_t kPageSize = BufferedWriteStream::kPageSize;
+  ASSERT_FALSE(
+      BufferedWriteStream::Create(MemoryStream::CreateForWrite(nullptr), 10));
+  Buffer data(5 * kPageSize + 100);
+  std::iota(data.begin(), data.end(), 0);
+
+  Buffer buf;
+  auto stream = BufferedWriteStream::Create(MemoryStream::CreateForWrite(&buf),
+                                            2 * kPageSize);
+  ASSERT_TRUE(stream);
+  ASSERT_FALSE(stream->Read(data.data(), 1));
+  // Small writes are buffered and written out up to the last page boundary
+  // when the buffer fills.
+  uint64_t offset = 0;
+  for (; offset + 100 <= 2 * kPageSize + 100; offset += 100) {
+    ASSERT_TRUE(stream->Write(data.data() + offset, 100));
+  }
+  EXPECT_EQ(buf.size(), 2 * kPageSize);
+  uint64_t size;
+  ASSERT_TRUE(stream->GetOffset(&size));
+  EXPECT_EQ(size, offset);
+  ASSERT_TRUE(stream->GetSize(&size));
+  EXPECT_EQ(size, offset);
+  // Seeking to the current offset does not write out the buffered bytes, but
+  // seeking elsewhere does.
+  ASSERT_TRUE(stream->Seek(offset));
+  EXPECT_EQ(buf.size(), 2 * kPageSize);
+  ASSERT_TRUE(stream->Seek(10));
+  EXPECT_EQ(buf.size(), offset);
+  ASSERT_TRUE(stream->Write(data.data() + 10, 20));
+  // Large writes go through directly.
+  ASSERT_TRUE(stream->Seek(offset));
+  ASSERT_TRUE(stream->Write(data.data() + offset, 3 * kPageSize));
+  EXPECT_EQ(buf.size(), offset + 3 * kPageSize);
+  offset += 3 * kPageSize;
+  ASSERT_TRUE(stream->Write(data.data() + offset, data.size() - offset));
+  EXPECT_EQ(buf.size(), offset);
+  ASSERT_TRUE(stream->Close());
+  EXPECT_EQ(buf, data);
+
+  // Destroying it also writes out the buffered bytes.
+  buf.clear();
+  stream = BufferedWriteStream::Create(MemoryStream::CreateForWrite(&buf),
+                                       kPageSize);
+  ASSERT_TRUE(stream->Write(data.data(), 10));
+  stream.reset();
+  EXPECT_EQ(buf, Buffer(data.begin(), data.begin() + 10));
+}
+
+// Tests a |PuffinStream| keeping the bytes of the deflates it puffs.
+TEST_F(StreamTest, PuffinStreamDeflateCacheTest) {
+  shared_ptr<Puffer> puffer(new Puffer());
+  // Only one deflate fits in the smaller pool, and it is evicted before it is
+  // read again.
+  for (const auto& test :
+       {std::make_pair(3 * 4096u, 3u), std::make_pair(4096u, 0u)}) {
+    Stats stats;
+    PuffinStream::PuffOptions options;
+    options.stats = &stats;
+    options.deflate_cache_pool = std::make_shared<BufferPool>(test.first);
+    auto stream = PuffinStream::CreateForPuff(
+        MemoryStream::CreateForRead(kDeflates8), puffer, kPuffs8.size(),
+        kSubblockDeflateExtents8, kPuffExtents8, options);
+    ASSERT_TRUE(stream);
+    Buffer puffs(kPuffs8.size());
+    ASSERT_TRUE(stream->Read(puffs.data(), puffs.size()));
+    EXPECT_EQ(puffs, kPuffs8);
+    EXPECT_EQ(stats.deflate_cache_hits, 0u);
+    auto stream_reads = stats.stream_reads.load();
+    // The puffs are not cached, so they are puffed again from the kept bytes.
+    ASSERT_TRUE(stream->Seek(0));
+    ASSERT_TRUE(stream->Read(puffs.data(), puffs.size()));
+    EXPECT_EQ(puffs, kPuffs8);
+    EXPECT_EQ(stats.deflates_puffed, 6u);
+    EXPECT_EQ(stats.deflate_cache_hits, test.second);
+    if (test.second > 0) {
+      // Only the raw bytes in between the deflates are read again.
+      EXPECT_LT(stats.stream_reads, 2 * stream_reads);
+    }
+    // Parts of the deflates are puffed from the kept bytes too.
+    Buffer buf(3);
+    ASSERT_TRUE(stream->Seek(26));
+    ASSERT_TRUE(stream->Read(buf.data(), buf.size()));
+    EXPECT_EQ(buf, Buffer(kPuffs8.begin() + 26, kPuffs8.begin() + 29));
+    stream.reset();
+    // The buffers are given back to the pool.
+    EXPECT_LE(options.deflate_cache_pool->size(), test.first);
+  }
+}
+
+// Tests a |PuffinStream| reading the next deflates ahead of puffing them.
+TEST_F(StreamTest, PuffinStreamReadaheadTest) {
+  shared_ptr<Puffer> puffer(new Puffer());
+  // Nothing is read ahead if not even one deflate fits.
+  for (const auto& test : {std::make_pair(1u, 1u), std::make_pair(2u, 1u),
+                           std::make_pair(1u, 0u)}) {
+    Stats stats;
+    PuffinStream::PuffOptions options;
+    options.stats = &stats;
+    options.readahead_depth = test.first;
+    if (test.second == 0) {
+      options.max_readahead_size = 1;
+    }
+    auto stream = PuffinStream::CreateForPuff(
+        MemoryStream::CreateForRead(kDeflates8), puffer, kPuffs8.size(),
+        kSubblockDeflateExtents8, kPuffExtents8, options);
+    ASSERT_TRUE(stream);
+    Buffer puffs(kPuffs8.size());
+    ASSERT_TRUE(stream->Read(puffs.data(), puffs.size()));
+    EXPECT_EQ(puffs, kPuffs8);
+    // All the deflates but the first one are read ahead.
+    EXPECT_EQ(stats.readahead_hits, test.second * (kPuffExtents8.size() - 1));
+
+    // Reading in small pieces and out of order gives the same puffs.
+    ASSERT_TRUE(stream->Seek(0));
+    for (size_t offset = 0; offset < puffs.size(); offset += 3) {
+      auto length = std::min<size_t>(3, puffs.size() - offset);
+      ASSERT_TRUE(stream->Read(puffs.data() + offset, length));
+    }
+    EXPECT_EQ(puffs, kPuffs8);
+    Buffer buf(5);
+    ASSERT_TRUE(stream->Seek(15));
+    ASSERT_TRUE(stream->Read(buf.data(), buf.size()));
+    EXPECT_EQ(buf, Buffer(kPuffs8.begin() + 15, kPuffs8.begin() + 20));
+    ASSERT_TRUE(stream->Seek(2));
+    ASSERT_TRUE(stream->Read(buf.data(), buf.size()));
+    EXPECT_EQ(buf, Buffer(kPuffs8.begin() + 2, kPuffs8.begin() + 7));
+    ASSERT_TRUE(stream->Close());
+  }
+}
+
+// Tests puffing into and huffing from the puffs of |PuffFormat::kV2|, which
+// are smaller than the ones of |PuffFormat::kV1|.
+TEST_F(StreamTest, PuffinStreamPuffFormatTest) {
+  vector<ByteExtent> puffs;
+  uint64_t puff_size;
+  ASSERT_TRUE(FindPuffLocations(MemoryStream::CreateForRead(kDeflates8),
+                                kSubblockDeflateExtents8, &puffs, &puff_size,
+                                1, PuffFormat::kV2));
+  EXPECT_LT(puff_size, kPuffs8.size());
+
+  Buffer puff_buffer;
+  vector<ByteExtent> puffed_puffs;
+  uint64_t puffed_size;
+  ASSERT_TRUE(PuffDeflates(MemoryStream::CreateForRead(kDeflates8),
+                           kSubblockDeflateExtents8,
+                           MemoryStream::CreateForWrite(&puff_buffer),
+                           &puffed_puffs, &puffed_size, 1, nullptr,
+                           PuffFormat::kV2));
+  EXPECT_EQ(puffed_puffs, puffs);
+  EXPECT_EQ(puffed_size, puff_size);
+  ASSERT_EQ(puff_buffer.size(), puff_size);
+
+  PuffinStream::PuffOptions puff_options;
+  puff_options.puff_format = PuffFormat::kV2;
+  auto reader = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(kDeflates8), std::make_shared<Puffer>(),
+      puff_size, kSubblockDeflateExtents8, puffs, puff_options);
+  ASSERT_TRUE(reader);
+  TestRead(reader.get(), puff_buffer);
+
+  // Huffed back on the calling thread (incrementally) and on worker threads,
+  // also when the puffs are written one byte at a time.
+  PuffinStream::HuffOptions huff_options;
+  huff_options.puff_format = PuffFormat::kV2;
+  for (size_t num_threads : {1, 2}) {
+    huff_options.num_threads = num_threads;
+    for (size_t piece_size : {puff_size, uint64_t(1)}) {
+      Buffer deflates;
+      auto writer = PuffinStream::CreateForHuff(
+          MemoryStream::CreateForWrite(&deflates), std::make_shared<Huffer>(),
+          puff_size, kSubblockDeflateExtents8, puffs, huff_options);
+      ASSERT_TRUE(writer);
+      for (uint64_t offset = 0; offset < puff_size; offset += piece_size) {
+        ASSERT_TRUE(writer->Write(puff_buffer.data() + offset,
+                                  std::min(piece_size, puff_size - offset)));
+      }
+      ASSERT_TRUE(writer->Close());
+      EXPECT_EQ(deflates, kDeflates8);
+    }
+  }
+}
+
+// Tests a |PuffinStream| prefetching the puffs in a read plan.
+TEST_F(StreamTest, PuffinStreamReadPlanTest) {
+  shared_ptr<Puffer> puffer(new Puffer());
+  // The reads cover parts of one or more puffs, and some of them start in the
+  // puff the previous read ended in.
+  vector<ByteExtent> reads = {{18, 4},  {5, 3},  {0, 16},  {25, 3},
+                              {10, 12}, {3, 25}, {20, 8}, {2, 2}};
+  CachePlan plan;
+  GetPuffReads(reads, kPuffExtents8, &plan.puff_reads);
+  ASSERT_EQ(plan.puff_reads,
+            vector<size_t>({1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0}));
+  // Also test a plan that does not keep some of the puffs in the cache. Only
+  // one puff fits in the cache, so only puff 1 is kept until it is read again.
+  CachePlan partial_plan = plan;
+  MakeCachePlan(kPuffExtents8, 4096, &partial_plan);
+  ASSERT_EQ(partial_plan.cached_reads,
+            vector<bool>({true, false, false, true, false, false, true, false,
+                          false, false, false, false}));
+  for (const auto& cache_plan : {plan, partial_plan}) {
+    for (auto pool_size : {4096, 2 * 4096, 4 * 4096}) {
+      for (size_t skip = 0; skip < 2; skip++) {
+        PuffinStream::PuffOptions options;
+        options.max_cache_size = kPuffs8.size();
+        options.buffer_pool = std::make_shared<BufferPool>(pool_size);
+        options.cache_plan = cache_plan;
+        auto stream = PuffinStream::CreateForPuff(
+            MemoryStream::CreateForRead(kDeflates8), puffer, kPuffs8.size(),
+            kSubblockDeflateExtents8, kPuffExtents8, options);
+        // Test both following the plan and diverging from it by skipping every
+        // other read.
+        for (size_t idx = 0; idx < reads.size(); idx += 1 + skip) {
+          const auto& read = reads[idx];
+          Buffer buf(read.length);
+          ASSERT_TRUE(stream->Seek(read.offset));
+          ASSERT_TRUE(stream->Read(buf.data(), buf.size()));
+          ASSERT_EQ(buf, Buffer(kPuffs8.begin() + read.offset,
+                                kPuffs8.begin() + read.offset + read.length));
+        }
+        TestRead(stream.get(), kPuffs8);
+        TestClose(stream.get());
+      }
+    }
+  }
+}
+
+// Tests simulating the puff cache of a |PuffinStream| following a read plan.
+TEST_F(StreamTest, SimulateCacheTest) {
+  CachePlan plan;
+  plan.puff_reads = {1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0};
+  CachePlan partial_plan = plan;
+  MakeCachePlan(kPuffExtents8, 4096, &partial_plan);
+  // The cache size and plan, the expected cache hits, and the puffed and
+  // re-puffed bytes.
+  struct {
+    uint64_t cache_size;
+    const CachePlan* plan;
+    uint64_t hits, puff_bytes, repuff_bytes;
+  } tests[] = {
+      {0, &plan, 0, 92, 69},
+      // Only one puff fits, and each one evicts the one before it, except for
+      // the last reads that are not kept.
+      {4096, &plan, 1, 81, 58},
+      // Only puff 1 is kept until it is read again.
+      {4096, &partial_plan, 3, 77, 54},
+      {3 * 4096, &plan, 9, 23, 0},
+  };
+  for (const auto& test : tests) {
+    PuffCacheSimulation simulation;
+    vector<bool> puffed(kPuffExtents8.size(), false);
+    SimulateCache(kPuffExtents8, *test.plan, test.cache_size, &puffed,
+                  &simulation);
+    EXPECT_EQ(simulation.puff_reads, plan.puff_reads.size());
+    EXPECT_EQ(simulation.cache_hits, test.hits);
+    EXPECT_EQ(simulation.puff_bytes, test.puff_bytes);
+    EXPECT_EQ(simulation.repuff_bytes, test.repuff_bytes);
+    EXPECT_EQ(puffed, vector<bool>(kPuffExtents8.size(), true));
+  }
+}
+
+// Tests the stats recorded by |PuffinStream|.
+TEST_F(StreamTest, PuffinStreamStatsTest) {
+  Stats stats;
+  shared_ptr<Puffer> puffer(new Puffer());
+  PuffinStream::PuffOptions options;
+  options.max_cache_size = 3 * 4096;
+  options.stats = &stats;
+  auto read_stream = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(kDeflates8), puffer, kPuffs8.size(),
+      kSubblockDeflateExtents8, kPuffExtents8, options);
+  Buffer buf(kPuffs8.size());
+  // Each puff is puffed once and then read from the cache.
+  ASSERT_TRUE(read_stream->Read(buf.data(), buf.size()));
+  ASSERT_TRUE(read_stream->Seek(0));
+  ASSERT_TRUE(read_stream->Read(buf.data(), buf.size()));
+  ASSERT_EQ(buf, kPuffs8);
+  EXPECT_EQ(stats.deflates_puffed, kPuffExtents8.size());
+  EXPECT_EQ(stats.puff_bytes, BytesInByteExtents(kPuffExtents8));
+  EXPECT_EQ(stats.cache_misses, kPuffExtents8.size());
+  EXPECT_EQ(stats.cache_hits, kPuffExtents8.size());
+  EXPECT_EQ(stats.cache_evictions, 0);
+  EXPECT_EQ(stats.peak_cache_size, 3 * 4096);
+  EXPECT_GT(stats.stream_seeks, 0);
+  EXPECT_GT(stats.stream_reads, 0);
+  EXPECT_EQ(stats.stream_writes, 0);
+
+  Stats huff_stats;
+  Buffer deflates(kDeflates8.size());
+  shared_ptr<Huffer> huffer(new Huffer());
+  PuffinStream::HuffOptions huff_options;
+  huff_options.stats = &huff_stats;
+  auto write_stream = PuffinStream::CreateForHuff(
+      MemoryStream::CreateForWrite(&deflates), huffer, kPuffs8.size(),
+      kSubblockDeflateExtents8, kPuffExtents8, huff_options);
+  ASSERT_TRUE(write_stream->Write(kPuffs8.data(), kPuffs8.size()));
+  ASSERT_EQ(deflates, kDeflates8);
+  EXPECT_EQ(huff_stats.deflates_huffed, kPuffExtents8.size());
+  EXPECT_EQ(huff_stats.huff_bytes, BytesInByteExtents(kPuffExtents8));
+  EXPECT_EQ(huff_stats.deflates_puffed, 0);
+  EXPECT_GT(huff_stats.stream_writes, 0);
+}
+
+TEST_F(StreamTest, PuffinStreamSubblocksTest) {
+  auto src = MemoryStream::CreateForRead(kDeflate7_4);
+  vector<BitExtent> subblocks;
+  ASSERT_TRUE(
+      FindDeflateSubBlocks(src, {{0, kDeflate7_4.size()}}, &subblocks));
+  vector<BitExtent> deflates = {
+      {0, subblocks.back().offset + subblocks.back().length}};
+  vector<ByteExtent> puffs;
+  uint64_t puff_size;
+  vector<BitExtent> subblock_deflates;
+  vector<ByteExtent> subblock_puffs;
+  ASSERT_TRUE(FindPuffLocations(src, deflates, &puffs, &puff_size,
+                                &subblock_deflates, &subblock_puffs));
+
+  shared_ptr<Puffer> puffer(new Puffer());
+  Buffer puff(puff_size);
+  auto read_stream =
+      PuffinStream::CreateForPuff(MemoryStream::CreateForRead(kDeflate7_4),
+                                  puffer, puff_size, deflates, puffs);
+  ASSERT_TRUE(read_stream->Read(puff.data(), puff.size()));
+
+  // Reading with checkpoints should only puff the needed subblocks but result
+  // in the same stream.
+  PuffinStream::PuffOptions options;
+  options.subblock_deflates = subblock_deflates;
+  options.subblock_puffs = subblock_puffs;
+  read_stream = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(kDeflate7_4), puffer, puff_size, deflates,
+      puffs, options);
+  TestRead(read_stream.get(), puff);
+  TestSeek(read_stream.get(), false);
+  TestClose(read_stream.get());
+
+  // Mismatching checkpoints are not accepted.
+  options.subblock_puffs.pop_back();
+  EXPECT_EQ(PuffinStream::CreateForPuff(
+                MemoryStream::CreateForRead(kDeflate7_4), puffer, puff_size,
+                deflates, puffs, options),
+            nullptr);
 }
 
 TEST_F(StreamTest, ExtentStreamTest) {
@@ -274,4 +850,56 @@ TEST_F(StreamTest, ExtentStreamTest) {
   TestClose(write_stream.get());
 }
 
+// Tests an |ExtentStream| over a |FileStream|, which reads and writes the parts
+// of many extents in one batch.
+TEST_F(StreamTest, ExtentStreamFileStreamTest) {
+  string filepath;
+  ASSERT_TRUE(MakeTempFile(&filepath, nullptr));
+  ScopedPathUnlinker scoped_unlinker(filepath);
+  Buffer buf(100);
+  std::iota(buf.begin(), buf.end(), 0);
+  auto file_stream = FileStream::Open(filepath, false, true);
+  ASSERT_TRUE(file_stream);
+  ASSERT_TRUE(file_stream->Write(buf.data(), buf.size()));
+  ASSERT_TRUE(file_stream->Close());
+
+  // The first two extents are merged.
+  vector<ByteExtent> extents = {{60, 5}, {65, 5}, {10, 10}, {25, 0}, {30, 10}};
+  Buffer data = {60, 61, 62, 63, 64, 65, 66, 67, 68, 69, 10, 11, 12, 13, 14,
+                 15, 16, 17, 18, 19, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39};
+  auto read_stream = ExtentStream::CreateForRead(
+      FileStream::Open(filepath, true, false), extents);
+  ASSERT_TRUE(read_stream);
+  TestRead(read_stream.get(), data);
+  // Reads spanning many extents starting in the middle of one, followed by
+  // reads within one.
+  Buffer tmp(17);
+  ASSERT_TRUE(read_stream->Seek(3));
+  ASSERT_TRUE(read_stream->Read(tmp.data(), tmp.size()));
+  EXPECT_EQ(tmp, Buffer(data.begin() + 3, data.begin() + 20));
+  ASSERT_TRUE(read_stream->Read(tmp.data(), 2));
+  EXPECT_EQ(tmp[0], 30);
+  EXPECT_EQ(tmp[1], 31);
+  EXPECT_FALSE(read_stream->Read(tmp.data(), tmp.size()));
+  TestClose(read_stream.get());
+
+  std::fill(data.begin(), data.end(), 3);
+  for (const auto& extent : extents) {
+    std::fill(buf.begin() + extent.offset,
+              buf.begin() + (extent.offset + extent.length), 3);
+  }
+  auto write_stream = ExtentStream::CreateForWrite(
+      FileStream::Open(filepath, true, true), extents);
+  ASSERT_TRUE(write_stream);
+  ASSERT_TRUE(write_stream->Seek(0));
+  ASSERT_TRUE(write_stream->Write(data.data(), 12));
+  ASSERT_TRUE(write_stream->Write(data.data() + 12, data.size() - 12));
+  TestClose(write_stream.get());
+  Buffer file_buf(buf.size());
+  file_stream = FileStream::Open(filepath, true, false);
+  ASSERT_TRUE(file_stream);
+  ASSERT_TRUE(file_stream->Read(file_buf.data(), file_buf.size()));
+  EXPECT_EQ(file_buf, buf);
+}
+
 }  // namespace puffin
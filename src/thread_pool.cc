@@ -0,0 +1,116 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <utility>
+
+namespace puffin {
+
+ThreadPool::ThreadPool(size_t num_threads) : pending_tasks_(0), stop_(false) {
+  if (num_threads == 0) {
+    num_threads = GetDefaultNumThreads();
+  }
+  workers_.reserve(num_threads);
+  for (size_t idx = 0; idx < num_threads; idx++) {
+    workers_.emplace_back(&ThreadPool::RunWorker, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  Wait();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  task_cv_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+size_t ThreadPool::GetDefaultNumThreads() {
+  return std::max(std::thread::hardware_concurrency(), 1U);
+}
+
+void ThreadPool::Schedule(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push_back(std::move(task));
+    pending_tasks_++;
+  }
+  task_cv_.notify_one();
+}
+
+void ThreadPool::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [this] { return pending_tasks_ == 0; });
+}
+
+void ThreadPool::RunWorker() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      task_cv_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+      if (tasks_.empty()) {
+        return;
+      }
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_tasks_--;
+    }
+    done_cv_.notify_all();
+  }
+}
+
+bool ThreadPool::ParallelFor(
+    size_t count,
+    const std::function<bool(size_t index, size_t worker)>& task) {
+  // Each worker picks the next index to run until all the indices are taken.
+  std::atomic<size_t> next_index(0);
+  std::atomic<bool> failed(false);
+  auto num_workers = std::min(num_threads(), count);
+  for (size_t worker = 0; worker < num_workers; worker++) {
+    Schedule([&, worker] {
+      while (!failed) {
+        auto index = next_index++;
+        if (index >= count) {
+          break;
+        }
+        if (!task(index, worker)) {
+          failed = true;
+        }
+      }
+    });
+  }
+  Wait();
+  return !failed;
+}
+
+bool ParallelFor(size_t count,
+                 size_t num_threads,
+                 const std::function<bool(size_t index, size_t worker)>& task) {
+  if (num_threads == 0) {
+    num_threads = ThreadPool::GetDefaultNumThreads();
+  }
+  if (num_threads == 1 || count < 2) {
+    for (size_t index = 0; index < count; index++) {
+      if (!task(index, 0)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  ThreadPool pool(std::min(num_threads, count));
+  return pool.ParallelFor(count, task);
+}
+
+}  // namespace puffin
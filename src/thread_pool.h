@@ -0,0 +1,81 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_THREAD_POOL_H_
+#define SRC_THREAD_POOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "puffin/src/include/puffin/common.h"
+
+namespace puffin {
+
+// A simple fixed size pool of worker threads. Tasks are run in the order they
+// are scheduled.
+class ThreadPool {
+ public:
+  // |num_threads| IN  The number of worker threads. If zero, the number of
+  //                   available cores is used.
+  explicit ThreadPool(size_t num_threads);
+
+  // Waits for all the scheduled tasks to finish and joins the worker threads.
+  ~ThreadPool();
+
+  // Returns the number of cores available or one if it cannot be determined.
+  static size_t GetDefaultNumThreads();
+
+  // Returns the number of worker threads.
+  size_t num_threads() const { return workers_.size(); }
+
+  // Schedules |task| to run on one of the worker threads.
+  void Schedule(std::function<void()> task);
+
+  // Blocks until all the scheduled tasks are finished.
+  void Wait();
+
+  // Runs |task| for each index in [0, |count|) on the worker threads and waits
+  // for all of them to finish. |worker| is an index in [0, |num_threads()|)
+  // that is unique among the tasks running at the same time, so it can be used
+  // to access per worker objects without locking. If any of the tasks fails,
+  // the tasks not started yet are skipped.
+  //
+  // Returns false if any of the tasks fails.
+  bool ParallelFor(
+      size_t count,
+      const std::function<bool(size_t index, size_t worker)>& task);
+
+ private:
+  // The main loop of the worker threads.
+  void RunWorker();
+
+  std::vector<std::thread> workers_;
+
+  // Guards all the members below.
+  std::mutex mutex_;
+  std::condition_variable task_cv_;
+  std::condition_variable done_cv_;
+  std::deque<std::function<void()>> tasks_;
+  // The number of tasks scheduled but not finished yet.
+  size_t pending_tasks_;
+  bool stop_;
+
+  DISALLOW_COPY_AND_ASSIGN(ThreadPool);
+};
+
+// Similar to |ThreadPool::ParallelFor| but runs the tasks on a temporary pool
+// of |num_threads| threads. If |num_threads| is one (or |count| is less than
+// two), the tasks are run sequentially on the calling thread without creating
+// any threads. If |num_threads| is zero, the number of available cores is used.
+bool ParallelFor(size_t count,
+                 size_t num_threads,
+                 const std::function<bool(size_t index, size_t worker)>& task);
+
+}  // namespace puffin
+
+#endif  // SRC_THREAD_POOL_H_
@@ -148,6 +148,28 @@ const std::vector<BitExtent> kSubblockDeflateExtents9 = {
 const std::vector<ByteExtent> kPuffExtents9 = {{0, 11}, {14, 11}, {25, 7}};
 
 const Buffer kPatch8To9 = {
+  0x50, 0x55, 0x46, 0x31, 0x00, 0x00, 0x00, 0x2A, 0x08, 0x03, 0x12, 0x12,
+  0x18, 0x1F, 0x22, 0x06, 0x10, 0x32, 0x0E, 0x0A, 0x06, 0x12, 0x2A, 0x06,
+  0x02, 0x0B, 0x02, 0x05, 0x01, 0x07, 0x1A, 0x12, 0x18, 0x21, 0x22, 0x06,
+  0x00, 0x32, 0x16, 0x50, 0x00, 0x12, 0x2A, 0x06, 0x00, 0x0B, 0x03, 0x0B,
+  0x00, 0x07, 0x42, 0x53, 0x44, 0x49, 0x46, 0x46, 0x34, 0x30, 0x38, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x34, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x21, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x42, 0x5A,
+  0x68, 0x39, 0x31, 0x41, 0x59, 0x26, 0x53, 0x59, 0xD1, 0x20, 0xBB, 0x7E,
+  0x00, 0x00, 0x03, 0x60, 0x40, 0x78, 0x0E, 0x08, 0x00, 0x40, 0x00, 0x20,
+  0x00, 0x31, 0x06, 0x4C, 0x40, 0x92, 0x8F, 0x46, 0xA7, 0xA8, 0xE0, 0xF3,
+  0xD6, 0x21, 0x12, 0xF4, 0xBC, 0x43, 0x32, 0x1F, 0x17, 0x72, 0x45, 0x38,
+  0x50, 0x90, 0xD1, 0x20, 0xBB, 0x7E, 0x42, 0x5A, 0x68, 0x39, 0x31, 0x41,
+  0x59, 0x26, 0x53, 0x59, 0xF1, 0x20, 0x5F, 0x0D, 0x00, 0x00, 0x02, 0x41,
+  0x15, 0x42, 0x08, 0x20, 0x00, 0x40, 0x00, 0x00, 0x02, 0x40, 0x00, 0x20,
+  0x00, 0x22, 0x3D, 0x23, 0x10, 0x86, 0x03, 0x96, 0x54, 0x11, 0x16, 0x5F,
+  0x17, 0x72, 0x45, 0x38, 0x50, 0x90, 0xF1, 0x20, 0x5F, 0x0D, 0x42, 0x5A,
+  0x68, 0x39, 0x31, 0x41, 0x59, 0x26, 0x53, 0x59, 0x07, 0xD4, 0xCB, 0x6E,
+  0x00, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x20, 0x00, 0x21, 0x18, 0x46,
+  0x82, 0xEE, 0x48, 0xA7, 0x0A, 0x12, 0x00, 0xFA, 0x99, 0x6D, 0xC0};
+
+// |kPatch8To9| in the version one format, with the extents not packed.
+const Buffer kLegacyPatch8To9 = {
   0x50, 0x55, 0x46, 0x31, 0x00, 0x00, 0x00, 0x51, 0x08, 0x01, 0x12, 0x27,
   0x0A, 0x04, 0x08, 0x10, 0x10, 0x32, 0x0A, 0x04, 0x08, 0x50, 0x10, 0x0A,
   0x0A, 0x04, 0x08, 0x60, 0x10, 0x12, 0x12, 0x04, 0x08, 0x10, 0x10, 0x58,
@@ -173,60 +195,53 @@ const Buffer kPatch8To9 = {
   0x6D, 0xC0};
 
 const Buffer kPatch9To8 = {
-  0x50, 0x55, 0x46, 0x31, 0x00, 0x00, 0x00, 0x51, 0x08, 0x01, 0x12, 0x24,
-  0x0A, 0x02, 0x10, 0x32, 0x0A, 0x04, 0x08, 0x48, 0x10, 0x50, 0x0A, 0x05,
-  0x08, 0x98, 0x01, 0x10, 0x12, 0x12, 0x02, 0x10, 0x58, 0x12, 0x04, 0x08,
-  0x70, 0x10, 0x58, 0x12, 0x05, 0x08, 0xC8, 0x01, 0x10, 0x38, 0x18, 0x21,
-  0x1A, 0x27, 0x0A, 0x04, 0x08, 0x10, 0x10, 0x32, 0x0A, 0x04, 0x08, 0x50,
-  0x10, 0x0A, 0x0A, 0x04, 0x08, 0x60, 0x10, 0x12, 0x12, 0x04, 0x08, 0x10,
-  0x10, 0x58, 0x12, 0x04, 0x08, 0x78, 0x10, 0x28, 0x12, 0x05, 0x08, 0xA8,
-  0x01, 0x10, 0x38, 0x18, 0x1F, 0x42, 0x53, 0x44, 0x49, 0x46, 0x46, 0x34,
-  0x30, 0x33, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x25, 0x00, 0x00,
-  0x00, 0x00, 0x00, 0x00, 0x00, 0x1F, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-  0x00, 0x42, 0x5A, 0x68, 0x39, 0x31, 0x41, 0x59, 0x26, 0x53, 0x59, 0x3D,
-  0xBD, 0x08, 0x91, 0x00, 0x00, 0x01, 0xE0, 0x40, 0x5C, 0x0A, 0x40, 0x00,
-  0x40, 0x00, 0x20, 0x00, 0x31, 0x0C, 0x08, 0x23, 0xD2, 0x34, 0xD1, 0xB1,
-  0x73, 0x60, 0x44, 0x54, 0xE4, 0xFC, 0x5D, 0xC9, 0x14, 0xE1, 0x42, 0x40,
-  0xF6, 0xF4, 0x22, 0x44, 0x42, 0x5A, 0x68, 0x39, 0x31, 0x41, 0x59, 0x26,
-  0x53, 0x59, 0x41, 0x62, 0x2E, 0xF0, 0x00, 0x00, 0x00, 0x40, 0x00, 0x40,
-  0x20, 0x20, 0x00, 0x21, 0x00, 0x82, 0x83, 0x17, 0x72, 0x45, 0x38, 0x50,
-  0x90, 0x41, 0x62, 0x2E, 0xF0, 0x42, 0x5A, 0x68, 0x39, 0x31, 0x41, 0x59,
-  0x26, 0x53, 0x59, 0xE0, 0x20, 0x04, 0x57, 0x00, 0x00, 0x04, 0x76, 0x50,
-  0xE0, 0x00, 0x20, 0x00, 0x10, 0x00, 0x04, 0x00, 0x02, 0x00, 0x20, 0x00,
-  0x40, 0x00, 0x00, 0x00, 0xA0, 0x00, 0x21, 0xA1, 0xA3, 0x10, 0x83, 0x26,
-  0x21, 0x5E, 0xB2, 0x69, 0xAC, 0x70, 0x60, 0x53, 0xC5, 0xDC, 0x91, 0x4E,
-  0x14, 0x24, 0x38, 0x08, 0x01, 0x15, 0xC0};
+  0x50, 0x55, 0x46, 0x31, 0x00, 0x00, 0x00, 0x2A, 0x08, 0x03, 0x12, 0x12,
+  0x18, 0x21, 0x22, 0x06, 0x00, 0x32, 0x16, 0x50, 0x00, 0x12, 0x2A, 0x06,
+  0x00, 0x0B, 0x03, 0x0B, 0x00, 0x07, 0x1A, 0x12, 0x18, 0x1F, 0x22, 0x06,
+  0x10, 0x32, 0x0E, 0x0A, 0x06, 0x12, 0x2A, 0x06, 0x02, 0x0B, 0x02, 0x05,
+  0x01, 0x07, 0x42, 0x53, 0x44, 0x49, 0x46, 0x46, 0x34, 0x30, 0x33, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x25, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x1F, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x42, 0x5A,
+  0x68, 0x39, 0x31, 0x41, 0x59, 0x26, 0x53, 0x59, 0x3D, 0xBD, 0x08, 0x91,
+  0x00, 0x00, 0x01, 0xE0, 0x40, 0x5C, 0x0A, 0x40, 0x00, 0x40, 0x00, 0x20,
+  0x00, 0x31, 0x0C, 0x08, 0x23, 0xD2, 0x34, 0xD1, 0xB1, 0x73, 0x60, 0x44,
+  0x54, 0xE4, 0xFC, 0x5D, 0xC9, 0x14, 0xE1, 0x42, 0x40, 0xF6, 0xF4, 0x22,
+  0x44, 0x42, 0x5A, 0x68, 0x39, 0x31, 0x41, 0x59, 0x26, 0x53, 0x59, 0x41,
+  0x62, 0x2E, 0xF0, 0x00, 0x00, 0x00, 0x40, 0x00, 0x40, 0x20, 0x20, 0x00,
+  0x21, 0x00, 0x82, 0x83, 0x17, 0x72, 0x45, 0x38, 0x50, 0x90, 0x41, 0x62,
+  0x2E, 0xF0, 0x42, 0x5A, 0x68, 0x39, 0x31, 0x41, 0x59, 0x26, 0x53, 0x59,
+  0xE0, 0x20, 0x04, 0x57, 0x00, 0x00, 0x04, 0x76, 0x50, 0xE0, 0x00, 0x20,
+  0x00, 0x10, 0x00, 0x04, 0x00, 0x02, 0x00, 0x20, 0x00, 0x40, 0x00, 0x00,
+  0x00, 0xA0, 0x00, 0x21, 0xA1, 0xA3, 0x10, 0x83, 0x26, 0x21, 0x5E, 0xB2,
+  0x69, 0xAC, 0x70, 0x60, 0x53, 0xC5, 0xDC, 0x91, 0x4E, 0x14, 0x24, 0x38,
+  0x08, 0x01, 0x15, 0xC0};
 
 const Buffer kPatch8ToEmpty = {
-  0x50, 0x55, 0x46, 0x31, 0x00, 0x00, 0x00, 0x2D, 0x08, 0x01, 0x12, 0x27,
-  0x0A, 0x04, 0x08, 0x10, 0x10, 0x32, 0x0A, 0x04, 0x08, 0x50, 0x10, 0x0A,
-  0x0A, 0x04, 0x08, 0x60, 0x10, 0x12, 0x12, 0x04, 0x08, 0x10, 0x10, 0x58,
-  0x12, 0x04, 0x08, 0x78, 0x10, 0x28, 0x12, 0x05, 0x08, 0xA8, 0x01, 0x10,
-  0x38, 0x18, 0x1F, 0x1A, 0x00, 0x42, 0x53, 0x44, 0x49, 0x46, 0x46, 0x34,
-  0x30, 0x0E, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0E, 0x00, 0x00,
-  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-  0x00, 0x42, 0x5A, 0x68, 0x39, 0x17, 0x72, 0x45, 0x38, 0x50, 0x90, 0x00,
-  0x00, 0x00, 0x00, 0x42, 0x5A, 0x68, 0x39, 0x17, 0x72, 0x45, 0x38, 0x50,
-  0x90, 0x00, 0x00, 0x00, 0x00, 0x42, 0x5A, 0x68, 0x39, 0x17, 0x72, 0x45,
-  0x38, 0x50, 0x90, 0x00, 0x00, 0x00, 0x00};
+  0x50, 0x55, 0x46, 0x31, 0x00, 0x00, 0x00, 0x18, 0x08, 0x03, 0x12, 0x12,
+  0x18, 0x1F, 0x22, 0x06, 0x10, 0x32, 0x0E, 0x0A, 0x06, 0x12, 0x2A, 0x06,
+  0x02, 0x0B, 0x02, 0x05, 0x01, 0x07, 0x1A, 0x00, 0x42, 0x53, 0x44, 0x49,
+  0x46, 0x46, 0x34, 0x30, 0x0E, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x0E, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x42, 0x5A, 0x68, 0x39, 0x17, 0x72, 0x45, 0x38,
+  0x50, 0x90, 0x00, 0x00, 0x00, 0x00, 0x42, 0x5A, 0x68, 0x39, 0x17, 0x72,
+  0x45, 0x38, 0x50, 0x90, 0x00, 0x00, 0x00, 0x00, 0x42, 0x5A, 0x68, 0x39,
+  0x17, 0x72, 0x45, 0x38, 0x50, 0x90, 0x00, 0x00, 0x00, 0x00};
 
 const Buffer kPatch8ToNoDeflate = {
-  0x50, 0x55, 0x46, 0x31, 0x00, 0x00, 0x00, 0x2F, 0x08, 0x01, 0x12, 0x27,
-  0x0A, 0x04, 0x08, 0x10, 0x10, 0x32, 0x0A, 0x04, 0x08, 0x50, 0x10, 0x0A,
-  0x0A, 0x04, 0x08, 0x60, 0x10, 0x12, 0x12, 0x04, 0x08, 0x10, 0x10, 0x58,
-  0x12, 0x04, 0x08, 0x78, 0x10, 0x28, 0x12, 0x05, 0x08, 0xA8, 0x01, 0x10,
-  0x38, 0x18, 0x1F, 0x1A, 0x02, 0x18, 0x04, 0x42, 0x53, 0x44, 0x49, 0x46,
-  0x46, 0x34, 0x30, 0x28, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0E,
-  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00,
-  0x00, 0x00, 0x00, 0x42, 0x5A, 0x68, 0x39, 0x31, 0x41, 0x59, 0x26, 0x53,
-  0x59, 0xBA, 0x8D, 0x7F, 0x2D, 0x00, 0x00, 0x00, 0x40, 0x00, 0x44, 0x08,
-  0x20, 0x00, 0x30, 0xCC, 0x09, 0x32, 0x54, 0x65, 0x38, 0xBB, 0x92, 0x29,
-  0xC2, 0x84, 0x85, 0xD4, 0x6B, 0xF9, 0x68, 0x42, 0x5A, 0x68, 0x39, 0x17,
-  0x72, 0x45, 0x38, 0x50, 0x90, 0x00, 0x00, 0x00, 0x00, 0x42, 0x5A, 0x68,
-  0x39, 0x31, 0x41, 0x59, 0x26, 0x53, 0x59, 0xE7, 0xAA, 0xF1, 0xFC, 0x00,
-  0x00, 0x00, 0x70, 0x00, 0x00, 0x08, 0x01, 0x00, 0x20, 0x04, 0x20, 0x00,
-  0x21, 0x9A, 0x68, 0x33, 0x4D, 0x13, 0x3C, 0x5D, 0xC9, 0x14, 0xE1, 0x42,
-  0x43, 0x9E, 0xAB, 0xC7, 0xF0};
+  0x50, 0x55, 0x46, 0x31, 0x00, 0x00, 0x00, 0x1A, 0x08, 0x03, 0x12, 0x12,
+  0x18, 0x1F, 0x22, 0x06, 0x10, 0x32, 0x0E, 0x0A, 0x06, 0x12, 0x2A, 0x06,
+  0x02, 0x0B, 0x02, 0x05, 0x01, 0x07, 0x1A, 0x02, 0x18, 0x04, 0x42, 0x53,
+  0x44, 0x49, 0x46, 0x46, 0x34, 0x30, 0x28, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x0E, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x42, 0x5A, 0x68, 0x39, 0x31, 0x41,
+  0x59, 0x26, 0x53, 0x59, 0xBA, 0x8D, 0x7F, 0x2D, 0x00, 0x00, 0x00, 0x40,
+  0x00, 0x44, 0x08, 0x20, 0x00, 0x30, 0xCC, 0x09, 0x32, 0x54, 0x65, 0x38,
+  0xBB, 0x92, 0x29, 0xC2, 0x84, 0x85, 0xD4, 0x6B, 0xF9, 0x68, 0x42, 0x5A,
+  0x68, 0x39, 0x17, 0x72, 0x45, 0x38, 0x50, 0x90, 0x00, 0x00, 0x00, 0x00,
+  0x42, 0x5A, 0x68, 0x39, 0x31, 0x41, 0x59, 0x26, 0x53, 0x59, 0xE7, 0xAA,
+  0xF1, 0xFC, 0x00, 0x00, 0x00, 0x70, 0x00, 0x00, 0x08, 0x01, 0x00, 0x20,
+  0x04, 0x20, 0x00, 0x21, 0x9A, 0x68, 0x33, 0x4D, 0x13, 0x3C, 0x5D, 0xC9,
+  0x14, 0xE1, 0x42, 0x43, 0x9E, 0xAB, 0xC7, 0xF0};
 
 // It is actuall the content of the copyright header.
 const Buffer kRaw10 = {
@@ -6,19 +6,27 @@
 
 #include <inttypes.h>
 
+#include <algorithm>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include <zlib.h>
 
 #include "puffin/src/bit_reader.h"
+#include "puffin/src/bit_writer.h"
 #include "puffin/src/file_stream.h"
 #include "puffin/src/include/puffin/common.h"
 #include "puffin/src/include/puffin/errors.h"
+#include "puffin/src/include/puffin/huffer.h"
 #include "puffin/src/include/puffin/puffer.h"
+#include "puffin/src/include/puffin/stats.h"
 #include "puffin/src/memory_stream.h"
+#include "puffin/src/puff_reader.h"
 #include "puffin/src/puff_writer.h"
 #include "puffin/src/set_errors.h"
+#include "puffin/src/thread_pool.h"
 
 namespace {
 // Use memcpy to access the unaligned data of type |T|.
@@ -72,6 +80,172 @@ bool CalculateSizeOfDeflateBlock(const puffin::Buffer& data,
   return true;
 }
 
+// Similar to the function above, but reads the deflate from |src| in small
+// chunks so only a constant amount of memory is used no matter how large the
+// deflate is.
+bool CalculateSizeOfDeflateBlock(const puffin::UniqueStreamPtr& src,
+                                 uint64_t start,
+                                 uint64_t* compressed_size,
+                                 uint64_t* uncompressed_size) {
+  TEST_AND_RETURN_FALSE(compressed_size != nullptr &&
+                        uncompressed_size != nullptr);
+
+  uint64_t size;
+  TEST_AND_RETURN_FALSE(src->GetSize(&size));
+  TEST_AND_RETURN_FALSE(start < size);
+  TEST_AND_RETURN_FALSE(src->Seek(start));
+
+  z_stream strm = {};
+  // -15 means we are decoding a 'raw' stream without zlib headers.
+  if (inflateInit2(&strm, -15)) {
+    LOG(ERROR) << "Failed to initialize inflate: " << strm.msg;
+    return false;
+  }
+
+  const unsigned int kBufferSize = 32768;
+  std::vector<uint8_t> compressed_data(kBufferSize);
+  std::vector<uint8_t> uncompressed_data(kBufferSize);
+  uint64_t bytes_read = 0;
+  *uncompressed_size = 0;
+  int status = Z_OK;
+  do {
+    if (strm.avail_in == 0 && start + bytes_read < size) {
+      auto length = std::min(static_cast<uint64_t>(kBufferSize),
+                             size - start - bytes_read);
+      if (!src->Read(compressed_data.data(), length)) {
+        inflateEnd(&strm);
+        return false;
+      }
+      strm.avail_in = length;
+      strm.next_in = compressed_data.data();
+      bytes_read += length;
+    }
+    // Overwrite the same buffer since we don't need the uncompressed data.
+    strm.avail_out = kBufferSize;
+    strm.next_out = uncompressed_data.data();
+    status = inflate(&strm, Z_NO_FLUSH);
+    // Running out of input before the end of the deflate gives |Z_BUF_ERROR|.
+    if (status < 0) {
+      LOG(ERROR) << "Inflate failed: " << (strm.msg ? strm.msg : "truncated")
+                 << ", has decompressed " << *uncompressed_size << " bytes.";
+      inflateEnd(&strm);
+      return false;
+    }
+    *uncompressed_size += kBufferSize - strm.avail_out;
+  } while (status != Z_STREAM_END);
+
+  *compressed_size = bytes_read - strm.avail_in;
+  TEST_AND_RETURN_FALSE(inflateEnd(&strm) == Z_OK);
+  return true;
+}
+
+// Reads |length| bytes at |offset| of |src| into |buffer|.
+bool ReadAt(const puffin::UniqueStreamPtr& src,
+            uint64_t offset,
+            void* buffer,
+            size_t length) {
+  TEST_AND_RETURN_FALSE(src->Seek(offset));
+  TEST_AND_RETURN_FALSE(src->Read(buffer, length));
+  return true;
+}
+
+// Checks the two header bytes |cmf| and |flag| of a zlib stream and sets
+// |header_len| to the size of its header.
+bool ParseZlibHeader(uint8_t cmf, uint8_t flag, uint64_t* header_len) {
+  auto compression_method = cmf & 0x0F;
+  // For deflate compression_method should be 8.
+  TEST_AND_RETURN_FALSE(compression_method == 8);
+
+  auto cinfo = (cmf & 0xF0) >> 4;
+  // Value greater than 7 is not allowed in deflate.
+  TEST_AND_RETURN_FALSE(cinfo <= 7);
+
+  TEST_AND_RETURN_FALSE(((static_cast<uint16_t>(cmf) << 8) + flag) % 31 == 0);
+
+  *header_len = 2;
+  if (flag & 0x20) {
+    *header_len += 4;  // 4 bytes for the preset dictionary.
+  }
+  return true;
+}
+
+// Returns the offset in the puff stream of the puff of |deflates[index]|, which
+// has size |puff_size|. |size_difference| is the difference between the sizes
+// of the puff and deflate streams before the deflate, and it is updated to
+// include the deflate and its puff. It is signed because puff size could be
+// smaller than deflate size.
+uint64_t GetPuffOffset(const std::vector<puffin::BitExtent>& deflates,
+                       size_t index,
+                       uint64_t puff_size,
+                       int64_t* size_difference) {
+  const auto& deflate = deflates[index];
+  // 1 if a deflate ends at the same byte that the next deflate starts and
+  // there is a few bits gap between them. In practice this may never happen,
+  // but it is a good idea to support it anyways. If there is a gap, the value
+  // of the gap will be saved as an integer byte to the puff stream. The parts
+  // of the byte that belogs to the deflates are shifted out.
+  int gap = 0;
+  if (index != 0) {
+    const auto& prev_deflate = deflates[index - 1];
+    if ((prev_deflate.offset + prev_deflate.length == deflate.offset)
+        // If deflates are on byte boundary the gap will not be counted later,
+        // so we won't worry about it.
+        && (deflate.offset % 8 != 0)) {
+      gap = 1;
+    }
+  }
+
+  auto start_byte = ((deflate.offset + 7) / 8);
+  auto end_byte = (deflate.offset + deflate.length) / 8;
+  int64_t deflate_length_in_bytes = end_byte - start_byte;
+
+  // If there was no gap bits between the current and previous deflates, there
+  // will be no extra gap byte, so the offset will be shifted one byte back.
+  auto puff_offset = start_byte - gap + *size_difference;
+  *size_difference +=
+      static_cast<int64_t>(puff_size) - deflate_length_in_bytes - gap;
+  return puff_offset;
+}
+
+// The size of the pieces the raw data between the deflates is copied in by
+// |PuffDeflates|.
+constexpr size_t kRawCopyBufferSize = 1024 * 1024;  // 1 MiB
+
+// Copies the |count| raw bytes of the puff stream between the end of a deflate
+// (or the beginning of |src|) at bit |start_bit| and the start of the next
+// deflate (or the end of |src|) at bit |end_bit| from |src| into |dst|. Like
+// |PuffinStream::Read|, the bits of the deflates in the bytes they share with
+// the raw data are masked and shifted out.
+bool CopyRawBytes(const puffin::UniqueStreamPtr& src,
+                  uint64_t start_bit,
+                  uint64_t end_bit,
+                  uint64_t count,
+                  puffin::Buffer* buffer,
+                  const puffin::UniqueStreamPtr& dst) {
+  if (count == 0) {
+    return true;
+  }
+  auto start_byte = start_bit / 8;
+  TEST_AND_RETURN_FALSE(count == (end_bit + 7) / 8 - start_byte);
+  TEST_AND_RETURN_FALSE(src->Seek(start_byte));
+  for (uint64_t copied = 0; copied < count;) {
+    auto size = std::min<uint64_t>(count - copied, kRawCopyBufferSize);
+    buffer->resize(size);
+    TEST_AND_RETURN_FALSE(src->Read(buffer->data(), size));
+    // The first byte of the next deflate is masked before the last byte of the
+    // previous one is shifted, since they can be the same byte.
+    if (copied + size == count && end_bit % 8 != 0) {
+      (*buffer)[size - 1] &= (1 << (end_bit % 8)) - 1;
+    }
+    if (copied == 0) {
+      (*buffer)[0] >>= start_bit % 8;
+    }
+    TEST_AND_RETURN_FALSE(dst->Write(buffer->data(), size));
+    copied += size;
+  }
+  return true;
+}
+
 }  // namespace
 
 namespace puffin {
@@ -94,57 +268,78 @@ uint64_t BytesInByteExtents(const vector<ByteExtent>& extents) {
 // find the location of compressed blocks using CalculateSizeOfDeflateBlock().
 bool LocateDeflatesInZlib(const Buffer& data,
                           std::vector<ByteExtent>* deflate_blocks) {
+  return LocateDeflatesInZlib(MemoryStream::CreateForRead(data),
+                              deflate_blocks);
+}
+
+bool LocateDeflatesInZlib(const UniqueStreamPtr& src,
+                          std::vector<ByteExtent>* deflate_blocks) {
   // A zlib stream has the following format:
   // 0           1     compression method and flag
   // 1           1     flag
   // 2           4     preset dictionary (optional)
   // 2 or 6      n     compressed data
   // n+(2 or 6)  4     Adler-32 checksum
-  TEST_AND_RETURN_FALSE(data.size() >= 6 + 4);  // Header + Footer
-  uint16_t cmf = data[0];
-  auto compression_method = cmf & 0x0F;
-  // For deflate compression_method should be 8.
-  TEST_AND_RETURN_FALSE(compression_method == 8);
+  uint64_t size;
+  TEST_AND_RETURN_FALSE(src->GetSize(&size));
+  TEST_AND_RETURN_FALSE(size >= 6 + 4);  // Header + Footer
+  uint8_t header[2];
+  TEST_AND_RETURN_FALSE(ReadAt(src, 0, header, sizeof(header)));
 
-  auto cinfo = (cmf & 0xF0) >> 4;
-  // Value greater than 7 is not allowed in deflate.
-  TEST_AND_RETURN_FALSE(cinfo <= 7);
-
-  auto flag = data[1];
-  TEST_AND_RETURN_FALSE(((cmf << 8) + flag) % 31 == 0);
-
-  uint64_t header_len = 2;
-  if (flag & 0x20) {
-    header_len += 4;  // 4 bytes for the preset dictionary.
-  }
+  uint64_t header_len;
+  TEST_AND_RETURN_FALSE(ParseZlibHeader(header[0], header[1], &header_len));
 
   // 4 is for ADLER32.
-  deflate_blocks->emplace_back(header_len, data.size() - header_len - 4);
+  deflate_blocks->emplace_back(header_len, size - header_len - 4);
   return true;
 }
 
 bool FindDeflateSubBlocks(const UniqueStreamPtr& src,
                           const vector<ByteExtent>& deflates,
-                          vector<BitExtent>* subblock_deflates) {
-  Puffer puffer;
-  Buffer deflate_buffer;
-  for (const auto& deflate : deflates) {
-    TEST_AND_RETURN_FALSE(src->Seek(deflate.offset));
-    // Read from src into deflate_buffer.
-    deflate_buffer.resize(deflate.length);
-    TEST_AND_RETURN_FALSE(src->Read(deflate_buffer.data(), deflate.length));
-
-    // Find all the subblocks.
-    BufferBitReader bit_reader(deflate_buffer.data(), deflate.length);
-    BufferPuffWriter puff_writer(nullptr, 0);
-    Error error;
-    vector<BitExtent> subblocks;
-    TEST_AND_RETURN_FALSE(
-        puffer.PuffDeflate(&bit_reader, &puff_writer, &subblocks, &error));
-    TEST_AND_RETURN_FALSE(deflate.length == bit_reader.Offset());
-    for (const auto& subblock : subblocks) {
-      subblock_deflates->emplace_back(subblock.offset + deflate.offset * 8,
-                                      subblock.length);
+                          vector<BitExtent>* subblock_deflates,
+                          size_t num_threads) {
+  if (num_threads == 0) {
+    num_threads = ThreadPool::GetDefaultNumThreads();
+  }
+  num_threads = std::max(std::min(num_threads, deflates.size()), size_t(1));
+
+  // Each deflate is puffed by one of the workers and its subblocks are kept
+  // separately, so they can be appended in the order of |deflates| at the end.
+  vector<Puffer> puffers(num_threads);
+  vector<Buffer> deflate_buffers(num_threads);
+  vector<vector<BitExtent>> subblocks(deflates.size());
+  std::mutex src_mutex;
+  TEST_AND_RETURN_FALSE(ParallelFor(
+      deflates.size(), num_threads, [&](size_t index, size_t worker) {
+        const auto& deflate = deflates[index];
+        auto& deflate_buffer = deflate_buffers[worker];
+        // Read from src into deflate_buffer, unless it can be read in place.
+        const uint8_t* deflate_data;
+        {
+          std::lock_guard<std::mutex> lock(src_mutex);
+          TEST_AND_RETURN_FALSE(src->Seek(deflate.offset));
+          if (!src->ReadZeroCopy(&deflate_data, deflate.length)) {
+            deflate_buffer.resize(deflate.length);
+            TEST_AND_RETURN_FALSE(
+                src->Read(deflate_buffer.data(), deflate.length));
+            deflate_data = deflate_buffer.data();
+          }
+        }
+
+        // Find all the subblocks.
+        BufferBitReader bit_reader(deflate_data, deflate.length);
+        uint64_t puff_size;
+        Error error;
+        TEST_AND_RETURN_FALSE(puffers[worker].ScanDeflate(
+            &bit_reader, &subblocks[index], nullptr, &puff_size, &error));
+        TEST_AND_RETURN_FALSE(deflate.length == bit_reader.Offset());
+        return true;
+      }));
+
+  for (size_t index = 0; index < deflates.size(); index++) {
+    for (const auto& subblock : subblocks[index]) {
+      subblock_deflates->emplace_back(
+          subblock.offset + deflates[index].offset * 8, subblock.length);
     }
   }
   return true;
@@ -152,27 +347,43 @@ bool FindDeflateSubBlocks(const UniqueStreamPtr& src,
 
 bool LocateDeflatesInZlibBlocks(const string& file_path,
                                 const vector<ByteExtent>& zlibs,
-                                vector<BitExtent>* deflates) {
+                                vector<BitExtent>* deflates,
+                                size_t num_threads) {
   auto src = FileStream::Open(file_path, true, false);
   TEST_AND_RETURN_FALSE(src);
+  if (num_threads == 0) {
+    num_threads = ThreadPool::GetDefaultNumThreads();
+  }
+  num_threads = std::max(std::min(num_threads, zlibs.size()), size_t(1));
 
-  Buffer buffer;
-  for (auto& zlib : zlibs) {
-    buffer.resize(zlib.length);
-    TEST_AND_RETURN_FALSE(src->Seek(zlib.offset));
-    TEST_AND_RETURN_FALSE(src->Read(buffer.data(), buffer.size()));
+  // The zlibs are split between the workers, and the deflates of each of them
+  // are appended in the order of |zlibs| at the end.
+  vector<Buffer> buffers(num_threads);
+  vector<vector<BitExtent>> zlib_deflates(zlibs.size());
+  std::mutex src_mutex;
+  TEST_AND_RETURN_FALSE(ParallelFor(
+      zlibs.size(), num_threads, [&](size_t index, size_t worker) {
+        const auto& zlib = zlibs[index];
+        auto& buffer = buffers[worker];
+        buffer.resize(zlib.length);
+        {
+          std::lock_guard<std::mutex> lock(src_mutex);
+          TEST_AND_RETURN_FALSE(src->Seek(zlib.offset));
+          TEST_AND_RETURN_FALSE(src->Read(buffer.data(), buffer.size()));
+        }
 
-    vector<ByteExtent> deflate_blocks;
-    TEST_AND_RETURN_FALSE(LocateDeflatesInZlib(buffer, &deflate_blocks));
+        vector<ByteExtent> deflate_blocks;
+        TEST_AND_RETURN_FALSE(LocateDeflatesInZlib(buffer, &deflate_blocks));
 
-    vector<BitExtent> deflate_subblocks;
-    auto zlib_blc_src = MemoryStream::CreateForRead(buffer);
-    TEST_AND_RETURN_FALSE(
-        FindDeflateSubBlocks(zlib_blc_src, deflate_blocks, &deflate_subblocks));
+        auto zlib_blc_src = MemoryStream::CreateForRead(buffer);
+        return FindDeflateSubBlocks(zlib_blc_src, deflate_blocks,
+                                    &zlib_deflates[index]);
+      }));
 
+  for (size_t index = 0; index < zlibs.size(); index++) {
     // Relocated based on the offset of the zlib.
-    for (const auto& def : deflate_subblocks) {
-      deflates->emplace_back(zlib.offset * 8 + def.offset, def.length);
+    for (const auto& def : zlib_deflates[index]) {
+      deflates->emplace_back(zlibs[index].offset * 8 + def.offset, def.length);
     }
   }
   return true;
@@ -182,8 +393,16 @@ bool LocateDeflatesInZlibBlocks(const string& file_path,
 // https://www.ietf.org/rfc/rfc1952.txt
 bool LocateDeflatesInGzip(const Buffer& data,
                           vector<ByteExtent>* deflate_blocks) {
+  return LocateDeflatesInGzip(MemoryStream::CreateForRead(data),
+                              deflate_blocks);
+}
+
+bool LocateDeflatesInGzip(const UniqueStreamPtr& src,
+                          vector<ByteExtent>* deflate_blocks) {
+  uint64_t size;
+  TEST_AND_RETURN_FALSE(src->GetSize(&size));
   uint64_t member_start = 0;
-  while (member_start < data.size()) {
+  while (member_start < size) {
     // Each member entry has the following format
     // 0      1     0x1F
     // 1      1     0x8B
@@ -192,37 +411,33 @@ bool LocateDeflatesInGzip(const Buffer& data,
     // 4      4     modification time
     // 8      1     extra flags
     // 9      1     operating system
-    TEST_AND_RETURN_FALSE(member_start + 10 <= data.size());
-    TEST_AND_RETURN_FALSE(data[member_start + 0] == 0x1F);
-    TEST_AND_RETURN_FALSE(data[member_start + 1] == 0x8B);
-    TEST_AND_RETURN_FALSE(data[member_start + 2] == 8);
+    uint8_t header[10];
+    TEST_AND_RETURN_FALSE(member_start + sizeof(header) <= size);
+    TEST_AND_RETURN_FALSE(ReadAt(src, member_start, header, sizeof(header)));
+    TEST_AND_RETURN_FALSE(header[0] == 0x1F);
+    TEST_AND_RETURN_FALSE(header[1] == 0x8B);
+    TEST_AND_RETURN_FALSE(header[2] == 8);
 
-    uint64_t offset = member_start + 10;
-    int flag = data[member_start + 3];
+    uint64_t offset = member_start + sizeof(header);
+    int flag = header[3];
     // Extra field
     if (flag & 4) {
-      TEST_AND_RETURN_FALSE(offset + 2 <= data.size());
-      uint16_t extra_length = data[offset++];
-      extra_length |= static_cast<uint16_t>(data[offset++]) << 8;
-      TEST_AND_RETURN_FALSE(offset + extra_length <= data.size());
-      offset += extra_length;
+      uint8_t extra_length[2];
+      TEST_AND_RETURN_FALSE(offset + 2 <= size);
+      TEST_AND_RETURN_FALSE(src->Read(extra_length, 2));
+      offset += 2 + (extra_length[0] | (extra_length[1] << 8));
+      TEST_AND_RETURN_FALSE(offset <= size);
+      TEST_AND_RETURN_FALSE(src->Seek(offset));
     }
-    // File name field
-    if (flag & 8) {
-      while (true) {
-        TEST_AND_RETURN_FALSE(offset + 1 <= data.size());
-        if (data[offset++] == 0) {
-          break;
-        }
-      }
-    }
-    // File comment field
-    if (flag & 16) {
-      while (true) {
-        TEST_AND_RETURN_FALSE(offset + 1 <= data.size());
-        if (data[offset++] == 0) {
-          break;
-        }
+    // File name and file comment fields are zero terminated.
+    for (int field : {8, 16}) {
+      if (flag & field) {
+        uint8_t byte;
+        do {
+          TEST_AND_RETURN_FALSE(offset + 1 <= size);
+          TEST_AND_RETURN_FALSE(src->Read(&byte, 1));
+          offset++;
+        } while (byte != 0);
       }
     }
     // CRC16 field
@@ -232,19 +447,22 @@ bool LocateDeflatesInGzip(const Buffer& data,
 
     uint64_t compressed_size, uncompressed_size;
     TEST_AND_RETURN_FALSE(CalculateSizeOfDeflateBlock(
-        data, offset, &compressed_size, &uncompressed_size));
-    TEST_AND_RETURN_FALSE(offset + compressed_size <= data.size());
+        src, offset, &compressed_size, &uncompressed_size));
+    TEST_AND_RETURN_FALSE(offset + compressed_size <= size);
     deflate_blocks->push_back(ByteExtent(offset, compressed_size));
     offset += compressed_size;
 
     // Ignore CRC32;
-    TEST_AND_RETURN_FALSE(offset + 8 <= data.size());
-    offset += 4;
+    uint8_t footer[8];
+    TEST_AND_RETURN_FALSE(offset + sizeof(footer) <= size);
+    TEST_AND_RETURN_FALSE(ReadAt(src, offset, footer, sizeof(footer)));
+    offset += sizeof(footer);
     uint32_t u_size = 0;
     for (size_t i = 0; i < 4; i++) {
-      u_size |= static_cast<uint32_t>(data[offset++]) << (i * 8);
+      u_size |= static_cast<uint32_t>(footer[4 + i]) << (i * 8);
     }
-    TEST_AND_RETURN_FALSE(uncompressed_size % (1 << 31) == u_size);
+    // The footer keeps the uncompressed size modulo 2^32.
+    TEST_AND_RETURN_FALSE(static_cast<uint32_t>(uncompressed_size) == u_size);
     member_start = offset;
   }
   return true;
@@ -328,85 +546,518 @@ bool LocateDeflatesInZipArchive(const Buffer& data,
   return true;
 }
 
+bool LocateDeflatesInZipArchive(const UniqueStreamPtr& src,
+                                vector<ByteExtent>* deflate_blocks) {
+  uint64_t size;
+  TEST_AND_RETURN_FALSE(src->GetSize(&size));
+
+  // end of central directory record format
+  // 0      4     0x06054b50
+  // 4      2     number of this disk
+  // 6      2     disk where central directory starts
+  // 8      2     number of central directory records on this disk
+  // 10     2     total number of central directory records
+  // 12     4     size of central directory
+  // 16     4     offset of start of central directory
+  // 20     2     comment length
+  // 22     n     comment
+  // It is at the end of the archive, before a comment of at most 64KiB.
+  const uint64_t kEocdSize = 22;
+  TEST_AND_RETURN_FALSE(size >= kEocdSize);
+  uint64_t tail_size = std::min(size, kEocdSize + 0xFFFF);
+  Buffer tail(tail_size);
+  TEST_AND_RETURN_FALSE(ReadAt(src, size - tail_size, tail.data(), tail_size));
+  uint64_t pos = tail_size - kEocdSize + 1;
+  do {
+    pos--;
+    if (get_unaligned<uint32_t>(tail.data() + pos) == 0x06054b50 &&
+        pos + kEocdSize + get_unaligned<uint16_t>(tail.data() + pos + 20) <=
+            tail_size) {
+      break;
+    }
+  } while (pos > 0);
+  if (get_unaligned<uint32_t>(tail.data() + pos) != 0x06054b50) {
+    LOG(ERROR) << "Failed to find the end of central directory record.";
+    return false;
+  }
+  uint64_t eocd_offset = size - tail_size + pos;
+  uint64_t num_entries = get_unaligned<uint16_t>(tail.data() + pos + 10);
+  uint64_t cd_size = get_unaligned<uint32_t>(tail.data() + pos + 12);
+  uint64_t cd_offset = get_unaligned<uint32_t>(tail.data() + pos + 16);
+  Buffer().swap(tail);
+
+  // The real values of the saturated fields are in the zip64 end of central
+  // directory record, which is found by the locator right before the end of
+  // central directory record.
+  // zip64 end of central directory locator format
+  // 0      4     0x07064b50
+  // 4      4     disk where zip64 end of central directory starts
+  // 8      8     offset of zip64 end of central directory record
+  // 16     4     total number of disks
+  // zip64 end of central directory record format
+  // 0      4     0x06064b50
+  // 4      8     size of the rest of the record
+  // 12     2     version made by
+  // 14     2     version needed to extract
+  // 16     4     number of this disk
+  // 20     4     disk where central directory starts
+  // 24     8     number of central directory records on this disk
+  // 32     8     total number of central directory records
+  // 40     8     size of central directory
+  // 48     8     offset of start of central directory
+  if (num_entries == 0xFFFF || cd_size == 0xFFFFFFFF ||
+      cd_offset == 0xFFFFFFFF) {
+    uint8_t locator[20];
+    uint8_t record[56];
+    TEST_AND_RETURN_FALSE(eocd_offset >= sizeof(locator));
+    TEST_AND_RETURN_FALSE(ReadAt(src, eocd_offset - sizeof(locator), locator,
+                                 sizeof(locator)));
+    if (get_unaligned<uint32_t>(locator) == 0x07064b50) {
+      auto record_offset = get_unaligned<uint64_t>(locator + 8);
+      TEST_AND_RETURN_FALSE(record_offset <= size - sizeof(record));
+      TEST_AND_RETURN_FALSE(
+          ReadAt(src, record_offset, record, sizeof(record)));
+      TEST_AND_RETURN_FALSE(get_unaligned<uint32_t>(record) == 0x06064b50);
+      num_entries = get_unaligned<uint64_t>(record + 32);
+      cd_size = get_unaligned<uint64_t>(record + 40);
+      cd_offset = get_unaligned<uint64_t>(record + 48);
+    }
+  }
+  TEST_AND_RETURN_FALSE(cd_offset <= size && cd_size <= size - cd_offset);
+
+  // central directory file header format
+  // 0      4     0x02014b50
+  // 4      2     version made by
+  // 6      2     minimum version needed to extract
+  // 8      2     general purpose bit flag
+  // 10     2     compression method
+  // 12     4     file last modification date & time
+  // 16     4     CRC-32
+  // 20     4     compressed size
+  // 24     4     uncompressed size
+  // 28     2     file name length
+  // 30     2     extra field length
+  // 32     2     file comment length
+  // 34     2     disk number where file starts
+  // 36     2     internal file attributes
+  // 38     4     external file attributes
+  // 42     4     offset of local file header
+  // 46     n     file name
+  // 46+n   m     extra field
+  // 46+n+m k     file comment
+  const uint64_t kCdHeaderSize = 46;
+  const uint64_t kLocalHeaderSize = 30;
+  auto first_new_block = deflate_blocks->size();
+  uint8_t header[kCdHeaderSize];
+  Buffer extra_field;
+  pos = cd_offset;
+  for (uint64_t idx = 0; idx < num_entries; idx++) {
+    TEST_AND_RETURN_FALSE(pos + kCdHeaderSize <= cd_offset + cd_size);
+    TEST_AND_RETURN_FALSE(ReadAt(src, pos, header, kCdHeaderSize));
+    TEST_AND_RETURN_FALSE(get_unaligned<uint32_t>(header) == 0x02014b50);
+    auto compression_method = get_unaligned<uint16_t>(header + 10);
+    uint64_t compressed_size = get_unaligned<uint32_t>(header + 20);
+    uint64_t uncompressed_size = get_unaligned<uint32_t>(header + 24);
+    auto file_name_length = get_unaligned<uint16_t>(header + 28);
+    auto extra_field_length = get_unaligned<uint16_t>(header + 30);
+    auto file_comment_length = get_unaligned<uint16_t>(header + 32);
+    uint64_t local_header_offset = get_unaligned<uint32_t>(header + 42);
+    uint64_t entry_size = kCdHeaderSize + file_name_length +
+                          extra_field_length + file_comment_length;
+    TEST_AND_RETURN_FALSE(pos + entry_size <= cd_offset + cd_size);
+
+    if (compression_method != 8) {  // non-deflate type
+      pos += entry_size;
+      continue;
+    }
+
+    // The saturated sizes and offset are in the zip64 extended information
+    // extra field (tag 0x0001), in this order.
+    if (uncompressed_size == 0xFFFFFFFF || compressed_size == 0xFFFFFFFF ||
+        local_header_offset == 0xFFFFFFFF) {
+      extra_field.resize(extra_field_length);
+      TEST_AND_RETURN_FALSE(src->Seek(pos + kCdHeaderSize + file_name_length));
+      TEST_AND_RETURN_FALSE(src->Read(extra_field.data(), extra_field_length));
+      uint64_t field = 0;
+      while (field + 4 <= extra_field.size()) {
+        auto tag = get_unaligned<uint16_t>(extra_field.data() + field);
+        auto field_size =
+            get_unaligned<uint16_t>(extra_field.data() + field + 2);
+        field += 4;
+        if (tag == 0x0001) {
+          uint64_t value = field;
+          for (auto* member :
+               {&uncompressed_size, &compressed_size, &local_header_offset}) {
+            if (*member == 0xFFFFFFFF && value + 8 <= field + field_size &&
+                value + 8 <= extra_field.size()) {
+              *member = get_unaligned<uint64_t>(extra_field.data() + value);
+              value += 8;
+            }
+          }
+          break;
+        }
+        field += field_size;
+      }
+    }
+    pos += entry_size;
+
+    // The deflate starts after the file name and extra field of the local file
+    // header, which can be different from the ones in the central directory
+    // (see the local file header format above).
+    uint8_t local_header[kLocalHeaderSize];
+    if (local_header_offset > size - kLocalHeaderSize ||
+        !ReadAt(src, local_header_offset, local_header, kLocalHeaderSize) ||
+        get_unaligned<uint32_t>(local_header) != 0x04034b50) {
+      LOG(ERROR) << "Invalid local file header at: " << local_header_offset
+                 << ", skip adding deflates for this entry.";
+      continue;
+    }
+    uint64_t data_offset = local_header_offset + kLocalHeaderSize +
+                           get_unaligned<uint16_t>(local_header + 26) +
+                           get_unaligned<uint16_t>(local_header + 28);
+    if (data_offset > size || compressed_size > size - data_offset) {
+      LOG(ERROR) << "The zip entry starting from: " << local_header_offset
+                 << " overflows the archive, skip adding deflates for this "
+                 << "entry.";
+      continue;
+    }
+    if (compressed_size > 0) {
+      deflate_blocks->emplace_back(data_offset, compressed_size);
+    }
+  }
+
+  // The central directory does not have to be in the order of the entries.
+  std::sort(deflate_blocks->begin() + first_new_block, deflate_blocks->end(),
+            [](const ByteExtent& a, const ByteExtent& b) {
+              return a.offset < b.offset;
+            });
+  return true;
+}
+
 bool LocateDeflateSubBlocksInZipArchive(const Buffer& data,
-                                        vector<BitExtent>* deflates) {
+                                        vector<BitExtent>* deflates,
+                                        size_t num_threads) {
   vector<ByteExtent> deflate_blocks;
   if (!LocateDeflatesInZipArchive(data, &deflate_blocks)) {
     return false;
   }
 
   auto src = MemoryStream::CreateForRead(data);
-  return FindDeflateSubBlocks(src, deflate_blocks, deflates);
+  return FindDeflateSubBlocks(src, deflate_blocks, deflates, num_threads);
 }
 
 bool FindPuffLocations(const UniqueStreamPtr& src,
                        const vector<BitExtent>& deflates,
                        vector<ByteExtent>* puffs,
-                       uint64_t* out_puff_size) {
-  Puffer puffer;
-  Buffer deflate_buffer;
+                       uint64_t* out_puff_size,
+                       size_t num_threads,
+                       PuffFormat puff_format) {
+  return FindPuffLocations(src, deflates, puffs, out_puff_size, nullptr,
+                           nullptr, num_threads, puff_format);
+}
+
+bool FindPuffLocations(const UniqueStreamPtr& src,
+                       const vector<BitExtent>& deflates,
+                       vector<ByteExtent>* puffs,
+                       uint64_t* out_puff_size,
+                       vector<BitExtent>* subblock_deflates,
+                       vector<ByteExtent>* subblock_puffs,
+                       size_t num_threads,
+                       PuffFormat puff_format) {
+  bool find_subblocks = subblock_deflates != nullptr;
+  TEST_AND_RETURN_FALSE(find_subblocks == (subblock_puffs != nullptr));
+  if (num_threads == 0) {
+    num_threads = ThreadPool::GetDefaultNumThreads();
+  }
+  num_threads = std::max(std::min(num_threads, deflates.size()), size_t(1));
+
+  // Each worker has its own |Puffer| and buffer. The deflates are independent
+  // from each other, so they can be puffed at the same time to find the size
+  // of their puffs. Only reading from |src| needs to be serialized.
+  vector<Puffer> puffers(num_threads);
+  vector<Buffer> deflate_buffers(num_threads);
+  vector<uint64_t> puff_sizes(deflates.size());
+  // The subblocks of each deflate relative to the beginning of the deflate's
+  // first byte and its puff.
+  vector<vector<BitExtent>> deflate_subblocks(find_subblocks ? deflates.size()
+                                                             : 0);
+  vector<vector<ByteExtent>> puff_subblocks(find_subblocks ? deflates.size()
+                                                           : 0);
+  std::mutex src_mutex;
+  TEST_AND_RETURN_FALSE(ParallelFor(
+      deflates.size(), num_threads, [&](size_t index, size_t worker) {
+        const auto& deflate = deflates[index];
+        auto& deflate_buffer = deflate_buffers[worker];
+        // Read from src into deflate_buffer, unless it can be read in place.
+        auto start_byte = deflate.offset / 8;
+        auto end_byte = (deflate.offset + deflate.length + 7) / 8;
+        auto deflate_size = end_byte - start_byte;
+        const uint8_t* deflate_data;
+        {
+          std::lock_guard<std::mutex> lock(src_mutex);
+          TEST_AND_RETURN_FALSE(src->Seek(start_byte));
+          if (!src->ReadZeroCopy(&deflate_data, deflate_size)) {
+            deflate_buffer.resize(deflate_size);
+            TEST_AND_RETURN_FALSE(
+                src->Read(deflate_buffer.data(), deflate_size));
+            deflate_data = deflate_buffer.data();
+          }
+        }
+        // Find the size of the puff.
+        BufferBitReader bit_reader(deflate_data, deflate_size);
+        uint64_t bits_to_skip = deflate.offset % 8;
+        TEST_AND_RETURN_FALSE(bit_reader.CacheBits(bits_to_skip));
+        bit_reader.DropBits(bits_to_skip);
+
+        Error error;
+        TEST_AND_RETURN_FALSE(puffers[worker].ScanDeflate(
+            &bit_reader, find_subblocks ? &deflate_subblocks[index] : nullptr,
+            find_subblocks ? &puff_subblocks[index] : nullptr,
+            &puff_sizes[index], &error, puff_format));
+        TEST_AND_RETURN_FALSE(deflate_size == bit_reader.Offset());
+        return true;
+      }));
 
   // Here accumulate the size difference between each corresponding deflate and
   // puff. At the end we add this cummulative size difference to the size of the
-  // deflate stream to get the size of the puff stream. We use signed size
-  // because puff size could be smaller than deflate size.
+  // deflate stream to get the size of the puff stream.
   int64_t total_size_difference = 0;
-  for (auto deflate = deflates.begin(); deflate != deflates.end(); ++deflate) {
-    // Read from src into deflate_buffer.
-    auto start_byte = deflate->offset / 8;
-    auto end_byte = (deflate->offset + deflate->length + 7) / 8;
-    deflate_buffer.resize(end_byte - start_byte);
-    TEST_AND_RETURN_FALSE(src->Seek(start_byte));
-    TEST_AND_RETURN_FALSE(
-        src->Read(deflate_buffer.data(), deflate_buffer.size()));
-    // Find the size of the puff.
-    BufferBitReader bit_reader(deflate_buffer.data(), deflate_buffer.size());
-    uint64_t bits_to_skip = deflate->offset % 8;
+  for (size_t index = 0; index < deflates.size(); index++) {
+    const auto& deflate = deflates[index];
+    auto puff_size = puff_sizes[index];
+    auto puff_offset =
+        GetPuffOffset(deflates, index, puff_size, &total_size_difference);
+    // Add the location into puff.
+    puffs->emplace_back(puff_offset, puff_size);
+    if (find_subblocks) {
+      for (const auto& subblock : deflate_subblocks[index]) {
+        subblock_deflates->emplace_back(
+            (deflate.offset & ~7ull) + subblock.offset, subblock.length);
+      }
+      for (const auto& subblock : puff_subblocks[index]) {
+        subblock_puffs->emplace_back(puff_offset + subblock.offset,
+                                     subblock.length);
+      }
+    }
+  }
+
+  uint64_t src_size;
+  TEST_AND_RETURN_FALSE(src->GetSize(&src_size));
+  auto final_size = static_cast<int64_t>(src_size) + total_size_difference;
+  TEST_AND_RETURN_FALSE(final_size >= 0);
+  *out_puff_size = final_size;
+  return true;
+}
+
+bool PuffDeflates(const UniqueStreamPtr& src,
+                  const vector<BitExtent>& deflates,
+                  const UniqueStreamPtr& dst,
+                  vector<ByteExtent>* puffs,
+                  uint64_t* out_puff_size,
+                  size_t num_threads,
+                  Stats* stats,
+                  PuffFormat puff_format) {
+  if (num_threads == 0) {
+    num_threads = ThreadPool::GetDefaultNumThreads();
+  }
+  num_threads = std::max(std::min(num_threads, deflates.size()), size_t(1));
+  std::unique_ptr<ThreadPool> pool;
+  if (num_threads > 1) {
+    pool.reset(new ThreadPool(num_threads));
+  }
+
+  // The deflates are puffed in batches of two per worker, each into its own
+  // buffer, while only reading from |src| is serialized. Then the batch is
+  // written into |dst| in order before the next one is puffed.
+  vector<Puffer> puffers(num_threads);
+  vector<Buffer> deflate_buffers(num_threads);
+  vector<Buffer> puff_buffers(num_threads * 2);
+  vector<uint64_t> puff_sizes(puff_buffers.size());
+  std::mutex src_mutex;
+  size_t batch_start = 0;
+  auto puff_deflate = [&](size_t batch_index, size_t worker) {
+    ScopedStatsTimer timer(stats, &Stats::puff_time_ns);
+    const auto& deflate = deflates[batch_start + batch_index];
+    auto& deflate_buffer = deflate_buffers[worker];
+    // Read from src into deflate_buffer, unless it can be read in place.
+    auto start_byte = deflate.offset / 8;
+    auto end_byte = (deflate.offset + deflate.length + 7) / 8;
+    auto deflate_size = end_byte - start_byte;
+    const uint8_t* deflate_data;
+    {
+      std::lock_guard<std::mutex> lock(src_mutex);
+      TEST_AND_RETURN_FALSE(src->Seek(start_byte));
+      if (!src->ReadZeroCopy(&deflate_data, deflate_size)) {
+        deflate_buffer.resize(deflate_size);
+        TEST_AND_RETURN_FALSE(src->Read(deflate_buffer.data(), deflate_size));
+        deflate_data = deflate_buffer.data();
+      }
+    }
+    BufferBitReader bit_reader(deflate_data, deflate_size);
+    uint64_t bits_to_skip = deflate.offset % 8;
     TEST_AND_RETURN_FALSE(bit_reader.CacheBits(bits_to_skip));
     bit_reader.DropBits(bits_to_skip);
 
-    BufferPuffWriter puff_writer(nullptr, 0);
+    BufferPuffWriter puff_writer(&puff_buffers[batch_index], puff_format);
     Error error;
-    TEST_AND_RETURN_FALSE(
-        puffer.PuffDeflate(&bit_reader, &puff_writer, nullptr, &error));
-    TEST_AND_RETURN_FALSE(deflate_buffer.size() == bit_reader.Offset());
-
-    // 1 if a deflate ends at the same byte that the next deflate starts and
-    // there is a few bits gap between them. In practice this may never happen,
-    // but it is a good idea to support it anyways. If there is a gap, the value
-    // of the gap will be saved as an integer byte to the puff stream. The parts
-    // of the byte that belogs to the deflates are shifted out.
-    int gap = 0;
-    if (deflate != deflates.begin()) {
-      auto prev_deflate = std::prev(deflate);
-      if ((prev_deflate->offset + prev_deflate->length == deflate->offset)
-          // If deflates are on byte boundary the gap will not be counted later,
-          // so we won't worry about it.
-          && (deflate->offset % 8 != 0)) {
-        gap = 1;
-      }
+    TEST_AND_RETURN_FALSE(puffers[worker].PuffDeflate(
+        &bit_reader, &puff_writer, nullptr, &error));
+    TEST_AND_RETURN_FALSE(deflate_size == bit_reader.Offset());
+    puff_sizes[batch_index] = puff_writer.Size();
+    if (stats != nullptr) {
+      stats->deflates_puffed++;
+      stats->puff_bytes += puff_writer.Size();
     }
+    return true;
+  };
 
-    start_byte = ((deflate->offset + 7) / 8);
-    end_byte = (deflate->offset + deflate->length) / 8;
-    int64_t deflate_length_in_bytes = end_byte - start_byte;
-
-    // If there was no gap bits between the current and previous deflates, there
-    // will be no extra gap byte, so the offset will be shifted one byte back.
-    auto puff_offset = start_byte - gap + total_size_difference;
-    auto puff_size = puff_writer.Size();
-    // Add the location into puff.
-    puffs->emplace_back(puff_offset, puff_size);
-    total_size_difference +=
-        static_cast<int64_t>(puff_size) - deflate_length_in_bytes - gap;
+  puffs->clear();
+  puffs->reserve(deflates.size());
+  Buffer raw_buffer;
+  int64_t total_size_difference = 0;
+  // The end of the last deflate and its puff written into |dst|.
+  uint64_t deflate_end = 0;
+  uint64_t puff_end = 0;
+  for (; batch_start < deflates.size(); batch_start += puff_buffers.size()) {
+    auto count = std::min(puff_buffers.size(), deflates.size() - batch_start);
+    if (pool) {
+      TEST_AND_RETURN_FALSE(pool->ParallelFor(count, puff_deflate));
+    } else {
+      TEST_AND_RETURN_FALSE(ParallelFor(count, 1, puff_deflate));
+    }
+    for (size_t batch_index = 0; batch_index < count; batch_index++) {
+      auto index = batch_start + batch_index;
+      const auto& deflate = deflates[index];
+      auto puff_size = puff_sizes[batch_index];
+      auto puff_offset =
+          GetPuffOffset(deflates, index, puff_size, &total_size_difference);
+      TEST_AND_RETURN_FALSE(puff_offset >= puff_end);
+      TEST_AND_RETURN_FALSE(CopyRawBytes(src, deflate_end, deflate.offset,
+                                         puff_offset - puff_end, &raw_buffer,
+                                         dst));
+      TEST_AND_RETURN_FALSE(
+          dst->Write(puff_buffers[batch_index].data(), puff_size));
+      puffs->emplace_back(puff_offset, puff_size);
+      deflate_end = deflate.offset + deflate.length;
+      puff_end = puff_offset + puff_size;
+    }
   }
 
   uint64_t src_size;
   TEST_AND_RETURN_FALSE(src->GetSize(&src_size));
   auto final_size = static_cast<int64_t>(src_size) + total_size_difference;
-  TEST_AND_RETURN_FALSE(final_size >= 0);
+  TEST_AND_RETURN_FALSE(final_size >= 0 &&
+                        static_cast<uint64_t>(final_size) >= puff_end);
+  TEST_AND_RETURN_FALSE(CopyRawBytes(src, deflate_end, src_size * 8,
+                                     final_size - puff_end, &raw_buffer, dst));
   *out_puff_size = final_size;
   return true;
 }
 
+bool ValidateDeflates(const UniqueStreamPtr& src,
+                      const vector<BitExtent>& deflates,
+                      vector<size_t>* bad_deflates,
+                      size_t num_threads,
+                      Stats* stats) {
+  if (num_threads == 0) {
+    num_threads = ThreadPool::GetDefaultNumThreads();
+  }
+  num_threads = std::max(std::min(num_threads, deflates.size()), size_t(1));
+
+  // Each worker has its own |Puffer|, |Huffer| and buffers, and only reading
+  // from |src| is serialized.
+  vector<Puffer> puffers(num_threads);
+  vector<Huffer> huffers(num_threads);
+  vector<Buffer> deflate_buffers(num_threads);
+  vector<Buffer> puff_buffers(num_threads);
+  vector<Buffer> huff_buffers(num_threads);
+  // Not a vector<bool>, which the workers could not write at the same time.
+  vector<uint8_t> reproduced(deflates.size(), 0);
+  std::mutex src_mutex;
+  TEST_AND_RETURN_FALSE(ParallelFor(
+      deflates.size(), num_threads, [&](size_t index, size_t worker) {
+        const auto& deflate = deflates[index];
+        auto& deflate_buffer = deflate_buffers[worker];
+        // Read from src into deflate_buffer, unless it can be read in place.
+        auto start_byte = deflate.offset / 8;
+        auto end_byte = (deflate.offset + deflate.length + 7) / 8;
+        auto deflate_size = end_byte - start_byte;
+        const uint8_t* deflate_data;
+        {
+          std::lock_guard<std::mutex> lock(src_mutex);
+          TEST_AND_RETURN_FALSE(src->Seek(start_byte));
+          if (!src->ReadZeroCopy(&deflate_data, deflate_size)) {
+            deflate_buffer.resize(deflate_size);
+            TEST_AND_RETURN_FALSE(
+                src->Read(deflate_buffer.data(), deflate_size));
+            deflate_data = deflate_buffer.data();
+          }
+        }
+        if (deflate_size == 0) {
+          return true;
+        }
+
+        // The deflates that cannot be puffed or huffed back are not failures,
+        // they are only not reproduced.
+        auto& puff_buffer = puff_buffers[worker];
+        {
+          ScopedStatsTimer timer(stats, &Stats::puff_time_ns);
+          BufferBitReader bit_reader(deflate_data, deflate_size);
+          uint64_t bits_to_skip = deflate.offset % 8;
+          BufferPuffWriter puff_writer(&puff_buffer);
+          Error error;
+          if (!bit_reader.CacheBits(bits_to_skip)) {
+            return true;
+          }
+          bit_reader.DropBits(bits_to_skip);
+          if (!puffers[worker].PuffDeflate(&bit_reader, &puff_writer, nullptr,
+                                           &error) ||
+              bit_reader.Offset() != deflate_size) {
+            return true;
+          }
+          puff_buffer.resize(puff_writer.Size());
+          if (stats != nullptr) {
+            stats->deflates_puffed++;
+            stats->puff_bytes += puff_buffer.size();
+          }
+        }
+
+        ScopedStatsTimer timer(stats, &Stats::huff_time_ns);
+        if (stats != nullptr) {
+          stats->deflates_huffed++;
+          stats->huff_bytes += puff_buffer.size();
+        }
+        auto& huff_buffer = huff_buffers[worker];
+        huff_buffer.assign(deflate_size, 0);
+        BufferBitWriter bit_writer(huff_buffer.data(), deflate_size);
+        BufferPuffReader puff_reader(puff_buffer.data(), puff_buffer.size());
+        uint8_t first_mask = (1 << (deflate.offset & 7)) - 1;
+        Error error;
+        if (!bit_writer.WriteBits(deflate.offset & 7,
+                                  deflate_data[0] & first_mask) ||
+            !huffers[worker].HuffDeflate(&puff_reader, &bit_writer, &error) ||
+            bit_writer.Size() != deflate_size ||
+            puff_reader.BytesLeft() != 0) {
+          return true;
+        }
+        // The bits after the deflate in its last byte are not compared.
+        auto last_bits = (deflate.offset + deflate.length) & 7;
+        uint8_t last_mask = last_bits == 0 ? 0xFF : (1 << last_bits) - 1;
+        reproduced[index] =
+            std::equal(deflate_data, deflate_data + deflate_size - 1,
+                       huff_buffer.data()) &&
+            ((deflate_data[deflate_size - 1] ^ huff_buffer[deflate_size - 1]) &
+             last_mask) == 0;
+        return true;
+      }));
+
+  bad_deflates->clear();
+  for (size_t index = 0; index < deflates.size(); index++) {
+    if (!reproduced[index] && deflates[index].length > 0) {
+      bad_deflates->push_back(index);
+    }
+  }
+  return true;
+}
+
 }  // namespace puffin
@@ -4,14 +4,17 @@
 
 #include <unistd.h>
 
+#include <atomic>
 #include <vector>
 
 #include "gtest/gtest.h"
 
 #include "puffin/src/file_stream.h"
 #include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/puff_index.h"
 #include "puffin/src/include/puffin/utils.h"
 #include "puffin/src/memory_stream.h"
+#include "puffin/src/thread_pool.h"
 #include "puffin/src/unittest_common.h"
 
 namespace puffin {
@@ -51,6 +54,36 @@ const uint8_t kZipEntryWithDataDescriptor[] = {
     0x2e, 0x00, 0xb4, 0xa0, 0xf2, 0x36, 0x06, 0x00, 0x00, 0x00, 0x07, 0x00,
     0x00, 0x00};
 
+// echo "123456" > 1 && echo "abcdefgh" > 2 && echo "666666" > 3 &&
+// zip -X test.zip 1 && zip -X -0 test.zip 2 && zip -X test.zip 3 &&
+// cat test.zip | hexdump -v -e '12/1 "0x%02x, " "\n"'
+// Only the last entry is a deflate, and the archive has a central directory.
+const uint8_t kZipArchiveWithCentralDirectory[] = {
+    0x50, 0x4b, 0x03, 0x04, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x9d, 0x6e,
+    0x4e, 0x5d, 0x8e, 0x25, 0x6b, 0x08, 0x07, 0x00, 0x00, 0x00, 0x07, 0x00,
+    0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x31, 0x31, 0x32, 0x33, 0x34, 0x35,
+    0x36, 0x0a, 0x50, 0x4b, 0x03, 0x04, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x9d, 0x6e, 0x4e, 0x5d, 0x4d, 0xb8, 0x12, 0x59, 0x09, 0x00, 0x00, 0x00,
+    0x09, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x32, 0x61, 0x62, 0x63,
+    0x64, 0x65, 0x66, 0x67, 0x68, 0x0a, 0x50, 0x4b, 0x03, 0x04, 0x14, 0x00,
+    0x00, 0x00, 0x08, 0x00, 0x9d, 0x6e, 0x4e, 0x5d, 0xb4, 0xa0, 0xf2, 0x36,
+    0x06, 0x00, 0x00, 0x00, 0x07, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
+    0x33, 0x33, 0x33, 0x03, 0x01, 0x2e, 0x00, 0x50, 0x4b, 0x01, 0x02, 0x1e,
+    0x03, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x9d, 0x6e, 0x4e, 0x5d, 0x8e,
+    0x25, 0x6b, 0x08, 0x07, 0x00, 0x00, 0x00, 0x07, 0x00, 0x00, 0x00, 0x01,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0xa4,
+    0x81, 0x00, 0x00, 0x00, 0x00, 0x31, 0x50, 0x4b, 0x01, 0x02, 0x1e, 0x03,
+    0x0a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x9d, 0x6e, 0x4e, 0x5d, 0x4d, 0xb8,
+    0x12, 0x59, 0x09, 0x00, 0x00, 0x00, 0x09, 0x00, 0x00, 0x00, 0x01, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xa4, 0x81,
+    0x26, 0x00, 0x00, 0x00, 0x32, 0x50, 0x4b, 0x01, 0x02, 0x1e, 0x03, 0x14,
+    0x00, 0x00, 0x00, 0x08, 0x00, 0x9d, 0x6e, 0x4e, 0x5d, 0xb4, 0xa0, 0xf2,
+    0x36, 0x06, 0x00, 0x00, 0x00, 0x07, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0xa4, 0x81, 0x4e,
+    0x00, 0x00, 0x00, 0x33, 0x50, 0x4b, 0x05, 0x06, 0x00, 0x00, 0x00, 0x00,
+    0x03, 0x00, 0x03, 0x00, 0x8d, 0x00, 0x00, 0x00, 0x73, 0x00, 0x00, 0x00,
+    0x00, 0x00};
+
 // echo "0123456789" > test1.txt && echo "9876543210" > test2.txt &&
 // gzip -kf test1.txt test2.txt && cat test1.txt.gz test2.txt.gz |
 // hexdump -v -e '12/1 "0x%02x, " "\n"'
@@ -94,22 +127,44 @@ void FindDeflatesInZlibBlocks(const Buffer& src,
   ASSERT_TRUE(src_stream->Write(src.data(), src.size()));
   ASSERT_TRUE(src_stream->Close());
 
-  vector<BitExtent> deflates_out;
-  ASSERT_TRUE(LocateDeflatesInZlibBlocks(tmp_file, zlibs, &deflates_out));
-  ASSERT_EQ(deflates, deflates_out);
+  for (size_t num_threads : {1, 3}) {
+    vector<BitExtent> deflates_out;
+    ASSERT_TRUE(LocateDeflatesInZlibBlocks(tmp_file, zlibs, &deflates_out,
+                                           num_threads));
+    ASSERT_EQ(deflates, deflates_out);
+  }
 }
 
 void CheckFindPuffLocation(const Buffer& compressed,
                            const vector<BitExtent>& deflates,
                            const vector<ByteExtent>& expected_puffs,
-                           uint64_t expected_puff_size) {
+                           uint64_t expected_puff_size,
+                           size_t num_threads = 1) {
   auto src = MemoryStream::CreateForRead(compressed);
   vector<ByteExtent> puffs;
   uint64_t puff_size;
-  ASSERT_TRUE(FindPuffLocations(src, deflates, &puffs, &puff_size));
+  ASSERT_TRUE(
+      FindPuffLocations(src, deflates, &puffs, &puff_size, num_threads));
   EXPECT_EQ(puffs, expected_puffs);
   EXPECT_EQ(puff_size, expected_puff_size);
 }
+
+void CheckPuffDeflates(const Buffer& compressed,
+                       const vector<BitExtent>& deflates,
+                       const vector<ByteExtent>& expected_puffs,
+                       const Buffer& expected_puff) {
+  for (size_t num_threads : {1, 2, 0}) {
+    auto src = MemoryStream::CreateForRead(compressed);
+    Buffer puff;
+    vector<ByteExtent> puffs;
+    uint64_t puff_size;
+    ASSERT_TRUE(PuffDeflates(src, deflates, MemoryStream::CreateForWrite(&puff),
+                             &puffs, &puff_size, num_threads));
+    EXPECT_EQ(puffs, expected_puffs);
+    EXPECT_EQ(puff_size, expected_puff.size());
+    EXPECT_EQ(puff, expected_puff);
+  }
+}
 }  // namespace
 
 // Test Simple Puffing of the source.
@@ -123,6 +178,143 @@ TEST(UtilsTest, FindPuffLocations2Test) {
                         kPuffs9.size());
 }
 
+TEST(UtilsTest, FindPuffLocationsMultiThreadTest) {
+  CheckFindPuffLocation(kDeflates8, kSubblockDeflateExtents8, kPuffExtents8,
+                        kPuffs8.size(), 4);
+  CheckFindPuffLocation(kDeflates9, kSubblockDeflateExtents9, kPuffExtents9,
+                        kPuffs9.size(), 0);
+}
+
+// Testing puffing in a single pass finds the same puffs as |FindPuffLocations|
+// and writes the same puff stream as |PuffinStream|, including the bytes shared
+// between the deflates and the raw data.
+TEST(UtilsTest, PuffDeflatesTest) {
+  CheckPuffDeflates(kDeflates8, kSubblockDeflateExtents8, kPuffExtents8,
+                    kPuffs8);
+  CheckPuffDeflates(kDeflates9, kSubblockDeflateExtents9, kPuffExtents9,
+                    kPuffs9);
+  CheckPuffDeflates(kDeflates9, {}, {}, kDeflates9);
+
+  // A deflate reaching past the end of the stream fails.
+  auto src = MemoryStream::CreateForRead(kDeflates9);
+  Buffer puff;
+  vector<ByteExtent> puffs;
+  uint64_t puff_size;
+  EXPECT_FALSE(PuffDeflates(src, {{152, 30}},
+                            MemoryStream::CreateForWrite(&puff), &puffs,
+                            &puff_size));
+}
+
+// Tests round-tripping each deflate finds the ones that are not reproduced.
+TEST(UtilsTest, ValidateDeflatesTest) {
+  for (size_t num_threads : {1, 4}) {
+    vector<size_t> bad_deflates;
+    auto src = MemoryStream::CreateForRead(kDeflates8);
+    ASSERT_TRUE(ValidateDeflates(src, kSubblockDeflateExtents8, &bad_deflates,
+                                 num_threads));
+    EXPECT_TRUE(bad_deflates.empty());
+
+    // The repeated 'a's are a length of 258 encoded with the extra bits of the
+    // length code 284 instead of the length code 285 |Huffer| uses, in a
+    // fixed Huffman block after the deflates of |kDeflates8|. Those are still
+    // reproduced, but not the raw bytes (which are not a valid deflate).
+    Buffer deflates = kDeflates8;
+    deflates.insert(deflates.end(), {0x4B, 0x1C, 0xF9, 0x00, 0x00});
+    auto extents = kSubblockDeflateExtents8;
+    extents.insert(extents.begin() + 2, {120, 8});
+    extents.push_back({deflates.size() * 8 - 40, 36});
+    src = MemoryStream::CreateForRead(deflates);
+    Stats stats;
+    ASSERT_TRUE(ValidateDeflates(src, extents, &bad_deflates, num_threads,
+                                 &stats));
+    EXPECT_EQ(bad_deflates, (vector<size_t>{2, 4}));
+    EXPECT_EQ(stats.deflates_puffed, 4u);
+    EXPECT_EQ(stats.deflates_huffed, 4u);
+
+    // A deflate reaching past the end of the stream fails.
+    EXPECT_FALSE(
+        ValidateDeflates(src, {{deflates.size() * 8 - 8, 30}}, &bad_deflates));
+  }
+}
+
+TEST(UtilsTest, FindPuffLocationsSubblocksTest) {
+  auto src = MemoryStream::CreateForRead(kDeflate7_4);
+  vector<BitExtent> subblocks;
+  ASSERT_TRUE(
+      FindDeflateSubBlocks(src, {{0, kDeflate7_4.size()}}, &subblocks));
+  ASSERT_EQ(subblocks.size(), 2u);
+  vector<BitExtent> deflates = {
+      {0, subblocks.back().offset + subblocks.back().length}};
+
+  vector<ByteExtent> puffs;
+  uint64_t puff_size;
+  vector<BitExtent> subblock_deflates;
+  vector<ByteExtent> subblock_puffs;
+  ASSERT_TRUE(FindPuffLocations(src, deflates, &puffs, &puff_size,
+                                &subblock_deflates, &subblock_puffs));
+  EXPECT_EQ(puffs, (vector<ByteExtent>{{0, kPuff7_4.size()}}));
+  EXPECT_EQ(subblock_deflates, subblocks);
+  EXPECT_EQ(subblock_puffs, (vector<ByteExtent>{{0, 7}, {7, 7}}));
+}
+
+TEST(UtilsTest, PuffIndexTest) {
+  auto src = MemoryStream::CreateForRead(kDeflates8);
+  PuffIndex index;
+  ASSERT_TRUE(CreatePuffIndex(src, kSubblockDeflateExtents8, &index));
+  EXPECT_EQ(index.deflates, kSubblockDeflateExtents8);
+  EXPECT_EQ(index.puffs, kPuffExtents8);
+  EXPECT_EQ(index.puff_size, kPuffs8.size());
+  EXPECT_EQ(index.file_size, kDeflates8.size());
+  EXPECT_EQ(index.subblock_deflates.size(), index.subblock_puffs.size());
+  EXPECT_TRUE(CheckPuffIndex(src, index));
+
+  Buffer index_data;
+  ASSERT_TRUE(SavePuffIndex(index, MemoryStream::CreateForWrite(&index_data)));
+  PuffIndex loaded_index;
+  ASSERT_TRUE(
+      LoadPuffIndex(index_data.data(), index_data.size(), &loaded_index));
+  EXPECT_EQ(loaded_index.deflates, index.deflates);
+  EXPECT_EQ(loaded_index.puffs, index.puffs);
+  EXPECT_EQ(loaded_index.puff_size, index.puff_size);
+  EXPECT_EQ(loaded_index.subblock_deflates, index.subblock_deflates);
+  EXPECT_EQ(loaded_index.subblock_puffs, index.subblock_puffs);
+  EXPECT_EQ(loaded_index.file_size, index.file_size);
+  EXPECT_EQ(loaded_index.file_crc32, index.file_crc32);
+
+  // The index is not for a file with different content or size.
+  Buffer changed = kDeflates8;
+  changed[0] ^= 1;
+  EXPECT_FALSE(CheckPuffIndex(MemoryStream::CreateForRead(changed), index));
+  changed.push_back(0);
+  EXPECT_FALSE(CheckPuffIndex(MemoryStream::CreateForRead(changed), index));
+
+  // A corrupted magic is rejected.
+  index_data[0] = 'X';
+  EXPECT_FALSE(
+      LoadPuffIndex(index_data.data(), index_data.size(), &loaded_index));
+}
+
+TEST(UtilsTest, ParallelForTest) {
+  for (size_t num_threads : {1, 3, 8}) {
+    vector<size_t> results(100);
+    std::atomic<size_t> running(0);
+    EXPECT_TRUE(ParallelFor(results.size(), num_threads,
+                            [&](size_t index, size_t worker) {
+                              EXPECT_LT(worker, num_threads);
+                              EXPECT_LE(++running, num_threads);
+                              results[index] = index * 2;
+                              running--;
+                              return true;
+                            }));
+    for (size_t index = 0; index < results.size(); index++) {
+      EXPECT_EQ(results[index], index * 2);
+    }
+  }
+  EXPECT_FALSE(ParallelFor(100, 4, [](size_t index, size_t) {
+    return index != 50;
+  }));
+}
+
 TEST(UtilsTest, LocateDeflatesInZlib) {
   Buffer zlib_data(kZlibEntry, std::end(kZlibEntry));
   vector<ByteExtent> deflates;
@@ -138,6 +330,27 @@ TEST(UtilsTest, LocateDeflatesInEmptyZlib) {
   FindDeflatesInZlibBlocks(empty, empty_zlibs, empty_deflates);
 }
 
+TEST(UtilsTest, LocateDeflatesInZlibBlocks) {
+  Buffer zlib_data(kZlibEntry, std::end(kZlibEntry));
+  vector<BitExtent> subblocks;
+  ASSERT_TRUE(FindDeflateSubBlocks(MemoryStream::CreateForRead(zlib_data),
+                                   {{2, 13}}, &subblocks));
+  ASSERT_EQ(static_cast<size_t>(1), subblocks.size());
+
+  // Three zlib blocks with a gap before each of them.
+  Buffer src;
+  vector<ByteExtent> zlibs;
+  vector<BitExtent> deflates;
+  for (size_t idx = 0; idx < 3; idx++) {
+    src.insert(src.end(), idx + 1, 0);
+    zlibs.emplace_back(src.size(), zlib_data.size());
+    deflates.emplace_back(src.size() * 8 + subblocks[0].offset,
+                          subblocks[0].length);
+    src.insert(src.end(), zlib_data.begin(), zlib_data.end());
+  }
+  FindDeflatesInZlibBlocks(src, zlibs, deflates);
+}
+
 TEST(UtilsTest, LocateDeflatesInZlibWithInvalidFields) {
   Buffer zlib_data(kZlibEntry, std::end(kZlibEntry));
   auto cmf = zlib_data[0];
@@ -163,6 +376,22 @@ TEST(UtilsTest, LocateDeflatesInZipArchiveSmoke) {
   EXPECT_EQ(ByteExtent(124, 6), deflates[1]);
 }
 
+TEST(UtilsTest, LocateDeflateSubBlocksInZipArchiveMultiThread) {
+  Buffer zip_entries(kZipEntries, std::end(kZipEntries));
+  vector<BitExtent> subblocks;
+  EXPECT_TRUE(LocateDeflateSubBlocksInZipArchive(zip_entries, &subblocks));
+  ASSERT_EQ(static_cast<size_t>(2), subblocks.size());
+  EXPECT_EQ(subblocks[0].offset, 59u * 8);
+  EXPECT_EQ(subblocks[1].offset, 124u * 8);
+  // The subblocks found on multiple threads should be in the same order.
+  for (size_t num_threads : {2, 0}) {
+    vector<BitExtent> parallel_subblocks;
+    EXPECT_TRUE(LocateDeflateSubBlocksInZipArchive(
+        zip_entries, &parallel_subblocks, num_threads));
+    EXPECT_EQ(subblocks, parallel_subblocks);
+  }
+}
+
 TEST(UtilsTest, LocateDeflatesInZipArchiveWithDataDescriptor) {
   Buffer zip_entries(kZipEntryWithDataDescriptor,
                      std::end(kZipEntryWithDataDescriptor));
@@ -188,6 +417,74 @@ TEST(UtilsTest, LocateDeflatesInZipArchiveErrorChecks) {
   EXPECT_EQ(static_cast<size_t>(0), deflates_incomplete.size());
 }
 
+TEST(UtilsTest, LocateDeflatesInZipArchiveStream) {
+  Buffer zip_archive(kZipArchiveWithCentralDirectory,
+                     std::end(kZipArchiveWithCentralDirectory));
+  vector<ByteExtent> deflates;
+  EXPECT_TRUE(LocateDeflatesInZipArchive(
+      MemoryStream::CreateForRead(zip_archive), &deflates));
+  EXPECT_EQ(vector<ByteExtent>{ByteExtent(109, 6)}, deflates);
+
+  // Should be the same as the deflates found by scanning the whole archive.
+  vector<ByteExtent> scanned_deflates;
+  EXPECT_TRUE(LocateDeflatesInZipArchive(zip_archive, &scanned_deflates));
+  EXPECT_EQ(scanned_deflates, deflates);
+
+  // With a comment at the end of the archive.
+  Buffer comment = {'a', 'b', 'c'};
+  zip_archive[zip_archive.size() - 2] = comment.size();
+  zip_archive.insert(zip_archive.end(), comment.begin(), comment.end());
+  deflates.clear();
+  EXPECT_TRUE(LocateDeflatesInZipArchive(
+      MemoryStream::CreateForRead(zip_archive), &deflates));
+  EXPECT_EQ(vector<ByteExtent>{ByteExtent(109, 6)}, deflates);
+}
+
+TEST(UtilsTest, LocateDeflatesInZipArchiveStreamErrorChecks) {
+  // No end of central directory record.
+  Buffer zip_entries(kZipEntries, std::end(kZipEntries));
+  vector<ByteExtent> deflates;
+  EXPECT_FALSE(LocateDeflatesInZipArchive(
+      MemoryStream::CreateForRead(zip_entries), &deflates));
+
+  // A central directory that overflows the archive.
+  Buffer zip_archive(kZipArchiveWithCentralDirectory,
+                     std::end(kZipArchiveWithCentralDirectory));
+  zip_archive[zip_archive.size() - 7] = 0xff;
+  EXPECT_FALSE(LocateDeflatesInZipArchive(
+      MemoryStream::CreateForRead(zip_archive), &deflates));
+
+  // A local file header that is not where the central directory says is
+  // skipped.
+  zip_archive.assign(kZipArchiveWithCentralDirectory,
+                     std::end(kZipArchiveWithCentralDirectory));
+  zip_archive[78] = 0;
+  deflates.clear();
+  EXPECT_TRUE(LocateDeflatesInZipArchive(
+      MemoryStream::CreateForRead(zip_archive), &deflates));
+  EXPECT_TRUE(deflates.empty());
+}
+
+TEST(UtilsTest, LocateDeflatesInGzipAndZlibStream) {
+  Buffer gzip_data(kGzipEntryWithMultipleMembers,
+                   std::end(kGzipEntryWithMultipleMembers));
+  vector<ByteExtent> deflates;
+  EXPECT_TRUE(
+      LocateDeflatesInGzip(MemoryStream::CreateForRead(gzip_data), &deflates));
+  EXPECT_EQ((vector<ByteExtent>{{20, 13}, {61, 13}}), deflates);
+
+  // A truncated member.
+  gzip_data.resize(gzip_data.size() - 10);
+  EXPECT_FALSE(
+      LocateDeflatesInGzip(MemoryStream::CreateForRead(gzip_data), &deflates));
+
+  Buffer zlib_data(kZlibEntry, std::end(kZlibEntry));
+  deflates.clear();
+  EXPECT_TRUE(
+      LocateDeflatesInZlib(MemoryStream::CreateForRead(zlib_data), &deflates));
+  EXPECT_EQ(vector<ByteExtent>{ByteExtent(2, 13)}, deflates);
+}
+
 TEST(UtilsTest, LocateDeflatesInGzip) {
   Buffer gzip_data(kGzipEntryWithMultipleMembers,
                    std::end(kGzipEntryWithMultipleMembers));